@@ -0,0 +1,631 @@
+#ifndef smpp_cdr_hpp
+#define smpp_cdr_hpp
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <toolbox/bin.hpp>
+#include <smpp/proto.hpp>
+#include <smpp/msgid.hpp>
+#include <smpp/time.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Billing record of a message event, 96 bytes of fixed layout written
+ * as is to binary files. Text fields are zero padded, cut if longer.
+ * Records of events after acceptance carry id, state and error only,
+ * billing joins them to the accepted one by id. */
+struct cdr {
+	enum event_t: bin::u8_t {
+		accepted = 1
+		, final = 2
+		, expired = 3
+		, cancelled = 4
+	};
+
+	bin::u64_t id;
+	/* Milliseconds since epoch */
+	bin::u64_t time;
+	bin::u8_t event;
+	/* message_state and network error code */
+	bin::u8_t state;
+	bin::u8_t error;
+	bin::u8_t data_coding;
+	bin::u8_t esm_class;
+	bin::u8_t src_ton;
+	bin::u8_t src_npi;
+	bin::u8_t dst_ton;
+	bin::u8_t dst_npi;
+	/* Parts of the concatenated message this one completes, 0
+	 * for a message standing alone or a part before the last */
+	bin::u8_t parts;
+	bin::u8_t reserved[4];
+	/* Bytes of short message or payload */
+	bin::u16_t length;
+	char sys_id[16];
+	char src_addr[24];
+	char dst_addr[24];
+
+	/* Record of event of message id taken now */
+	static cdr of(event_t e, bin::u64_t id) {
+		cdr r;
+		std::memset(&r, 0, sizeof(r));
+		r.event = e;
+		r.id = id;
+		r.time = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		return r;
+	}
+
+	/* Source, destination and text of a submitted message */
+	template <class MsgT>
+	void set_message(const MsgT & msg) {
+		data_coding = msg.data_coding;
+		esm_class = msg.esm_class;
+		src_ton = msg.src_addr_ton;
+		src_npi = msg.src_addr_npi;
+		field(src_addr, sizeof(src_addr), msg.src_addr, msg.src_addr_len);
+		length = msg.msg_payload.tag == option::msg_payload
+			? msg.msg_payload.len : msg.short_msg_len;
+	}
+
+	void set_dst(const bin::u8_t * addr, bin::sz_t len, bin::u8_t ton, bin::u8_t npi) {
+		dst_ton = ton;
+		dst_npi = npi;
+		field(dst_addr, sizeof(dst_addr), addr, len);
+	}
+
+	void set_sys_id(const bin::u8_t * v, bin::sz_t len) {
+		field(sys_id, sizeof(sys_id), v, len);
+	}
+
+	/* Copy up to terminating zero, if any */
+	static void field(char * out, bin::sz_t size, const bin::u8_t * v, bin::sz_t len) {
+		bin::sz_t n = 0;
+		for (; n < len && n < size && v[n] != '\0'; ++n) {
+			out[n] = v[n];
+		}
+		std::memset(out + n, 0, size - n);
+	}
+};
+
+static_assert(sizeof(cdr) == 96, "cdr layout is fixed");
+
+/* Billing records written to files in the background.
+ *
+ * Every thread making records has a producer of its own: a single
+ * producer ring of fixed size, so a push is a copy and a release store,
+ * with no lock and no system call. A full ring refuses the record, the
+ * caller is never blocked; producers report congestion earlier so new
+ * messages may be turned away before records are lost.
+ *
+ * The writer thread wakes every flush interval, or once a ring is half
+ * full, drains rings into a batch, binary or CSV, and writes it with a
+ * single write call when it is batch_bytes or the rings are empty. Files
+ * are preallocated and named *.part while written; once file_size or
+ * file_age is reached one is cut to its length, synced and renamed, so
+ * only complete files show up under their final names. */
+class cdr_writer {
+	public:
+		typedef std::chrono::steady_clock clock_t;
+
+		enum format_t {
+			binary
+			, csv
+		};
+
+		struct stats {
+			bin::u64_t records;
+			/* Refused by full rings or lost to write errors */
+			bin::u64_t dropped;
+			bin::u64_t bytes;
+			bin::u64_t writes;
+			bin::u64_t files;
+			bin::u64_t errors;
+			/* Records waiting in rings */
+			bin::u64_t backlog;
+		};
+
+		struct options {
+			format_t format;
+			bin::sz_t file_size;
+			clock_t::duration file_age;
+			/* Records per producer */
+			bin::sz_t ring_size;
+			bin::sz_t batch_bytes;
+			clock_t::duration flush;
+			/* Called from the writer thread with the name of a complete file */
+			std::function<void (const std::string & path, const stats & s)> on_file;
+			/* Called from the writer thread with the number of records
+			 * dropped since the last call, at most once per report
+			 * interval and once more when stopped */
+			std::function<void (bin::u64_t dropped, const stats & s)> on_dropped;
+			clock_t::duration report;
+
+			options()
+				: format(binary)
+				, file_size(64 << 20)
+				, file_age(std::chrono::hours(1))
+				, ring_size(1 << 16)
+				, batch_bytes(1 << 20)
+				, flush(std::chrono::milliseconds(200))
+				, report(std::chrono::seconds(10))
+			{}
+		};
+
+		class producer {
+			public:
+				producer(const producer &) = delete;
+				producer & operator=(const producer &) = delete;
+
+				/* Queue a record, false if the ring is full */
+				bool push(const cdr & r) {
+					bin::u64_t t = m_tail.load(std::memory_order_relaxed);
+					if (t - m_head_seen > m_mask) {
+						m_head_seen = m_head.load(std::memory_order_acquire);
+						if (t - m_head_seen > m_mask) {
+							m_dropped.fetch_add(1, std::memory_order_relaxed);
+							m_writer.wake();
+							return false;
+						}
+					}
+					m_slots[t & m_mask] = r;
+					m_tail.store(t + 1, std::memory_order_release);
+					/* Head seen is behind, so the ring looks half full
+					 * before it is; the writer is woken if it really is */
+					if (t - m_head_seen == (m_mask + 1) / 2) {
+						m_head_seen = m_head.load(std::memory_order_acquire);
+						if (t - m_head_seen >= (m_mask + 1) / 2) {
+							m_writer.wake();
+						}
+					}
+					return true;
+				}
+
+				/* Ring is more than three quarters full */
+				bool congested() const {
+					return size() > (m_mask + 1) / 4 * 3;
+				}
+
+				bin::sz_t size() const {
+					return m_tail.load(std::memory_order_acquire)
+						- m_head.load(std::memory_order_acquire);
+				}
+
+				bin::u64_t dropped() const {
+					return m_dropped.load(std::memory_order_relaxed);
+				}
+
+			private:
+				friend class cdr_writer;
+
+				/* Records are taken in chunks, each one frees its slots */
+				static const bin::sz_t chunk = 1024;
+
+				cdr_writer & m_writer;
+				const bin::u64_t m_mask;
+				std::vector<cdr> m_slots;
+				std::atomic<bin::u64_t> m_dropped;
+				/* Producer side */
+				std::atomic<bin::u64_t> m_tail;
+				bin::u64_t m_head_seen;
+				char m_pad[64];
+				/* Consumer side */
+				std::atomic<bin::u64_t> m_head;
+
+				producer(cdr_writer & w, bin::sz_t size)
+					: m_writer(w)
+					, m_mask(pow2(size) - 1)
+					, m_slots(m_mask + 1)
+					, m_dropped(0)
+					, m_tail(0)
+					, m_head_seen(0)
+					, m_head(0)
+				{}
+
+				template <class F>
+				bin::sz_t pop(F f) {
+					bin::u64_t h = m_head.load(std::memory_order_relaxed);
+					bin::u64_t t = m_tail.load(std::memory_order_acquire);
+					bin::sz_t n = 0;
+					while (h != t) {
+						bin::u64_t end = t - h > chunk ? h + chunk : t;
+						n += end - h;
+						for (; h != end; ++h) {
+							f(m_slots[h & m_mask]);
+						}
+						m_head.store(h, std::memory_order_release);
+					}
+					return n;
+				}
+
+				static bin::u64_t pow2(bin::sz_t n) {
+					bin::u64_t p = 1;
+					while (p < n) {
+						p <<= 1;
+					}
+					return p;
+				}
+		};
+
+		cdr_writer(const cdr_writer &) = delete;
+		cdr_writer & operator=(const cdr_writer &) = delete;
+
+		cdr_writer(const std::string & dir, const options & o = options())
+			: m_dir(dir)
+			, m_opts(o)
+			, m_stop(false)
+			, m_wake(false)
+			, m_fd(-1)
+			, m_seq(0)
+			, m_file_bytes(0)
+			, m_batched(0)
+			, m_reported(0)
+			, m_records(0)
+			, m_dropped(0)
+			, m_bytes(0)
+			, m_writes(0)
+			, m_files(0)
+			, m_errors(0)
+		{
+			m_batch.reserve(m_opts.batch_bytes + max_line);
+		}
+
+		~cdr_writer() {
+			stop();
+		}
+
+		/* Producer for one thread, lives as long as the writer */
+		producer & add_producer() {
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_producers.push_back(std::unique_ptr<producer>(new producer(*this, m_opts.ring_size)));
+			return *m_producers.back();
+		}
+
+		/* Returns false if the directory is not writable */
+		bool start() {
+			if (::access(m_dir.c_str(), W_OK) != 0) {
+				return false;
+			}
+			m_stop = false;
+			m_report_at = clock_t::now() + m_opts.report;
+			m_thread = std::thread([this] {
+				run();
+			});
+			return true;
+		}
+
+		/* Records pushed before the call are written and the file is
+		 * completed. Producers are to stop pushing first. */
+		void stop() {
+			{
+				std::lock_guard<std::mutex> lock(m_mtx);
+				m_stop = true;
+				m_cond.notify_one();
+			}
+			if (m_thread.joinable()) {
+				m_thread.join();
+			}
+		}
+
+		stats get_stats() const {
+			stats s;
+			s.records = m_records.load(std::memory_order_relaxed);
+			s.dropped = m_dropped.load(std::memory_order_relaxed);
+			s.bytes = m_bytes.load(std::memory_order_relaxed);
+			s.writes = m_writes.load(std::memory_order_relaxed);
+			s.files = m_files.load(std::memory_order_relaxed);
+			s.errors = m_errors.load(std::memory_order_relaxed);
+			s.backlog = 0;
+			std::lock_guard<std::mutex> lock(m_mtx);
+			for (const std::unique_ptr<producer> & p: m_producers) {
+				s.dropped += p->dropped();
+				s.backlog += p->size();
+			}
+			return s;
+		}
+
+		/* Line of CSV files naming the fields */
+		static const char * csv_header() {
+			return "id,time,event,state,error,sys_id,src_ton,src_npi,src_addr"
+				",dst_ton,dst_npi,dst_addr,data_coding,esm_class,length,parts\n";
+		}
+
+		/* CSV line of r to out, which takes max_line bytes.
+		 * Returns its length. */
+		static bin::sz_t format_csv(const cdr & r, char * out) {
+			char * p = out;
+			bin::u8_t id[msgid::text_len];
+			msgid::format(r.id, id);
+			p = put(p, reinterpret_cast<const char *>(id), msgid::text_len - 1);
+			*p++ = ',';
+			p = put_time(p, r.time);
+			*p++ = ',';
+			const bin::u8_t fields[] = { r.event, r.state, r.error };
+			for (bin::u8_t v: fields) {
+				p = put_num(p, v);
+				*p++ = ',';
+			}
+			p = put_text(p, r.sys_id, sizeof(r.sys_id));
+			*p++ = ',';
+			p = put_num(p, r.src_ton);
+			*p++ = ',';
+			p = put_num(p, r.src_npi);
+			*p++ = ',';
+			p = put_text(p, r.src_addr, sizeof(r.src_addr));
+			*p++ = ',';
+			p = put_num(p, r.dst_ton);
+			*p++ = ',';
+			p = put_num(p, r.dst_npi);
+			*p++ = ',';
+			p = put_text(p, r.dst_addr, sizeof(r.dst_addr));
+			*p++ = ',';
+			p = put_num(p, r.data_coding);
+			*p++ = ',';
+			p = put_num(p, r.esm_class);
+			*p++ = ',';
+			p = put_num(p, r.length);
+			*p++ = ',';
+			p = put_num(p, r.parts);
+			*p++ = '\n';
+			return p - out;
+		}
+
+		/* Longest CSV line */
+		static const bin::sz_t max_line = 256;
+
+	private:
+		const std::string m_dir;
+		const options m_opts;
+
+		mutable std::mutex m_mtx;
+		std::condition_variable m_cond;
+		std::vector<std::unique_ptr<producer> > m_producers;
+		bool m_stop;
+		std::atomic<bool> m_wake;
+		std::thread m_thread;
+
+		/* Writer thread only */
+		std::vector<char> m_batch;
+		int m_fd;
+		std::string m_path;
+		bin::u32_t m_seq;
+		bin::sz_t m_file_bytes;
+		clock_t::time_point m_opened;
+		bin::u64_t m_batched;
+		bin::u64_t m_reported;
+		clock_t::time_point m_report_at;
+
+		std::atomic<bin::u64_t> m_records;
+		std::atomic<bin::u64_t> m_dropped;
+		std::atomic<bin::u64_t> m_bytes;
+		std::atomic<bin::u64_t> m_writes;
+		std::atomic<bin::u64_t> m_files;
+		std::atomic<bin::u64_t> m_errors;
+
+		void wake() {
+			m_wake.store(true, std::memory_order_relaxed);
+			m_cond.notify_one();
+		}
+
+		void run() {
+			std::vector<producer *> producers;
+			std::unique_lock<std::mutex> lock(m_mtx);
+			while (true) {
+				m_cond.wait_for(lock, m_opts.flush, [this] {
+					return m_stop || m_wake.load(std::memory_order_relaxed);
+				});
+				m_wake.store(false, std::memory_order_relaxed);
+				bool stop = m_stop;
+				producers.clear();
+				for (const std::unique_ptr<producer> & p: m_producers) {
+					producers.push_back(p.get());
+				}
+				lock.unlock();
+				for (producer * p: producers) {
+					p->pop([this] (const cdr & r) {
+						add(r);
+					});
+				}
+				flush();
+				if (m_fd >= 0 && (stop || clock_t::now() - m_opened >= m_opts.file_age)) {
+					close_file();
+				}
+				if (stop || clock_t::now() >= m_report_at) {
+					report();
+				}
+				lock.lock();
+				if (stop) {
+					break;
+				}
+			}
+		}
+
+		void add(const cdr & r) {
+			if (m_opts.format == binary) {
+				const char * p = reinterpret_cast<const char *>(&r);
+				m_batch.insert(m_batch.end(), p, p + sizeof(cdr));
+			} else {
+				char line[max_line];
+				m_batch.insert(m_batch.end(), line, line + format_csv(r, line));
+			}
+			m_batched++;
+			if (m_batch.size() >= m_opts.batch_bytes) {
+				flush();
+			}
+		}
+
+		void flush() {
+			if (m_batch.empty()) {
+				return;
+			}
+			bool ok = (m_fd >= 0 || open_file()) && write(m_batch.data(), m_batch.size());
+			if (ok) {
+				m_records.fetch_add(m_batched, std::memory_order_relaxed);
+				m_bytes.fetch_add(m_batch.size(), std::memory_order_relaxed);
+				m_writes.fetch_add(1, std::memory_order_relaxed);
+				m_file_bytes += m_batch.size();
+			} else {
+				m_errors.fetch_add(1, std::memory_order_relaxed);
+				m_dropped.fetch_add(m_batched, std::memory_order_relaxed);
+			}
+			m_batch.clear();
+			m_batched = 0;
+			if (m_fd >= 0 && m_file_bytes >= m_opts.file_size) {
+				close_file();
+			}
+		}
+
+		/* Drops are told in one call per interval, not one per record */
+		void report() {
+			m_report_at = clock_t::now() + m_opts.report;
+			if (!m_opts.on_dropped) {
+				return;
+			}
+			stats s = get_stats();
+			if (s.dropped != m_reported) {
+				m_opts.on_dropped(s.dropped - m_reported, s);
+				m_reported = s.dropped;
+			}
+		}
+
+		bool write(const char * p, bin::sz_t len) {
+			while (len != 0) {
+				ssize_t n = ::write(m_fd, p, len);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n <= 0) {
+					return false;
+				}
+				p += n;
+				len -= n;
+			}
+			return true;
+		}
+
+		bool open_file() {
+			std::time_t now = std::time(nullptr);
+			long y;
+			unsigned m, d;
+			civil_from_days(now / 86400, y, m, d);
+			char name[64];
+			std::snprintf(name, sizeof(name), "cdr-%04ld%02u%02u-%02u%02u%02u-%06u.%s"
+				, y, m, d, static_cast<unsigned>(now % 86400 / 3600)
+				, static_cast<unsigned>(now % 3600 / 60), static_cast<unsigned>(now % 60)
+				, static_cast<unsigned>(m_seq++), m_opts.format == binary ? "bin" : "csv");
+			m_path = m_dir + "/" + name;
+			std::string part = m_path + ".part";
+			m_fd = ::open(part.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+			if (m_fd < 0) {
+				return false;
+			}
+			/* Blocks are allocated upfront, a file system not
+			 * supporting it gets them as the file grows */
+			posix_fallocate(m_fd, 0, m_opts.file_size + m_opts.batch_bytes);
+			m_file_bytes = 0;
+			m_opened = clock_t::now();
+			if (m_opts.format == csv) {
+				const char * h = csv_header();
+				if (!write(h, std::strlen(h))) {
+					::close(m_fd);
+					m_fd = -1;
+					std::remove(part.c_str());
+					return false;
+				}
+				m_file_bytes = std::strlen(h);
+			}
+			return true;
+		}
+
+		void close_file() {
+			std::string part = m_path + ".part";
+			bool ok = ftruncate(m_fd, m_file_bytes) == 0 && fdatasync(m_fd) == 0;
+			::close(m_fd);
+			m_fd = -1;
+			if (!ok || std::rename(part.c_str(), m_path.c_str()) != 0) {
+				m_errors.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			m_files.fetch_add(1, std::memory_order_relaxed);
+			if (m_opts.on_file) {
+				m_opts.on_file(m_path, get_stats());
+			}
+		}
+
+		static char * put(char * p, const char * v, bin::sz_t len) {
+			std::memcpy(p, v, len);
+			return p + len;
+		}
+
+		static char * put_num(char * p, unsigned v) {
+			char buf[10];
+			int n = 0;
+			do {
+				buf[n++] = '0' + v % 10;
+				v /= 10;
+			} while (v != 0);
+			while (n != 0) {
+				*p++ = buf[--n];
+			}
+			return p;
+		}
+
+		static char * put_digits(char * p, unsigned v, int n) {
+			for (int i = n - 1; i >= 0; --i, v /= 10) {
+				p[i] = '0' + v % 10;
+			}
+			return p + n;
+		}
+
+		/* UTC, YYYY-MM-DD hh:mm:ss.mmm */
+		static char * put_time(char * p, bin::u64_t ms) {
+			std::time_t t = ms / 1000;
+			long y;
+			unsigned m, d;
+			civil_from_days(t / 86400, y, m, d);
+			p = put_digits(p, y, 4);
+			*p++ = '-';
+			p = put_digits(p, m, 2);
+			*p++ = '-';
+			p = put_digits(p, d, 2);
+			*p++ = ' ';
+			p = put_digits(p, t % 86400 / 3600, 2);
+			*p++ = ':';
+			p = put_digits(p, t % 3600 / 60, 2);
+			*p++ = ':';
+			p = put_digits(p, t % 60, 2);
+			*p++ = '.';
+			return put_digits(p, ms % 1000, 3);
+		}
+
+		/* Quoted, quotes doubled */
+		static char * put_text(char * p, const char * v, bin::sz_t size) {
+			*p++ = '"';
+			for (bin::sz_t i = 0; i < size && v[i] != '\0'; ++i) {
+				if (v[i] == '"') {
+					*p++ = '"';
+				}
+				*p++ = v[i];
+			}
+			*p++ = '"';
+			return p;
+		}
+};
+
+} } }
+
+#endif
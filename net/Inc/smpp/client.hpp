@@ -0,0 +1,694 @@
+#ifndef smpp_client_hpp
+#define smpp_client_hpp
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <toolbox/bin.hpp>
+#include <smpp/proto.hpp>
+#include <smpp/service.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* SMSC account binds are opened to */
+struct smsc_account {
+	ba::ip::tcp::endpoint endpoint;
+	std::string sys_id;
+	std::string password;
+	std::string sys_type;
+	/* Transmitter binds only submit, receiver ones only get deliver_sm */
+	enum mode_t: bin::u8_t {
+		transmitter,
+		receiver,
+		transceiver
+	} mode;
+	bin::sz_t binds;
+	/* Silence after which the link is checked with enquire_link */
+	std::chrono::seconds enquire_link;
+	/* Submits waiting for room in a bind window */
+	bin::sz_t max_queue;
+
+	smsc_account()
+		: mode(transceiver)
+		, binds(1)
+		, enquire_link(30)
+		, max_queue(1 << 16)
+	{}
+};
+
+/* ESME side of SMPP: binds to SMSC accounts and submits messages there.
+ *
+ * Every account has a number of binds, each of them a session of its
+ * own with its window. A submit goes to the bound bind of the account
+ * with the most room in its window, or waits in the account queue until
+ * a response frees some. Binds are kept alive with enquire_link when
+ * nothing comes from the SMSC for a while; one which drops, fails to
+ * bind or does not answer is reopened after a delay doubling up to a
+ * minute.
+ *
+ * Submits may come from any thread; done is called from message
+ * processing thread with the response, generic_nack turned into one.
+ * Requests whose bind goes down or whose response times out are sent
+ * again, on whatever bind is up, so the SMSC may get them twice; after
+ * max_attempts they are done with status lost. */
+template <class AllocatorT, class LogT>
+class client: public tcp_service<AllocatorT, LogT, bin::u64_t> {
+
+	typedef tcp_service<AllocatorT, LogT, bin::u64_t> service_t;
+
+	public:
+		typedef typename service_t::allocator_t					allocator_t;
+		typedef typename service_t::log_t						log_t;
+		typedef std::chrono::steady_clock						clock_t;
+		typedef std::function<void (const submit_sm_r & r)>	done_t;
+		typedef std::function<void (bin::sz_t account, const deliver_sm & msg)>
+																deliver_t;
+
+		/* Status of submits given up without a response */
+		static const bin::u32_t lost = command_status::esme_runknownerr;
+		static const bin::u32_t max_attempts = 3;
+
+		client(allocator_t & a, log_t l)
+			: service_t(a, std::move(l))
+			, m_next_id(0)
+			, m_stopping(false)
+		{
+			service_t::set_role(session::esme);
+		}
+
+		virtual ~client() {
+		}
+
+		/* Account to bind to on start, returns its number.
+		 * Call before start. */
+		bin::sz_t add_account(const smsc_account & a) {
+			bin::sz_t n = m_accounts.size();
+			m_accounts.push_back(std::unique_ptr<account_data>(new account_data(a)));
+			for (bin::sz_t i = 0; i < a.binds; ++i) {
+				m_accounts.back()->binds.push_back(m_binds.size());
+				m_binds.push_back(bind_data(n));
+			}
+			return n;
+		}
+
+		/* Receiver of deliver_sm, e.g. receipts, coming over
+		 * receiver and transceiver binds. Set before start. */
+		void set_deliver_handler(deliver_t f) {
+			m_on_deliver = f;
+		}
+
+		void start() {
+			for (bind_data & b: m_binds) {
+				b.state = connecting;
+			}
+			service_t::start();
+			for (bin::sz_t i = 0; i < m_binds.size(); ++i) {
+				service_t::connect(m_accounts[m_binds[i].account]->conf.endpoint, i);
+			}
+		}
+
+		/* Close binds, submits not done by then are done with
+		 * status lost from the calling thread */
+		void stop() {
+			m_stopping = true;
+			service_t::stop();
+			std::vector<request> in;
+			{
+				std::lock_guard<std::mutex> lock(m_mtx);
+				in.swap(m_incoming);
+			}
+			for (request & r: in) {
+				m_requests[++m_next_id] = r;
+			}
+			while (!m_requests.empty()) {
+				complete(m_requests.begin()->first, failure(lost));
+			}
+		}
+
+		/* Queue msg for a bind of the account. Returns false if the
+		 * account queue is full or its binds are receivers. Payload is referenced, not copied,
+		 * it has to stay until done is called. Any thread. */
+		bool submit(bin::sz_t account, const submit_sm & msg, done_t done) {
+			if (account >= m_accounts.size()) {
+				return false;
+			}
+			account_data & a = *m_accounts[account];
+			if (a.conf.mode == smsc_account::receiver) {
+				return false;
+			}
+			if (a.queued.fetch_add(1, std::memory_order_relaxed) >= a.conf.max_queue) {
+				a.queued.fetch_sub(1, std::memory_order_relaxed);
+				return false;
+			}
+			request r;
+			r.account = account;
+			r.msg = msg;
+			r.done = done;
+			r.attempts = 0;
+			bool first;
+			{
+				std::lock_guard<std::mutex> lock(m_mtx);
+				first = m_incoming.empty();
+				m_incoming.push_back(r);
+			}
+			if (first) {
+				service_t::wake();
+			}
+			return true;
+		}
+
+		/* The same, response comes with the future. A full queue
+		 * gives one of status esme_rmsgqful at once. */
+		std::future<submit_sm_r> submit(bin::sz_t account, const submit_sm & msg) {
+			std::shared_ptr<std::promise<submit_sm_r> > p
+				= std::make_shared<std::promise<submit_sm_r> >();
+			std::future<submit_sm_r> f = p->get_future();
+			if (!submit(account, msg, [p] (const submit_sm_r & r) {
+					p->set_value(r);
+				})) {
+				p->set_value(failure(command_status::esme_rmsgqful));
+			}
+			return f;
+		}
+
+		/* Binds of the account bound at the moment */
+		bin::sz_t bound(bin::sz_t account) const {
+			return m_accounts[account]->bound.load(std::memory_order_relaxed);
+		}
+
+		/* Submits of the account waiting for a window */
+		bin::sz_t queued(bin::sz_t account) const {
+			return m_accounts[account]->queued.load(std::memory_order_relaxed);
+		}
+
+	protected:
+		using service_t::L;
+
+		/* Delay before reopening a bind, doubled on each failure */
+		static const bin::sz_t reconnect_min_ms = 1000;
+		static const bin::sz_t reconnect_max_ms = 60000;
+
+		enum bind_state_t: bin::u8_t {
+			idle,
+			connecting,
+			binding,
+			bound_state
+		};
+
+		struct bind_data {
+			bin::sz_t account;
+			bin::sz_t channel;
+			bind_state_t state;
+			clock_t::time_point retry_at;
+			clock_t::duration backoff;
+			/* Last PDU from the SMSC and whether enquire_link is out */
+			clock_t::time_point last_seen;
+			bool linking;
+			/* Bind or enquire_link got no response, the channel is closed
+			 * on the next tick unless on_closed has come first */
+			bool unanswered;
+
+			explicit bind_data(bin::sz_t a)
+				: account(a)
+				, channel(0)
+				, state(idle)
+				, backoff(std::chrono::milliseconds(bin::sz_t(reconnect_min_ms)))
+				, linking(false)
+				, unanswered(false)
+			{}
+		};
+
+		struct account_data {
+			const smsc_account conf;
+			std::vector<bin::sz_t> binds;
+			/* Requests waiting for a window, message processing thread only */
+			std::deque<bin::u64_t> pending;
+			std::atomic<bin::sz_t> queued;
+			std::atomic<bin::sz_t> bound;
+
+			explicit account_data(const smsc_account & a)
+				: conf(a)
+				, queued(0)
+				, bound(0)
+			{}
+		};
+
+		struct request {
+			bin::sz_t account;
+			submit_sm msg;
+			done_t done;
+			bin::u32_t attempts;
+		};
+
+		std::vector<std::unique_ptr<account_data> > m_accounts;
+		std::vector<bind_data> m_binds;
+		/* Bind of every open channel */
+		std::unordered_map<bin::sz_t, bin::sz_t> m_channels;
+		/* Requests by the context they are sent with, 0 is for binds
+		 * and enquire_link. Message processing thread only. */
+		std::unordered_map<bin::u64_t, request> m_requests;
+		bin::u64_t m_next_id;
+		std::atomic<bool> m_stopping;
+		/* Submits from other threads */
+		std::mutex m_mtx;
+		std::vector<request> m_incoming;
+		deliver_t m_on_deliver;
+
+		static submit_sm_r failure(bin::u32_t status) {
+			submit_sm_r r;
+			r.command.status = status;
+			r.msg_id[0] = '\0';
+			r.msg_id_len = 1;
+			return r;
+		}
+
+		bind_data * find_bind(bin::sz_t channel_id) {
+			auto it = m_channels.find(channel_id);
+			return it == m_channels.end() ? nullptr : &m_binds[it->second];
+		}
+
+		/* Bound bind of the account with the most room, nullptr if none */
+		bind_data * pick(const account_data & a) {
+			bind_data * best = nullptr;
+			bin::sz_t room = 0;
+			for (bin::sz_t i: a.binds) {
+				bind_data & b = m_binds[i];
+				if (b.state != bound_state) {
+					continue;
+				}
+				bin::sz_t n = service_t::window_available(b.channel);
+				if (n > room) {
+					best = &b;
+					room = n;
+				}
+			}
+			return best;
+		}
+
+		/* Send waiting requests of the account while windows have room */
+		void drain(bin::sz_t account) {
+			account_data & a = *m_accounts[account];
+			while (!a.pending.empty()) {
+				bind_data * b = pick(a);
+				if (b == nullptr) {
+					return;
+				}
+				bin::u64_t id = a.pending.front();
+				auto it = m_requests.find(id);
+				if (it != m_requests.end()
+						&& service_t::send_request(b->channel, it->second.msg, id) == 0) {
+					return;
+				}
+				a.pending.pop_front();
+				a.queued.fetch_sub(1, std::memory_order_relaxed);
+			}
+		}
+
+		void complete(bin::u64_t id, const submit_sm_r & r) {
+			auto it = m_requests.find(id);
+			if (it == m_requests.end()) {
+				return;
+			}
+			done_t done = std::move(it->second.done);
+			m_requests.erase(it);
+			if (done) {
+				done(r);
+			}
+		}
+
+		/* Request got no response, send it again first thing */
+		void retry(bin::u64_t id) {
+			auto it = m_requests.find(id);
+			if (it == m_requests.end()) {
+				return;
+			}
+			request & r = it->second;
+			if (++r.attempts >= max_attempts || m_stopping) {
+				complete(id, failure(lost));
+				return;
+			}
+			account_data & a = *m_accounts[r.account];
+			a.pending.push_front(id);
+			a.queued.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void reconnect_later(bind_data & b) {
+			b.state = idle;
+			b.unanswered = false;
+			b.retry_at = clock_t::now() + b.backoff;
+			b.backoff = std::min<clock_t::duration>(b.backoff * 2
+				, std::chrono::milliseconds(bin::sz_t(reconnect_max_ms)));
+		}
+
+		void seen(bin::sz_t channel_id) {
+			bind_data * b = find_bind(channel_id);
+			if (b != nullptr) {
+				b->last_seen = clock_t::now();
+				b->linking = false;
+			}
+		}
+
+		template <class BindT>
+		void send_bind(bin::sz_t channel_id, const smsc_account & a) {
+			BindT msg;
+			msg.set_sys_id(a.sys_id);
+			msg.set_password(a.password);
+			msg.set_sys_type(a.sys_type);
+			msg.set_addr_range("");
+			msg.interface_version = 0x34;
+			msg.addr_ton = 0;
+			msg.addr_npi = 0;
+			if (service_t::send_request(channel_id, msg, 0) == 0) {
+				service_t::close(channel_id);
+			}
+		}
+
+		void on_connected(bin::sz_t channel_id, bin::sz_t tag) {
+			bind_data & b = m_binds[tag];
+			m_channels[channel_id] = tag;
+			b.channel = channel_id;
+			b.state = binding;
+			const smsc_account & a = m_accounts[b.account]->conf;
+			ldebug(L) << "channel #" << channel_id << " connected to " << a.endpoint
+				<< ", binding as " << a.sys_id;
+			if (m_stopping) {
+				service_t::close(channel_id);
+			} else if (a.mode == smsc_account::transceiver) {
+				send_bind<bind_transceiver>(channel_id, a);
+			} else if (a.mode == smsc_account::receiver) {
+				send_bind<bind_receiver>(channel_id, a);
+			} else {
+				send_bind<bind_transmitter>(channel_id, a);
+			}
+		}
+
+		void on_connect_failed(bin::sz_t tag) {
+			bind_data & b = m_binds[tag];
+			lwarning(L) << "can not connect to " << m_accounts[b.account]->conf.endpoint;
+			reconnect_later(b);
+		}
+
+		void on_closed(bin::sz_t channel_id) {
+			auto it = m_channels.find(channel_id);
+			if (it == m_channels.end()) {
+				return;
+			}
+			bind_data & b = m_binds[it->second];
+			m_channels.erase(it);
+			if (b.state == bound_state) {
+				m_accounts[b.account]->bound.fetch_sub(1, std::memory_order_relaxed);
+				lwarning(L) << "channel #" << channel_id << " bind to "
+					<< m_accounts[b.account]->conf.endpoint << " is closed";
+			}
+			reconnect_later(b);
+		}
+
+		template <class RespT>
+		void bind_done(bin::sz_t channel_id, const RespT & msg) {
+			bind_data * b = find_bind(channel_id);
+			if (b == nullptr || b->state != binding) {
+				return;
+			}
+			if (msg.command.status != command_status::esme_rok) {
+				lwarning(L) << "channel #" << channel_id << " bind rejected: "
+					<< msg.command.status;
+				service_t::close(channel_id);
+				return;
+			}
+			linfo(L) << "channel #" << channel_id << " bound to "
+				<< m_accounts[b->account]->conf.endpoint;
+			b->state = bound_state;
+			b->backoff = std::chrono::milliseconds(bin::sz_t(reconnect_min_ms));
+			b->last_seen = clock_t::now();
+			b->linking = false;
+			m_accounts[b->account]->bound.fetch_add(1, std::memory_order_relaxed);
+			drain(b->account);
+		}
+
+		void on_response(bin::sz_t channel_id, const bind_transmitter_r & msg, const bin::u64_t & ctx) {
+			(void)(ctx);
+			bind_done(channel_id, msg);
+		}
+
+		void on_response(bin::sz_t channel_id, const bind_receiver_r & msg, const bin::u64_t & ctx) {
+			(void)(ctx);
+			bind_done(channel_id, msg);
+		}
+
+		void on_response(bin::sz_t channel_id, const bind_transceiver_r & msg, const bin::u64_t & ctx) {
+			(void)(ctx);
+			bind_done(channel_id, msg);
+		}
+
+		void on_response(bin::sz_t channel_id, const submit_sm_r & msg, const bin::u64_t & ctx) {
+			seen(channel_id);
+			complete(ctx, msg);
+			bind_data * b = find_bind(channel_id);
+			if (b != nullptr) {
+				drain(b->account);
+			}
+		}
+
+		void on_response(bin::sz_t channel_id, const generic_nack & msg, const bin::u64_t & ctx) {
+			seen(channel_id);
+			if (ctx == 0) {
+				lwarning(L) << "channel #" << channel_id << " got: " << msg;
+				service_t::close(channel_id);
+				return;
+			}
+			submit_sm_r r = failure(msg.command.status);
+			r.command.seqno = msg.command.seqno;
+			complete(ctx, r);
+			bind_data * b = find_bind(channel_id);
+			if (b != nullptr) {
+				drain(b->account);
+			}
+		}
+
+		void on_response(bin::sz_t channel_id, const enquire_link_r & msg, const bin::u64_t & ctx) {
+			(void)(ctx);
+			service_t::trace_got(channel_id, msg.command);
+			seen(channel_id);
+		}
+
+		/* Bind or enquire_link unanswered closes the bind. Requests of a
+		 * channel being destroyed expire too, before on_closed, so the
+		 * close waits for the tick and is skipped if the bind is gone. */
+		void on_expire(bin::sz_t channel_id, bin::u32_t seqno, const bin::u64_t & ctx) {
+			if (ctx != 0) {
+				ldebug(L) << "channel #" << channel_id << " request #" << seqno << " got no response";
+				retry(ctx);
+				return;
+			}
+			bind_data * b = find_bind(channel_id);
+			if (b != nullptr && b->state != idle) {
+				b->unanswered = true;
+			}
+		}
+
+		void on_wake() {
+			std::vector<request> in;
+			{
+				std::lock_guard<std::mutex> lock(m_mtx);
+				in.swap(m_incoming);
+			}
+			for (request & r: in) {
+				bin::u64_t id = ++m_next_id;
+				m_accounts[r.account]->pending.push_back(id);
+				m_requests[id] = r;
+			}
+			for (bin::sz_t i = 0; i < m_accounts.size(); ++i) {
+				drain(i);
+			}
+		}
+
+		void on_timer() {
+			clock_t::time_point now = clock_t::now();
+			for (bin::sz_t i = 0; i < m_binds.size(); ++i) {
+				bind_data & b = m_binds[i];
+				const smsc_account & a = m_accounts[b.account]->conf;
+				if (b.unanswered) {
+					lwarning(L) << "channel #" << b.channel << " SMSC does not answer, closing";
+					b.unanswered = false;
+					service_t::close(b.channel);
+				} else if (b.state == idle && now >= b.retry_at && !m_stopping) {
+					b.state = connecting;
+					service_t::connect(a.endpoint, i);
+				} else if (b.state == bound_state && !b.linking
+						&& now - b.last_seen >= a.enquire_link) {
+					enquire_link msg;
+					b.linking = service_t::send_request(b.channel, msg, 0) != 0;
+				}
+			}
+			for (bin::sz_t i = 0; i < m_accounts.size(); ++i) {
+				drain(i);
+			}
+		}
+
+		void on_deliver_sm(bin::sz_t channel_id, const deliver_sm & msg) {
+			service_t::trace_got(channel_id, msg.command);
+			seen(channel_id);
+			deliver_sm_r r;
+			r.command.seqno = msg.command.seqno;
+			r.msg_id[0] = '\0';
+			r.msg_id_len = 1;
+			service_t::send(channel_id, r);
+			bind_data * b = find_bind(channel_id);
+			if (b != nullptr && m_on_deliver) {
+				m_on_deliver(b->account, msg);
+			}
+		}
+
+		void on_data_sm(bin::sz_t channel_id, const data_sm & msg) {
+			service_t::trace_got(channel_id, msg.command);
+			seen(channel_id);
+			data_sm_r r;
+			r.command.seqno = msg.command.seqno;
+			r.msg_id[0] = '\0';
+			r.msg_id_len = 1;
+			service_t::send(channel_id, r);
+		}
+
+		void on_enquire_link(bin::sz_t channel_id, const enquire_link & msg) {
+			service_t::trace_got(channel_id, msg.command);
+			seen(channel_id);
+			enquire_link_r r;
+			r.command.seqno = msg.command.seqno;
+			service_t::send(channel_id, r);
+		}
+
+		void on_unbind(bin::sz_t channel_id, const unbind & msg) {
+			service_t::trace_got(channel_id, msg.command);
+			unbind_r r;
+			r.command.seqno = msg.command.seqno;
+			service_t::send(channel_id, r);
+			service_t::close(channel_id);
+		}
+
+		void on_recv_error(bin::sz_t channel_id) {
+			ldebug(L) << "channel #" << channel_id << " recv error";
+			service_t::close(channel_id);
+		}
+
+		void on_parse_error(bin::sz_t channel_id) {
+			lerror(L) << "channel #" << channel_id << " parse error";
+			service_t::close(channel_id);
+		}
+
+		void on_send(bin::sz_t channel_id, bin::sz_t msg_id) {
+			(void)(channel_id);
+			(void)(msg_id);
+		}
+
+		void on_send_error(bin::sz_t channel_id, bin::sz_t msg_id) {
+			ltrace(L) << "channel #" << channel_id << " msg #" << msg_id << " not sent";
+		}
+
+		/* Requests an ESME does not get, and responses
+		 * to requests not sent by send_request */
+		void on_bind_transmitter(bin::sz_t channel_id, const bind_transmitter & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_bind_transmitter_r(bin::sz_t channel_id, const bind_transmitter_r & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_bind_receiver(bin::sz_t channel_id, const bind_receiver & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_bind_receiver_r(bin::sz_t channel_id, const bind_receiver_r & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_bind_transceiver(bin::sz_t channel_id, const bind_transceiver & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_bind_transceiver_r(bin::sz_t channel_id, const bind_transceiver_r & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_unbind_r(bin::sz_t channel_id, const unbind_r & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_outbind(bin::sz_t channel_id, const outbind & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_generic_nack(bin::sz_t channel_id, const generic_nack & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_submit_sm(bin::sz_t channel_id, const submit_sm & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_submit_sm_r(bin::sz_t channel_id, const submit_sm_r & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_submit_multi_sm(bin::sz_t channel_id, const submit_multi_sm & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_submit_multi_r(bin::sz_t channel_id, const submit_multi_r & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_deliver_sm_r(bin::sz_t channel_id, const deliver_sm_r & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_data_sm_r(bin::sz_t channel_id, const data_sm_r & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_query_sm(bin::sz_t channel_id, const query_sm & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_query_sm_r(bin::sz_t channel_id, const query_sm_r & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_cancel_sm(bin::sz_t channel_id, const cancel_sm & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_cancel_sm_r(bin::sz_t channel_id, const cancel_sm_r & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_replace_sm(bin::sz_t channel_id, const replace_sm & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_replace_sm_r(bin::sz_t channel_id, const replace_sm_r & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_enquire_link_r(bin::sz_t channel_id, const enquire_link_r & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+
+		void on_alert_notification(bin::sz_t channel_id, const alert_notification & msg) {
+			service_t::trace_got(channel_id, msg.command);
+		}
+};
+
+} } }
+
+#endif
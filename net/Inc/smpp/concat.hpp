@@ -0,0 +1,686 @@
+#ifndef smpp_concat_hpp
+#define smpp_concat_hpp
+
+#include <chrono>
+#include <vector>
+#include <limits>
+#include <cstring>
+#include <toolbox/bin.hpp>
+#include <smpp/proto.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+namespace udh {
+	/* esm_class bit telling short message starts with user data header */
+	const bin::u8_t esm_udhi				= 0x40;
+	/* Concatenated short message information elements */
+	const bin::u8_t iei_concat_8			= 0x00;
+	const bin::u8_t iei_concat_16			= 0x08;
+}
+
+/* Part of a concatenated message as found in a PDU */
+struct segment {
+	bin::u16_t ref;
+	bin::u8_t total;
+	bin::u8_t seqnum;
+	/* Part text without user data header */
+	const bin::u8_t * data;
+	bin::sz_t len;
+	segment(): ref(0), total(0), seqnum(0), data(nullptr), len(0) {}
+};
+
+/* Find concatenation info in SAR TLVs or in UDH of text.
+ * Returns false for a standalone message or a malformed header. */
+inline bool parse_segment(bin::u8_t esm_class
+		, const tlv_sar_msg_ref_num & sar_ref
+		, const tlv_sar_total_segments & sar_total
+		, const tlv_sar_segment_seqnum & sar_seqnum
+		, const bin::u8_t * text, bin::sz_t len, segment & s) {
+	s.data = text;
+	s.len = len;
+	if (sar_ref.tag == option::sar_msg_ref_num
+			&& sar_total.tag == option::sar_total_segments
+			&& sar_seqnum.tag == option::sar_segment_seqnum) {
+		s.ref = sar_ref.val;
+		s.total = sar_total.val;
+		s.seqnum = sar_seqnum.val;
+		return s.total != 0 && s.seqnum != 0 && s.seqnum <= s.total;
+	}
+	if (!(esm_class & udh::esm_udhi) || len == 0) {
+		return false;
+	}
+	bin::sz_t hlen = text[0] + 1;
+	if (hlen > len) {
+		return false;
+	}
+	bool found = false;
+	for (bin::sz_t i = 1; i + 2 <= hlen; ) {
+		bin::u8_t iei = text[i];
+		bin::sz_t ielen = text[i + 1];
+		const bin::u8_t * ie = text + i + 2;
+		if (i + 2 + ielen > hlen) {
+			return false;
+		}
+		if (iei == udh::iei_concat_8 && ielen == 3) {
+			s.ref = ie[0];
+			s.total = ie[1];
+			s.seqnum = ie[2];
+			found = true;
+		} else if (iei == udh::iei_concat_16 && ielen == 4) {
+			s.ref = (ie[0] << 8) | ie[1];
+			s.total = ie[2];
+			s.seqnum = ie[3];
+			found = true;
+		}
+		i += 2 + ielen;
+	}
+	s.data = text + hlen;
+	s.len = len - hlen;
+	return found && s.total != 0 && s.seqnum != 0 && s.seqnum <= s.total;
+}
+
+/* submit_sm and deliver_sm carry text either in short_msg or msg_payload */
+template <class MsgT>
+bool get_segment(const MsgT & msg, segment & s) {
+	if (msg.msg_payload.tag == option::msg_payload) {
+		return parse_segment(msg.esm_class, msg.sar_msg_ref_num
+			, msg.sar_total_segments, msg.sar_segment_seqnum
+			, msg.msg_payload.val, msg.msg_payload.len, s);
+	}
+	return parse_segment(msg.esm_class, msg.sar_msg_ref_num
+		, msg.sar_total_segments, msg.sar_segment_seqnum
+		, msg.short_msg, msg.short_msg_len, s);
+}
+
+inline bool get_segment(const data_sm & msg, segment & s) {
+	return parse_segment(msg.esm_class, msg.sar_msg_ref_num
+		, msg.sar_total_segments, msg.sar_segment_seqnum
+		, msg.msg_payload.val, msg.msg_payload.len, s);
+}
+
+/* Concatenated messages being collected from their parts.
+ *
+ * Parts are grouped by source, destination and reference number. All
+ * memory is allocated on construction: a fixed number of groups and a
+ * pool of fixed size blocks holding part text. A part is stored in O(1):
+ * one hash lookup, a bitmap check for duplicates, a copy into free blocks.
+ *
+ * Groups are linked in the order they were started, and each one gets
+ * the same timeout, so expiration starts from the head of the list.
+ * When memory runs out the oldest incomplete group is dropped.
+ *
+ * Not thread safe, meant to be used from message processing thread. */
+class reassembler {
+	public:
+		typedef std::chrono::steady_clock			clock_t;
+		typedef clock_t::time_point					time_point;
+		typedef clock_t::duration					duration;
+
+		/* Bytes of text per block */
+		static const bin::sz_t block_size = 128;
+		/* Largest message assembled */
+		static const bin::sz_t max_message = 0xFFFF;
+
+		enum result_t: bin::u8_t {
+			stored,			/* Part is kept until the rest arrives */
+			complete,		/* Message is assembled */
+			duplicate,		/* Part is already there, ignored */
+			invalid,		/* Bad numbering or message too long */
+			overflow		/* Part does not fit in memory at all */
+		};
+
+		/* Complete message, valid until the next call to insert */
+		struct message {
+			const bin::u8_t * data;
+			bin::sz_t len;
+			bin::u16_t ref;
+			bin::u8_t total;
+		};
+
+		reassembler(bin::sz_t max_groups, bin::sz_t max_bytes, duration timeout)
+			: m_timeout(timeout)
+			, m_head(nil)
+			, m_tail(nil)
+			, m_free_group(nil)
+			, m_free_part(nil)
+			, m_free_block(nil)
+			, m_groups_used(0)
+			, m_blocks_free(0)
+			, m_completed(0)
+			, m_expired(0)
+			, m_evicted(0)
+			, m_duplicates(0)
+			, m_out(max_message)
+		{
+			if (max_groups == 0) {
+				max_groups = 1;
+			}
+			bin::sz_t nblocks = (max_bytes + block_size - 1) / block_size;
+			if (nblocks == 0) {
+				nblocks = 1;
+			}
+			bin::sz_t nbuckets = 1;
+			while (nbuckets < max_groups * 2) {
+				nbuckets <<= 1;
+			}
+			m_buckets.assign(nbuckets, bin::u32_t(nil));
+			m_groups.resize(max_groups);
+			m_parts.resize(nblocks);
+			m_blocks.resize(nblocks);
+			for (bin::u32_t i = m_groups.size(); i-- > 0; ) {
+				m_groups[i].next = m_free_group;
+				m_free_group = i;
+			}
+			for (bin::u32_t i = m_parts.size(); i-- > 0; ) {
+				m_parts[i].next = m_free_part;
+				m_free_part = i;
+			}
+			for (bin::u32_t i = m_blocks.size(); i-- > 0; ) {
+				m_blocks[i].next = m_free_block;
+				m_free_block = i;
+			}
+			m_blocks_free = m_blocks.size();
+		}
+
+		/* Store a part. On complete result msg refers to the whole text. */
+		result_t insert(const bin::u8_t * src, bin::sz_t src_len
+				, const bin::u8_t * dst, bin::sz_t dst_len
+				, const segment & s, time_point now, message & msg) {
+			if (s.total == 0 || s.seqnum == 0 || s.seqnum > s.total
+					|| s.len > max_message) {
+				return invalid;
+			}
+			if (s.total == 1) {
+				msg.data = s.data;
+				msg.len = s.len;
+				msg.ref = s.ref;
+				msg.total = 1;
+				m_completed++;
+				return complete;
+			}
+
+			key k(src, src_len, dst, dst_len, s.ref);
+			bin::u32_t idx = find(k);
+			if (idx != nil && m_groups[idx].total != s.total) {
+				/* Same reference reused for another message */
+				release(idx);
+				m_evicted++;
+				idx = nil;
+			}
+			if (idx == nil) {
+				if (m_free_group == nil) {
+					release(m_head);
+					m_evicted++;
+				}
+				idx = start(k, s.total, now);
+			}
+
+			group & g = m_groups[idx];
+			if (g.has(s.seqnum)) {
+				m_duplicates++;
+				return duplicate;
+			}
+			if (g.bytes + s.len > max_message) {
+				return invalid;
+			}
+
+			/* Make room by dropping oldest groups but this one */
+			bin::sz_t nblocks = (s.len + block_size - 1) / block_size;
+			while (m_blocks_free < nblocks || m_free_part == nil) {
+				bin::u32_t victim = m_head == idx ? m_groups[idx].next : m_head;
+				if (victim == nil) {
+					return overflow;
+				}
+				release(victim);
+				m_evicted++;
+			}
+
+			store(g, s);
+			if (g.count < g.total) {
+				return stored;
+			}
+
+			assemble(g, msg);
+			release(idx);
+			m_completed++;
+			return complete;
+		}
+
+		/* Drop groups started before now - timeout,
+		 * f(ref, received, total) is called for each of them */
+		template <typename F>
+		bin::sz_t expire(time_point now, F f) {
+			bin::sz_t n = 0;
+			while (m_head != nil && m_groups[m_head].deadline <= now) {
+				const group & g = m_groups[m_head];
+				f(g.k.ref, g.count, g.total);
+				release(m_head);
+				m_expired++;
+				n++;
+			}
+			return n;
+		}
+
+		/* Incomplete messages kept */
+		bin::sz_t groups() const { return m_groups_used; }
+
+		/* Memory taken by stored parts */
+		bin::sz_t bytes_used() const {
+			return (m_blocks.size() - m_blocks_free) * block_size;
+		}
+
+		bin::sz_t completed() const { return m_completed; }
+		bin::sz_t expired() const { return m_expired; }
+		bin::sz_t evicted() const { return m_evicted; }
+		bin::sz_t duplicates() const { return m_duplicates; }
+
+	private:
+		static const bin::u32_t nil = std::numeric_limits<bin::u32_t>::max();
+
+		struct key {
+			bin::u8_t src[21];
+			bin::u8_t dst[21];
+			bin::u8_t src_len;
+			bin::u8_t dst_len;
+			bin::u16_t ref;
+			bin::u32_t hash;
+
+			key(): src_len(0), dst_len(0), ref(0), hash(0) {}
+
+			/* Address length may include terminating zero */
+			key(const bin::u8_t * s, bin::sz_t slen
+					, const bin::u8_t * d, bin::sz_t dlen, bin::u16_t r)
+				: src_len(length(s, slen, sizeof(src)))
+				, dst_len(length(d, dlen, sizeof(dst)))
+				, ref(r)
+			{
+				std::memcpy(src, s, src_len);
+				std::memcpy(dst, d, dst_len);
+				/* FNV-1a */
+				bin::u32_t h = 2166136261u;
+				for (bin::sz_t i = 0; i < src_len; ++i) {
+					h = (h ^ src[i]) * 16777619u;
+				}
+				h = (h ^ 0xFF) * 16777619u;
+				for (bin::sz_t i = 0; i < dst_len; ++i) {
+					h = (h ^ dst[i]) * 16777619u;
+				}
+				h = (h ^ (ref & 0xFF)) * 16777619u;
+				h = (h ^ (ref >> 8)) * 16777619u;
+				hash = h;
+			}
+
+			bool operator==(const key & k) const {
+				return hash == k.hash && ref == k.ref
+					&& src_len == k.src_len && dst_len == k.dst_len
+					&& std::memcmp(src, k.src, src_len) == 0
+					&& std::memcmp(dst, k.dst, dst_len) == 0;
+			}
+
+			static bin::u8_t length(const bin::u8_t * s, bin::sz_t len, bin::sz_t max) {
+				bin::sz_t n = 0;
+				while (n < len && n < max && s[n] != 0) {
+					n++;
+				}
+				return n;
+			}
+		};
+
+		struct group {
+			key k;
+			bin::u8_t total;
+			bin::u8_t count;
+			bin::sz_t bytes;
+			/* Parts received, bit per sequence number */
+			bin::u32_t received[8];
+			bin::u32_t parts;
+			bin::u32_t chain;
+			/* Age list, or free list link */
+			bin::u32_t prev;
+			bin::u32_t next;
+			time_point deadline;
+
+			bool has(bin::u8_t seqnum) const {
+				return (received[seqnum >> 5] >> (seqnum & 31)) & 1;
+			}
+		};
+
+		struct part {
+			bin::u32_t next;
+			bin::u32_t block;
+			bin::u16_t len;
+			bin::u8_t seqnum;
+		};
+
+		struct block {
+			bin::u32_t next;
+			bin::u8_t data[block_size];
+		};
+
+		duration m_timeout;
+
+		std::vector<bin::u32_t> m_buckets;
+		std::vector<group> m_groups;
+		std::vector<part> m_parts;
+		std::vector<block> m_blocks;
+
+		bin::u32_t m_head;
+		bin::u32_t m_tail;
+		bin::u32_t m_free_group;
+		bin::u32_t m_free_part;
+		bin::u32_t m_free_block;
+		bin::sz_t m_groups_used;
+		bin::sz_t m_blocks_free;
+
+		bin::sz_t m_completed;
+		bin::sz_t m_expired;
+		bin::sz_t m_evicted;
+		bin::sz_t m_duplicates;
+
+		/* Assembled message */
+		std::vector<bin::u8_t> m_out;
+
+		bin::u32_t & bucket(bin::u32_t hash) {
+			return m_buckets[hash & (m_buckets.size() - 1)];
+		}
+
+		bin::u32_t find(const key & k) {
+			for (bin::u32_t i = bucket(k.hash); i != nil; i = m_groups[i].chain) {
+				if (m_groups[i].k == k) {
+					return i;
+				}
+			}
+			return nil;
+		}
+
+		bin::u32_t start(const key & k, bin::u8_t total, time_point now) {
+			bin::u32_t idx = m_free_group;
+			group & g = m_groups[idx];
+			m_free_group = g.next;
+
+			g.k = k;
+			g.total = total;
+			g.count = 0;
+			g.bytes = 0;
+			std::memset(g.received, 0, sizeof(g.received));
+			g.parts = nil;
+			g.deadline = now + m_timeout;
+
+			bin::u32_t & b = bucket(k.hash);
+			g.chain = b;
+			b = idx;
+
+			g.prev = m_tail;
+			g.next = nil;
+			if (m_tail != nil) {
+				m_groups[m_tail].next = idx;
+			} else {
+				m_head = idx;
+			}
+			m_tail = idx;
+			m_groups_used++;
+			return idx;
+		}
+
+		void store(group & g, const segment & s) {
+			bin::u32_t pidx = m_free_part;
+			part & p = m_parts[pidx];
+			m_free_part = p.next;
+
+			p.seqnum = s.seqnum;
+			p.len = s.len;
+			p.block = nil;
+			/* Blocks are taken in reverse, so link them back to front */
+			bin::sz_t nblocks = (s.len + block_size - 1) / block_size;
+			for (bin::sz_t i = nblocks; i-- > 0; ) {
+				bin::u32_t bidx = m_free_block;
+				block & b = m_blocks[bidx];
+				m_free_block = b.next;
+				bin::sz_t off = i * block_size;
+				bin::sz_t len = s.len - off;
+				std::memcpy(b.data, s.data + off, len < block_size ? len : block_size);
+				b.next = p.block;
+				p.block = bidx;
+			}
+			m_blocks_free -= nblocks;
+
+			p.next = g.parts;
+			g.parts = pidx;
+			g.received[s.seqnum >> 5] |= bin::u32_t(1) << (s.seqnum & 31);
+			g.count++;
+			g.bytes += s.len;
+		}
+
+		void assemble(const group & g, message & msg) {
+			bin::u32_t order[256];
+			for (bin::u32_t i = g.parts; i != nil; i = m_parts[i].next) {
+				order[m_parts[i].seqnum] = i;
+			}
+			bin::u8_t * out = m_out.data();
+			for (bin::sz_t n = 1; n <= g.total; ++n) {
+				const part & p = m_parts[order[n]];
+				bin::sz_t left = p.len;
+				for (bin::u32_t b = p.block; b != nil; b = m_blocks[b].next) {
+					bin::sz_t len = left < block_size ? left : block_size;
+					std::memcpy(out, m_blocks[b].data, len);
+					out += len;
+					left -= len;
+				}
+			}
+			msg.data = m_out.data();
+			msg.len = out - m_out.data();
+			msg.ref = g.k.ref;
+			msg.total = g.total;
+		}
+
+		void release(bin::u32_t idx) {
+			group & g = m_groups[idx];
+
+			while (g.parts != nil) {
+				part & p = m_parts[g.parts];
+				bin::u32_t next = p.next;
+				while (p.block != nil) {
+					block & b = m_blocks[p.block];
+					bin::u32_t bnext = b.next;
+					b.next = m_free_block;
+					m_free_block = p.block;
+					m_blocks_free++;
+					p.block = bnext;
+				}
+				p.next = m_free_part;
+				m_free_part = g.parts;
+				g.parts = next;
+			}
+
+			bin::u32_t * link = &bucket(g.k.hash);
+			while (*link != idx) {
+				link = &m_groups[*link].chain;
+			}
+			*link = g.chain;
+
+			if (g.prev != nil) {
+				m_groups[g.prev].next = g.next;
+			} else {
+				m_head = g.next;
+			}
+			if (g.next != nil) {
+				m_groups[g.next].prev = g.prev;
+			} else {
+				m_tail = g.prev;
+			}
+			g.next = m_free_group;
+			m_free_group = idx;
+			m_groups_used--;
+		}
+};
+
+/* Split of a long text into parts of a concatenated message.
+ *
+ * Part boundaries are found in one pass on construction, fill then
+ * puts a part straight into short_msg of a submit_sm or deliver_sm,
+ * so no copy of the text is made apart from the PDU itself.
+ *
+ * How parts are told to be concatenated depends on what the peer
+ * supports: the whole text in one msg_payload TLV, SAR TLVs, or UDH
+ * with 8 or 16 bit reference. Boundaries never split GSM escape
+ * sequence or UCS-2 surrogate pair. */
+class segmenter {
+	public:
+		enum mode_t: bin::u8_t {
+			payload,
+			sar,
+			udh8,
+			udh16
+		};
+
+		/* Parts a message may consist of */
+		static const bin::sz_t max_parts = 255;
+
+		segmenter(mode_t mode, bin::u8_t data_coding
+				, const bin::u8_t * text, bin::sz_t len)
+			: m_mode(mode)
+			, m_text(text)
+			, m_len(len)
+			, m_count(0)
+		{
+			alphabet_t a = alphabet(data_coding);
+			if (len <= single_size(a)) {
+				/* Plain short_msg, nothing to concatenate */
+				m_mode = sar;
+				m_count = 1;
+				m_bounds[1] = len;
+			} else if (mode == payload) {
+				m_count = len <= max_payload ? 1 : 0;
+				m_bounds[1] = len;
+			} else {
+				split(a, part_size(a, mode));
+			}
+			m_bounds[0] = 0;
+		}
+
+		/* Number of parts, 0 if text does not fit */
+		bin::sz_t count() const { return m_count; }
+
+		/* Set text of i-th part to msg, ref is the message reference */
+		template <class MsgT>
+		void fill(MsgT & msg, bin::sz_t i, bin::u16_t ref) const {
+			const bin::u8_t * data = m_text + m_bounds[i];
+			bin::sz_t len = m_bounds[i + 1] - m_bounds[i];
+			bin::u8_t * out = msg.short_msg;
+			msg.esm_class &= ~udh::esm_udhi;
+			if (m_count == 1) {
+				if (m_mode == payload) {
+					msg.short_msg_len = 0;
+					msg.msg_payload.set(data, len);
+				} else {
+					std::memcpy(out, data, len);
+					msg.short_msg_len = len;
+				}
+				return;
+			}
+			switch (m_mode) {
+				case sar:
+					msg.sar_msg_ref_num.set(ref);
+					msg.sar_total_segments.set(m_count);
+					msg.sar_segment_seqnum.set(i + 1);
+					break;
+				case udh8:
+					*out++ = 5;
+					*out++ = udh::iei_concat_8;
+					*out++ = 3;
+					*out++ = ref & 0xFF;
+					*out++ = m_count;
+					*out++ = i + 1;
+					msg.esm_class |= udh::esm_udhi;
+					break;
+				case udh16:
+					*out++ = 6;
+					*out++ = udh::iei_concat_16;
+					*out++ = 4;
+					*out++ = ref >> 8;
+					*out++ = ref & 0xFF;
+					*out++ = m_count;
+					*out++ = i + 1;
+					msg.esm_class |= udh::esm_udhi;
+					break;
+				default:
+					break;
+			}
+			std::memcpy(out, data, len);
+			msg.short_msg_len = out + len - msg.short_msg;
+		}
+
+	private:
+		enum alphabet_t: bin::u8_t {
+			gsm7,	/* Septet per octet, 160 per message */
+			octet,	/* 140 octets per message */
+			ucs2	/* 70 UTF-16 code units per message */
+		};
+
+		static const bin::sz_t max_payload = 0xFFFF;
+		static const bin::u8_t gsm7_escape = 0x1B;
+
+		mode_t m_mode;
+		const bin::u8_t * m_text;
+		bin::sz_t m_len;
+		bin::sz_t m_count;
+		/* Part i is [m_bounds[i], m_bounds[i + 1]) */
+		bin::u16_t m_bounds[max_parts + 1];
+
+		static alphabet_t alphabet(bin::u8_t dc) {
+			if ((dc & 0xF0) == 0xF0) {
+				return (dc & 0x04) ? octet : gsm7;
+			}
+			switch (dc) {
+				case 0x08:
+					return ucs2;
+				case 0x02:
+				case 0x04:
+					return octet;
+				default:
+					/* SMSC default, IA5, Latin-1 and alike
+					 * are delivered in GSM 7-bit alphabet */
+					return gsm7;
+			}
+		}
+
+		static bin::sz_t single_size(alphabet_t a) {
+			return a == gsm7 ? 160 : 140;
+		}
+
+		/* SMSC adds 8-bit reference UDH for SAR parts on its own */
+		static bin::sz_t part_size(alphabet_t a, mode_t mode) {
+			bin::sz_t udh_len = mode == udh16 ? 7 : 6;
+			if (a == gsm7) {
+				/* UDH is padded to septet boundary */
+				return 160 - (udh_len * 8 + 6) / 7;
+			}
+			return (140 - udh_len) & (a == ucs2 ? ~bin::sz_t(1) : ~bin::sz_t(0));
+		}
+
+		void split(alphabet_t a, bin::sz_t size) {
+			bin::sz_t pos = 0;
+			while (pos < m_len) {
+				if (m_count == max_parts) {
+					m_count = 0;
+					return;
+				}
+				bin::sz_t end = pos + size;
+				if (end >= m_len) {
+					end = m_len;
+				} else if (a == gsm7 && m_text[end - 1] == gsm7_escape) {
+					end--;
+				} else if (a == ucs2 && (m_text[end - 2] & 0xFC) == 0xD8) {
+					end -= 2;
+				}
+				m_bounds[++m_count] = end;
+				pos = end;
+			}
+		}
+};
+
+} } }
+
+#endif
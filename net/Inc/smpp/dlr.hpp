@@ -0,0 +1,284 @@
+#ifndef smpp_dlr_hpp
+#define smpp_dlr_hpp
+
+#include <chrono>
+#include <vector>
+#include <cstring>
+#include <toolbox/bin.hpp>
+#include <smpp/proto.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+namespace dlr {
+	/* Message type bits of esm_class and the one of SMSC delivery receipt */
+	const bin::u8_t esm_type_mask			= 0x3C;
+	const bin::u8_t esm_smsc_receipt		= 0x04;
+}
+
+/* Whether deliver_sm or data_sm is a delivery receipt */
+template <class MsgT>
+bool is_receipt(const MsgT & msg) {
+	return (msg.esm_class & dlr::esm_type_mask) == dlr::esm_smsc_receipt;
+}
+
+/* Message id a receipt refers to, taken from receipted_msg_id TLV.
+ * Returns false if there is none. */
+template <class MsgT>
+bool receipted_id(const MsgT & msg, const bin::u8_t *& id, bin::sz_t & len) {
+	if (msg.receipted_msg_id.tag != option::receipted_msg_id) {
+		return false;
+	}
+	id = msg.receipted_msg_id.val;
+	len = msg.receipted_msg_id.len;
+	const void * end = std::memchr(id, 0, len);
+	if (end != nullptr) {
+		len = static_cast<const bin::u8_t *>(end) - id;
+	}
+	return len != 0;
+}
+
+/* Where messages sent upstream came from, found by the id upstream gave
+ * them once their delivery receipts arrive.
+ *
+ * Entries live in one open addressing table with linear probing, sized
+ * upfront for the maximum number of entries, so lookups take a probe or
+ * two and nothing is allocated afterwards. A slot is one cache line: hash
+ * of the id, first max_key bytes of it and the origin. Longer ids are told
+ * apart by the hash of the whole id. Removal shifts the rest of the probe
+ * run back, so there are no tombstones to clean up.
+ *
+ * Every entry expires ttl after it is made. Expired entries are dropped
+ * when met by lookups and by expire, which walks a part of the table per
+ * call so the cost is spread over ticks.
+ *
+ * Not thread safe, meant to be used from message processing thread. */
+class correlator {
+	public:
+		typedef std::chrono::steady_clock			clock_t;
+		typedef clock_t::time_point					time_point;
+		typedef clock_t::duration					duration;
+
+		/* Id bytes kept in a slot */
+		static const bin::sz_t max_key = 27;
+
+		/* Message as it was accepted by us */
+		struct origin {
+			bin::u64_t msg_id;
+			/* System it came from, channels are reused before
+			 * receipts arrive, see route_table::sys_key */
+			bin::u64_t sys_key;
+			/* Seconds since epoch */
+			bin::u32_t submit_time;
+		};
+
+		correlator(bin::sz_t max_entries, duration ttl)
+			: m_slots(capacity_for(max_entries))
+			, m_mask(m_slots.size() - 1)
+			, m_max(max_entries)
+			, m_size(0)
+			, m_ttl(std::chrono::duration_cast<std::chrono::seconds>(ttl).count())
+			, m_start(clock_t::now())
+			, m_cursor(0)
+			, m_expired(0)
+			, m_rejected(0)
+		{
+			if (m_ttl == 0) {
+				m_ttl = 1;
+			}
+		}
+
+		/* Remember origin of a message upstream knows by id. Entry with
+		 * the same id is replaced. Returns false if the table is full. */
+		bool insert(const bin::u8_t * id, bin::sz_t len, const origin & o, time_point now) {
+			len = key_len(id, len);
+			bin::u64_t h = hash(id, len);
+			bin::u32_t t = seconds(now);
+			bin::sz_t i = h & m_mask;
+			for (; m_slots[i].expires != 0; i = (i + 1) & m_mask) {
+				if (same(m_slots[i], h, id, len)) {
+					set(m_slots[i], h, id, len, o, t);
+					return true;
+				}
+			}
+			if (m_size >= m_max) {
+				m_rejected++;
+				return false;
+			}
+			set(m_slots[i], h, id, len, o, t);
+			m_size++;
+			return true;
+		}
+
+		/* Origin of a message by upstream id */
+		bool find(const bin::u8_t * id, bin::sz_t len, origin & o, time_point now) {
+			bin::sz_t i;
+			if (!lookup(id, len, now, i)) {
+				return false;
+			}
+			o = m_slots[i].o;
+			return true;
+		}
+
+		/* Find and forget, e.g. on a final receipt */
+		bool take(const bin::u8_t * id, bin::sz_t len, origin & o, time_point now) {
+			bin::sz_t i;
+			if (!lookup(id, len, now, i)) {
+				return false;
+			}
+			o = m_slots[i].o;
+			remove(i);
+			return true;
+		}
+
+		bool erase(const bin::u8_t * id, bin::sz_t len, time_point now) {
+			bin::sz_t i;
+			if (!lookup(id, len, now, i)) {
+				return false;
+			}
+			remove(i);
+			return true;
+		}
+
+		/* Drop expired entries among the next max_slots slots.
+		 * Returns number of entries dropped. */
+		bin::sz_t expire(time_point now, bin::sz_t max_slots) {
+			bin::u32_t t = seconds(now);
+			bin::sz_t dropped = 0;
+			for (bin::sz_t n = 0; n < max_slots && n < m_slots.size(); ++n) {
+				slot & s = m_slots[m_cursor];
+				if (s.expires != 0 && s.expires <= t) {
+					/* Slot gets the next entry of its run, look again */
+					remove(m_cursor);
+					dropped++;
+					continue;
+				}
+				m_cursor = (m_cursor + 1) & m_mask;
+			}
+			m_expired += dropped;
+			return dropped;
+		}
+
+		bin::sz_t size() const { return m_size; }
+		bin::sz_t capacity() const { return m_max; }
+
+		/* Bytes taken by the table */
+		bin::sz_t memory() const {
+			return m_slots.size() * sizeof(slot);
+		}
+
+		bin::sz_t expired() const { return m_expired; }
+		bin::sz_t rejected() const { return m_rejected; }
+
+	private:
+		struct slot {
+			bin::u64_t hash;
+			origin o;
+			/* Seconds since start, 0 for a free slot */
+			bin::u32_t expires;
+			bin::u8_t len;
+			bin::u8_t key[max_key];
+		};
+
+		static_assert(sizeof(slot) == 64, "slot is not a cache line");
+
+		std::vector<slot> m_slots;
+		const bin::sz_t m_mask;
+		const bin::sz_t m_max;
+		bin::sz_t m_size;
+		bin::u32_t m_ttl;
+		const time_point m_start;
+		bin::sz_t m_cursor;
+		bin::sz_t m_expired;
+		bin::sz_t m_rejected;
+
+		/* Load factor is kept under 3/4 */
+		static bin::sz_t capacity_for(bin::sz_t n) {
+			bin::sz_t c = 16;
+			while (c / 4 * 3 < n) {
+				c <<= 1;
+			}
+			return c;
+		}
+
+		static bin::sz_t key_len(const bin::u8_t * id, bin::sz_t len) {
+			const void * end = std::memchr(id, 0, len);
+			return end == nullptr ? len : static_cast<const bin::u8_t *>(end) - id;
+		}
+
+		/* FNV-1a, finished to spread low bits used for slot index */
+		static bin::u64_t hash(const bin::u8_t * id, bin::sz_t len) {
+			bin::u64_t h = 0xCBF29CE484222325ull;
+			for (bin::sz_t i = 0; i < len; ++i) {
+				h = (h ^ id[i]) * 0x100000001B3ull;
+			}
+			h ^= h >> 33;
+			h *= 0xFF51AFD7ED558CCDull;
+			h ^= h >> 33;
+			return h;
+		}
+
+		/* Never 0, which marks a free slot */
+		bin::u32_t seconds(time_point now) const {
+			return std::chrono::duration_cast<std::chrono::seconds>(
+				now - m_start).count() + 1;
+		}
+
+		static bin::sz_t stored_len(bin::sz_t len) {
+			return len < max_key ? len : max_key;
+		}
+
+		static bool same(const slot & s, bin::u64_t h, const bin::u8_t * id, bin::sz_t len) {
+			bin::sz_t l = stored_len(len);
+			return s.hash == h && s.len == l && std::memcmp(s.key, id, l) == 0;
+		}
+
+		void set(slot & s, bin::u64_t h, const bin::u8_t * id, bin::sz_t len
+				, const origin & o, bin::u32_t t) {
+			s.hash = h;
+			s.len = stored_len(len);
+			std::memcpy(s.key, id, s.len);
+			s.o = o;
+			s.expires = t + m_ttl;
+		}
+
+		bool lookup(const bin::u8_t * id, bin::sz_t len, time_point now, bin::sz_t & i) {
+			len = key_len(id, len);
+			bin::u64_t h = hash(id, len);
+			for (i = h & m_mask; m_slots[i].expires != 0; i = (i + 1) & m_mask) {
+				if (same(m_slots[i], h, id, len)) {
+					if (m_slots[i].expires <= seconds(now)) {
+						remove(i);
+						m_expired++;
+						return false;
+					}
+					return true;
+				}
+			}
+			return false;
+		}
+
+		/* Move later entries of the probe run into the hole
+		 * unless it is before their home slot */
+		void remove(bin::sz_t i) {
+			bin::sz_t j = i;
+			while (true) {
+				j = (j + 1) & m_mask;
+				if (m_slots[j].expires == 0) {
+					break;
+				}
+				bin::sz_t home = m_slots[j].hash & m_mask;
+				if (((j - home) & m_mask) >= ((j - i) & m_mask)) {
+					m_slots[i] = m_slots[j];
+					i = j;
+				}
+			}
+			m_slots[i].expires = 0;
+			m_size--;
+		}
+};
+
+} } }
+
+#endif
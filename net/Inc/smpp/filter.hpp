@@ -0,0 +1,427 @@
+#ifndef smpp_filter_hpp
+#define smpp_filter_hpp
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <istream>
+#include <toolbox/bin.hpp>
+#include <smpp/proto.hpp>
+#include <smpp/concat.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Text of messages and patterns is brought to one form before matching:
+ * code points are case folded, Latin letters lose their accents, runs
+ * of spaces and punctuation become a single space and zero width ones
+ * are dropped, then the result is taken as UTF-8 bytes. */
+namespace content {
+
+	enum alphabet_t {
+		gsm7,	/* GSM 03.38 default alphabet, septet per octet */
+		latin1,	/* IA5 and ISO-8859-1 */
+		ucs2,	/* UTF-16 big endian */
+		binary	/* Not scanned */
+	};
+
+	inline alphabet_t alphabet(bin::u8_t dc) {
+		if ((dc & 0xF0) == 0xF0) {
+			return (dc & 0x04) ? binary : gsm7;
+		}
+		switch (dc) {
+			case 0x00:
+				return gsm7;
+			case 0x08:
+				return ucs2;
+			case 0x02:
+			case 0x04:
+				return binary;
+			default:
+				return latin1;
+		}
+	}
+
+	/* Code point of a default alphabet septet, escaped ones
+	 * are all punctuation and the euro sign */
+	inline bin::u32_t gsm7_char(bin::u8_t c) {
+		static const bin::u16_t table[128] = {
+			0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
+			0x00F2, 0x00C7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+			0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
+			0x03A3, 0x0398, 0x039E, 0x0020, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+			0x0020, 0x0021, 0x0022, 0x0023, 0x00A4, 0x0025, 0x0026, 0x0027,
+			0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+			0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+			0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+			0x00A1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+			0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+			0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+			0x0058, 0x0059, 0x005A, 0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7,
+			0x00BF, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+			0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+			0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+			0x0078, 0x0079, 0x007A, 0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0
+		};
+		return table[c & 0x7F];
+	}
+
+	/* Code point in the matching form, ' ' for a separator
+	 * and 0 for one to drop */
+	inline bin::u32_t fold(bin::u32_t cp) {
+		/* Base letters of U+00E0 - U+00FF, '*' keeps the letter */
+		static const char latin[] = "aaaaaa*ceeeeiiiidnooooo ouuuuy*y";
+		if (cp < 0x80) {
+			if (cp >= 'A' && cp <= 'Z') {
+				return cp + 0x20;
+			}
+			return (cp >= 'a' && cp <= 'z') || (cp >= '0' && cp <= '9') ? cp : ' ';
+		}
+		if (cp < 0x100) {
+			if (cp < 0xC0 || cp == 0xD7) {
+				return ' ';
+			}
+			if (cp < 0xDF) {
+				cp += 0x20;
+			}
+			if (cp >= 0xE0 && latin[cp - 0xE0] != '*') {
+				return static_cast<unsigned char>(latin[cp - 0xE0]);
+			}
+			return cp;
+		}
+		if (cp >= 0x391 && cp <= 0x3A9) {
+			return cp + 0x20;
+		}
+		if (cp == 0x3C2) {
+			return 0x3C3;
+		}
+		if (cp >= 0x410 && cp <= 0x42F) {
+			return cp + 0x20;
+		}
+		if (cp >= 0x400 && cp <= 0x40F) {
+			cp += 0x50;
+		}
+		if (cp == 0x451) {
+			return 0x435;
+		}
+		if ((cp >= 0x200B && cp <= 0x200D) || cp == 0x2060 || cp == 0xFEFF) {
+			return 0;
+		}
+		if ((cp >= 0x2000 && cp <= 0x206F) || cp == 0x3000) {
+			return ' ';
+		}
+		if (cp >= 0xFF01 && cp <= 0xFF5E) {
+			/* Fullwidth forms of ASCII */
+			return fold(cp - 0xFEE0);
+		}
+		return cp;
+	}
+
+	/* UTF-8 of cp, out takes 4 bytes. Returns its length. */
+	inline bin::sz_t encode(bin::u32_t cp, bin::u8_t * out) {
+		if (cp < 0x80) {
+			out[0] = cp;
+			return 1;
+		}
+		if (cp < 0x800) {
+			out[0] = 0xC0 | (cp >> 6);
+			out[1] = 0x80 | (cp & 0x3F);
+			return 2;
+		}
+		if (cp < 0x10000) {
+			out[0] = 0xE0 | (cp >> 12);
+			out[1] = 0x80 | ((cp >> 6) & 0x3F);
+			out[2] = 0x80 | (cp & 0x3F);
+			return 3;
+		}
+		out[0] = 0xF0 | (cp >> 18);
+		out[1] = 0x80 | ((cp >> 12) & 0x3F);
+		out[2] = 0x80 | ((cp >> 6) & 0x3F);
+		out[3] = 0x80 | (cp & 0x3F);
+		return 4;
+	}
+
+	/* Feed code points of text to f(cp) until it returns false */
+	template <class F>
+	void decode(alphabet_t a, const bin::u8_t * text, bin::sz_t len, F f) {
+		switch (a) {
+			case gsm7:
+				for (bin::sz_t i = 0; i < len; ++i) {
+					if (text[i] == 0x1B) {
+						/* Extension table */
+						i++;
+						if (!f(' ')) {
+							return;
+						}
+					} else if (!f(gsm7_char(text[i]))) {
+						return;
+					}
+				}
+				break;
+			case latin1:
+				for (bin::sz_t i = 0; i < len; ++i) {
+					if (!f(text[i])) {
+						return;
+					}
+				}
+				break;
+			case ucs2:
+				for (bin::sz_t i = 0; i + 1 < len; i += 2) {
+					bin::u32_t cp = text[i] << 8 | text[i + 1];
+					if (cp >= 0xD800 && cp < 0xDC00 && i + 3 < len) {
+						bin::u32_t lo = text[i + 2] << 8 | text[i + 3];
+						if (lo >= 0xDC00 && lo < 0xE000) {
+							cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+							i += 2;
+						}
+					}
+					if (!f(cp)) {
+						return;
+					}
+				}
+				break;
+			case binary:
+				break;
+		}
+	}
+
+	/* UTF-8, malformed bytes are taken as Latin-1 */
+	template <class F>
+	void decode_utf8(const std::string & s, F f) {
+		const bin::u8_t * p = reinterpret_cast<const bin::u8_t *>(s.data());
+		bin::sz_t len = s.size();
+		for (bin::sz_t i = 0; i < len; ) {
+			bin::u32_t cp = p[i];
+			bin::sz_t n = cp >= 0xF0 ? 4 : cp >= 0xE0 ? 3 : cp >= 0xC0 ? 2 : 1;
+			if (n > 1 && i + n <= len) {
+				bin::u32_t v = cp & (0x3F >> (n - 1));
+				bin::sz_t k = 1;
+				for (; k < n && (p[i + k] & 0xC0) == 0x80; ++k) {
+					v = v << 6 | (p[i + k] & 0x3F);
+				}
+				if (k == n) {
+					cp = v;
+				} else {
+					n = 1;
+				}
+			} else {
+				n = 1;
+			}
+			f(cp);
+			i += n;
+		}
+	}
+}
+
+/* Read patterns, one UTF-8 pattern per line. Empty lines and ones
+ * starting with '#' are skipped, so are trailing '\r'. */
+inline void read_patterns(std::istream & in, std::vector<std::string> & patterns) {
+	std::string line;
+	while (std::getline(in, line)) {
+		if (!line.empty() && line[line.size() - 1] == '\r') {
+			line.erase(line.size() - 1);
+		}
+		if (!line.empty() && line[0] != '#') {
+			patterns.push_back(line);
+		}
+	}
+}
+
+/* Patterns compiled to an Aho-Corasick automaton, found anywhere in text
+ * of messages, after both are brought to matching form.
+ *
+ * The automaton is a full DFA: every state has a transition for each
+ * byte class, failure links are resolved at build time, so a byte of
+ * text costs one table read however many patterns there are. Bytes not
+ * found in any pattern share one class, which keeps rows as narrow as
+ * the patterns' alphabet. A state knows the first pattern ending in it
+ * or in any of its suffixes, so a scan stops at the first match.
+ *
+ * Text is decoded and normalized on the fly as it is scanned, nothing
+ * is copied. Parts of a concatenated message are scanned one by one.
+ *
+ * Immutable once built, so any number of threads may use it. */
+class content_filter {
+	public:
+		static const bin::u32_t nil = ~static_cast<bin::u32_t>(0);
+
+		explicit content_filter(const std::vector<std::string> & patterns)
+			: m_patterns(patterns)
+		{
+			build();
+		}
+
+		/* Matching form of a UTF-8 pattern, empty if nothing is left */
+		static std::string normalize(const std::string & pattern) {
+			std::string out;
+			bool space = true;
+			content::decode_utf8(pattern, [&] (bin::u32_t cp) {
+				put(content::fold(cp), space, [&] (bin::u8_t b) {
+					out.push_back(b);
+				});
+			});
+			if (!out.empty() && out[out.size() - 1] == ' ') {
+				out.erase(out.size() - 1);
+			}
+			return out;
+		}
+
+		/* Index of the first pattern found in text of data_coding dc,
+		 * nil if none is. Binary data is not scanned. */
+		bin::u32_t find(bin::u8_t dc, const bin::u8_t * text, bin::sz_t len) const {
+			bin::u32_t s = 0;
+			bin::u32_t found = nil;
+			bool space = true;
+			content::decode(content::alphabet(dc), text, len, [&] (bin::u32_t cp) {
+				put(content::fold(cp), space, [&] (bin::u8_t b) {
+					s = m_delta[s * m_width + m_classes[b]];
+					if (found == nil) {
+						found = m_match[s];
+					}
+				});
+				return found == nil;
+			});
+			return found;
+		}
+
+		/* Pattern found in short message or payload, whichever holds the
+		 * text, user data header skipped */
+		template <class MsgT>
+		bin::u32_t find(const MsgT & msg) const {
+			if (msg.msg_payload.tag == option::msg_payload) {
+				return find(msg.esm_class, msg.data_coding, msg.msg_payload.val, msg.msg_payload.len);
+			}
+			return find(msg.esm_class, msg.data_coding, msg.short_msg, msg.short_msg_len);
+		}
+
+		bin::u32_t find(const data_sm & msg) const {
+			return find(msg.esm_class, msg.data_coding, msg.msg_payload.val, msg.msg_payload.len);
+		}
+
+		const std::string & pattern(bin::u32_t i) const { return m_patterns[i]; }
+		bin::sz_t patterns() const { return m_patterns.size(); }
+		bin::sz_t states() const { return m_match.size(); }
+		bin::sz_t classes() const { return m_width; }
+
+		/* Bytes taken by the automaton */
+		bin::sz_t memory() const {
+			return (m_delta.size() + m_match.size()) * sizeof(bin::u32_t) + sizeof(m_classes);
+		}
+
+	private:
+		std::vector<std::string> m_patterns;
+		/* Byte classes, 0 for bytes of no pattern */
+		bin::u16_t m_classes[256];
+		bin::sz_t m_width;
+		/* Next state of state s and class c at s * m_width + c */
+		std::vector<bin::u32_t> m_delta;
+		/* First pattern ending in a state or its suffixes */
+		std::vector<bin::u32_t> m_match;
+
+		/* Pass matching form of cp to emit byte by byte, no
+		 * separator after another one or at the start */
+		template <class F>
+		static void put(bin::u32_t cp, bool & space, F emit) {
+			if (cp == 0) {
+				return;
+			}
+			if (cp == ' ') {
+				if (!space) {
+					emit(' ');
+					space = true;
+				}
+				return;
+			}
+			space = false;
+			bin::u8_t buf[4];
+			bin::sz_t n = content::encode(cp, buf);
+			for (bin::sz_t i = 0; i < n; ++i) {
+				emit(buf[i]);
+			}
+		}
+
+		template <class F>
+		bin::u32_t find(bin::u8_t esm_class, bin::u8_t dc, const F * text, bin::sz_t len) const {
+			const bin::u8_t * p = reinterpret_cast<const bin::u8_t *>(text);
+			if ((esm_class & udh::esm_udhi) && len != 0) {
+				bin::sz_t udh_len = p[0] + 1u;
+				if (udh_len > len) {
+					return nil;
+				}
+				p += udh_len;
+				len -= udh_len;
+			}
+			return find(dc, p, len);
+		}
+
+		void build() {
+			std::vector<std::string> forms;
+			forms.reserve(m_patterns.size());
+			bool used[256] = { false };
+			for (const std::string & p: m_patterns) {
+				forms.push_back(normalize(p));
+				for (char c: forms.back()) {
+					used[static_cast<unsigned char>(c)] = true;
+				}
+			}
+			m_width = 1;
+			for (int b = 0; b < 256; ++b) {
+				m_classes[b] = used[b] ? m_width++ : 0;
+			}
+			/* Trie first, nil for no transition */
+			m_delta.assign(m_width, bin::u32_t(nil));
+			m_match.assign(1, bin::u32_t(nil));
+			for (bin::u32_t i = 0; i < forms.size(); ++i) {
+				if (forms[i].empty()) {
+					continue;
+				}
+				bin::u32_t s = 0;
+				for (char c: forms[i]) {
+					bin::u32_t & t = m_delta[s * m_width + m_classes[static_cast<unsigned char>(c)]];
+					if (t == nil) {
+						t = m_match.size();
+						m_match.push_back(bin::u32_t(nil));
+						m_delta.resize(m_delta.size() + m_width, bin::u32_t(nil));
+					}
+					s = m_delta[s * m_width + m_classes[static_cast<unsigned char>(c)]];
+				}
+				if (m_match[s] == nil) {
+					m_match[s] = i;
+				}
+			}
+			/* Then missing transitions follow failure links, breadth
+			 * first so links always point to finished states */
+			std::vector<bin::u32_t> fail(m_match.size(), 0);
+			std::deque<bin::u32_t> queue;
+			for (bin::sz_t c = 0; c < m_width; ++c) {
+				bin::u32_t & t = m_delta[c];
+				if (t == nil) {
+					t = 0;
+				} else {
+					queue.push_back(t);
+				}
+			}
+			while (!queue.empty()) {
+				bin::u32_t s = queue.front();
+				queue.pop_front();
+				bin::u32_t f = fail[s];
+				if (m_match[f] < m_match[s]) {
+					m_match[s] = m_match[f];
+				}
+				for (bin::sz_t c = 0; c < m_width; ++c) {
+					bin::u32_t & t = m_delta[s * m_width + c];
+					if (t == nil) {
+						t = m_delta[f * m_width + c];
+					} else {
+						fail[t] = m_delta[f * m_width + c];
+						queue.push_back(t);
+					}
+				}
+			}
+		}
+};
+
+} } }
+
+#endif
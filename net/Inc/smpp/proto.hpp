@@ -5,6 +5,7 @@
 
 #include <bitset>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <algorithm>
 #include <ostream>
@@ -47,6 +48,59 @@ namespace mobi { namespace net { namespace smpp {
 			data_sm_r			= 0x80000103,
 		}; }
 
+	/* Name of a command id, nullptr if SMPP 3.4 has none */
+	inline const char * command_name(bin::u32_t id) {
+		switch (id) {
+			case command::generic_nack:			return "generic_nack";
+			case command::bind_receiver:		return "bind_receiver";
+			case command::bind_receiver_r:		return "bind_receiver_r";
+			case command::bind_transmitter:		return "bind_transmitter";
+			case command::bind_transmitter_r:	return "bind_transmitter_r";
+			case command::query_sm:				return "query_sm";
+			case command::query_sm_r:			return "query_sm_r";
+			case command::submit_sm:			return "submit_sm";
+			case command::submit_sm_r:			return "submit_sm_r";
+			case command::deliver_sm:			return "deliver_sm";
+			case command::deliver_sm_r:			return "deliver_sm_r";
+			case command::unbind:				return "unbind";
+			case command::unbind_r:				return "unbind_r";
+			case command::replace_sm:			return "replace_sm";
+			case command::replace_sm_r:			return "replace_sm_r";
+			case command::cancel_sm:			return "cancel_sm";
+			case command::cancel_sm_r:			return "cancel_sm_r";
+			case command::bind_transceiver:		return "bind_transceiver";
+			case command::bind_transceiver_r:	return "bind_transceiver_r";
+			case command::outbind:				return "outbind";
+			case command::enquire_link:			return "enquire_link";
+			case command::enquire_link_r:		return "enquire_link_r";
+			case command::submit_multi_sm:		return "submit_multi_sm";
+			case command::submit_multi_sm_r:	return "submit_multi_sm_r";
+			case command::alert_notification:	return "alert_notification";
+			case command::data_sm:				return "data_sm";
+			case command::data_sm_r:			return "data_sm_r";
+			default:
+				return nullptr;
+		}
+	}
+
+	/* Command id printed as its name, or in hex if it has none,
+	 * for logs of PDU headers */
+	struct command_id {
+		bin::u32_t id;
+	};
+
+	template <typename CharT, typename TraitsT>
+	std::basic_ostream<CharT, TraitsT> &
+	operator<<(std::basic_ostream<CharT, TraitsT> & L, command_id c) {
+		const char * name = command_name(c.id);
+		if (name != nullptr) {
+			return L << name;
+		}
+		char hex[11];
+		std::snprintf(hex, sizeof(hex), "0x%08x", static_cast<unsigned>(c.id));
+		return L << hex;
+	}
+
 	/* SMPP 3.4 COMMAND STATUS/ERROR CODES */
 	/* TODO modify to enum */
 	namespace command_status {
@@ -278,6 +332,18 @@ namespace mobi { namespace net { namespace smpp {
 		}
 	}
 
+	/* SMPP 3.4 message states, query_sm_r and receipts */
+	namespace message_state {
+		const bin::u8_t enroute					= 1;
+		const bin::u8_t delivered				= 2;
+		const bin::u8_t expired					= 3;
+		const bin::u8_t deleted					= 4;
+		const bin::u8_t undeliverable			= 5;
+		const bin::u8_t accepted				= 6;
+		const bin::u8_t unknown					= 7;
+		const bin::u8_t rejected				= 8;
+	}
+
 	/* SMPP 3.4 PDU header */
 	struct pdu {
 		bin::u32_t		len;
@@ -685,6 +751,13 @@ namespace mobi { namespace net { namespace smpp {
 			typedef tlv<bin::u8_t *> base;
 			tlv_msg_payload(): base() {}
 
+			/* Payload is referenced, not copied */
+			void set(const bin::u8_t * v, bin::u16_t l) {
+				tag = option::msg_payload;
+				len = l;
+				val = const_cast<bin::u8_t *>(v);
+			}
+
 			bin::sz_t raw_size() const { return len + sizeof(bin::u16_t)*2; }
 		};
 		struct tlv_delivery_failure_reason: tlv<bin::u8_t> {
@@ -1255,7 +1328,7 @@ namespace mobi { namespace net { namespace smpp {
 						+ (payload_type.tag == option::payload_type
 							? payload_type.raw_size(): 0)
 						+ (msg_payload.tag == option::msg_payload
-							? payload_type.tag: 0)
+							? msg_payload.raw_size(): 0)
 						+ (privacy_ind.tag == option::privacy_ind
 							? privacy_ind.raw_size(): 0)
 						+ (callback_num.tag == option::callback_num
@@ -1324,6 +1397,11 @@ namespace mobi { namespace net { namespace smpp {
 			dl_name(): value_len(0) {}
 			bin::sz_t raw_size() const { return value_len; }
 
+			void set_value(const std::string & v) {
+				value_len = v.size() + 1;
+				bin::w::scpy(value, bin::ascbuf(v.c_str()), value_len);
+			}
+
 			std::size_t value_len;
 		};
 		struct sme_dst_addr {
@@ -1334,17 +1412,29 @@ namespace mobi { namespace net { namespace smpp {
 			sme_dst_addr(): dst_addr_len(0) {}
 			bin::sz_t raw_size() const { return 2 + dst_addr_len; }
 
+			void set_dst_addr(const std::string & v) {
+				dst_addr_len = v.size() + 1;
+				bin::w::scpy(dst_addr, bin::ascbuf(v.c_str()), dst_addr_len);
+			}
+
 			std::size_t dst_addr_len;
 		};
 		struct dst_addr {
-			bin::u8_t 		dst_flag; /* 1 - sme_addr, 2 - dlist_name */
+			enum flag_t: bin::u8_t {
+				sme			= 1,
+				dist_list	= 2
+			};
+
+			bin::u8_t 		dst_flag;
+
+			dst_addr(): dst_flag(0) {}
 
 			bin::sz_t raw_size() const {
 				switch (dst_flag) {
-					case 1:
-						return sme_addr.raw_size();
-					case 2:
-						return dlist_name.raw_size();
+					case sme:
+						return 1 + sme_addr.raw_size();
+					case dist_list:
+						return 1 + dlist_name.raw_size();
 					default:
 						return 0; /* error */
 				}
@@ -1355,13 +1445,17 @@ namespace mobi { namespace net { namespace smpp {
 		};
 
 		struct submit_multi_sm {
+			/* Destinations a message may be submitted to at once */
+			static const bin::sz_t max_dsts = 255;
+
 			pdu command;
 			bin::u8_t serv_type[6];
 			bin::u8_t src_addr_ton;
 			bin::u8_t src_addr_npi;
 			bin::u8_t src_addr[21];
 			bin::u8_t num_of_dsts;
-			//dst_addr dst_addr[24];
+			/* First num_of_dsts are valid */
+			dst_addr dst_addrs[max_dsts];
 			bin::u8_t esm_class;
 			bin::u8_t protocol_id;
 			bin::u8_t priority_flag;
@@ -1397,7 +1491,51 @@ namespace mobi { namespace net { namespace smpp {
 			tlv_alert_on_msg_delivery	alert_on_msg_delivery;
 			tlv_lang_ind				lang_ind;
 
-			submit_multi_sm(): command(command::submit_multi_sm) {}
+			submit_multi_sm()
+				: command(command::submit_multi_sm)
+				, num_of_dsts(0)
+				, short_msg_len(0)
+				, serv_type_len(0)
+				, src_addr_len(0)
+			{
+				schedule_delivery_time[0] = '\0';
+				validity_period[0] = '\0';
+			}
+
+			void set_serv_type(const std::string & v) {
+				serv_type_len = v.size() + 1;
+				bin::w::scpy(serv_type, bin::ascbuf(v.c_str()), serv_type_len);
+			}
+			void set_src_addr(const std::string & v) {
+				src_addr_len = v.size() + 1;
+				bin::w::scpy(src_addr, bin::ascbuf(v.c_str()), src_addr_len);
+			}
+			void set_short_msg(const std::string & v) {
+				short_msg_len = v.size() + 1;
+				bin::w::scpy(short_msg, bin::ascbuf(v.c_str()), short_msg_len);
+			}
+
+			/* Append a destination, false if there is no room */
+			bool add_dst_addr(bin::u8_t ton, bin::u8_t npi, const std::string & v) {
+				if (num_of_dsts == max_dsts) {
+					return false;
+				}
+				dst_addr & d = dst_addrs[num_of_dsts++];
+				d.dst_flag = dst_addr::sme;
+				d.sme_addr.dst_addr_ton = ton;
+				d.sme_addr.dst_addr_npi = npi;
+				d.sme_addr.set_dst_addr(v);
+				return true;
+			}
+			bool add_dl_name(const std::string & v) {
+				if (num_of_dsts == max_dsts) {
+					return false;
+				}
+				dst_addr & d = dst_addrs[num_of_dsts++];
+				d.dst_flag = dst_addr::dist_list;
+				d.dlist_name.set_value(v);
+				return true;
+			}
 
 			bin::sz_t raw_size() const {
 				bin::sz_t len = sizeof(command)
@@ -1405,8 +1543,9 @@ namespace mobi { namespace net { namespace smpp {
 								+ 2
 								+ src_addr_len
 								+ 1;
-				//for (int i = 0; i < num_of_dsts; ++i)
-					//len += dst_addr[i].raw_size();
+				for (bin::sz_t i = 0; i < num_of_dsts; ++i) {
+					len += dst_addrs[i].raw_size();
+				}
 				len = len		+ 3
 								+ (schedule_delivery_time[0] == '\0' ? 1: sizeof(schedule_delivery_time))
 								+ (validity_period[0] == '\0' ? 1: sizeof(validity_period))
@@ -1431,7 +1570,7 @@ namespace mobi { namespace net { namespace smpp {
 								+ (payload_type.tag == option::payload_type
 									? payload_type.raw_size(): 0)
 								+ (msg_payload.tag == option::msg_payload
-									? payload_type.tag: 0)
+									? msg_payload.raw_size(): 0)
 								+ (privacy_ind.tag == option::privacy_ind
 									? privacy_ind.raw_size(): 0)
 								+ (callback_num.tag == option::callback_num
@@ -1464,31 +1603,47 @@ namespace mobi { namespace net { namespace smpp {
 			std::size_t src_addr_len;
 		};
 
+		struct unsuccess_smes {
+			bin::u8_t		dst_addr_ton;
+			bin::u8_t		dst_addr_npi;
+			bin::u8_t		dst_addr[21];
+			bin::u32_t	error_status_code;
+
+			unsuccess_smes(): dst_addr_len(0) {}
+			bin::sz_t raw_size() const { return 2 + dst_addr_len + 4; }
+
+			std::size_t dst_addr_len;
+		};
+
 		struct submit_multi_r {
 			pdu command;
 
 			bin::u8_t	msg_id[65];
 			bin::u8_t	no_unsuccess;
-			/* TODO: 4.5.2 unsuccess_sme(s) */
+			/* First no_unsuccess are valid */
+			unsuccess_smes unsuccess_sme[submit_multi_sm::max_dsts];
 
 			void set_msg_id(const std::string & v) {
 				msg_id_len = v.size() + 1;
 				bin::w::scpy(msg_id, bin::ascbuf(v.c_str()), msg_id_len);
 			}
 
+			bin::sz_t raw_size() const {
+				bin::sz_t len = sizeof(command) + msg_id_len + 1;
+				for (bin::sz_t i = 0; i < no_unsuccess; ++i) {
+					len += unsuccess_sme[i].raw_size();
+				}
+				return len;
+			}
+
 			size_t msg_id_len;
 			submit_multi_r()
 				: command(command::submit_multi_sm_r)
+				, no_unsuccess(0)
+				, msg_id_len(0)
 			{}
 		};
 
-		struct unsuccess_smes {
-			bin::u8_t		dst_addr_ton;
-			bin::u8_t		dst_addr_npi;
-			bin::u8_t		dst_addr[21];
-			bin::u32_t	error_status_code;
-		};
-
 		/* DELIVER SM Operations */
 		struct deliver_sm {
 			pdu command;
@@ -1522,6 +1677,7 @@ namespace mobi { namespace net { namespace smpp {
 			tlv_user_resp_code			user_resp_code;
 			tlv_privacy_ind				privacy_ind;
 			tlv_payload_type			payload_type;
+			tlv_msg_payload				msg_payload;
 			tlv_callback_num			callback_num;
 			tlv_src_subaddr				src_subaddr;
 			tlv_dst_subaddr			dst_subaddr;
@@ -1586,6 +1742,7 @@ namespace mobi { namespace net { namespace smpp {
 						+ (sar_total_segments.tag == option::sar_total_segments ? sar_total_segments.raw_size(): 0)
 						+ (sar_segment_seqnum.tag == option::sar_segment_seqnum ? sar_segment_seqnum.raw_size(): 0)
 						+ (payload_type.tag == option::payload_type ? payload_type.raw_size(): 0)
+						+ (msg_payload.tag == option::msg_payload ? msg_payload.raw_size(): 0)
 						+ (privacy_ind.tag == option::privacy_ind ? privacy_ind.raw_size(): 0)
 						+ (callback_num.tag == option::callback_num ? callback_num.raw_size(): 0)
 						+ (src_subaddr.tag == option::src_subaddr ? src_subaddr.raw_size(): 0)
@@ -1730,7 +1887,7 @@ namespace mobi { namespace net { namespace smpp {
 						+ (payload_type.tag == option::payload_type
 							? payload_type.raw_size(): 0)
 						+ (msg_payload.tag == option::msg_payload
-							? msg_payload.len: 0)
+							? msg_payload.raw_size(): 0)
 						+ (privacy_ind.tag == option::privacy_ind
 							? privacy_ind.raw_size(): 0)
 						+ (callback_num.tag == option::callback_num
@@ -2261,23 +2418,18 @@ namespace mobi { namespace net { namespace smpp {
 
 			buf = w::scpyf(buf, bend, r.password, r.password_len);
 			RETURN_NULL_IF(buf == NULL);
+
+			return buf;
 		}
 
 		/* UNBIND P&W		*/
 		/* UNBIND_R P&W		*/
 		/* GENERIC_NACK P&W	*/
 		template <class BindT, class LogT>
-		void parse(BindT & r, const bin::u8_t * buf
-				, const bin::u8_t * bend, LogT & L) {
-			RETURN_NULL_IF(buf + sizeof(r.command) > bend);
-			parse(r.command, buf, L);
-		}
-
-		template <class BindT, class LogT>
-		void write(bin::u8_t * buf, bin::u8_t * bend
+		bin::u8_t * write(bin::u8_t * buf, bin::u8_t * bend
 				,const unbind & r, LogT & L) {
 			RETURN_NULL_IF(buf + sizeof(r.command) > bend);
-			write(buf, r.command, L);
+			return write(buf, r.command, L);
 		}
 
 		/* SUBMIT_SM P&W */
@@ -2622,7 +2774,7 @@ namespace mobi { namespace net { namespace smpp {
 
 		/* SUBMIT_SM_R P&W */
 		template <class LogT>
-		void parse(submit_sm_r & r, const bin::u8_t * buf
+		const bin::u8_t * parse(submit_sm_r & r, const bin::u8_t * buf
 				, const bin::u8_t * bend, LogT & L) {
 			using namespace bin;
 
@@ -2631,18 +2783,20 @@ namespace mobi { namespace net { namespace smpp {
 
 			RETURN_NULL_IF(buf + sizeof(r.msg_id) > bend);
 			buf = p::scpyl(r.msg_id, buf, bend, sizeof(r.msg_id), r.msg_id_len);
+			return buf;
 		}
 
 		template <class LogT>
-		void write(bin::u8_t * buf, const submit_sm_r & r, LogT & L) {
+		bin::u8_t * write(bin::u8_t * buf, const submit_sm_r & r, LogT & L) {
 			using namespace bin;
 			buf = write(buf, r.command, L);
 			buf = w::scpy(buf, r.msg_id, r.msg_id_len + 1);
+			return buf;
 		}
 
 		/* SUBMIT_MULTI P&W */
 		template <class LogT>
-		void parse(submit_multi_sm & r, const bin::u8_t * buf
+		const bin::u8_t * parse(submit_multi_sm & r, const bin::u8_t * buf
 				, const bin::u8_t * bend, LogT & L) {
 
 			using namespace bin;
@@ -2761,15 +2915,16 @@ namespace mobi { namespace net { namespace smpp {
 						buf = parse(r.alert_on_msg_delivery, buf, L); break;
 					case option::lang_ind:
 						buf = parse(r.lang_ind, buf, L); break;
-					default: return;
+					default: return nullptr;
 				}
 				RETURN_NULL_IF(buf + sizeof(optid) > bend);
 				buf = p::cp_u16(asbuf(optid), buf);
 			}
+			return buf;
 		}
 
 		template <class LogT>
-		void write(bin::u8_t * buf, const submit_multi_sm & r, LogT & L) {
+		bin::u8_t * write(bin::u8_t * buf, const submit_multi_sm & r, LogT & L) {
 			using namespace bin;
 			buf = write(buf, r.command, L);
 			buf = w::scpy(buf, r.serv_type, 6);
@@ -2815,30 +2970,33 @@ namespace mobi { namespace net { namespace smpp {
 			if (r.ms_msg_wait_fclts.tag != 0)	buf = write(buf, r.ms_msg_wait_fclts, L);
 			if (r.alert_on_msg_delivery.tag!=0)	buf = write(buf, r.alert_on_msg_delivery, L);
 			if (r.lang_ind.tag != 0)		buf = write(buf, r.lang_ind, L);
+			return buf;
 		}
 
 		/* DEST_ADDRESS P&W */
 		template <class LogT>
-		void parse(dst_addr & r, const bin::u8_t * buf
+		const bin::u8_t * parse(dst_addr & r, const bin::u8_t * buf
 				, const bin::u8_t * bend, LogT & L) {
 			using namespace bin;
 
 			RETURN_NULL_IF(buf + sizeof(r.dst_flag) >= bend);
 			buf = p::cp_u8(&r.dst_flag, buf);
 			/* TODO: 4.5.1.1 SME_Address */
+			return buf;
 		}
 
 		template <class LogT>
-		void write(bin::u8_t * buf, const dst_addr & r, LogT & L) {
+		bin::u8_t * write(bin::u8_t * buf, const dst_addr & r, LogT & L) {
 			using namespace bin;
 			buf = w::cp_u8(buf, &r.dst_flag);
 			/* TODO: 4.5.1.1 SME_Address */
+			return buf;
 		}
 
 
 		/* SUBMIT_MULTI_R P&W */
 		template <class LogT>
-		void parse(submit_multi_r & r, const bin::u8_t * buf
+		const bin::u8_t * parse(submit_multi_r & r, const bin::u8_t * buf
 				, const bin::u8_t * bend, LogT & L) {
 			using namespace bin;
 			buf = ascbuf(buf);
@@ -2855,6 +3013,7 @@ namespace mobi { namespace net { namespace smpp {
 			buf = p::cp_u8(&r.no_unsuccess, buf);
 
 			/* TODO unsuccess_sme(s) */
+			return buf;
 		}
 	}
 
@@ -2997,7 +3156,7 @@ namespace mobi { namespace net { namespace smpp {
 			if (r.more_msgs_to_send.tag != 0)	{ L << "[more_msgs_to_send:"		<< r.more_msgs_to_send		<< "]"; }
 			if (r.payload_type.tag != 0)		{ L << "[payload_type:"			<< r.payload_type			<< "]"; }
 			if (r.msg_payload.tag != 0)			{ L << "[msg_payload:"
-				<< std::string(r.payload_type.val, r.payload_type.val +	r.payload_type.len) << "]"; }
+				<< std::string(r.msg_payload.val, r.msg_payload.val + r.msg_payload.len) << "]"; }
 			if (r.privacy_ind.tag != 0)			{ L << "[privacy_ind:"				<< r.privacy_ind			<< "]"; }
 			if (r.callback_num.tag != 0)		{ L << "[callback_num:"			<< r.callback_num			<< "]";	}
 			if (r.callback_num_pres_ind.tag!=0) { L << "[callback_num_pres_ind:"	<< r.callback_num_pres_ind 	<< "]"; }
@@ -3045,7 +3204,7 @@ namespace mobi { namespace net { namespace smpp {
 			if (r.more_msgs_to_send.tag != 0)	{ L << "[more_msgs_to_send:"		<< r.more_msgs_to_send		<< "]"; }
 			if (r.payload_type.tag != 0)		{ L << "[payload_type:"			<< r.payload_type			<< "]"; }
 			if (r.msg_payload.tag != 0)			{ L << "[msg_payload:"
-				<< std::string(r.payload_type.val, r.payload_type.val +	r.payload_type.len) << "]"; }
+				<< std::string(r.msg_payload.val, r.msg_payload.val + r.msg_payload.len) << "]"; }
 			if (r.privacy_ind.tag != 0)			{ L << "[privacy_ind:"				<< r.privacy_ind			<< "]"; }
 			if (r.callback_num.tag != 0)		{ L << "[callback_num:"			<< r.callback_num			<< "]";	}
 			if (r.callback_num_pres_ind.tag!=0) { L << "[callback_num_pres_ind:"	<< r.callback_num_pres_ind 	<< "]"; }
@@ -3077,6 +3236,53 @@ namespace mobi { namespace net { namespace smpp {
 			return L;
 		}
 
+		template<typename CharT, typename TraitsT>
+		std::basic_ostream<CharT, TraitsT>&
+		operator<<(std::basic_ostream<CharT, TraitsT> &L
+				, const submit_multi_sm & r) {
+			L	<< "submit_multi_sm: "
+				<< r.command
+				<< "[serv_type:"				<< r.serv_type													<< "]"
+				<< "[src_addr_ton:"			<< std::bitset<8>(r.src_addr_ton)								<< "]"
+				<< "[src_addr_npi:"			<< std::bitset<8>(r.src_addr_npi)								<< "]"
+				<< "[src_addr:"				<< r.src_addr													<< "]"
+				<< "[num_of_dsts:"				<< static_cast<int>(r.num_of_dsts)								<< "]";
+			for (bin::sz_t i = 0; i < r.num_of_dsts; ++i) {
+				const dst_addr & d = r.dst_addrs[i];
+				if (d.dst_flag == dst_addr::sme) {
+					L << "[dst_addr:"		<< d.sme_addr.dst_addr		<< "]";
+				} else {
+					L << "[dl_name:"		<< d.dlist_name.value		<< "]";
+				}
+			}
+			L	<< "[esm_class:"				<< std::bitset<8>(r.esm_class)									<< "]"
+				<< "[protocol_id:"				<< static_cast<int>(r.protocol_id)								<< "]"
+				<< "[priority_flag:"			<< static_cast<int>(r.priority_flag)							<< "]"
+				<< "[registered_delivery:"		<< static_cast<bool>(r.registered_delivery)						<< "]"
+				<< "[data_coding:"				<< std::bitset<8>(r.data_coding)								<< "]"
+				<< "[short_msg_len:"			<< static_cast<int>(r.short_msg_len)							<< "]"
+				<< "[short_msg:"				<< std::string(r.short_msg, r.short_msg + r.short_msg_len)		<< "]";
+			if (r.msg_payload.tag != 0)			{ L << "[msg_payload:"
+				<< std::string(r.msg_payload.val, r.msg_payload.val + r.msg_payload.len) << "]"; }
+			return L;
+		}
+
+		template<typename CharT, typename TraitsT>
+		std::basic_ostream<CharT, TraitsT>&
+		operator<<(std::basic_ostream<CharT, TraitsT> &L
+				, const submit_multi_r & r) {
+			L
+			<< "submit_multi_r:"
+			<< r.command
+			<< "[msg_id:"<< std::string(r.msg_id, r.msg_id + r.msg_id_len) << "]"
+			<< "[no_unsuccess:" << static_cast<int>(r.no_unsuccess) << "]";
+			for (bin::sz_t i = 0; i < r.no_unsuccess; ++i) {
+				L << "[unsuccess_sme:" << r.unsuccess_sme[i].dst_addr
+					<< ":" << r.unsuccess_sme[i].error_status_code << "]";
+			}
+			return L;
+		}
+
 		template<typename CharT, typename TraitsT>
 		std::basic_ostream<CharT, TraitsT>&
 		operator<<(std::basic_ostream<CharT, TraitsT> &L
@@ -3305,6 +3511,8 @@ namespace mobi { namespace net { namespace smpp {
 			if (r.sar_total_segments.tag != 0)	{ L << "[sar_total_segments:"		<< r.sar_total_segments		<< "]";	}
 			if (r.sar_segment_seqnum.tag != 0)	{ L << "[sar_segment_seqnum:"		<< r.sar_segment_seqnum		<< "]";	}
 			if (r.payload_type.tag != 0)		{ L << "[payload_type:"			<< r.payload_type			<< "]"; }
+			if (r.msg_payload.tag != 0)			{ L << "[msg_payload:"
+				<< std::string(r.msg_payload.val, r.msg_payload.val + r.msg_payload.len) << "]"; }
 			if (r.privacy_ind.tag != 0)			{ L << "[privacy_ind:"				<< r.privacy_ind			<< "]"; }
 			if (r.callback_num.tag != 0)		{ L << "[callback_num:"			<< r.callback_num			<< "]";	}
 			if (r.src_subaddr.tag != 0)			{ L << "[src_subaddr:"				<< r.src_subaddr			<< "]";	}
@@ -3953,6 +4161,10 @@ namespace mobi { namespace net { namespace smpp {
 					RETURN_NULL_IF(buf + msg.payload_type.raw_size() > bend);
 					buf = write_tlv_u8(buf, msg.payload_type);
 				}
+				if (msg.msg_payload.tag == option::msg_payload) {
+					RETURN_NULL_IF(buf + msg.msg_payload.raw_size() > bend);
+					buf = write_tlv_ptr(buf, msg.msg_payload);
+				}
 				if (msg.privacy_ind.tag == option::privacy_ind) {
 					RETURN_NULL_IF(buf + msg.privacy_ind.raw_size() > bend);
 					buf = write_tlv_u8(buf, msg.privacy_ind);
@@ -4388,53 +4600,175 @@ namespace mobi { namespace net { namespace smpp {
 				return buf;
 			}
 
-			/* TODO */
-			void write(bin::u8_t * buf, const submit_multi_sm & r) {
+			bin::u8_t * write(bin::u8_t * buf, bin::u8_t * bend
+					, const submit_multi_sm & msg) {
 				using namespace bin;
-				buf = write(buf, r.command, L);
-				buf = w::scpy(buf, r.serv_type, 6);
-
-				buf = w::cp_u8(buf, r.src_addr_ton);
-				buf = w::cp_u8(buf, r.src_addr_npi);
-				buf = w::scpy(buf, r.src_addr, 21);
-				buf = w::cp_u8(buf, r.num_of_dsts);
-				/*
-				TODO dst_addr(es)
-				*/
-				buf = w::cp_u8(buf, r.esm_class);
-				buf = w::cp_u8(buf, r.protocol_id);
-				buf = w::cp_u8(buf, r.priority_flag);
-				buf = w::scpy(buf, r.schedule_delivery_time, 17);
-				buf = w::scpy(buf, r.validity_period, 17);
-				buf = w::cp_u8(buf, r.registered_delivery);
-				buf = w::cp_u8(buf, r.replace_if_present_flag);
-				buf = w::cp_u8(buf, r.data_coding);
-				buf = w::cp_u8(buf, r.sm_default_msg_id);
-				buf = w::cp_u8(buf, r.short_msg_len);
-				buf = w::scpy(buf, r.short_msg, 254);
-
-				if (r.user_msg_reference.tag != 0)	buf = write(buf, r.user_msg_reference, L);
-				if (r.src_port.tag != 0)				buf = write(buf, r.src_port, L);
-				if (r.src_addr_subunit.tag != 0)		buf = write(buf, r.src_addr_subunit, L);
-				if (r.dst_port.tag != 0)				buf = write(buf, r.dst_port.tag, L);
-				if (r.dst_addr_subunit.tag != 0)		buf = write(buf, r.dst_addr_subunit, L);
-				if (r.sar_msg_ref_num.tag != 0)			buf = write(buf, r.sar_msg_ref_num, L);
-				if (r.sar_total_segments.tag != 0)		buf = write(buf, r.sar_total_segments, L);
-				if (r.sar_segment_seqnum.tag != 0)		buf = write(buf, r.sar_segment_seqnum, L);
-				if (r.payload_type.tag != 0)			buf = write(buf, r.payload_type, L);
-				if (r.msg_payload.tag != 0)			buf = write(buf, r.msg_payload.tag, L);
-				if (r.privacy_ind.tag != 0)		buf = write(buf, r.privacy_ind, L);
-				if (r.callback_num.tag != 0)			buf = write(buf, r.callback_num, L);
-				if (r.callback_num_pres_ind.tag != 0)	buf = write(buf, r.callback_num_pres_ind, L);
-				if (r.callback_num_atag.tag != 0)		buf = write(buf, r.callback_num_atag, L);
-				if (r.src_subaddr.tag != 0)		buf = write(buf, r.src_subaddr, L);
-				if (r.dst_subaddr.tag != 0)			buf = write(buf, r.dst_subaddr, L);
-				if (r.display_time.tag != 0)			buf = write(buf, r.display_time, L);
-				if (r.sms_signal.tag != 0)				buf = write(buf, r.sms_signal, L);
-				if (r.ms_validity.tag != 0)				buf = write(buf, r.ms_validity, L);
-				if (r.ms_msg_wait_fclts.tag != 0)	buf = write(buf, r.ms_msg_wait_fclts, L);
-				if (r.alert_on_msg_delivery.tag!=0)	buf = write(buf, r.alert_on_msg_delivery, L);
-				if (r.lang_ind.tag != 0)		buf = write(buf, r.lang_ind, L);
+
+				RETURN_NULL_IF(buf + sizeof(msg.command) > bend);
+				buf = write_pdu(buf, msg.command);
+
+				RETURN_NULL_IF(buf + msg.serv_type_len > bend);
+				buf = w::scpy(buf, msg.serv_type, msg.serv_type_len);
+
+				RETURN_NULL_IF(buf + sizeof(bin::u8_t) * 2 > bend);
+				buf = w::cp_u8(buf, &msg.src_addr_ton);
+				buf = w::cp_u8(buf, &msg.src_addr_npi);
+
+				RETURN_NULL_IF(buf + msg.src_addr_len > bend);
+				buf = w::scpy(buf, msg.src_addr, msg.src_addr_len);
+
+				RETURN_NULL_IF(buf + sizeof(msg.num_of_dsts) > bend);
+				buf = w::cp_u8(buf, &msg.num_of_dsts);
+
+				for (bin::sz_t i = 0; i < msg.num_of_dsts; ++i) {
+					const dst_addr & d = msg.dst_addrs[i];
+					RETURN_NULL_IF(d.raw_size() == 0);
+					RETURN_NULL_IF(buf + d.raw_size() > bend);
+					buf = w::cp_u8(buf, &d.dst_flag);
+					if (d.dst_flag == dst_addr::sme) {
+						buf = w::cp_u8(buf, &d.sme_addr.dst_addr_ton);
+						buf = w::cp_u8(buf, &d.sme_addr.dst_addr_npi);
+						buf = w::scpy(buf, d.sme_addr.dst_addr
+								, d.sme_addr.dst_addr_len);
+					} else {
+						buf = w::scpy(buf, d.dlist_name.value
+								, d.dlist_name.value_len);
+					}
+				}
+
+				RETURN_NULL_IF(buf + sizeof(bin::u8_t) * 3 > bend);
+				buf = w::cp_u8(buf, &msg.esm_class);
+				buf = w::cp_u8(buf, &msg.protocol_id);
+				buf = w::cp_u8(buf, &msg.priority_flag);
+
+				RETURN_NULL_IF(buf + sizeof(msg.schedule_delivery_time) > bend);
+				buf = w::scpy(buf, msg.schedule_delivery_time
+						, msg.schedule_delivery_time[0] == '\0'
+							? 1 : sizeof(msg.schedule_delivery_time));
+
+				RETURN_NULL_IF(buf + sizeof(msg.validity_period) > bend);
+				buf = w::scpy(buf, msg.validity_period
+						, msg.validity_period[0] == '\0'
+							? 1 : sizeof(msg.validity_period));
+
+				RETURN_NULL_IF(buf + sizeof(bin::u8_t) * 5 > bend);
+				buf = w::cp_u8(buf, &msg.registered_delivery);
+				buf = w::cp_u8(buf, &msg.replace_if_present_flag);
+				buf = w::cp_u8(buf, &msg.data_coding);
+				buf = w::cp_u8(buf, &msg.sm_default_msg_id);
+				buf = w::cp_u8(buf, &msg.short_msg_len);
+
+				RETURN_NULL_IF(buf + msg.short_msg_len > bend);
+				buf = w::scpy(buf, msg.short_msg, msg.short_msg_len);
+
+				if (msg.user_msg_reference.tag == option::user_msg_reference) {
+					RETURN_NULL_IF(buf + msg.user_msg_reference.raw_size() > bend);
+					buf = write_tlv_u16(buf, msg.user_msg_reference);
+				}
+				if (msg.src_port.tag == option::src_port) {
+					RETURN_NULL_IF(buf + msg.src_port.raw_size() > bend);
+					buf = write_tlv_u16(buf, msg.src_port);
+				}
+				if (msg.src_addr_subunit.tag == option::src_addr_subunit) {
+					RETURN_NULL_IF(buf + msg.src_addr_subunit.raw_size() > bend);
+					buf = write_tlv_u8(buf, msg.src_addr_subunit);
+				}
+				if (msg.dst_port.tag == option::dst_port) {
+					RETURN_NULL_IF(buf + msg.dst_port.raw_size() > bend);
+					buf = write_tlv_u16(buf, msg.dst_port);
+				}
+				if (msg.dst_addr_subunit.tag == option::dst_addr_subunit) {
+					RETURN_NULL_IF(buf + msg.dst_addr_subunit.raw_size() > bend);
+					buf = write_tlv_u8(buf, msg.dst_addr_subunit);
+				}
+				if (msg.sar_msg_ref_num.tag == option::sar_msg_ref_num) {
+					RETURN_NULL_IF(buf + msg.sar_msg_ref_num.raw_size() > bend);
+					buf = write_tlv_u16(buf, msg.sar_msg_ref_num);
+				}
+				if (msg.sar_total_segments.tag == option::sar_total_segments) {
+					RETURN_NULL_IF(buf + msg.sar_total_segments.raw_size() > bend);
+					buf = write_tlv_u8(buf, msg.sar_total_segments);
+				}
+				if (msg.sar_segment_seqnum.tag == option::sar_segment_seqnum) {
+					RETURN_NULL_IF(buf + msg.sar_segment_seqnum.raw_size() > bend);
+					buf = write_tlv_u8(buf, msg.sar_segment_seqnum);
+				}
+				if (msg.payload_type.tag == option::payload_type) {
+					RETURN_NULL_IF(buf + msg.payload_type.raw_size() > bend);
+					buf = write_tlv_u8(buf, msg.payload_type);
+				}
+				if (msg.msg_payload.tag == option::msg_payload) {
+					RETURN_NULL_IF(buf + msg.msg_payload.raw_size() > bend);
+					buf = write_tlv_ptr(buf, msg.msg_payload);
+				}
+				if (msg.privacy_ind.tag == option::privacy_ind) {
+					RETURN_NULL_IF(buf + msg.privacy_ind.raw_size() > bend);
+					buf = write_tlv_u8(buf, msg.privacy_ind);
+				}
+				if (msg.callback_num.tag == option::callback_num) {
+					RETURN_NULL_IF(buf + msg.callback_num.raw_size() > bend);
+					buf = write_tlv_s19(buf, msg.callback_num);
+				}
+				if (msg.callback_num_pres_ind.tag == option::callback_num_pres_ind) {
+					RETURN_NULL_IF(buf + msg.callback_num_pres_ind.raw_size() > bend);
+					buf = write_tlv_u8(buf, msg.callback_num_pres_ind);
+				}
+				if (msg.callback_num_atag.tag == option::callback_num_atag) {
+					RETURN_NULL_IF(buf + msg.callback_num_atag.raw_size() > bend);
+					buf = write_tlv_s65(buf, msg.callback_num_atag);
+				}
+				if (msg.src_subaddr.tag == option::src_subaddr) {
+					RETURN_NULL_IF(buf + msg.src_subaddr.raw_size() > bend);
+					buf = write_tlv_s23(buf, msg.src_subaddr);
+				}
+				if (msg.dst_subaddr.tag == option::dst_subaddr) {
+					RETURN_NULL_IF(buf + msg.dst_subaddr.raw_size() > bend);
+					buf = write_tlv_s23(buf, msg.dst_subaddr);
+				}
+				if (msg.display_time.tag == option::display_time) {
+					RETURN_NULL_IF(buf + msg.display_time.raw_size() > bend);
+					buf = write_tlv_u8(buf, msg.display_time);
+				}
+				if (msg.sms_signal.tag == option::sms_signal) {
+					RETURN_NULL_IF(buf + msg.sms_signal.raw_size() > bend);
+					buf = write_tlv_u16(buf, msg.sms_signal);
+				}
+				if (msg.ms_validity.tag == option::ms_validity) {
+					RETURN_NULL_IF(buf + msg.ms_validity.raw_size() > bend);
+					buf = write_tlv_u8(buf, msg.ms_validity);
+				}
+				if (msg.ms_msg_wait_fclts.tag == option::ms_msg_wait_fclts) {
+					RETURN_NULL_IF(buf + msg.ms_msg_wait_fclts.raw_size() > bend);
+					buf = write_tlv_u8(buf, msg.ms_msg_wait_fclts);
+				}
+				if (msg.alert_on_msg_delivery.tag == option::alert_on_msg_delivery) {
+					RETURN_NULL_IF(buf + msg.alert_on_msg_delivery.raw_size() > bend);
+					buf = write_tlv_u8(buf, msg.alert_on_msg_delivery);
+				}
+				if (msg.lang_ind.tag == option::lang_ind) {
+					RETURN_NULL_IF(buf + msg.lang_ind.raw_size() > bend);
+					buf = write_tlv_u8(buf, msg.lang_ind);
+				}
+				return buf;
+			}
+
+			bin::u8_t * write(bin::u8_t * buf, bin::u8_t * bend
+					, const submit_multi_r & msg) {
+				using namespace bin;
+				RETURN_NULL_IF(buf + sizeof(msg.command) > bend);
+				buf = write_pdu(buf, msg.command);
+				RETURN_NULL_IF(buf + msg.msg_id_len + 1 > bend);
+				buf = w::scpy(buf, msg.msg_id, msg.msg_id_len);
+				buf = w::cp_u8(buf, &msg.no_unsuccess);
+				for (bin::sz_t i = 0; i < msg.no_unsuccess; ++i) {
+					const unsuccess_smes & u = msg.unsuccess_sme[i];
+					RETURN_NULL_IF(buf + u.raw_size() > bend);
+					buf = w::cp_u8(buf, &u.dst_addr_ton);
+					buf = w::cp_u8(buf, &u.dst_addr_npi);
+					buf = w::scpy(buf, u.dst_addr, u.dst_addr_len);
+					buf = w::cp_u32(buf, ascbuf(u.error_status_code));
+				}
+				return buf;
 			}
 
 		private:
@@ -4539,30 +4873,17 @@ namespace mobi { namespace net { namespace smpp {
 
 			const bin::u8_t * parse_tlv_s23(tlv<bin::u8_t[23]> & t
 					, const bin::u8_t * buf) {
-				using namespace bin;
-				buf = p::cp_u16(asbuf(t.tag), buf);
-				buf = p::cp_u16(asbuf(t.len), buf);
-				buf = p::cpy(t.val, ascbuf(buf), t.len);
-				return buf;
+				return parse_tlv_arr(t, buf);
 			}
 
 			const bin::u8_t * parse_tlv_s19(tlv_callback_num & t
 					, const bin::u8_t * buf) {
-				using namespace bin;
-				buf = p::cp_u16(asbuf(t.tag), buf);
-				buf = p::cp_u16(asbuf(t.len), buf);
-				buf = p::cpy(t.val, ascbuf(buf), t.len);
-
-				return buf;
+				return parse_tlv_arr(t, buf);
 			}
 
 			const bin::u8_t * parse_tlv_s65(tlv<bin::u8_t[65]> & t
 					, const bin::u8_t * buf) {
-				using namespace bin;
-				buf = p::cp_u16(asbuf(t.tag), buf);
-				buf = p::cp_u16(asbuf(t.len), buf);
-				buf = p::cpy(t.val, ascbuf(buf), t.len);
-				return buf;
+				return parse_tlv_arr(t, buf);
 			}
 
 			const bin::u8_t * parse_tlv_ptr(tlv<bin::u8_t *> & t
@@ -4570,45 +4891,44 @@ namespace mobi { namespace net { namespace smpp {
 				using namespace bin;
 				buf = p::cp_u16(asbuf(t.tag), buf);
 				buf = p::cp_u16(asbuf(t.len), buf);
+				/* Value points into the parsed buffer */
+				t.val = const_cast<bin::u8_t *>(buf);
 				buf += t.len;
-				/* TODO buf = p::cpy(t.val, ascbuf(buf), t.len); */
 				return buf;
 			}
 
 			const bin::u8_t * parse_tlv_s3(tlv<bin::u8_t[3]> & t
 					, const bin::u8_t * buf) {
-				using namespace bin;
-				buf = p::cp_u16(asbuf(t.tag), buf);
-				buf = p::cp_u16(asbuf(t.len), buf);
-				buf = p::cpy(t.val, ascbuf(buf), t.len);
-				return buf;
+				return parse_tlv_arr(t, buf);
 			}
 
 			const bin::u8_t * parse_tlv_s2(tlv_its_session_info & t
 					, const bin::u8_t * buf) {
-				using namespace bin;
-				buf = p::cp_u16(asbuf(t.tag), buf);
-				buf = p::cp_u16(asbuf(t.len), buf);
-				buf = p::cpy(t.val, ascbuf(buf), t.len);
-				return buf;
+				return parse_tlv_arr(t, buf);
 			}
 
 			const bin::u8_t * parse_tlv_s1(tlv_ussd_serv_op & t
 					, const bin::u8_t * buf) {
-				using namespace bin;
-				buf = p::cp_u16(asbuf(t.tag), buf);
-				buf = p::cp_u16(asbuf(t.len), buf);
-				buf = p::cpy(t.val, ascbuf(buf), t.len);
-				return buf;
+				return parse_tlv_arr(t, buf);
 			}
 
 			const bin::u8_t * parse_tlv_s256(tlv<bin::u8_t[256]> & t
 					, const bin::u8_t * buf) {
+				return parse_tlv_arr(t, buf);
+			}
+
+		private:
+			/* Values longer than the field are truncated,
+			 * the whole value is skipped anyway */
+			template <typename TlvT>
+			const bin::u8_t * parse_tlv_arr(TlvT & t, const bin::u8_t * buf) {
 				using namespace bin;
+				bin::u16_t len;
 				buf = p::cp_u16(asbuf(t.tag), buf);
-				buf = p::cp_u16(asbuf(t.len), buf);
-				buf = p::cpy(t.val, ascbuf(buf), t.len);
-				return buf;
+				buf = p::cp_u16(asbuf(len), buf);
+				t.len = std::min<bin::u16_t>(len, sizeof(t.val));
+				p::cpy(t.val, ascbuf(buf), t.len);
+				return buf + len;
 			}
 	};
 	template <class LogT>
@@ -4659,6 +4979,7 @@ namespace mobi { namespace net { namespace smpp {
 			virtual action on_submit_sm_r(const submit_sm_r & msg) = 0;
 			virtual action on_parse_error(const bin::u8_t * buf, const bin::u8_t * bend) = 0;
 			virtual action on_submit_multi_sm(const submit_multi_sm & msg) = 0;
+			virtual action on_submit_multi_r(const submit_multi_r & msg) = 0;
 			virtual action on_deliver_sm(const deliver_sm & msg) = 0;
 			virtual action on_deliver_sm_r(const deliver_sm_r & msg) = 0;
 			virtual action on_data_sm(const data_sm & msg) = 0;
@@ -4742,6 +5063,11 @@ namespace mobi { namespace net { namespace smpp {
 							continue;
 						case command::submit_multi_sm:
 							cur = parse_submit_multi_sm(cur, cur + len);
+							RETURN_NULL_IF(cur == nullptr);
+							continue;
+						case command::submit_multi_sm_r:
+							cur = parse_submit_multi_r(cur, cur + len);
+							RETURN_NULL_IF(cur == nullptr);
 							continue;
 						case command::outbind:
 							cur = parse_outbind(cur, cur + len);
@@ -5048,6 +5374,7 @@ namespace mobi { namespace net { namespace smpp {
 					cur = buf;
 					cur = p::cp_u16(asbuf(optid), cur);
 					cur = p::cp_u16(asbuf(len), cur);
+					RETURN_NULL_IF(cur + len > bend);
 
 					switch (optid) {
 						case option::user_msg_reference:
@@ -5249,6 +5576,7 @@ namespace mobi { namespace net { namespace smpp {
 					cur = buf;
 					cur = p::cp_u16(asbuf(optid), cur);
 					cur = p::cp_u16(asbuf(len), cur);
+					RETURN_NULL_IF(cur + len > bend);
 
 					switch (optid) {
 						case option::user_msg_reference:
@@ -5272,6 +5600,9 @@ namespace mobi { namespace net { namespace smpp {
 						case option::payload_type:
 							buf = parse_tlv_u8(msg.payload_type, buf);
 							break;
+						case option::msg_payload:
+							buf = parse_tlv_ptr(msg.msg_payload, buf);
+							break;
 						case option::privacy_ind:
 							buf = parse_tlv_u8(msg.privacy_ind, buf);
 							break;
@@ -5324,6 +5655,7 @@ namespace mobi { namespace net { namespace smpp {
 				submit_multi_sm msg;
 
 				u16_t optid;
+				u16_t len;
 
 				RETURN_NULL_IF(buf + sizeof(msg.command) > bend);
 				buf = parse_pdu(msg.command, buf);
@@ -5343,7 +5675,29 @@ namespace mobi { namespace net { namespace smpp {
 				RETURN_NULL_IF(buf + sizeof(u8_t) > bend);
 				buf = p::cp_u8(&msg.num_of_dsts, buf);
 
-				/* TODO dst_address(es) new struct */
+				for (bin::sz_t i = 0; i < msg.num_of_dsts; ++i) {
+					dst_addr & d = msg.dst_addrs[i];
+					RETURN_NULL_IF(buf + sizeof(u8_t) > bend);
+					buf = p::cp_u8(&d.dst_flag, buf);
+					switch (d.dst_flag) {
+						case dst_addr::sme:
+							RETURN_NULL_IF(buf + sizeof(u8_t)*2 > bend);
+							buf = p::cp_u8(&d.sme_addr.dst_addr_ton, buf);
+							buf = p::cp_u8(&d.sme_addr.dst_addr_npi, buf);
+							buf = p::scpyl(d.sme_addr.dst_addr, buf, bend
+									, sizeof(d.sme_addr.dst_addr)
+									, d.sme_addr.dst_addr_len);
+							break;
+						case dst_addr::dist_list:
+							buf = p::scpyl(d.dlist_name.value, buf, bend
+									, sizeof(d.dlist_name.value)
+									, d.dlist_name.value_len);
+							break;
+						default:
+							return nullptr;
+					}
+					RETURN_NULL_IF(buf == NULL);
+				}
 
 				RETURN_NULL_IF(buf + sizeof(u8_t)*3 > bend);
 				buf = p::cp_u8(&msg.esm_class, buf);
@@ -5365,22 +5719,19 @@ namespace mobi { namespace net { namespace smpp {
 				buf = p::cp_u8(&msg.sm_default_msg_id, buf);
 				buf = p::cp_u8(&msg.short_msg_len, buf);
 
-				buf = p::scpyl(msg.short_msg, buf, bend
-						, sizeof(msg.short_msg), msg.short_msg_len);
-				RETURN_NULL_IF(buf == NULL);
-
-				buf = p::cp_u16(asbuf(optid), buf);
-				/*
-				buf += sizeof(bin::u16_t);
-				*/
+				RETURN_NULL_IF(msg.short_msg_len > sizeof(msg.short_msg));
+				RETURN_NULL_IF(buf + msg.short_msg_len > bend);
+				buf = p::cpy(msg.short_msg, buf, msg.short_msg_len);
 
-				while ((buf + sizeof (u16_t)) <= bend) {
-					p::cp_u16(asbuf(optid), buf);
+				const bin::u8_t * cur;
+				while (buf + sizeof(u16_t)*2 <= bend) {
+					cur = buf;
+					cur = p::cp_u16(asbuf(optid), cur);
+					cur = p::cp_u16(asbuf(len), cur);
+					RETURN_NULL_IF(cur + len > bend);
 
 					switch (optid) {
 						case option::user_msg_reference:
-							RETURN_NULL_IF(buf +
-									msg.user_msg_reference.raw_size() > bend);
 							buf = parse_tlv_u16(msg.user_msg_reference, buf);
 							break;
 						case option::src_port:
@@ -5407,12 +5758,9 @@ namespace mobi { namespace net { namespace smpp {
 						case option::payload_type:
 							buf = parse_tlv_u8(msg.payload_type, buf);
 							break;
-						/* TODO: Parse msg_payload*/
-						/*
 						case option::msg_payload:
-							buf = parse(msg.msg_payload, buf, bend);
+							buf = parse_tlv_ptr(msg.msg_payload, buf);
 							break;
-						*/
 						case option::privacy_ind:
 							buf = parse_tlv_u8(msg.privacy_ind, buf);
 							break;
@@ -5450,13 +5798,12 @@ namespace mobi { namespace net { namespace smpp {
 							buf = parse_tlv_u8(msg.lang_ind, buf);
 							break;
 						default:
-							buf = nullptr;
-							break;
+							return nullptr;
 					}
-
-					RETURN_NULL_IF(buf == nullptr);
 				}
 
+				RETURN_NULL_IF(buf != bend);
+
 				if (on_submit_multi_sm(msg) == resume) {
 					return buf;
 				} else {
@@ -5464,6 +5811,40 @@ namespace mobi { namespace net { namespace smpp {
 				}
 			}
 
+			const bin::u8_t * parse_submit_multi_r(const bin::u8_t * buf
+				, const bin::u8_t * bend) {
+
+				using namespace bin;
+				submit_multi_r msg;
+
+				RETURN_NULL_IF(buf + sizeof(msg.command) > bend);
+				buf = parse_pdu(msg.command, buf);
+				buf = p::scpyl(msg.msg_id, buf, bend
+						, sizeof(msg.msg_id), msg.msg_id_len);
+				RETURN_NULL_IF(buf == NULL);
+
+				RETURN_NULL_IF(buf + sizeof(msg.no_unsuccess) > bend);
+				buf = p::cp_u8(&msg.no_unsuccess, buf);
+
+				for (bin::sz_t i = 0; i < msg.no_unsuccess; ++i) {
+					unsuccess_smes & u = msg.unsuccess_sme[i];
+					RETURN_NULL_IF(buf + sizeof(u8_t)*2 > bend);
+					buf = p::cp_u8(&u.dst_addr_ton, buf);
+					buf = p::cp_u8(&u.dst_addr_npi, buf);
+					buf = p::scpyl(u.dst_addr, buf, bend
+							, sizeof(u.dst_addr), u.dst_addr_len);
+					RETURN_NULL_IF(buf == NULL);
+					RETURN_NULL_IF(buf + sizeof(u.error_status_code) > bend);
+					buf = p::cp_u32(asbuf(u.error_status_code), buf);
+				}
+
+				if (on_submit_multi_r(msg) == resume) {
+					return buf;
+				} else {
+					return nullptr;
+				}
+			}
+
 			const bin::u8_t * parse_outbind(const bin::u8_t * buf
 					, const bin::u8_t * bend) {
 
@@ -5529,6 +5910,7 @@ namespace mobi { namespace net { namespace smpp {
 					cur = buf;
 					cur = p::cp_u16(asbuf(optid), cur);
 					cur = p::cp_u16(asbuf(len), cur);
+					RETURN_NULL_IF(cur + len > bend);
 
 					switch (optid) {
 						case option::user_msg_reference:
@@ -5647,6 +6029,7 @@ namespace mobi { namespace net { namespace smpp {
 					cur = buf;
 					cur = p::cp_u16(asbuf(optid), cur);
 					cur = p::cp_u16(asbuf(len), cur);
+					RETURN_NULL_IF(cur + len > bend);
 
 					switch (optid) {
 						case option::delivery_failure_reason:
@@ -5912,6 +6295,7 @@ namespace mobi { namespace net { namespace smpp {
 					cur = buf;
 					cur = p::cp_u16(asbuf(optid), cur);
 					cur = p::cp_u16(asbuf(len), cur);
+					RETURN_NULL_IF(cur + len > bend);
 
 					switch (optid) {
 						case option::ms_availability_status:
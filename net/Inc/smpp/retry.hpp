@@ -0,0 +1,210 @@
+#ifndef smpp_retry_hpp
+#define smpp_retry_hpp
+
+#include <deque>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <unordered_map>
+#include <toolbox/bin.hpp>
+#include <toolbox/wheel.hpp>
+#include <smpp/proto.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Errors worth another attempt later */
+inline bool transient(bin::u32_t status) {
+	return status == command_status::esme_rthrottled
+		|| status == command_status::esme_rmsgqful
+		|| status == command_status::esme_rx_t_appn;
+}
+
+/* Requests failed for a transient reason, waiting for another attempt.
+ *
+ * Every destination, e.g. a route or a system, has its own backoff: each
+ * failure in a row doubles the delay up to the limit, with random jitter
+ * so retries of a burst do not come back at once. A success resets it,
+ * and so does a max delay passing with nothing of the destination waiting,
+ * so ones which never succeed do not pile up.
+ * Waiting requests are kept in a timer wheel, so scheduling is O(1).
+ * Due ones are passed on while fewer than max_inflight retries are
+ * unfinished, the rest wait in order for the next poll.
+ *
+ * Not thread safe, meant to be used from message processing thread. */
+template <class ValueT>
+class retrier {
+	public:
+		typedef timer_wheel<bin::u64_t>::clock_t		clock_t;
+		typedef clock_t::time_point						time_point;
+		typedef clock_t::duration						duration;
+
+		struct policy {
+			duration initial;
+			duration max;
+			/* Attempts after the first one */
+			bin::u32_t max_attempts;
+			bin::sz_t max_inflight;
+
+			policy()
+				: initial(std::chrono::seconds(1))
+				, max(std::chrono::minutes(10))
+				, max_attempts(10)
+				, max_inflight(64)
+			{}
+		};
+
+		/* Wheel turns once in tick * slots, longer delays take more turns */
+		retrier(bin::sz_t capacity, const policy & p
+				, duration tick = std::chrono::milliseconds(100)
+				, bin::sz_t slots = 4096)
+			: m_policy(p)
+			, m_wheel(capacity, tick, slots, clock_t::now())
+			, m_entries(capacity)
+			, m_free(0)
+			, m_swept(clock_t::now())
+			, m_inflight(0)
+			, m_dropped(0)
+		{
+			for (bin::sz_t i = 0; i < capacity; ++i) {
+				m_entries[i].next = i + 1;
+			}
+		}
+
+		/* Request to dst failed on attempt, 0 being the first one. Returns
+		 * false if it should be given up: attempts are over or no room. */
+		bool failed(bin::u64_t dst, const ValueT & v, bin::u32_t attempt, time_point now) {
+			if (attempt >= m_policy.max_attempts || m_free == m_entries.size()) {
+				m_dropped++;
+				return false;
+			}
+			/* Failures of requests sent before the backoff
+			 * was raised do not raise it again */
+			backoff & b = m_backoff[dst];
+			if (now >= b.until && b.failures < 32) {
+				b.failures++;
+			}
+			duration delay = m_policy.initial;
+			for (bin::u32_t i = 1; i < b.failures && delay < m_policy.max; ++i) {
+				delay *= 2;
+			}
+			if (delay > m_policy.max) {
+				delay = m_policy.max;
+			}
+			/* Somewhere in the second half of the delay */
+			std::uniform_int_distribution<duration::rep> jitter(delay.count() / 2, delay.count());
+			time_point at = now + duration(jitter(m_random));
+			if (at < b.until) {
+				at = b.until;
+			}
+			b.until = at;
+			bin::u32_t i = m_free;
+			if (m_wheel.add(at - now, i, now) == m_wheel.nil) {
+				m_dropped++;
+				return false;
+			}
+			b.waiting++;
+			entry & e = m_entries[i];
+			m_free = e.next;
+			e.dst = dst;
+			e.value = v;
+			e.attempt = attempt + 1;
+			return true;
+		}
+
+		/* Request to dst went through, its backoff is over */
+		void succeeded(bin::u64_t dst) {
+			m_backoff.erase(dst);
+		}
+
+		/* Retry passed by poll is answered or failed again */
+		void finished() {
+			if (m_inflight != 0) {
+				m_inflight--;
+			}
+		}
+
+		/* Pass due retries to f(dst, value, attempt), each one
+		 * counts as unfinished. Returns number of calls. */
+		template <class F>
+		bin::sz_t poll(time_point now, F f) {
+			m_wheel.expire(now, [this] (bin::u64_t i) {
+				m_ready.push_back(i);
+			});
+			bin::sz_t n = 0;
+			while (!m_ready.empty() && m_inflight < m_policy.max_inflight) {
+				bin::u32_t i = m_ready.front();
+				m_ready.pop_front();
+				entry & e = m_entries[i];
+				bin::u64_t dst = e.dst;
+				ValueT v = e.value;
+				bin::u32_t attempt = e.attempt;
+				e.next = m_free;
+				m_free = i;
+				auto b = m_backoff.find(dst);
+				if (b != m_backoff.end() && b->second.waiting != 0) {
+					b->second.waiting--;
+				}
+				m_inflight++;
+				n++;
+				f(dst, v, attempt);
+			}
+			if (now - m_swept >= m_policy.max) {
+				sweep(now);
+			}
+			return n;
+		}
+
+		/* Requests waiting, in the wheel or due */
+		bin::sz_t size() const { return m_wheel.size() + m_ready.size(); }
+		bin::sz_t inflight() const { return m_inflight; }
+		bin::sz_t dropped() const { return m_dropped; }
+		bin::sz_t destinations() const { return m_backoff.size(); }
+
+	private:
+		struct entry {
+			bin::u64_t dst;
+			ValueT value;
+			bin::u32_t attempt;
+			/* Next free entry */
+			bin::u32_t next;
+		};
+
+		struct backoff {
+			bin::u32_t failures;
+			/* Requests in the wheel or due */
+			bin::u32_t waiting;
+			time_point until;
+
+			backoff(): failures(0), waiting(0) {}
+		};
+
+		const policy m_policy;
+		/* Timers hold entry numbers */
+		timer_wheel<bin::u64_t> m_wheel;
+		std::vector<entry> m_entries;
+		bin::u32_t m_free;
+		std::deque<bin::u32_t> m_ready;
+		std::unordered_map<bin::u64_t, backoff> m_backoff;
+		time_point m_swept;
+		std::minstd_rand m_random;
+		bin::sz_t m_inflight;
+		bin::sz_t m_dropped;
+
+		/* Forget backoffs over for a max delay with nothing waiting */
+		void sweep(time_point now) {
+			m_swept = now;
+			for (auto it = m_backoff.begin(); it != m_backoff.end(); ) {
+				if (it->second.waiting == 0 && now - it->second.until >= m_policy.max) {
+					it = m_backoff.erase(it);
+				} else {
+					++it;
+				}
+			}
+		}
+};
+
+} } }
+
+#endif
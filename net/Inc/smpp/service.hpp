@@ -7,6 +7,10 @@
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <smpp/proto.hpp>
+#include <smpp/concat.hpp>
+#include <smpp/window.hpp>
+#include <smpp/session.hpp>
+#include <smpp/throttle.hpp>
 #include <toolbox/toolbox.hpp>
 #include <toolbox/service.hpp>
 
@@ -15,13 +19,15 @@ namespace mobi { namespace net { namespace smpp {
 namespace ba = boost::asio;
 namespace bs = boost::system;
 
-template <class ProtoT, class AllocatorT, class LogT>
+/* ContextT is a value kept along with every request sent by
+ * send_request and handed back with its response */
+template <class ProtoT, class AllocatorT, class LogT, class ContextT = void *>
 class service
 	: private parser<LogT>
 	, private writer<LogT>
 	, private toolbox::service<ProtoT, AllocatorT, LogT, pdu> {
 
-	typedef service<ProtoT, AllocatorT, LogT>	service_t;
+	typedef service<ProtoT, AllocatorT, LogT, ContextT>	service_t;
 
 	protected:
 
@@ -39,6 +45,9 @@ class service
 	typedef parser<LogT> parser_base;
 	typedef writer<LogT> writer_base;
 
+	typedef ContextT					context_t;
+	typedef window<context_t>			window_t;
+
 	friend channel_t;
 
 	using service_base::L;
@@ -49,7 +58,30 @@ class service
 			: parser_base(l)
 			, writer_base(l)
 			, service_base(ep, a, l)
-		{}
+			, m_replaying(false)
+			, m_throttle(nullptr)
+			, m_role(session::smsc)
+			, m_max_rejects(default_max_rejects)
+			, m_window_size(default_window_size)
+			, m_window_timeout(std::chrono::seconds(30))
+		{
+			service_base::set_tick(tick_ms);
+		}
+
+		/* Service opening its sessions by connect only, e.g. ESME */
+		service(allocator_t & a, log_t l)
+			: parser_base(l)
+			, writer_base(l)
+			, service_base(a, l)
+			, m_replaying(false)
+			, m_throttle(nullptr)
+			, m_role(session::smsc)
+			, m_max_rejects(default_max_rejects)
+			, m_window_size(default_window_size)
+			, m_window_timeout(std::chrono::seconds(30))
+		{
+			service_base::set_tick(tick_ms);
+		}
 
 		virtual ~service() {
 		}
@@ -57,8 +89,42 @@ class service
 		using service_base::start;
 		using service_base::stop;
 		using service_base::close;
+		using service_base::wake;
+		using service_base::connect;
+		using service_base::local_endpoint;
+		using service_base::set_capture;
+
+		/* Side of SMPP sessions this service acts as,
+		 * applied to sessions opened after the call */
+		void set_role(session::role_t role) {
+			m_role = role;
+		}
+
+		/* Throughput limits of accounts bound to this service,
+		 * excess messages are answered with ESME_RTHROTTLED */
+		void set_throttle(throttle * t) {
+			m_throttle = t;
+		}
+
+		/* Channel is closed after that many PDUs rejected in a row */
+		void set_max_rejects(bin::sz_t n) {
+			m_max_rejects = n;
+		}
+
+		/* Maximum number of requests in flight and response timeout,
+		 * applied to sessions opened after the call */
+		void set_window(bin::sz_t size, bin::sz_t timeout_ms) {
+			m_window_size = size;
+			m_window_timeout = std::chrono::milliseconds(timeout_ms);
+		}
 
 	protected:
+		/* Header of a PDU got on the channel, for the trace log */
+		void trace_got(bin::sz_t channel_id, const pdu & command) {
+			ltrace(L) << "channel #" << channel_id << " got: "
+				<< command_id{command.id} << " seqno: " << command.seqno;
+		}
+
 		template <typename MsgT>
 		bin::sz_t send(bin::sz_t channel_id, MsgT & msg) {
 			bin::buffer buf;
@@ -67,9 +133,227 @@ class service
 			/* Set message overall length before serializing it to buffer */
 			msg.command.len = msg.raw_size();
 			writer_base::write(buf.data, buf.data + buf.len, msg);
+			get_session(channel_id).fsm.on_send(msg.command.id, msg.command.status);
+			return service_base::send(channel_id, buf);
+		}
+
+		/* Serialize messages back to back into one buffer which goes
+		 * to the channel as a single outgoing message, e.g. responses
+		 * to a burst of requests. Returns channel message number
+		 * shared by the whole batch, or 0 on failure. */
+		template <typename IterT>
+		bin::sz_t send_batch(bin::sz_t channel_id, IterT first, IterT last) {
+			bin::buffer buf;
+			buf.len = 0;
+			for (IterT it = first; it != last; ++it) {
+				it->command.len = it->raw_size();
+				buf.len += it->command.len;
+			}
+			if (buf.len == 0) {
+				return 0;
+			}
+			buf.data = bin::asbuf(A.alloc(buf.len));
+			bin::u8_t * ptr = buf.data;
+			bin::u8_t * bend = buf.data + buf.len;
+			for (IterT it = first; it != last && ptr != nullptr; ++it) {
+				ptr = writer_base::write(ptr, bend, *it);
+			}
+			if (ptr != bend) {
+				lerror(L) << "service::send_batch: serialization failed";
+				A.dealloc(buf.data);
+				return 0;
+			}
+			/* Session moves on only for a batch which is sent */
+			session & fsm = get_session(channel_id).fsm;
+			for (IterT it = first; it != last; ++it) {
+				fsm.on_send(it->command.id, it->command.status);
+			}
 			return service_base::send(channel_id, buf);
 		}
 
+		/* Current state of SMPP session on the channel */
+		session::state_t session_state(bin::sz_t channel_id) {
+			return get_session(channel_id).fsm.state();
+		}
+
+		/* Send request within session window. Sequence number is assigned
+		 * here, ctx is handed back to on_response or on_expire.
+		 * Returns sequence number or 0 if window is full or channel is gone.
+		 * Must be called from message processing thread. */
+		template <typename MsgT>
+		bin::u32_t send_request(bin::sz_t channel_id, MsgT & msg, const context_t & ctx) {
+			window_t & w = get_session(channel_id).window;
+			bin::u32_t seqno = w.push(ctx, window_t::clock_t::now());
+			if (seqno == 0) {
+				return 0;
+			}
+			msg.command.seqno = seqno;
+			if (send(channel_id, msg) == 0) {
+				context_t c;
+				w.pop(seqno, c);
+				return 0;
+			}
+			return seqno;
+		}
+
+		/* Send a long message as parts of concatenated one, each part is
+		 * a request within session window sharing the same ctx. All parts
+		 * are serialized into one buffer and go to the channel at once.
+		 * Returns number of parts sent, or 0 if the text does not fit,
+		 * window has no room for every part or channel is gone. */
+		template <typename MsgT>
+		bin::sz_t send_segmented(bin::sz_t channel_id, MsgT & msg
+				, const segmenter & seg, bin::u16_t ref, const context_t & ctx) {
+			bin::sz_t n = seg.count();
+			session_data & s = get_session(channel_id);
+			if (n == 0 || s.window.available() < n) {
+				return 0;
+			}
+			bin::buffer buf;
+			buf.len = 0;
+			for (bin::sz_t i = 0; i < n; ++i) {
+				seg.fill(msg, i, ref);
+				buf.len += msg.raw_size();
+			}
+			buf.data = bin::asbuf(A.alloc(buf.len));
+			bin::u8_t * ptr = buf.data;
+			bin::u8_t * bend = buf.data + buf.len;
+			bin::u32_t seqnos[segmenter::max_parts];
+			typename window_t::time_point now = window_t::clock_t::now();
+			bin::sz_t pushed = 0;
+			for (; pushed < n && ptr != nullptr; ++pushed) {
+				seg.fill(msg, pushed, ref);
+				seqnos[pushed] = s.window.push(ctx, now);
+				msg.command.seqno = seqnos[pushed];
+				msg.command.len = msg.raw_size();
+				ptr = writer_base::write(ptr, bend, msg);
+				s.fsm.on_send(msg.command.id, msg.command.status);
+			}
+			if (ptr != bend) {
+				lerror(L) << "service::send_segmented: serialization failed";
+				A.dealloc(buf.data);
+			} else if (service_base::send(channel_id, buf) != 0) {
+				return n;
+			}
+			context_t c;
+			for (bin::sz_t i = 0; i < pushed; ++i) {
+				s.window.pop(seqnos[i], c);
+			}
+			return 0;
+		}
+
+		/* Raw PDU being handled, valid within a callback only */
+		bin::buffer raw() const {
+			return m_raw;
+		}
+
+		/* Pass a PDU kept earlier, e.g. in a journal, to the callbacks
+		 * as if it came from channel_id, skipping session checks */
+		void replay(bin::sz_t channel_id, const bin::u8_t * buf, bin::sz_t len) {
+			m_channel_id = channel_id;
+			m_raw.data = const_cast<bin::u8_t *>(buf);
+			m_raw.len = len;
+			m_replaying = true;
+			parser_base::parse(buf, buf + len);
+			m_replaying = false;
+		}
+
+		/* Whether the PDU being handled comes from replay */
+		bool replaying() const {
+			return m_replaying;
+		}
+
+		/* Number of requests that can be sent before window is full */
+		bin::sz_t window_available(bin::sz_t channel_id) {
+			return get_session(channel_id).window.available();
+		}
+
+		/* Responses to requests sent by send_request. By default they are
+		 * passed to the regular callbacks and the context is dropped. */
+		virtual void on_response(bin::sz_t channel_id, const bind_transmitter_r & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_bind_transmitter_r(channel_id, msg);
+		}
+		virtual void on_response(bin::sz_t channel_id, const bind_receiver_r & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_bind_receiver_r(channel_id, msg);
+		}
+		virtual void on_response(bin::sz_t channel_id, const bind_transceiver_r & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_bind_transceiver_r(channel_id, msg);
+		}
+		virtual void on_response(bin::sz_t channel_id, const unbind_r & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_unbind_r(channel_id, msg);
+		}
+		virtual void on_response(bin::sz_t channel_id, const generic_nack & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_generic_nack(channel_id, msg);
+		}
+		virtual void on_response(bin::sz_t channel_id, const submit_sm_r & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_submit_sm_r(channel_id, msg);
+		}
+		virtual void on_response(bin::sz_t channel_id, const submit_multi_r & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_submit_multi_r(channel_id, msg);
+		}
+		virtual void on_response(bin::sz_t channel_id, const deliver_sm_r & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_deliver_sm_r(channel_id, msg);
+		}
+		virtual void on_response(bin::sz_t channel_id, const data_sm_r & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_data_sm_r(channel_id, msg);
+		}
+		virtual void on_response(bin::sz_t channel_id, const query_sm_r & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_query_sm_r(channel_id, msg);
+		}
+		virtual void on_response(bin::sz_t channel_id, const cancel_sm_r & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_cancel_sm_r(channel_id, msg);
+		}
+		virtual void on_response(bin::sz_t channel_id, const replace_sm_r & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_replace_sm_r(channel_id, msg);
+		}
+		virtual void on_response(bin::sz_t channel_id, const enquire_link_r & msg, const context_t & ctx) {
+			(void)(ctx);
+			on_enquire_link_r(channel_id, msg);
+		}
+
+		/* Called every tick_ms from message processing thread,
+		 * once windows are expired */
+		virtual void on_timer() {}
+
+		/* Called from message processing thread after wake */
+		virtual void on_wake() {}
+
+		/* Channel is closed and its session is gone,
+		 * the id may be reused from now on */
+		virtual void on_closed(bin::sz_t channel_id) {
+			(void)(channel_id);
+		}
+
+		/* Channel opened by connect with the tag, or the connection
+		 * failed. Called from message processing thread. */
+		virtual void on_connected(bin::sz_t channel_id, bin::sz_t tag) {
+			(void)(channel_id);
+			(void)(tag);
+		}
+		virtual void on_connect_failed(bin::sz_t tag) {
+			(void)(tag);
+		}
+
+		/* Request sent by send_request will never be answered:
+		 * response timed out or session is closed */
+		virtual void on_expire(bin::sz_t channel_id, bin::u32_t seqno, const context_t & ctx) {
+			(void)(ctx);
+			lwarning(L) << "channel #" << channel_id
+				<< " request #" << seqno << " expired";
+		}
+
 		virtual void on_bind_transmitter(bin::sz_t channel_id, const bind_transmitter & msg) = 0;
 		virtual void on_bind_transmitter_r(bin::sz_t channel_id, const bind_transmitter_r & msg) = 0;
 		virtual void on_bind_receiver(bin::sz_t channel_id, const bind_receiver & msg) = 0;
@@ -102,13 +386,176 @@ class service
 	private:
 		typedef typename parser_base::action action;
 
+		/* Expiration granularity of window requests */
+		static const bin::sz_t tick_ms = 100;
+		static const bin::sz_t default_window_size = 10;
+		static const bin::sz_t default_max_rejects = 100;
+
+		struct session_data {
+			session fsm;
+			window_t window;
+			/* Throughput limits of the bound sys_id */
+			throttle::account * account;
+			session_data(session::role_t role, bin::sz_t size
+					, typename window_t::duration timeout)
+				: fsm(role)
+				, window(size, timeout)
+				, account(nullptr)
+			{}
+		};
+
 		bin::sz_t m_channel_id;
+		bin::buffer m_raw;
+		bool m_replaying;
+
+		/* Sessions indexed by channel id,
+		 * touched from message processing thread only */
+		std::vector<session_data> m_sessions;
+		throttle * m_throttle;
+		session::role_t m_role;
+		bin::sz_t m_max_rejects;
+		bin::sz_t m_window_size;
+		typename window_t::duration m_window_timeout;
+
+		session_data & get_session(bin::sz_t channel_id) {
+			if (channel_id >= m_sessions.size()) {
+				m_sessions.resize(channel_id + 1
+					, session_data(m_role, m_window_size, m_window_timeout));
+			}
+			return m_sessions[channel_id];
+		}
+
+		bool pop_request(const pdu & command, context_t & ctx) {
+			if (m_channel_id >= m_sessions.size()) {
+				return false;
+			}
+			return m_sessions[m_channel_id].window.pop(command.seqno, ctx);
+		}
+
+		void on_tick() {
+			typename window_t::time_point now = window_t::clock_t::now();
+			for (bin::sz_t i = 0; i < m_sessions.size(); ++i) {
+				m_sessions[i].window.expire(now, [this, i] (bin::u32_t seqno, const context_t & ctx) {
+					on_expire(i, seqno, ctx);
+				});
+			}
+			on_timer();
+		}
+
+		void on_destroy(bin::sz_t channel_id) {
+			if (channel_id < m_sessions.size()) {
+				m_sessions[channel_id].window.clear([this, channel_id] (bin::u32_t seqno, const context_t & ctx) {
+					on_expire(channel_id, seqno, ctx);
+				});
+				m_sessions[channel_id] = session_data(m_role, m_window_size, m_window_timeout);
+			}
+			on_closed(channel_id);
+		}
+
+		void on_connect(bin::sz_t channel_id, bin::sz_t tag) {
+			on_connected(channel_id, tag);
+		}
+
+		void on_connect_error(bin::sz_t tag) {
+			on_connect_failed(tag);
+		}
 
 		void on_recv(bin::sz_t channel_id, bin::buffer buf) {
 			m_channel_id = channel_id;
+			m_raw = buf;
+			if (!admit(channel_id, buf)) {
+				return;
+			}
 			parser_base::parse(buf.data, buf.data + buf.len);
 		}
 
+		/* Check PDU header against session state before parsing the body.
+		 * Disallowed requests are answered with header only response. */
+		bool admit(bin::sz_t channel_id, bin::buffer buf) {
+			using namespace bin;
+			session_data & s = get_session(channel_id);
+			session & fsm = s.fsm;
+			pdu hdr;
+			bin::u32_t status;
+			if (buf.len < sizeof(hdr)) {
+				status = command_status::esme_rinvcmdlen;
+			} else {
+				const u8_t * ptr = buf.data;
+				bin::u32_t id;
+				ptr = p::cp_u32(asbuf(hdr.len), ptr);
+				ptr = p::cp_u32(asbuf(id), ptr);
+				ptr = p::cp_u32(asbuf(hdr.status), ptr);
+				p::cp_u32(asbuf(hdr.seqno), ptr);
+				hdr.id = static_cast<command::id>(id);
+				status = fsm.admit(hdr.id);
+				if (status == command_status::esme_rok) {
+					if (s.account != nullptr && limited(hdr.id)
+							&& !s.account->acquire(throttle::now())) {
+						reject(channel_id, hdr, command_status::esme_rthrottled);
+						return false;
+					}
+					fsm.on_recv(hdr.id, hdr.status);
+					return true;
+				}
+			}
+			ltrace(L) << "channel #" << channel_id
+				<< " rejected: " << command_id{hdr.id} << " status: " << status;
+			if (!(hdr.id & command::generic_nack)) {
+				reject(channel_id, hdr, status);
+			}
+			if (fsm.rejects() >= m_max_rejects) {
+				lwarning(L) << "channel #" << channel_id
+					<< " too many rejected PDUs, closing";
+				fsm.close();
+				service_base::close(channel_id);
+			}
+			return false;
+		}
+
+		static bool limited(command::id id) {
+			return id == command::submit_sm
+				|| id == command::submit_multi_sm
+				|| id == command::data_sm;
+		}
+
+		/* Attach account limits on bind request, as no message
+		 * may come before the bind is complete anyway */
+		void attach(const bin::u8_t * sys_id, bin::sz_t len) {
+			if (m_throttle != nullptr) {
+				get_session(m_channel_id).account = m_throttle->find(sys_id, len);
+			}
+		}
+
+		/* Destination prefix limits are checked once the body is parsed,
+		 * account token taken on admission is given back on failure */
+		bool admit_dst(const pdu & hdr, const bin::u8_t * dst, bin::sz_t len) {
+			if (m_replaying) {
+				return true;
+			}
+			throttle::account * a = m_sessions[m_channel_id].account;
+			if (a == nullptr || !a->has_prefixes()
+					|| a->acquire(dst, len, throttle::now())) {
+				return true;
+			}
+			a->release();
+			reject(m_channel_id, hdr, command_status::esme_rthrottled);
+			return false;
+		}
+
+		void reject(bin::sz_t channel_id, const pdu & hdr, bin::u32_t status) {
+			generic_nack r;
+			/* Requests without a response PDU of their own
+			 * are answered with generic_nack */
+			if (status != command_status::esme_rinvcmdid
+					&& hdr.id != command::outbind
+					&& hdr.id != command::alert_notification) {
+				r.command.id = static_cast<command::id>(hdr.id | command::generic_nack);
+			}
+			r.command.status = status;
+			r.command.seqno = hdr.seqno;
+			send(channel_id, r);
+		}
+
 		action on_parse_error(const bin::u8_t * buf, const bin::u8_t * bend) {
 			(void)(buf);
 			(void)(bend);
@@ -117,32 +564,50 @@ class service
 		}
 
 		action on_bind_transmitter(const bind_transmitter & msg) {
+			attach(msg.sys_id, msg.sys_id_len);
 			on_bind_transmitter(m_channel_id, msg);
 			return parser_base::resume;
 		}
 
 		action on_bind_transmitter_r(const bind_transmitter_r & msg) {
-			on_bind_transmitter_r(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_bind_transmitter_r(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
 		action on_bind_receiver(const bind_receiver & msg) {
+			attach(msg.sys_id, msg.sys_id_len);
 			on_bind_receiver(m_channel_id, msg);
 			return parser_base::resume;
 		}
 
 		action on_bind_receiver_r(const bind_receiver_r & msg) {
-			on_bind_receiver_r(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_bind_receiver_r(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
 		action on_bind_transceiver(const bind_transceiver & msg) {
+			attach(msg.sys_id, msg.sys_id_len);
 			on_bind_transceiver(m_channel_id, msg);
 			return parser_base::resume;
 		}
 
 		action on_bind_transceiver_r(const bind_transceiver_r & msg) {
-			on_bind_transceiver_r(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_bind_transceiver_r(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
@@ -152,7 +617,12 @@ class service
 		}
 
 		action on_unbind_r(const unbind_r & msg) {
-			on_unbind_r(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_unbind_r(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
@@ -162,17 +632,30 @@ class service
 		}
 
 		action on_generic_nack(const generic_nack & msg) {
-			on_generic_nack(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_generic_nack(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
 		action on_submit_sm(const submit_sm & msg) {
+			if (!admit_dst(msg.command, msg.dst_addr, msg.dst_addr_len)) {
+				return parser_base::resume;
+			}
 			on_submit_sm(m_channel_id, msg);
 			return parser_base::resume;
 		}
 
 		action on_submit_sm_r(const submit_sm_r & msg) {
-			on_submit_sm_r(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_submit_sm_r(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
@@ -182,7 +665,12 @@ class service
 		}
 
 		action on_submit_multi_r(const submit_multi_r & msg) {
-			on_submit_multi_r(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_submit_multi_r(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
@@ -192,17 +680,30 @@ class service
 		}
 
 		action on_deliver_sm_r(const deliver_sm_r & msg) {
-			on_deliver_sm_r(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_deliver_sm_r(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
 		action on_data_sm(const data_sm & msg) {
+			if (!admit_dst(msg.command, msg.dst_addr, msg.dst_addr_len)) {
+				return parser_base::resume;
+			}
 			on_data_sm(m_channel_id, msg);
 			return parser_base::resume;
 		}
 
 		action on_data_sm_r(const data_sm_r & msg) {
-			on_data_sm_r(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_data_sm_r(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
@@ -212,7 +713,12 @@ class service
 		}
 
 		action on_query_sm_r(const query_sm_r & msg) {
-			on_query_sm_r(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_query_sm_r(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
@@ -222,7 +728,12 @@ class service
 		}
 
 		action on_cancel_sm_r(const cancel_sm_r & msg) {
-			on_cancel_sm_r(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_cancel_sm_r(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
@@ -232,7 +743,12 @@ class service
 		}
 
 		action on_replace_sm_r(const replace_sm_r & msg) {
-			on_replace_sm_r(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_replace_sm_r(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
@@ -242,7 +758,12 @@ class service
 		}
 
 		action on_enquire_link_r(const enquire_link_r & msg) {
-			on_enquire_link_r(m_channel_id, msg);
+			context_t ctx;
+			if (pop_request(msg.command, ctx)) {
+				on_response(m_channel_id, msg, ctx);
+			} else {
+				on_enquire_link_r(m_channel_id, msg);
+			}
 			return parser_base::resume;
 		}
 
@@ -252,13 +773,13 @@ class service
 		}
 };
 
-template <class AllocatorT, class LogT>
+template <class AllocatorT, class LogT, class ContextT = void *>
 using local_service
-	= service<boost::asio::local::stream_protocol, AllocatorT, LogT>;
+	= service<boost::asio::local::stream_protocol, AllocatorT, LogT, ContextT>;
 
-template <class AllocatorT, class LogT>
+template <class AllocatorT, class LogT, class ContextT = void *>
 using tcp_service
-	= service<boost::asio::ip::tcp, AllocatorT, LogT>;
+	= service<boost::asio::ip::tcp, AllocatorT, LogT, ContextT>;
 
 } } }
 
@@ -0,0 +1,633 @@
+#ifndef smpp_store_hpp
+#define smpp_store_hpp
+
+#include <mutex>
+#include <ctime>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <toolbox/bin.hpp>
+#include <smpp/proto.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Fixed size blocks carved out of large chunks. Freed blocks are
+ * reused, chunks go back to the system with the slab only. */
+class slab {
+	public:
+		slab(const slab &) = delete;
+		slab & operator=(const slab &) = delete;
+
+		slab(bin::sz_t size, bin::sz_t per_chunk = 1024)
+			: m_size(align(size))
+			, m_per_chunk(per_chunk)
+			, m_free(nullptr)
+			, m_used(0)
+		{}
+
+		void * alloc() {
+			if (m_free == nullptr) {
+				grow();
+			}
+			void * p = m_free;
+			m_free = *static_cast<void **>(p);
+			m_used++;
+			return p;
+		}
+
+		void free(void * p) {
+			*static_cast<void **>(p) = m_free;
+			m_free = p;
+			m_used--;
+		}
+
+		bin::sz_t block_size() const { return m_size; }
+		bin::sz_t used() const { return m_used; }
+
+		/* Bytes taken from the system */
+		bin::sz_t capacity() const {
+			return m_chunks.size() * m_per_chunk * m_size;
+		}
+
+	private:
+		bin::sz_t m_size;
+		bin::sz_t m_per_chunk;
+		void * m_free;
+		bin::sz_t m_used;
+		std::vector<std::unique_ptr<bin::u8_t[]>> m_chunks;
+
+		static bin::sz_t align(bin::sz_t size) {
+			bin::sz_t a = sizeof(bin::u64_t);
+			size = size < sizeof(void *) ? sizeof(void *) : size;
+			return (size + a - 1) / a * a;
+		}
+
+		void grow() {
+			bin::u8_t * chunk = new bin::u8_t[m_per_chunk * m_size];
+			m_chunks.push_back(std::unique_ptr<bin::u8_t[]>(chunk));
+			for (bin::sz_t i = m_per_chunk; i-- > 0;) {
+				void * p = chunk + i * m_size;
+				*static_cast<void **>(p) = m_free;
+				m_free = p;
+			}
+		}
+};
+
+/* Messages accepted from ESMEs, kept for query_sm, cancel_sm, replace_sm
+ * and replace_if_present_flag of submit_sm.
+ *
+ * Records are found by message id and, while pending, by source and
+ * destination address, service type being checked on the record. Both
+ * indices are hash tables split into shards with a lock each: a record
+ * lives in the shard of its id, its address index entry in the shard of
+ * the addresses. An operation holds one lock at a time, except find,
+ * which checks records of its matches under the address shard lock.
+ * Records and texts come from per-shard slabs. */
+class store {
+	public:
+		typedef std::chrono::system_clock clock_t;
+
+		/* Up to that many ids are passed by one find call */
+		static const bin::sz_t max_matches = 64;
+
+		/* Service type and addresses of a message,
+		 * empty fields of a search key match anything */
+		struct key {
+			const bin::u8_t * serv_type;
+			bin::sz_t serv_type_len;
+			const bin::u8_t * src_addr;
+			bin::sz_t src_addr_len;
+			const bin::u8_t * dst_addr;
+			bin::sz_t dst_addr_len;
+
+			key()
+				: serv_type(nullptr), serv_type_len(0)
+				, src_addr(nullptr), src_addr_len(0)
+				, dst_addr(nullptr), dst_addr_len(0)
+			{}
+
+			/* PDU fields, length may include terminating zero */
+			template <class MsgT>
+			static key of(const MsgT & msg) {
+				key k;
+				k.serv_type = msg.serv_type;
+				k.serv_type_len = text_len(msg.serv_type, msg.serv_type_len);
+				k.src_addr = msg.src_addr;
+				k.src_addr_len = text_len(msg.src_addr, msg.src_addr_len);
+				k.dst_addr = msg.dst_addr;
+				k.dst_addr_len = text_len(msg.dst_addr, msg.dst_addr_len);
+				return k;
+			}
+		};
+
+		/* What query_sm_r reports */
+		struct status {
+			bin::u8_t state;
+			bin::u8_t error_code;
+			/* Zero while message is not in a final state */
+			std::time_t final_date;
+		};
+
+		store(const store &) = delete;
+		store & operator=(const store &) = delete;
+
+		/* Number of shards is rounded up to a power of two */
+		store(bin::sz_t shards = 64)
+			: m_mask(pow2(shards) - 1)
+			, m_ids(new id_shard[m_mask + 1])
+			, m_keys(new key_shard[m_mask + 1])
+		{}
+
+		/* Number of records, pending or not */
+		bin::sz_t size() {
+			bin::sz_t n = 0;
+			for (bin::sz_t i = 0; i <= m_mask; ++i) {
+				std::lock_guard<std::mutex> lock(m_ids[i].mtx);
+				n += m_ids[i].records.used();
+			}
+			return n;
+		}
+
+		/* Keep message accepted with the id, e.g. submit_sm, from the
+		 * ESME of sys_key, see route_table::sys_key. Returns false if
+		 * there is one with the same id already. */
+		template <class MsgT>
+		bool insert(bin::u64_t id, const MsgT & msg, clock_t::time_point now
+				, bin::u64_t sys_key = 0) {
+			key k = key::of(msg);
+			{
+				id_shard & s = id_shard_of(id);
+				std::lock_guard<std::mutex> lock(s.mtx);
+				if (s.find(id) != nullptr) {
+					return false;
+				}
+				record * r = static_cast<record *>(s.records.alloc());
+				r->id = id;
+				r->sys_key = sys_key;
+				r->state = message_state::enroute;
+				r->error_code = 0;
+				r->submit_date = clock_t::to_time_t(now);
+				r->final_date = 0;
+				r->esm_class = msg.esm_class;
+				r->data_coding = msg.data_coding;
+				r->serv_type_len = copy(r->serv_type, sizeof(r->serv_type)
+					, k.serv_type, k.serv_type_len);
+				r->src_addr_len = copy(r->src_addr, sizeof(r->src_addr)
+					, k.src_addr, k.src_addr_len);
+				r->dst_addr_len = copy(r->dst_addr, sizeof(r->dst_addr)
+					, k.dst_addr, k.dst_addr_len);
+				r->text = nullptr;
+				r->text_len = 0;
+				set_body(s, *r, msg);
+				s.index.insert(r, r->hash());
+			}
+			key_shard & s = key_shard_of(hash(k));
+			std::lock_guard<std::mutex> lock(s.mtx);
+			entry * e = static_cast<entry *>(s.entries.alloc());
+			e->id = id;
+			e->key_hash = hash(k);
+			s.index.insert(e, e->hash());
+			return true;
+		}
+
+		/* State of a message, src_addr must match the one it is from */
+		bool query(bin::u64_t id, const bin::u8_t * src_addr
+				, bin::sz_t src_addr_len, status & st) {
+			id_shard & s = id_shard_of(id);
+			std::lock_guard<std::mutex> lock(s.mtx);
+			record * r = s.find(id);
+			if (r == nullptr
+					|| !match(r->src_addr, r->src_addr_len
+						, src_addr, text_len(src_addr, src_addr_len))) {
+				return false;
+			}
+			st.state = r->state;
+			st.error_code = r->error_code;
+			st.final_date = r->final_date;
+			return true;
+		}
+
+		/* Whether message is there and not in a final state */
+		bool is_pending(bin::u64_t id) {
+			id_shard & s = id_shard_of(id);
+			std::lock_guard<std::mutex> lock(s.mtx);
+			record * r = s.find(id);
+			return r != nullptr && pending(*r);
+		}
+
+		/* Pass ids of pending messages matching k to f(id), which
+		 * returns false to stop. Source and destination are required.
+		 * Returns number of ids passed, at most max_matches. */
+		template <class F>
+		bin::sz_t find(const key & k, F f) {
+			bin::u64_t ids[max_matches];
+			bin::sz_t n = 0;
+			bin::u64_t h = hash(k);
+			{
+				key_shard & ks = key_shard_of(h);
+				std::lock_guard<std::mutex> lock(ks.mtx);
+				for (entry * e = ks.index.head(h); e != nullptr && n < max_matches; e = e->next) {
+					if (e->key_hash != h) {
+						continue;
+					}
+					id_shard & s = id_shard_of(e->id);
+					std::lock_guard<std::mutex> record_lock(s.mtx);
+					record * r = s.find(e->id);
+					if (r != nullptr && pending(*r) && match(*r, k)) {
+						ids[n++] = e->id;
+					}
+				}
+			}
+			for (bin::sz_t i = 0; i < n; ++i) {
+				if (!f(ids[i])) {
+					return i + 1;
+				}
+			}
+			return n;
+		}
+
+		/* Pending message with the addresses, data_coding and text of msg
+		 * submitted by the ESME of sys_key at since or later. Returns its
+		 * id, 0 if there is none. Messages in a final state have left the
+		 * address index and are not found, a resend of one is new. */
+		template <class MsgT>
+		bin::u64_t duplicate_of(const MsgT & msg, bin::u64_t sys_key, std::time_t since) {
+			bin::u64_t found = 0;
+			find(key::of(msg), [&] (bin::u64_t id) {
+				id_shard & s = id_shard_of(id);
+				std::lock_guard<std::mutex> lock(s.mtx);
+				record * r = s.find(id);
+				if (r != nullptr && r->sys_key == sys_key
+						&& static_cast<std::time_t>(r->submit_date) >= since
+						&& r->data_coding == msg.data_coding
+						&& r->text_len == msg.short_msg_len
+						&& (r->text_len == 0 || std::memcmp(r->text, msg.short_msg, r->text_len) == 0)) {
+					found = id;
+					return false;
+				}
+				return true;
+			});
+			return found;
+		}
+
+		/* Cancel pending message matching k.
+		 * Returns command status of cancel_sm_r. */
+		bin::u32_t cancel(bin::u64_t id, const key & k, clock_t::time_point now) {
+			bin::u64_t h;
+			{
+				id_shard & s = id_shard_of(id);
+				std::lock_guard<std::mutex> lock(s.mtx);
+				record * r = s.find(id);
+				if (r == nullptr || !pending(*r) || !match(*r, k)) {
+					return command_status::esme_rcancelfail;
+				}
+				r->state = message_state::deleted;
+				r->final_date = clock_t::to_time_t(now);
+				h = hash(*r);
+			}
+			unindex(id, h);
+			return command_status::esme_rok;
+		}
+
+		/* Replace text and delivery parameters of pending message,
+		 * e.g. by replace_sm or submit_sm with replace_if_present_flag.
+		 * src_addr of msg must match. Returns command status of replace_sm_r. */
+		template <class MsgT>
+		bin::u32_t replace(bin::u64_t id, const MsgT & msg) {
+			id_shard & s = id_shard_of(id);
+			std::lock_guard<std::mutex> lock(s.mtx);
+			record * r = s.find(id);
+			if (r == nullptr || !pending(*r)
+					|| !match(r->src_addr, r->src_addr_len, msg.src_addr
+						, text_len(msg.src_addr, msg.src_addr_len))) {
+				return command_status::esme_rreplacefail;
+			}
+			set_body(s, *r, msg);
+			return command_status::esme_rok;
+		}
+
+		/* Move message to a new state, final ones leave the address index */
+		bool update(bin::u64_t id, bin::u8_t state, bin::u8_t error_code
+				, clock_t::time_point now) {
+			return set_state(id, state, error_code, now, false);
+		}
+
+		/* Move message to expired unless it is in a final state already.
+		 * Returns false if it is not there or not pending. */
+		bool expire(bin::u64_t id, clock_t::time_point now) {
+			return set_state(id, message_state::expired, 0, now, true);
+		}
+
+		/* Forget the message, e.g. once its final state is reported */
+		bool erase(bin::u64_t id) {
+			bin::u64_t h;
+			bool was_pending;
+			{
+				id_shard & s = id_shard_of(id);
+				std::lock_guard<std::mutex> lock(s.mtx);
+				record * r = s.find(id);
+				if (r == nullptr) {
+					return false;
+				}
+				was_pending = pending(*r);
+				h = hash(*r);
+				s.index.remove(r, r->hash());
+				free_text(s, *r);
+				s.records.free(r);
+			}
+			if (was_pending) {
+				unindex(id, h);
+			}
+			return true;
+		}
+
+	private:
+		/* Texts are kept in blocks of 32, 64, 128 and 256 bytes */
+		static const bin::sz_t text_classes = 4;
+		static const bin::sz_t min_text_block = 32;
+
+		/* Strings are kept without terminating zero */
+		struct record {
+			bin::u64_t id;
+			/* ESME the message came from */
+			bin::u64_t sys_key;
+			record * next;
+			bin::u8_t * text;
+			bin::u32_t submit_date;
+			bin::u32_t final_date;
+			bin::u8_t state;
+			bin::u8_t error_code;
+			bin::u8_t esm_class;
+			bin::u8_t data_coding;
+			bin::u8_t registered_delivery;
+			bin::u8_t sm_default_msg_id;
+			bin::u8_t text_len;
+			bin::u8_t serv_type_len;
+			bin::u8_t src_addr_len;
+			bin::u8_t dst_addr_len;
+			bin::u8_t schedule_delivery_time_len;
+			bin::u8_t validity_period_len;
+			bin::u8_t serv_type[5];
+			bin::u8_t src_addr[20];
+			bin::u8_t dst_addr[20];
+			bin::u8_t schedule_delivery_time[16];
+			bin::u8_t validity_period[16];
+
+			bin::u64_t hash() const { return mix(id); }
+		};
+
+		/* Address index entry */
+		struct entry {
+			bin::u64_t id;
+			bin::u64_t key_hash;
+			entry * next;
+
+			bin::u64_t hash() const { return key_hash; }
+		};
+
+		/* Hash table chaining nodes through their next field */
+		template <class NodeT>
+		class table {
+			public:
+				table(): m_buckets(16, nullptr), m_count(0) {}
+
+				NodeT * head(bin::u64_t h) {
+					return m_buckets[h & (m_buckets.size() - 1)];
+				}
+
+				void insert(NodeT * n, bin::u64_t h) {
+					if (m_count >= m_buckets.size()) {
+						rehash(m_buckets.size() * 2);
+					}
+					NodeT *& b = m_buckets[h & (m_buckets.size() - 1)];
+					n->next = b;
+					b = n;
+					m_count++;
+				}
+
+				bool remove(NodeT * n, bin::u64_t h) {
+					NodeT ** p = &m_buckets[h & (m_buckets.size() - 1)];
+					for (; *p != nullptr; p = &(*p)->next) {
+						if (*p == n) {
+							*p = n->next;
+							m_count--;
+							return true;
+						}
+					}
+					return false;
+				}
+
+			private:
+				std::vector<NodeT *> m_buckets;
+				bin::sz_t m_count;
+
+				void rehash(bin::sz_t size) {
+					std::vector<NodeT *> buckets(size, nullptr);
+					for (NodeT * n: m_buckets) {
+						while (n != nullptr) {
+							NodeT * next = n->next;
+							NodeT *& b = buckets[n->hash() & (size - 1)];
+							n->next = b;
+							b = n;
+							n = next;
+						}
+					}
+					m_buckets.swap(buckets);
+				}
+		};
+
+		struct id_shard {
+			std::mutex mtx;
+			table<record> index;
+			slab records;
+			slab texts[text_classes];
+
+			id_shard()
+				: records(sizeof(record))
+				, texts { {min_text_block}, {min_text_block << 1}
+					, {min_text_block << 2}, {min_text_block << 3} }
+			{}
+
+			record * find(bin::u64_t id) {
+				record * r = index.head(mix(id));
+				while (r != nullptr && r->id != id) {
+					r = r->next;
+				}
+				return r;
+			}
+		};
+
+		struct key_shard {
+			std::mutex mtx;
+			table<entry> index;
+			slab entries;
+
+			key_shard(): entries(sizeof(entry)) {}
+		};
+
+		const bin::sz_t m_mask;
+		std::unique_ptr<id_shard[]> m_ids;
+		std::unique_ptr<key_shard[]> m_keys;
+
+		static bin::sz_t pow2(bin::sz_t n) {
+			bin::sz_t p = 1;
+			while (p < n) {
+				p <<= 1;
+			}
+			return p;
+		}
+
+		/* Tables use low bits of a hash, shards high ones */
+		id_shard & id_shard_of(bin::u64_t id) {
+			return m_ids[(mix(id) >> 48) & m_mask];
+		}
+
+		key_shard & key_shard_of(bin::u64_t h) {
+			return m_keys[(h >> 48) & m_mask];
+		}
+
+		static bin::u64_t mix(bin::u64_t x) {
+			x ^= x >> 33;
+			x *= 0xFF51AFD7ED558CCDull;
+			x ^= x >> 33;
+			x *= 0xC4CEB9FE1A85EC53ull;
+			x ^= x >> 33;
+			return x;
+		}
+
+		/* FNV-1a of source and destination */
+		static bin::u64_t hash(const bin::u8_t * src, bin::sz_t src_len
+				, const bin::u8_t * dst, bin::sz_t dst_len) {
+			bin::u64_t h = 0xCBF29CE484222325ull;
+			for (bin::sz_t i = 0; i < src_len; ++i) {
+				h = (h ^ src[i]) * 0x100000001B3ull;
+			}
+			h = (h ^ 0xFF) * 0x100000001B3ull;
+			for (bin::sz_t i = 0; i < dst_len; ++i) {
+				h = (h ^ dst[i]) * 0x100000001B3ull;
+			}
+			return mix(h);
+		}
+
+		static bin::u64_t hash(const key & k) {
+			return hash(k.src_addr, k.src_addr_len, k.dst_addr, k.dst_addr_len);
+		}
+
+		static bin::u64_t hash(const record & r) {
+			return hash(r.src_addr, r.src_addr_len, r.dst_addr, r.dst_addr_len);
+		}
+
+		static bool pending(const record & r) {
+			return r.state == message_state::enroute
+				|| r.state == message_state::accepted;
+		}
+
+		/* Length of a string field up to terminating zero */
+		static bin::sz_t text_len(const bin::u8_t * s, bin::sz_t len) {
+			const void * end = std::memchr(s, 0, len);
+			return end == nullptr ? len : static_cast<const bin::u8_t *>(end) - s;
+		}
+
+		/* Empty pattern matches anything */
+		static bool match(const bin::u8_t * s, bin::sz_t len
+				, const bin::u8_t * pattern, bin::sz_t pattern_len) {
+			return pattern_len == 0
+				|| (len == pattern_len && std::memcmp(s, pattern, len) == 0);
+		}
+
+		static bool match(const record & r, const key & k) {
+			return match(r.serv_type, r.serv_type_len, k.serv_type, k.serv_type_len)
+				&& match(r.src_addr, r.src_addr_len, k.src_addr, k.src_addr_len)
+				&& match(r.dst_addr, r.dst_addr_len, k.dst_addr, k.dst_addr_len);
+		}
+
+		static bin::u8_t copy(bin::u8_t * dst, bin::sz_t size
+				, const bin::u8_t * src, bin::sz_t len) {
+			len = len < size ? len : size;
+			std::memcpy(dst, src, len);
+			return len;
+		}
+
+		static bin::sz_t text_class(bin::sz_t len) {
+			bin::sz_t c = 0;
+			while ((min_text_block << c) < len) {
+				c++;
+			}
+			return c;
+		}
+
+		void free_text(id_shard & s, record & r) {
+			if (r.text != nullptr) {
+				s.texts[text_class(r.text_len)].free(r.text);
+				r.text = nullptr;
+				r.text_len = 0;
+			}
+		}
+
+		/* Fields common to submit_sm and replace_sm */
+		template <class MsgT>
+		void set_body(id_shard & s, record & r, const MsgT & msg) {
+			r.registered_delivery = msg.registered_delivery;
+			r.sm_default_msg_id = msg.sm_default_msg_id;
+			r.schedule_delivery_time_len = copy(r.schedule_delivery_time
+				, sizeof(r.schedule_delivery_time), msg.schedule_delivery_time
+				, text_len(msg.schedule_delivery_time, msg.schedule_delivery_time_len));
+			r.validity_period_len = copy(r.validity_period
+				, sizeof(r.validity_period), msg.validity_period
+				, text_len(msg.validity_period, msg.validity_period_len));
+			bin::sz_t len = msg.short_msg_len;
+			if (r.text != nullptr && text_class(r.text_len) != text_class(len)) {
+				free_text(s, r);
+			}
+			if (len != 0 && r.text == nullptr) {
+				r.text = static_cast<bin::u8_t *>(s.texts[text_class(len)].alloc());
+			}
+			std::memcpy(r.text, msg.short_msg, len);
+			r.text_len = len;
+		}
+
+		bool set_state(bin::u64_t id, bin::u8_t state, bin::u8_t error_code
+				, clock_t::time_point now, bool only_pending) {
+			bin::u64_t h;
+			{
+				id_shard & s = id_shard_of(id);
+				std::lock_guard<std::mutex> lock(s.mtx);
+				record * r = s.find(id);
+				if (r == nullptr) {
+					return false;
+				}
+				bool was_pending = pending(*r);
+				if (only_pending && !was_pending) {
+					return false;
+				}
+				r->state = state;
+				r->error_code = error_code;
+				if (pending(*r) || !was_pending) {
+					return true;
+				}
+				r->final_date = clock_t::to_time_t(now);
+				h = hash(*r);
+			}
+			unindex(id, h);
+			return true;
+		}
+
+		void unindex(bin::u64_t id, bin::u64_t h) {
+			key_shard & s = key_shard_of(h);
+			std::lock_guard<std::mutex> lock(s.mtx);
+			for (entry * e = s.index.head(h); e != nullptr; e = e->next) {
+				if (e->id == id && e->key_hash == h) {
+					s.index.remove(e, h);
+					s.entries.free(e);
+					return;
+				}
+			}
+		}
+};
+
+} } }
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef smpp_time_hpp
+#define smpp_time_hpp
+
+#include <ctime>
+#include <map>
+#include <vector>
+#include <toolbox/bin.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Days since 1970-01-01 of a civil date and back */
+inline long days_from_civil(long y, unsigned m, unsigned d) {
+	y -= m <= 2;
+	long era = (y >= 0 ? y : y - 399) / 400;
+	unsigned yoe = static_cast<unsigned>(y - era * 400);
+	unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + static_cast<long>(doe) - 719468;
+}
+
+inline void civil_from_days(long z, long & y, unsigned & m, unsigned & d) {
+	z += 719468;
+	long era = (z >= 0 ? z : z - 146096) / 146097;
+	unsigned doe = static_cast<unsigned>(z - era * 146097);
+	unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	unsigned mp = (5 * doy + 2) / 153;
+	d = doy - (153 * mp + 2) / 5 + 1;
+	m = mp < 10 ? mp + 3 : mp - 9;
+	y = static_cast<long>(yoe) + era * 400 + (m <= 2);
+}
+
+/* Time fields of schedule_delivery_time, validity_period and final_date:
+ *
+ * YYMMDDhhmmsstnnp
+ *
+ * Absolute time has p '+' or '-' for local time nn quarter hours ahead
+ * of or behind UTC. Relative one has p 'R' and is the period to add to
+ * the current time, t and nn being 0. */
+namespace smpp_time {
+
+	/* Text length without terminating zero */
+	const bin::sz_t text_len = 16;
+
+	inline bool digits(const bin::u8_t * v, bin::sz_t n, unsigned & out) {
+		out = 0;
+		for (bin::sz_t i = 0; i < n; ++i) {
+			if (v[i] < '0' || v[i] > '9') {
+				return false;
+			}
+			out = out * 10 + (v[i] - '0');
+		}
+		return true;
+	}
+}
+
+/* Parse time field of len bytes, zero terminated or not, to seconds since
+ * epoch. Relative time is taken from now. Empty field gives 0, meaning
+ * immediate delivery or default validity. Returns false if malformed. */
+inline bool parse_time(const bin::u8_t * buf, bin::sz_t len, std::time_t now, std::time_t & t) {
+	using namespace smpp_time;
+	t = 0;
+	if (len == 0 || buf[0] == '\0') {
+		return true;
+	}
+	if (len < text_len || (len > text_len && buf[text_len] != '\0')) {
+		return false;
+	}
+	unsigned f[7];
+	for (int i = 0; i < 6; ++i) {
+		if (!digits(buf + i * 2, 2, f[i])) {
+			return false;
+		}
+	}
+	unsigned tenths;
+	if (!digits(buf + 12, 1, tenths) || !digits(buf + 13, 2, f[6])) {
+		return false;
+	}
+	const unsigned year = f[0], mon = f[1], day = f[2], hour = f[3], min = f[4], sec = f[5];
+	if (buf[15] == 'R') {
+		/* Years and months move the calendar date, the rest adds up */
+		long y;
+		unsigned m, d;
+		std::time_t secs = now % 86400;
+		civil_from_days(now / 86400, y, m, d);
+		long months = y * 12 + (m - 1) + year * 12 + mon;
+		long days = days_from_civil(months / 12, months % 12 + 1, d) + day;
+		t = static_cast<std::time_t>(days) * 86400 + secs
+			+ hour * 3600 + min * 60 + sec;
+		return true;
+	}
+	if (buf[15] != '+' && buf[15] != '-') {
+		return false;
+	}
+	if (mon < 1 || mon > 12 || day < 1 || day > 31
+			|| hour > 23 || min > 59 || sec > 59 || f[6] > 48) {
+		return false;
+	}
+	std::time_t offset = f[6] * 900;
+	t = static_cast<std::time_t>(days_from_civil(2000 + year, mon, day)) * 86400
+		+ hour * 3600 + min * 60 + sec
+		+ (buf[15] == '+' ? -offset : offset);
+	return true;
+}
+
+/* Absolute UTC time with terminating zero, buf takes 17 bytes */
+inline void format_time(std::time_t t, bin::u8_t * buf) {
+	long y;
+	unsigned f[6];
+	civil_from_days(t / 86400, y, f[1], f[2]);
+	f[0] = y % 100;
+	f[3] = t % 86400 / 3600;
+	f[4] = t % 3600 / 60;
+	f[5] = t % 60;
+	for (int i = 0; i < 6; ++i) {
+		buf[i * 2] = '0' + f[i] / 10;
+		buf[i * 2 + 1] = '0' + f[i] % 10;
+	}
+	buf[12] = '0';
+	buf[13] = '0';
+	buf[14] = '0';
+	buf[15] = '+';
+	buf[16] = '\0';
+}
+
+/* Values held until a second of wall clock time, e.g. messages scheduled
+ * for later delivery or ones to expire at the end of their validity.
+ *
+ * Values due at the same second share one bucket, a vector appended to,
+ * so a campaign of millions of messages costs a few bytes per message
+ * and a bucket per distinct second rather than a timer per message.
+ * Buckets go in order of time, the last one used is kept at hand for
+ * runs of values due at the same second.
+ *
+ * Values are not removed once added: the one who gets them back checks
+ * whether they still matter, e.g. the message is not cancelled or already
+ * delivered. That keeps cancellation free and expiry lazy.
+ *
+ * Not thread safe, meant to be used from message processing thread. */
+template <class ValueT>
+class scheduler {
+	public:
+		scheduler()
+			: m_last(m_buckets.end())
+			, m_size(0)
+		{}
+
+		/* Hold v until second at, past ones come with the next poll */
+		void add(std::time_t at, const ValueT & v) {
+			if (m_last == m_buckets.end() || m_last->first != at) {
+				m_last = m_buckets.insert(std::make_pair(at, std::vector<ValueT>())).first;
+			}
+			m_last->second.push_back(v);
+			m_size++;
+		}
+
+		/* Pass at most max values due by now to f(value), in order
+		 * of seconds. Returns number of values passed. */
+		template <class F>
+		bin::sz_t poll(std::time_t now, bin::sz_t max, F f) {
+			bin::sz_t n = 0;
+			while (n < max && !m_buckets.empty() && m_buckets.begin()->first <= now) {
+				typename buckets_t::iterator it = m_buckets.begin();
+				while (n < max && !it->second.empty()) {
+					ValueT v = it->second.back();
+					it->second.pop_back();
+					m_size--;
+					n++;
+					f(v);
+				}
+				if (it->second.empty()) {
+					if (m_last == it) {
+						m_last = m_buckets.end();
+					}
+					m_buckets.erase(it);
+				}
+			}
+			return n;
+		}
+
+		/* Second the first value is due at, 0 if there are none */
+		std::time_t next() const {
+			return m_buckets.empty() ? 0 : m_buckets.begin()->first;
+		}
+
+		bin::sz_t size() const { return m_size; }
+		bin::sz_t buckets() const { return m_buckets.size(); }
+
+	private:
+		typedef std::map<std::time_t, std::vector<ValueT> > buckets_t;
+
+		buckets_t m_buckets;
+		typename buckets_t::iterator m_last;
+		bin::sz_t m_size;
+};
+
+} } }
+
+#endif
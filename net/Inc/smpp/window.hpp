@@ -0,0 +1,185 @@
+#ifndef smpp_window_hpp
+#define smpp_window_hpp
+
+#include <chrono>
+#include <vector>
+#include <limits>
+#include <toolbox/bin.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Requests sent within one SMPP session and still waiting for response.
+ *
+ * Sequence number of a request is built of its slot index in the lower
+ * bits and slot generation in the upper bits. Response lookup is thus
+ * a masked array access, and a late response to a reused slot is told
+ * apart by comparing the stored sequence number.
+ *
+ * Busy slots are linked in the order they were sent. Every request gets
+ * the same timeout, so the oldest one is always at the head of the list
+ * and expiration costs O(1) per expired request. */
+template <typename ContextT>
+class window {
+	public:
+		typedef ContextT							context_t;
+		typedef std::chrono::steady_clock			clock_t;
+		typedef typename clock_t::time_point		time_point;
+		typedef typename clock_t::duration			duration;
+
+		window(bin::sz_t size, duration timeout)
+			: m_size(size == 0 ? 1 : size)
+			, m_count(0)
+			, m_bits(0)
+			, m_timeout(timeout)
+			, m_head(nil)
+			, m_tail(nil)
+			, m_free(nil)
+		{
+			while ((bin::sz_t(1) << m_bits) < m_size) {
+				m_bits++;
+			}
+			m_slots.resize(bin::sz_t(1) << m_bits);
+			/* Keep lowest slots on top of the free list */
+			for (bin::u32_t i = m_slots.size(); i-- > 0; ) {
+				m_slots[i].next = m_free;
+				m_free = i;
+			}
+		}
+
+		/* Maximum number of requests in flight */
+		bin::sz_t size() const { return m_size; }
+
+		/* Number of requests in flight */
+		bin::sz_t count() const { return m_count; }
+
+		bin::sz_t available() const { return m_size - m_count; }
+
+		bool full() const { return m_count >= m_size; }
+
+		bool empty() const { return m_count == 0; }
+
+		/* Occupy a slot for a new request.
+		 * Returns sequence number to send the request with,
+		 * or 0 if window is full. */
+		bin::u32_t push(const context_t & ctx, time_point now) {
+			if (full()) {
+				return 0;
+			}
+			bin::u32_t idx = m_free;
+			slot & s = m_slots[idx];
+			m_free = s.next;
+
+			s.gen = s.gen >= max_gen() ? 1 : s.gen + 1;
+			s.seqno = (s.gen << m_bits) | idx;
+			s.deadline = now + m_timeout;
+			s.ctx = ctx;
+
+			s.prev = m_tail;
+			s.next = nil;
+			if (m_tail != nil) {
+				m_slots[m_tail].next = idx;
+			} else {
+				m_head = idx;
+			}
+			m_tail = idx;
+			m_count++;
+			return s.seqno;
+		}
+
+		/* Release a slot on response.
+		 * Returns false if seqno is unknown or already released. */
+		bool pop(bin::u32_t seqno, context_t & ctx) {
+			bin::u32_t idx = seqno & mask();
+			if (seqno == 0 || m_slots[idx].seqno != seqno) {
+				return false;
+			}
+			ctx = m_slots[idx].ctx;
+			release(idx);
+			return true;
+		}
+
+		/* Release all requests with deadline before now,
+		 * f(seqno, ctx) is called for each of them */
+		template <typename F>
+		bin::sz_t expire(time_point now, F f) {
+			bin::sz_t n = 0;
+			while (m_head != nil && m_slots[m_head].deadline <= now) {
+				bin::u32_t idx = m_head;
+				bin::u32_t seqno = m_slots[idx].seqno;
+				context_t ctx = m_slots[idx].ctx;
+				release(idx);
+				f(seqno, ctx);
+				n++;
+			}
+			return n;
+		}
+
+		/* Release all requests, f(seqno, ctx) is called for each of them */
+		template <typename F>
+		bin::sz_t clear(F f) {
+			return expire(time_point::max(), f);
+		}
+
+	private:
+		static const bin::u32_t nil = std::numeric_limits<bin::u32_t>::max();
+
+		struct slot {
+			/* 0 for free slot */
+			bin::u32_t seqno;
+			bin::u32_t gen;
+			bin::u32_t prev;
+			bin::u32_t next;
+			time_point deadline;
+			context_t ctx;
+			slot(): seqno(0), gen(0), prev(nil), next(nil), deadline(), ctx() {}
+		};
+
+		bin::sz_t m_size;
+		bin::sz_t m_count;
+		bin::u32_t m_bits;
+		duration m_timeout;
+
+		bin::u32_t m_head;
+		bin::u32_t m_tail;
+		bin::u32_t m_free;
+		std::vector<slot> m_slots;
+
+		bin::u32_t mask() const {
+			return (bin::u32_t(1) << m_bits) - 1;
+		}
+
+		/* Generation never reaches the sign bit,
+		 * as SMPP sequence numbers are limited to 0x7FFFFFFF */
+		bin::u32_t max_gen() const {
+			return 0x7FFFFFFF >> m_bits;
+		}
+
+		void release(bin::u32_t idx) {
+			slot & s = m_slots[idx];
+			if (s.prev != nil) {
+				m_slots[s.prev].next = s.next;
+			} else {
+				m_head = s.next;
+			}
+			if (s.next != nil) {
+				m_slots[s.next].prev = s.prev;
+			} else {
+				m_tail = s.prev;
+			}
+			s.seqno = 0;
+			s.ctx = context_t();
+			s.prev = nil;
+			s.next = m_free;
+			m_free = idx;
+			m_count--;
+		}
+};
+
+template <typename ContextT>
+const bin::u32_t window<ContextT>::nil;
+
+} } }
+
+#endif
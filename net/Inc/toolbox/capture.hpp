@@ -0,0 +1,294 @@
+#ifndef mobi_net_toolbox_capture_hpp
+#define mobi_net_toolbox_capture_hpp
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <toolbox/bin.hpp>
+
+namespace mobi { namespace net { namespace toolbox {
+
+	/* Capture file is a file header followed by records, each a record
+	 * header and len bytes of PDU as it went over the wire. Integers are
+	 * in host byte order, captures are read where they are taken. */
+	struct capture_record {
+		enum event_t: bin::u8_t {
+			/* PDU received by the service */
+			in = 1
+			/* PDU written to the peer */
+			, out = 2
+			/* Channel accepted or connected, closed */
+			, open = 3
+			, close = 4
+		};
+
+		/* Nanoseconds since epoch */
+		bin::u64_t time;
+		bin::u32_t channel;
+		bin::u32_t len;
+		bin::u8_t event;
+		bin::u8_t reserved[7];
+	};
+
+	static_assert(sizeof(capture_record) == 24, "capture record layout");
+
+	struct capture_file_header {
+		char magic[4];
+		bin::u32_t version;
+	};
+
+	/* Records PDUs of a service to a capture file.
+	 *
+	 * Records go to a byte ring in one piece and a writer thread copies
+	 * the ring to the file as is, so nothing on the way is parsed again.
+	 * There is one producer, io thread of the service, which never waits:
+	 * a record not fitting the ring is dropped and counted. The file ends
+	 * at the first write that fails, the capture is truncated then and
+	 * later records are dropped. */
+	class capture {
+		public:
+			static const bin::u32_t version = 1;
+
+			struct stats {
+				bin::u64_t records;
+				bin::u64_t dropped;
+				bin::u64_t bytes;
+				bin::u64_t errors;
+				bool truncated;
+			};
+
+			/* Called once from the writer thread with errno of the
+			 * write which truncated the capture */
+			typedef std::function<void (int err)> error_handler;
+
+			/* Ring of ring_size bytes, rounded up to a power of two */
+			explicit capture(const std::string & path, bin::sz_t ring_size = 64 << 20)
+				: m_path(path)
+				, m_ring(round_up(ring_size))
+				, m_mask(m_ring.size() - 1)
+				, m_head(0)
+				, m_tail(0)
+				, m_tail_cache(0)
+				, m_stop(false)
+				, m_fd(-1)
+				, m_records(0)
+				, m_dropped(0)
+				, m_bytes(0)
+				, m_errors(0)
+				, m_truncated(false)
+			{}
+
+			~capture() {
+				stop();
+			}
+
+			/* Set before start */
+			void set_error_handler(const error_handler & h) {
+				m_on_error = h;
+			}
+
+			/* Create the file and start writing, false if it can not
+			 * be created */
+			bool start() {
+				m_fd = ::open(m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+				if (m_fd < 0) {
+					return false;
+				}
+				capture_file_header h;
+				std::memcpy(h.magic, "MCAP", 4);
+				h.version = version;
+				if (!write_all(reinterpret_cast<const bin::u8_t *>(&h), sizeof(h))) {
+					::close(m_fd);
+					m_fd = -1;
+					return false;
+				}
+				m_thread = std::thread([this] {
+					run();
+				});
+				return true;
+			}
+
+			/* Write what is in the ring and close the file */
+			void stop() {
+				m_stop = true;
+				if (m_thread.joinable()) {
+					m_thread.join();
+				}
+				if (m_fd >= 0) {
+					::fdatasync(m_fd);
+					::close(m_fd);
+					m_fd = -1;
+				}
+			}
+
+			/* Producer thread only */
+			bool add(bin::u32_t channel, capture_record::event_t e
+				, const bin::u8_t * data, bin::sz_t len)
+			{
+				if (m_truncated.load(std::memory_order_relaxed)) {
+					m_dropped.fetch_add(1, std::memory_order_relaxed);
+					return false;
+				}
+				bin::u64_t head = m_head.load(std::memory_order_relaxed);
+				bin::u64_t need = sizeof(capture_record) + len;
+				if (head + need - m_tail_cache > m_ring.size()) {
+					m_tail_cache = m_tail.load(std::memory_order_acquire);
+					if (head + need - m_tail_cache > m_ring.size()) {
+						m_dropped.fetch_add(1, std::memory_order_relaxed);
+						return false;
+					}
+				}
+				capture_record r;
+				r.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::system_clock::now().time_since_epoch()).count();
+				r.channel = channel;
+				r.len = len;
+				r.event = e;
+				std::memset(r.reserved, 0, sizeof(r.reserved));
+				put(head, reinterpret_cast<const bin::u8_t *>(&r), sizeof(r));
+				if (len != 0) {
+					put(head + sizeof(r), data, len);
+				}
+				m_head.store(head + need, std::memory_order_release);
+				m_records.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+
+			stats get_stats() const {
+				stats s;
+				s.records = m_records.load(std::memory_order_relaxed);
+				s.dropped = m_dropped.load(std::memory_order_relaxed);
+				s.bytes = m_bytes.load(std::memory_order_relaxed);
+				s.errors = m_errors.load(std::memory_order_relaxed);
+				s.truncated = m_truncated.load(std::memory_order_relaxed);
+				return s;
+			}
+
+		private:
+			const std::string m_path;
+			std::vector<bin::u8_t> m_ring;
+			const bin::u64_t m_mask;
+			/* Bytes put by the producer and taken by the writer so far */
+			std::atomic<bin::u64_t> m_head;
+			std::atomic<bin::u64_t> m_tail;
+			/* Producer copy of m_tail, refreshed when the ring looks full */
+			bin::u64_t m_tail_cache;
+			std::atomic<bool> m_stop;
+			std::thread m_thread;
+			int m_fd;
+			std::atomic<bin::u64_t> m_records;
+			std::atomic<bin::u64_t> m_dropped;
+			std::atomic<bin::u64_t> m_bytes;
+			std::atomic<bin::u64_t> m_errors;
+			std::atomic<bool> m_truncated;
+			error_handler m_on_error;
+
+			/* Largest write and pause of the writer when the ring is empty */
+			static const bin::sz_t max_write = 1 << 20;
+			static const bin::sz_t idle_ms = 5;
+
+			static bin::sz_t round_up(bin::sz_t n) {
+				bin::sz_t r = 4096;
+				while (r < n) {
+					r <<= 1;
+				}
+				return r;
+			}
+
+			void put(bin::u64_t pos, const bin::u8_t * data, bin::sz_t len) {
+				bin::sz_t off = pos & m_mask;
+				bin::sz_t first = std::min<bin::sz_t>(len, m_ring.size() - off);
+				std::memcpy(&m_ring[off], data, first);
+				std::memcpy(&m_ring[0], data + first, len - first);
+			}
+
+			bool write_all(const bin::u8_t * data, bin::sz_t len) {
+				while (len != 0) {
+					ssize_t n = ::write(m_fd, data, len);
+					if (n < 0) {
+						if (errno == EINTR) {
+							continue;
+						}
+						m_errors.fetch_add(1, std::memory_order_relaxed);
+						return false;
+					}
+					data += n;
+					len -= n;
+					m_bytes.fetch_add(n, std::memory_order_relaxed);
+				}
+				return true;
+			}
+
+			void run() {
+				bin::u64_t tail = m_tail.load(std::memory_order_relaxed);
+				while (true) {
+					/* Stop is checked before head, so records put
+					 * before stop are written */
+					bool stopping = m_stop.load(std::memory_order_acquire);
+					bin::u64_t head = m_head.load(std::memory_order_acquire);
+					if (head == tail) {
+						if (stopping) {
+							return;
+						}
+						std::this_thread::sleep_for(std::chrono::milliseconds(bin::sz_t(idle_ms)));
+						continue;
+					}
+					bin::sz_t off = tail & m_mask;
+					bin::sz_t len = std::min<bin::u64_t>(head - tail, m_ring.size() - off);
+					len = std::min(len, bin::sz_t(max_write));
+					/* Bytes after a failed write would follow a hole
+					 * in the middle of a record, so the file is cut
+					 * short there rather than the service held */
+					if (!write_all(&m_ring[off], len)) {
+						int err = errno;
+						m_truncated.store(true, std::memory_order_relaxed);
+						if (m_on_error) {
+							m_on_error(err);
+						}
+						return;
+					}
+					tail += len;
+					m_tail.store(tail, std::memory_order_release);
+				}
+			}
+	};
+
+	/* Reads records of a capture file one after another */
+	class capture_reader {
+		public:
+			/* False if the file can not be read or is not a capture */
+			bool open(const std::string & path) {
+				m_in.open(path.c_str(), std::ios::binary);
+				capture_file_header h;
+				return m_in.read(reinterpret_cast<char *>(&h), sizeof(h))
+					&& std::memcmp(h.magic, "MCAP", 4) == 0
+					&& h.version == capture::version;
+			}
+
+			/* Next record and its bytes, false at the end of the
+			 * file or of its last complete record */
+			bool next(capture_record & r, std::vector<bin::u8_t> & data) {
+				if (!m_in.read(reinterpret_cast<char *>(&r), sizeof(r))) {
+					return false;
+				}
+				data.resize(r.len);
+				return r.len == 0
+					|| m_in.read(reinterpret_cast<char *>(data.data()), r.len);
+			}
+
+		private:
+			std::ifstream m_in;
+	};
+
+} } }
+
+#endif
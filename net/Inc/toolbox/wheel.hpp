@@ -0,0 +1,169 @@
+#ifndef mobi_net_toolbox_wheel_hpp
+#define mobi_net_toolbox_wheel_hpp
+
+#include <chrono>
+#include <vector>
+#include <toolbox/bin.hpp>
+
+namespace mobi { namespace net { namespace toolbox {
+
+	/* Hashed timer wheel.
+	 *
+	 * Time is cut in ticks, a timer goes to the slot of the tick it is due
+	 * at along with the number of full turns of the wheel left. Timers are
+	 * kept in a pool allocated upfront and linked both ways in their slot,
+	 * so adding and cancelling a timer is O(1) and expiry costs one step
+	 * per timer in the slots passed.
+	 *
+	 * Not thread safe. */
+	template <class ValueT>
+	class timer_wheel {
+		public:
+			typedef std::chrono::steady_clock		clock_t;
+			typedef clock_t::time_point				time_point;
+			typedef clock_t::duration				duration;
+			typedef bin::u32_t						handle;
+
+			static const handle nil = ~static_cast<handle>(0);
+
+			timer_wheel(bin::sz_t capacity, duration tick, bin::sz_t slots, time_point now)
+				: m_tick(tick)
+				, m_start(now)
+				, m_now(0)
+				, m_heads(slots + 1, nil)
+				, m_timers(capacity)
+				, m_free(nil)
+				, m_size(0)
+			{
+				for (bin::sz_t i = capacity; i-- > 0;) {
+					m_timers[i].next = m_free;
+					m_free = i;
+				}
+			}
+
+			/* Timer firing delay from now, not earlier than the next tick.
+			 * Returns nil if the pool is exhausted. */
+			handle add(duration delay, const ValueT & v, time_point now) {
+				if (m_free == nil) {
+					return nil;
+				}
+				duration at = (now > m_start ? now - m_start : duration(0)) + delay;
+				bin::u64_t ticks = (at + m_tick - duration(1)) / m_tick;
+				ticks = ticks > m_now ? ticks - m_now : 1;
+				handle h = m_free;
+				timer & t = m_timers[h];
+				m_free = t.next;
+				t.value = v;
+				t.rounds = (ticks - 1) / slots();
+				link(h, (m_now + ticks) % slots());
+				m_size++;
+				return h;
+			}
+
+			bool cancel(handle h) {
+				if (h >= m_timers.size() || m_timers[h].slot == nil) {
+					return false;
+				}
+				unlink(h);
+				release(h);
+				return true;
+			}
+
+			/* Pass values of timers due by now to f(value). Timers may be
+			 * added and cancelled from f. Returns number of timers fired. */
+			template <class F>
+			bin::sz_t expire(time_point now, F f) {
+				bin::u64_t target = now > m_start ? (now - m_start) / m_tick : 0;
+				const bin::sz_t due = slots();
+				while (m_now < target) {
+					m_now++;
+					handle h = m_heads[m_now % slots()];
+					while (h != nil) {
+						handle next = m_timers[h].next;
+						if (m_timers[h].rounds == 0) {
+							unlink(h);
+							link(h, due);
+						} else {
+							m_timers[h].rounds--;
+						}
+						h = next;
+					}
+				}
+				bin::sz_t n = 0;
+				while (m_heads[due] != nil) {
+					handle h = m_heads[due];
+					unlink(h);
+					ValueT v = m_timers[h].value;
+					release(h);
+					f(v);
+					n++;
+				}
+				return n;
+			}
+
+			bin::sz_t size() const { return m_size; }
+			bin::sz_t capacity() const { return m_timers.size(); }
+
+		private:
+			struct timer {
+				ValueT value;
+				handle prev;
+				handle next;
+				/* List the timer is in, nil when free */
+				handle slot;
+				bin::u32_t rounds;
+
+				timer(): prev(nil), next(nil), slot(nil), rounds(0) {}
+			};
+
+			const duration m_tick;
+			const time_point m_start;
+			/* Ticks since start processed */
+			bin::u64_t m_now;
+			/* Slot lists, and the one of timers due */
+			std::vector<handle> m_heads;
+			std::vector<timer> m_timers;
+			handle m_free;
+			bin::sz_t m_size;
+
+			bin::sz_t slots() const {
+				return m_heads.size() - 1;
+			}
+
+			void link(handle h, bin::sz_t slot) {
+				timer & t = m_timers[h];
+				t.slot = slot;
+				t.prev = nil;
+				t.next = m_heads[slot];
+				if (t.next != nil) {
+					m_timers[t.next].prev = h;
+				}
+				m_heads[slot] = h;
+			}
+
+			void unlink(handle h) {
+				timer & t = m_timers[h];
+				if (t.prev != nil) {
+					m_timers[t.prev].next = t.next;
+				} else {
+					m_heads[t.slot] = t.next;
+				}
+				if (t.next != nil) {
+					m_timers[t.next].prev = t.prev;
+				}
+				t.slot = nil;
+			}
+
+			void release(handle h) {
+				m_timers[h].next = m_free;
+				m_free = h;
+				m_size--;
+			}
+	};
+
+	template <class ValueT>
+	const typename timer_wheel<ValueT>::handle timer_wheel<ValueT>::nil;
+
+} } }
+
+#endif
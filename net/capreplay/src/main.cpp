@@ -0,0 +1,341 @@
+#include <map>
+#include <deque>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <toolbox/capture.hpp>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/program_options.hpp>
+
+namespace local {
+
+	using namespace mobi::net;
+	namespace ba = boost::asio;
+	namespace bs = boost::system;
+	namespace bin = toolbox::bin;
+
+	typedef ba::ip::tcp::endpoint endpoint_t;
+	typedef std::chrono::steady_clock clock;
+
+	struct totals {
+		std::size_t sessions;
+		std::size_t failed;
+		std::size_t pdus;
+		std::size_t skipped;
+		std::size_t sent;
+		std::size_t received;
+		clock::duration max_lag;
+
+		totals(): sessions(0), failed(0), pdus(0), skipped(0)
+			, sent(0), received(0), max_lag(0) {}
+	};
+
+	/* Connection sending what one captured channel received,
+	 * replies are read and counted only */
+	class session: public std::enable_shared_from_this<session> {
+		public:
+			session(ba::io_service & io, totals & t)
+				: m_sock(io)
+				, T(t)
+				, m_connected(false)
+				, m_writing(false)
+				, m_closing(false)
+				, m_failed(false)
+			{}
+
+			void connect(const endpoint_t & ep) {
+				std::shared_ptr<session> self = shared_from_this();
+				m_sock.async_connect(ep, [self] (const bs::error_code & ec) {
+					if (ec) {
+						self->fail();
+						return;
+					}
+					self->m_connected = true;
+					self->read();
+					self->write();
+				});
+			}
+
+			void send(const std::vector<bin::u8_t> & pdu) {
+				if (!m_failed) {
+					m_out.push_back(pdu);
+					write();
+				}
+			}
+
+			/* Stop sending once what is queued is written */
+			void close() {
+				m_closing = true;
+				write();
+			}
+
+			void abort() {
+				bs::error_code ec;
+				m_sock.close(ec);
+			}
+
+		private:
+			ba::ip::tcp::socket m_sock;
+			totals & T;
+			std::deque<std::vector<bin::u8_t> > m_out;
+			bin::u8_t m_in[4096];
+			bool m_connected;
+			bool m_writing;
+			bool m_closing;
+			bool m_failed;
+
+			void fail() {
+				if (!m_failed) {
+					m_failed = true;
+					T.failed++;
+				}
+				m_out.clear();
+				abort();
+			}
+
+			void write() {
+				if (!m_connected || m_writing || m_failed) {
+					return;
+				}
+				if (m_out.empty()) {
+					if (m_closing) {
+						bs::error_code ec;
+						m_sock.shutdown(ba::ip::tcp::socket::shutdown_send, ec);
+					}
+					return;
+				}
+				m_writing = true;
+				std::shared_ptr<session> self = shared_from_this();
+				ba::async_write(m_sock, ba::buffer(m_out.front())
+					, [self] (const bs::error_code & ec, std::size_t n) {
+						self->m_writing = false;
+						if (ec) {
+							self->fail();
+							return;
+						}
+						self->T.pdus++;
+						self->T.sent += n;
+						self->m_out.pop_front();
+						self->write();
+					});
+			}
+
+			void read() {
+				std::shared_ptr<session> self = shared_from_this();
+				m_sock.async_read_some(ba::buffer(m_in)
+					, [self] (const bs::error_code & ec, std::size_t n) {
+						if (!ec) {
+							self->T.received += n;
+							self->read();
+						}
+					});
+			}
+	};
+
+	/* Plays records of a capture against ep, a record is due
+	 * at its offset from the first one divided by speed */
+	class player {
+		public:
+			player(ba::io_service & io, toolbox::capture_reader & r
+				, const endpoint_t & ep, double speed, clock::duration linger)
+				: m_io(io)
+				, m_reader(r)
+				, m_ep(ep)
+				, m_speed(speed)
+				, m_linger(linger)
+				, m_timer(io)
+				, m_first(true)
+				, m_t0(0)
+				, m_pending(false)
+			{}
+
+			void start() {
+				m_start = clock::now();
+				m_io.post([this] {
+					next();
+				});
+			}
+
+			const totals & get_totals() const {
+				return T;
+			}
+
+		private:
+			/* Records played before others in io queue get their turn */
+			static const std::size_t batch = 64;
+
+			ba::io_service & m_io;
+			toolbox::capture_reader & m_reader;
+			const endpoint_t m_ep;
+			const double m_speed;
+			const clock::duration m_linger;
+			ba::steady_timer m_timer;
+			clock::time_point m_start;
+			bool m_first;
+			bin::u64_t m_t0;
+			/* m_rec is read and waits for its time */
+			bool m_pending;
+			toolbox::capture_record m_rec;
+			std::vector<bin::u8_t> m_data;
+			std::map<bin::u32_t, std::shared_ptr<session> > m_open;
+			std::vector<std::shared_ptr<session> > m_all;
+			totals T;
+
+			clock::time_point due() const {
+				if (m_speed <= 0 || m_rec.time <= m_t0) {
+					return m_start;
+				}
+				std::chrono::nanoseconds offset(static_cast<bin::u64_t>((m_rec.time - m_t0) / m_speed));
+				return m_start + std::chrono::duration_cast<clock::duration>(offset);
+			}
+
+			void next() {
+				for (std::size_t n = 0; n < batch; ++n) {
+					if (!m_pending) {
+						if (!m_reader.next(m_rec, m_data)) {
+							finish();
+							return;
+						}
+						if (m_first) {
+							m_t0 = m_rec.time;
+							m_first = false;
+						}
+						m_pending = true;
+					}
+					clock::time_point at = due();
+					clock::time_point now = clock::now();
+					if (at > now) {
+						m_timer.expires_at(at);
+						m_timer.async_wait([this] (const bs::error_code & ec) {
+							if (!ec) {
+								next();
+							}
+						});
+						return;
+					}
+					T.max_lag = std::max(T.max_lag, now - at);
+					m_pending = false;
+					play();
+				}
+				m_io.post([this] {
+					next();
+				});
+			}
+
+			std::shared_ptr<session> open() {
+				std::shared_ptr<session> s = std::make_shared<session>(m_io, T);
+				s->connect(m_ep);
+				m_open[m_rec.channel] = s;
+				m_all.push_back(s);
+				T.sessions++;
+				return s;
+			}
+
+			void play() {
+				std::map<bin::u32_t, std::shared_ptr<session> >::iterator it
+					= m_open.find(m_rec.channel);
+				switch (m_rec.event) {
+					case toolbox::capture_record::open:
+						if (it != m_open.end()) {
+							it->second->close();
+						}
+						open();
+						break;
+					case toolbox::capture_record::in:
+						/* Capture started with the channel open already */
+						(it != m_open.end() ? it->second : open())->send(m_data);
+						break;
+					case toolbox::capture_record::close:
+						if (it != m_open.end()) {
+							it->second->close();
+							m_open.erase(it);
+						}
+						break;
+					case toolbox::capture_record::out:
+					default:
+						T.skipped++;
+						break;
+				}
+			}
+
+			/* Let the peer reply, then drop what is still open */
+			void finish() {
+				for (const std::pair<const bin::u32_t, std::shared_ptr<session> > & s: m_open) {
+					s.second->close();
+				}
+				m_open.clear();
+				m_timer.expires_from_now(m_linger);
+				m_timer.async_wait([this] (const bs::error_code &) {
+					for (const std::shared_ptr<session> & s: m_all) {
+						s->abort();
+					}
+					m_all.clear();
+				});
+			}
+	};
+
+}
+
+int main(int argc, char ** argv)
+{
+	using namespace mobi::net;
+	namespace po = boost::program_options;
+
+	po::options_description options("Options");
+	options.add_options()
+		("help", "Produce help messages")
+		("capture", po::value<std::string>()
+			, "Capture file written by a service, e.g. smppd --capture")
+		("host", po::value<std::string>()->default_value("127.0.0.1")
+			, "Address of the service to replay to")
+		("port", po::value<unsigned short>()->default_value(5555)
+			, "Port of the service to replay to")
+		("speed", po::value<double>()->default_value(1.0)
+			, "Replay at this many times the captured rate, 0 for as fast as possible")
+		("linger-ms", po::value<std::size_t>()->default_value(1000)
+			, "Time to read replies after the last record before connections are dropped")
+	;
+
+	po::variables_map opts;
+	po::store(po::parse_command_line(argc, argv, options), opts);
+
+	if (opts.count("help") || !opts.count("capture")) {
+		std::cout << options << std::endl;
+		return 1;
+	}
+
+	const std::string & path = opts["capture"].as<std::string>();
+	toolbox::capture_reader reader;
+	if (!reader.open(path)) {
+		std::cerr << "can not read capture " << path << std::endl;
+		return 1;
+	}
+
+	try {
+		boost::asio::io_service io;
+		local::endpoint_t ep(boost::asio::ip::address::from_string(opts["host"].as<std::string>())
+			, opts["port"].as<unsigned short>());
+		local::player p(io, reader, ep, opts["speed"].as<double>()
+			, std::chrono::milliseconds(opts["linger-ms"].as<std::size_t>()));
+		local::clock::time_point started = local::clock::now();
+		p.start();
+		io.run();
+		double elapsed = std::chrono::duration<double>(local::clock::now() - started).count();
+		const local::totals & t = p.get_totals();
+		std::cout << t.sessions << " sessions, " << t.failed << " failed, "
+			<< t.pdus << " pdus, " << t.sent << " bytes sent, "
+			<< t.received << " bytes received, " << t.skipped << " records skipped, "
+			<< "max lag " << std::chrono::duration_cast<std::chrono::milliseconds>(t.max_lag).count()
+			<< " ms, " << elapsed << " s" << std::endl;
+	} catch (const std::exception & e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include <smpp/portability.hpp>
+
+#include <boost/program_options.hpp>
+
+int main(int argc, char ** argv)
+{
+	using namespace mobi::net;
+	namespace po = boost::program_options;
+
+	po::options_description options("Options");
+	options.add_options()
+		("help", "Produce help messages")
+		("input", po::value<std::string>()
+			, "Ported numbers, a number and the routing number of its operator per line, - for stdin")
+		("output", po::value<std::string>()
+			, "Database file to write, replaced as a whole")
+	;
+
+	po::variables_map opts;
+	po::store(po::parse_command_line(argc, argv, options), opts);
+
+	if (opts.count("help") || !opts.count("input") || !opts.count("output")) {
+		std::cout << options << std::endl;
+		return 1;
+	}
+
+	std::string input = opts["input"].as<std::string>();
+	std::ifstream file;
+	if (input != "-") {
+		file.open(input.c_str());
+		if (!file) {
+			std::cerr << "can not open " << input << std::endl;
+			return 1;
+		}
+	}
+	std::istream & in = input == "-" ? std::cin : file;
+
+	smpp::np_builder b;
+	std::string line;
+	std::size_t n = 0;
+	std::size_t skipped = 0;
+	while (std::getline(in, line)) {
+		n++;
+		/* Commas separate fields as well as blanks */
+		for (char & c: line) {
+			if (c == ',' || c == ';') {
+				c = ' ';
+			}
+		}
+		std::istringstream fields(line);
+		std::string number, op;
+		if (!(fields >> number) || number[0] == '#') {
+			continue;
+		}
+		if (!(fields >> op) || !b.add(number, op)) {
+			std::cerr << input << ":" << n << ": malformed line skipped" << std::endl;
+			skipped++;
+		}
+	}
+
+	if (!b.write(opts["output"].as<std::string>())) {
+		std::cerr << "can not write " << opts["output"].as<std::string>() << std::endl;
+		return 1;
+	}
+
+	smpp::np_database db;
+	if (!db.open(opts["output"].as<std::string>())) {
+		std::cerr << "can not read back " << opts["output"].as<std::string>() << std::endl;
+		return 1;
+	}
+	std::cout << db.numbers() << " numbers of " << db.operators() << " operators, "
+		<< db.size() << " bytes, " << skipped << " lines skipped" << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,191 @@
+#ifndef smpp_dedup_hpp
+#define smpp_dedup_hpp
+
+#include <chrono>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <toolbox/bin.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Hash of message fields fed one after another, 8 bytes per step.
+ * Field lengths go in as well, so "ab" + "c" and "a" + "bc" differ. */
+class dedup_hash {
+	public:
+		explicit dedup_hash(bin::u64_t seed = 0)
+			: m_h(seed ^ 0x243F6A8885A308D3ull)
+		{}
+
+		void add(const bin::u8_t * p, bin::sz_t len) {
+			mix(len);
+			for (; len >= 8; p += 8, len -= 8) {
+				bin::u64_t w;
+				std::memcpy(&w, p, 8);
+				mix(w);
+			}
+			if (len != 0) {
+				bin::u64_t w = 0;
+				std::memcpy(&w, p, len);
+				mix(w);
+			}
+		}
+
+		bin::u64_t value() const {
+			bin::u64_t h = m_h;
+			h ^= h >> 33;
+			h *= 0xFF51AFD7ED558CCDull;
+			h ^= h >> 33;
+			h *= 0xC4CEB9FE1A85EC53ull;
+			h ^= h >> 33;
+			return h;
+		}
+
+	private:
+		bin::u64_t m_h;
+
+		void mix(bin::u64_t w) {
+			m_h = (m_h ^ w) * 0x9E3779B97F4A7C15ull;
+			m_h ^= m_h >> 29;
+		}
+};
+
+/* Hashes of messages seen lately, answering "maybe" or "surely not".
+ *
+ * Blocked Bloom filters: a hash sets 7 bits in one 64 byte block, so a
+ * check reads one cache line per filter. Time is cut in spans of window
+ * / (generations - 1), each span has a filter of its own and a check
+ * looks at all of them, so a hash is remembered at least window long.
+ * Once a span is over the oldest filter is dropped and a spare one,
+ * cleared meanwhile a part per maintain call, takes new hashes. Memory
+ * is fixed, split evenly among the filters; false positive rate grows
+ * with the number of hashes per span. Spans are a second at least.
+ *
+ * Not thread safe, meant to be used from message processing thread. */
+class dedup_filter {
+	public:
+		typedef std::chrono::steady_clock		clock_t;
+		typedef clock_t::time_point				time_point;
+		typedef clock_t::duration				duration;
+
+		/* Filters checked, one more is being cleared */
+		static const bin::sz_t generations = 4;
+
+		dedup_filter(bin::sz_t memory, duration window, time_point now)
+			: m_blocks(std::max<bin::sz_t>(memory / (generations + 1) / sizeof(block), 1))
+			, m_span(std::max<duration>(window / (generations - 1), std::chrono::seconds(1)))
+			, m_filters((generations + 1) * m_blocks)
+			, m_current(0)
+			, m_cleared(m_blocks)
+			, m_rotate_at(now + m_span)
+			, m_checked(0)
+			, m_hits(0)
+		{}
+
+		/* Whether h may have been seen within window, it is added
+		 * either way */
+		bool check(bin::u64_t h, time_point now) {
+			rotate(now);
+			m_checked++;
+			bin::sz_t b = block_of(h);
+			bin::u64_t bits[8];
+			mask(h, bits);
+			bool hit = false;
+			for (bin::sz_t g = 0; g < generations && !hit; ++g) {
+				hit = contains(filter(g)[b], bits);
+			}
+			block & cur = filter(0)[b];
+			for (int i = 0; i < 8; ++i) {
+				cur.w[i] |= bits[i];
+			}
+			if (hit) {
+				m_hits++;
+			}
+			return hit;
+		}
+
+		/* Clear up to max_bytes more of the spare filter */
+		void maintain(time_point now, bin::sz_t max_bytes) {
+			rotate(now);
+			clear(std::max<bin::sz_t>(max_bytes / sizeof(block), 1));
+		}
+
+		/* Bytes taken by the filters */
+		bin::sz_t memory() const { return m_filters.size() * sizeof(block); }
+		bin::sz_t checked() const { return m_checked; }
+		/* Checks answered "maybe" */
+		bin::sz_t hits() const { return m_hits; }
+
+	private:
+		struct block {
+			bin::u64_t w[8];
+		};
+
+		const bin::sz_t m_blocks;
+		const duration m_span;
+		std::vector<block> m_filters;
+		/* Filter taking new hashes, the ones before it are older */
+		bin::sz_t m_current;
+		/* Blocks of the spare filter cleared so far */
+		bin::sz_t m_cleared;
+		time_point m_rotate_at;
+		bin::sz_t m_checked;
+		bin::sz_t m_hits;
+
+		/* Filter g spans back from the current one, generations is the spare */
+		block * filter(bin::sz_t g) {
+			bin::sz_t i = (m_current + generations + 1 - g) % (generations + 1);
+			return &m_filters[i * m_blocks];
+		}
+
+		bin::sz_t block_of(bin::u64_t h) const {
+			return static_cast<bin::sz_t>(((h >> 32) * m_blocks) >> 32);
+		}
+
+		/* 7 bits of 512 taken 9 bits of hash each */
+		static void mask(bin::u64_t h, bin::u64_t * bits) {
+			std::memset(bits, 0, 8 * sizeof(bin::u64_t));
+			bin::u64_t x = h * 0x9E3779B97F4A7C15ull;
+			for (int i = 0; i < 7; ++i, x >>= 9) {
+				bin::sz_t bit = x & 511;
+				bits[bit >> 6] |= 1ull << (bit & 63);
+			}
+		}
+
+		static bool contains(const block & b, const bin::u64_t * bits) {
+			for (int i = 0; i < 8; ++i) {
+				if ((b.w[i] & bits[i]) != bits[i]) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		void clear(bin::sz_t n) {
+			n = std::min(n, m_blocks - m_cleared);
+			if (n != 0) {
+				std::memset(filter(generations) + m_cleared, 0, n * sizeof(block));
+				m_cleared += n;
+			}
+		}
+
+		/* Spare filter becomes current and the oldest one the spare,
+		 * spans passed with no checks at all are caught up at once */
+		void rotate(time_point now) {
+			for (bin::sz_t i = 0; now >= m_rotate_at && i <= generations; ++i) {
+				clear(m_blocks);
+				m_current = (m_current + 1) % (generations + 1);
+				m_cleared = 0;
+				m_rotate_at += m_span;
+			}
+			if (now >= m_rotate_at) {
+				m_rotate_at = now + m_span;
+			}
+		}
+};
+
+} } }
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef smpp_fanout_hpp
+#define smpp_fanout_hpp
+
+#include <cstring>
+#include <algorithm>
+#include <toolbox/bin.hpp>
+#include <smpp/proto.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Lives next to PDU structures it refers to */
+namespace {
+
+/* One destination of submit_multi_sm. Message body is the one of the
+ * original PDU, every recipient points to it instead of holding a copy. */
+class recipient {
+	public:
+		recipient(const submit_multi_sm & msg)
+			: m_msg(msg)
+			, m_dst(nullptr)
+		{
+			if (msg.msg_payload.tag == option::msg_payload) {
+				m_data = msg.msg_payload.val;
+				m_len = msg.msg_payload.len;
+			} else {
+				m_data = msg.short_msg;
+				m_len = msg.short_msg_len;
+			}
+		}
+
+		const submit_multi_sm & msg() const { return m_msg; }
+		const dst_addr & dst() const { return *m_dst; }
+
+		bool is_sme() const { return m_dst->dst_flag == dst_addr::sme; }
+
+		/* Message body shared by all recipients */
+		const bin::u8_t * data() const { return m_data; }
+		bin::sz_t len() const { return m_len; }
+
+		/* Make submit_sm to the recipient. Body goes in msg_payload
+		 * pointing to the shared one, so it must outlive sm. */
+		void fill(submit_sm & sm) const {
+			const submit_multi_sm & m = m_msg;
+			std::memcpy(sm.serv_type, m.serv_type, m.serv_type_len);
+			sm.serv_type_len = m.serv_type_len;
+			sm.src_addr_ton = m.src_addr_ton;
+			sm.src_addr_npi = m.src_addr_npi;
+			std::memcpy(sm.src_addr, m.src_addr, m.src_addr_len);
+			sm.src_addr_len = m.src_addr_len;
+			sm.dst_addr_ton = m_dst->sme_addr.dst_addr_ton;
+			sm.dst_addr_npi = m_dst->sme_addr.dst_addr_npi;
+			std::memcpy(sm.dst_addr, m_dst->sme_addr.dst_addr
+				, m_dst->sme_addr.dst_addr_len);
+			sm.dst_addr_len = m_dst->sme_addr.dst_addr_len;
+			sm.esm_class = m.esm_class;
+			sm.protocol_id = m.protocol_id;
+			sm.priority_flag = m.priority_flag;
+			sm.schedule_delivery_time_len = copy_time(sm.schedule_delivery_time
+				, m.schedule_delivery_time);
+			sm.validity_period_len = copy_time(sm.validity_period
+				, m.validity_period);
+			sm.registered_delivery = m.registered_delivery;
+			sm.replace_if_present_flag = m.replace_if_present_flag;
+			sm.data_coding = m.data_coding;
+			sm.sm_default_msg_id = m.sm_default_msg_id;
+			sm.short_msg_len = 0;
+			sm.msg_payload.set(m_data, m_len);
+
+			sm.user_msg_reference = m.user_msg_reference;
+			sm.src_port = m.src_port;
+			sm.src_addr_subunit = m.src_addr_subunit;
+			sm.dst_port = m.dst_port;
+			sm.dst_addr_subunit = m.dst_addr_subunit;
+			sm.sar_msg_ref_num = m.sar_msg_ref_num;
+			sm.sar_total_segments = m.sar_total_segments;
+			sm.sar_segment_seqnum = m.sar_segment_seqnum;
+			sm.payload_type = m.payload_type;
+			sm.privacy_ind = m.privacy_ind;
+			sm.callback_num = m.callback_num;
+			sm.callback_num_pres_ind = m.callback_num_pres_ind;
+			sm.callback_num_atag = m.callback_num_atag;
+			sm.src_subaddr = m.src_subaddr;
+			sm.dst_subaddr = m.dst_subaddr;
+			sm.display_time = m.display_time;
+			sm.sms_signal = m.sms_signal;
+			sm.ms_validity = m.ms_validity;
+			sm.ms_msg_wait_fclts = m.ms_msg_wait_fclts;
+			sm.alert_on_msg_delivery = m.alert_on_msg_delivery;
+			sm.lang_ind = m.lang_ind;
+		}
+
+	private:
+		template <typename F>
+		friend bin::sz_t fanout(const submit_multi_sm &, submit_multi_r &, F);
+
+		const submit_multi_sm & m_msg;
+		const dst_addr * m_dst;
+		const bin::u8_t * m_data;
+		bin::sz_t m_len;
+
+		/* Time fields of submit_multi_sm are either empty or full */
+		static bin::sz_t copy_time(bin::u8_t * dst, const bin::u8_t * src) {
+			bin::sz_t len = src[0] == '\0' ? 1 : 17;
+			std::memcpy(dst, src, len);
+			return len;
+		}
+};
+
+/* Pass every destination of msg to route, which returns command status
+ * of the destination. Failed destinations are reported in r, the rest
+ * of r is left to the caller. Returns number of accepted destinations. */
+template <typename F>
+bin::sz_t fanout(const submit_multi_sm & msg, submit_multi_r & r, F route) {
+	recipient rcpt(msg);
+	bin::sz_t accepted = 0;
+	r.no_unsuccess = 0;
+	for (bin::sz_t i = 0; i < msg.num_of_dsts; ++i) {
+		const dst_addr & d = msg.dst_addrs[i];
+		rcpt.m_dst = &d;
+		bin::u32_t status = route(static_cast<const recipient &>(rcpt));
+		if (status == command_status::esme_rok) {
+			accepted++;
+			continue;
+		}
+		unsuccess_smes & u = r.unsuccess_sme[r.no_unsuccess++];
+		u.error_status_code = status;
+		if (d.dst_flag == dst_addr::sme) {
+			u.dst_addr_ton = d.sme_addr.dst_addr_ton;
+			u.dst_addr_npi = d.sme_addr.dst_addr_npi;
+			u.dst_addr_len = d.sme_addr.dst_addr_len;
+			std::memcpy(u.dst_addr, d.sme_addr.dst_addr, u.dst_addr_len);
+		} else {
+			/* Distribution list is reported by its name */
+			u.dst_addr_ton = 0;
+			u.dst_addr_npi = 0;
+			u.dst_addr_len = std::min(d.dlist_name.value_len, sizeof(u.dst_addr));
+			std::memcpy(u.dst_addr, d.dlist_name.value, u.dst_addr_len);
+		}
+	}
+	return accepted;
+}
+
+}
+
+} } }
+
+#endif
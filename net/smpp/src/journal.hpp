@@ -0,0 +1,641 @@
+#ifndef smpp_journal_hpp
+#define smpp_journal_hpp
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <toolbox/bin.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Append only journal of accepted messages.
+ *
+ * Records go to memory mapped segment files of fixed size named by
+ * their sequence numbers. A message is kept as the raw PDU it came in,
+ * its delivery is recorded by a tombstone with the message id. Record
+ * position is its log sequence number (LSN): segment number in the high
+ * 32 bits and offset past the record in the low ones.
+ *
+ * Background thread syncs written records in groups: the first unsynced
+ * record waits at most the latency budget, records appended meanwhile
+ * share its sync. A record is durable once committed() reaches its LSN.
+ * The same thread compacts the journal: the oldest segment, once sealed
+ * and mostly dead, has its live records copied to the head and is
+ * removed along with its tombstones, as records they cancel may only be
+ * in the same or older segments. */
+class journal {
+	public:
+		typedef std::chrono::steady_clock clock_t;
+		typedef std::function<void (bin::u64_t lsn)> commit_handler;
+		typedef std::function<void (bin::u32_t failures)> failure_handler;
+
+		enum record_t: bin::u8_t {
+			accepted = 1
+			, tombstone = 2
+		};
+
+		/* Length and type, CRC32 of the rest, message id */
+		static const bin::sz_t header_size = 16;
+		static const bin::sz_t default_segment_size = 64 << 20;
+		/* Sync without waiting for the budget once that much is written */
+		static const bin::sz_t max_batch_bytes = 1 << 20;
+		/* Oldest segment is compacted when live records make less
+		 * than that percent of those accepted there */
+		static const bin::sz_t compact_percent = 25;
+		/* Failed syncs are retried after a wait doubling from the
+		 * budget, up to that many milliseconds */
+		static const bin::sz_t max_backoff_ms = 1000;
+
+		journal(const journal &) = delete;
+		journal & operator=(const journal &) = delete;
+
+		journal(const std::string & dir
+				, bin::sz_t segment_size = default_segment_size
+				, clock_t::duration budget = std::chrono::milliseconds(2))
+			: m_dir(dir)
+			, m_segment_size(segment_size)
+			, m_budget(budget)
+			, m_page(sysconf(_SC_PAGESIZE))
+			, m_spare(nullptr)
+			, m_preparing(false)
+			, m_written(0)
+			, m_dirty_bytes(0)
+			, m_failures(0)
+			, m_stop(false)
+			, m_committed(0)
+		{}
+
+		~journal() {
+			stop();
+			std::unique_lock<std::mutex> lock(m_mtx);
+			m_on_commit = commit_handler();
+			m_on_failure = failure_handler();
+			sync(lock);
+			for (segment * s: m_segs) {
+				close(s);
+			}
+			if (m_spare != nullptr) {
+				std::string p = path(m_spare->seq);
+				close(m_spare);
+				std::remove(p.c_str());
+			}
+		}
+
+		/* Load existing segments and pass live records to f(id, pdu, len)
+		 * in the order they were written. Call once, before start. */
+		template <class F>
+		bool open(F f) {
+			std::vector<bin::u32_t> seqs;
+			if (!list(seqs)) {
+				return false;
+			}
+			std::lock_guard<std::mutex> lock(m_mtx);
+			for (bin::u32_t seq: seqs) {
+				segment * s = map(seq, false);
+				if (s == nullptr) {
+					return false;
+				}
+				m_segs.push_back(s);
+				scan(s);
+			}
+			for (segment * s: m_segs) {
+				for (bin::sz_t off = 0; off < s->used;) {
+					record r = read(s, off);
+					if (r.size == 0) {
+						break;
+					}
+					off += r.size;
+					auto it = m_index.find(r.id);
+					if (r.type == accepted && it != m_index.end()
+							&& it->second == lsn(s->seq, off)) {
+						f(r.id, r.data, r.len);
+					}
+				}
+			}
+			if (!m_segs.empty()) {
+				m_written = lsn(m_segs.back()->seq, m_segs.back()->used);
+			}
+			m_committed.store(m_written);
+			return true;
+		}
+
+		/* Start background sync and compaction. Handlers are called
+		 * from that thread with LSN committed so far, and with the
+		 * number of syncs failed in a row after each failed one. */
+		void start(commit_handler f = commit_handler()
+				, failure_handler e = failure_handler()) {
+			m_on_commit = f;
+			m_on_failure = e;
+			m_stop = false;
+			m_thread = std::thread([this] {
+				run();
+			});
+		}
+
+		void stop() {
+			{
+				std::lock_guard<std::mutex> lock(m_mtx);
+				m_stop = true;
+				m_cond.notify_one();
+			}
+			if (m_thread.joinable()) {
+				m_thread.join();
+			}
+		}
+
+		/* Keep raw PDU of an accepted message. Returns LSN, 0 on failure. */
+		bin::u64_t append(bin::u64_t id, const bin::u8_t * pdu, bin::sz_t len) {
+			std::unique_lock<std::mutex> lock(m_mtx);
+			return write(lock, accepted, id, pdu, len);
+		}
+
+		/* Message is done with, e.g. delivered or cancelled.
+		 * Returns LSN of the tombstone, 0 if message is unknown. */
+		bin::u64_t remove(bin::u64_t id) {
+			std::unique_lock<std::mutex> lock(m_mtx);
+			if (m_index.find(id) == m_index.end()) {
+				return 0;
+			}
+			return write(lock, tombstone, id, nullptr, 0);
+		}
+
+		/* Records up to that LSN are on disk */
+		bin::u64_t committed() const {
+			return m_committed.load(std::memory_order_acquire);
+		}
+
+		/* Number of messages without tombstones */
+		bin::sz_t live() {
+			std::lock_guard<std::mutex> lock(m_mtx);
+			return m_index.size();
+		}
+
+		bin::sz_t segments() {
+			std::lock_guard<std::mutex> lock(m_mtx);
+			return m_segs.size();
+		}
+
+	private:
+		struct segment {
+			bin::u32_t seq;
+			int fd;
+			bin::u8_t * data;
+			bin::sz_t size;
+			/* Written and synced bytes */
+			bin::sz_t used;
+			bin::sz_t synced;
+			/* Accepted records, and those without newer copy or tombstone */
+			bin::sz_t accepted;
+			bin::sz_t live;
+		};
+
+		struct record {
+			record_t type;
+			bin::u64_t id;
+			const bin::u8_t * data;
+			bin::sz_t len;
+			/* Aligned size taken in segment, 0 past the last record */
+			bin::sz_t size;
+		};
+
+		struct range {
+			segment * seg;
+			bin::sz_t from;
+			bin::sz_t to;
+		};
+
+		const std::string m_dir;
+		const bin::sz_t m_segment_size;
+		const clock_t::duration m_budget;
+		const bin::sz_t m_page;
+
+		/* Guards everything below but m_committed */
+		std::mutex m_mtx;
+		std::condition_variable m_cond;
+		std::deque<segment *> m_segs;
+		/* Preallocated segment to roll over to,
+		 * and whether one is being made */
+		segment * m_spare;
+		bool m_preparing;
+		std::condition_variable m_prepared;
+		/* LSN of the latest record of every live message */
+		std::unordered_map<bin::u64_t, bin::u64_t> m_index;
+		bin::u64_t m_written;
+		bin::sz_t m_dirty_bytes;
+		clock_t::time_point m_dirty_since;
+		/* Syncs failed in a row */
+		bin::u32_t m_failures;
+		bool m_stop;
+		std::vector<range> m_ranges;
+
+		std::atomic<bin::u64_t> m_committed;
+		commit_handler m_on_commit;
+		failure_handler m_on_failure;
+		std::thread m_thread;
+
+		static bin::u64_t lsn(bin::u32_t seq, bin::sz_t off) {
+			return static_cast<bin::u64_t>(seq) << 32 | off;
+		}
+
+		static bin::sz_t align(bin::sz_t n) {
+			return (n + 7) & ~static_cast<bin::sz_t>(7);
+		}
+
+		static bin::u32_t crc32(bin::u32_t crc, const bin::u8_t * p, bin::sz_t len) {
+			struct table {
+				bin::u32_t v[256];
+				table() {
+					for (bin::u32_t i = 0; i < 256; ++i) {
+						bin::u32_t c = i;
+						for (int k = 0; k < 8; ++k) {
+							c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+						}
+						v[i] = c;
+					}
+				}
+			};
+			static const table t;
+			crc = ~crc;
+			while (len--) {
+				crc = t.v[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+			}
+			return ~crc;
+		}
+
+		std::string path(bin::u32_t seq) const {
+			char name[16];
+			std::snprintf(name, sizeof(name), "%08x.jnl", seq);
+			return m_dir + "/" + name;
+		}
+
+		/* Sequence numbers of segment files in ascending order */
+		bool list(std::vector<bin::u32_t> & seqs) {
+			DIR * d = opendir(m_dir.c_str());
+			if (d == nullptr) {
+				return false;
+			}
+			while (struct dirent * e = readdir(d)) {
+				unsigned int seq;
+				char tail;
+				if (std::strlen(e->d_name) == 12
+						&& std::sscanf(e->d_name, "%8x.jn%c", &seq, &tail) == 2
+						&& tail == 'l') {
+					seqs.push_back(seq);
+				}
+			}
+			closedir(d);
+			std::sort(seqs.begin(), seqs.end());
+			return true;
+		}
+
+		segment * map(bin::u32_t seq, bool create) {
+			std::string p = path(seq);
+			int fd = ::open(p.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+			if (fd < 0) {
+				return nullptr;
+			}
+			bin::sz_t size = m_segment_size;
+			struct stat st;
+			if (create) {
+				/* Blocks are allocated upfront, so syncs
+				 * of written data touch no metadata */
+				if (posix_fallocate(fd, 0, size) != 0) {
+					::close(fd);
+					std::remove(p.c_str());
+					return nullptr;
+				}
+				sync_dir();
+			} else if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+				::close(fd);
+				return nullptr;
+			} else {
+				size = st.st_size;
+			}
+			void * data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (data == MAP_FAILED) {
+				::close(fd);
+				return nullptr;
+			}
+			segment * s = new segment;
+			s->seq = seq;
+			s->fd = fd;
+			s->data = static_cast<bin::u8_t *>(data);
+			s->size = size;
+			s->used = 0;
+			s->synced = 0;
+			s->accepted = 0;
+			s->live = 0;
+			return s;
+		}
+
+		static void close(segment * s) {
+			munmap(s->data, s->size);
+			::close(s->fd);
+			delete s;
+		}
+
+		void sync_dir() {
+			int fd = ::open(m_dir.c_str(), O_RDONLY);
+			if (fd >= 0) {
+				fsync(fd);
+				::close(fd);
+			}
+		}
+
+		/* Record at off, size is 0 if there is none or it is damaged */
+		record read(const segment * s, bin::sz_t off) const {
+			record r;
+			r.size = 0;
+			if (off + header_size > s->size) {
+				return r;
+			}
+			const bin::u8_t * p = s->data + off;
+			bin::u32_t word;
+			bin::u32_t crc;
+			std::memcpy(&word, p, 4);
+			std::memcpy(&crc, p + 4, 4);
+			std::memcpy(&r.id, p + 8, 8);
+			r.type = static_cast<record_t>(word >> 28);
+			r.len = word & 0x0FFFFFFF;
+			r.data = p + header_size;
+			if ((r.type != accepted && r.type != tombstone)
+					|| off + header_size + r.len > s->size
+					|| crc != crc32(crc32(0, p + 8, 8), r.data, r.len)) {
+				return r;
+			}
+			r.size = align(header_size + r.len);
+			return r;
+		}
+
+		/* Index records of a segment being loaded. A damaged record
+		 * ends the segment: it is either torn by a crash or zeros. */
+		void scan(segment * s) {
+			bin::sz_t off = 0;
+			while (true) {
+				record r = read(s, off);
+				if (r.size == 0) {
+					break;
+				}
+				off += r.size;
+				if (r.type == accepted) {
+					s->accepted++;
+					index(r.id, lsn(s->seq, off));
+				} else {
+					unindex(r.id);
+				}
+			}
+			s->used = off;
+			s->synced = off;
+		}
+
+		segment * find(bin::u32_t seq) {
+			for (segment * s: m_segs) {
+				if (s->seq == seq) {
+					return s;
+				}
+			}
+			return nullptr;
+		}
+
+		void index(bin::u64_t id, bin::u64_t at) {
+			auto it = m_index.find(id);
+			if (it != m_index.end()) {
+				segment * old = find(it->second >> 32);
+				if (old != nullptr) {
+					old->live--;
+				}
+				it->second = at;
+			} else {
+				m_index[id] = at;
+			}
+			segment * s = find(at >> 32);
+			if (s != nullptr) {
+				s->live++;
+			}
+		}
+
+		void unindex(bin::u64_t id) {
+			auto it = m_index.find(id);
+			if (it == m_index.end()) {
+				return;
+			}
+			segment * s = find(it->second >> 32);
+			if (s != nullptr) {
+				s->live--;
+			}
+			m_index.erase(it);
+		}
+
+		segment * roll(std::unique_lock<std::mutex> & lock) {
+			m_prepared.wait(lock, [this] { return !m_preparing; });
+			bin::u32_t seq = m_segs.empty() ? 1 : m_segs.back()->seq + 1;
+			segment * s = m_spare;
+			m_spare = nullptr;
+			if (s == nullptr || s->seq != seq) {
+				if (s != nullptr) {
+					std::string p = path(s->seq);
+					close(s);
+					std::remove(p.c_str());
+				}
+				s = map(seq, true);
+			}
+			if (s != nullptr) {
+				m_segs.push_back(s);
+			}
+			return s;
+		}
+
+		bin::u64_t write(std::unique_lock<std::mutex> & lock, record_t type
+				, bin::u64_t id, const bin::u8_t * data, bin::sz_t len) {
+			bin::sz_t size = align(header_size + len);
+			if (size > m_segment_size || len > 0x0FFFFFFF) {
+				return 0;
+			}
+			segment * s = m_segs.empty() ? nullptr : m_segs.back();
+			if (s == nullptr || s->used + size > s->size) {
+				s = roll(lock);
+				if (s == nullptr) {
+					return 0;
+				}
+			}
+			bin::u8_t * p = s->data + s->used;
+			bin::u32_t word = static_cast<bin::u32_t>(type) << 28 | len;
+			std::memcpy(p + 8, &id, 8);
+			if (len != 0) {
+				std::memcpy(p + header_size, data, len);
+			}
+			bin::u32_t crc = crc32(crc32(0, p + 8, 8), data, len);
+			std::memcpy(p + 4, &crc, 4);
+			std::memcpy(p, &word, 4);
+			s->used += size;
+			bin::u64_t at = lsn(s->seq, s->used);
+			if (type == accepted) {
+				s->accepted++;
+				index(id, at);
+			} else {
+				unindex(id);
+			}
+			m_written = at;
+			if (m_dirty_bytes == 0) {
+				m_dirty_since = clock_t::now();
+				m_cond.notify_one();
+			}
+			m_dirty_bytes += size;
+			if (m_dirty_bytes >= max_batch_bytes) {
+				m_cond.notify_one();
+			}
+			return at;
+		}
+
+		/* Sync everything written so far. Segments are removed by
+		 * the background thread only, so they stay while unlocked. */
+		bool sync(std::unique_lock<std::mutex> & lock) {
+			if (m_dirty_bytes == 0) {
+				return true;
+			}
+			bin::u64_t target = m_written;
+			m_ranges.clear();
+			for (segment * s: m_segs) {
+				if (s->synced < s->used) {
+					range r = { s, s->synced, s->used };
+					m_ranges.push_back(r);
+				}
+			}
+			m_dirty_bytes = 0;
+			lock.unlock();
+			bool ok = true;
+			for (const range & r: m_ranges) {
+				bin::sz_t from = r.from / m_page * m_page;
+				ok = ok && msync(r.seg->data + from, r.to - from, MS_SYNC) == 0;
+			}
+			lock.lock();
+			if (!ok) {
+				/* Retried with records written meanwhile once the
+				 * backoff is over, which run waits for */
+				m_dirty_bytes = std::max<bin::sz_t>(m_dirty_bytes, 1);
+				m_failures++;
+				m_dirty_since = clock_t::now() + backoff();
+				if (m_on_failure) {
+					bin::u32_t failures = m_failures;
+					lock.unlock();
+					m_on_failure(failures);
+					lock.lock();
+				}
+				return false;
+			}
+			m_failures = 0;
+			for (const range & r: m_ranges) {
+				r.seg->synced = std::max(r.seg->synced, r.to);
+			}
+			m_committed.store(target, std::memory_order_release);
+			if (m_on_commit) {
+				lock.unlock();
+				m_on_commit(target);
+				lock.lock();
+			}
+			return true;
+		}
+
+		void run() {
+			std::unique_lock<std::mutex> lock(m_mtx);
+			while (!m_stop) {
+				m_cond.wait_for(lock, std::chrono::milliseconds(100), [this] {
+					return m_stop || m_dirty_bytes != 0;
+				});
+				if (m_dirty_bytes != 0) {
+					/* A full batch does not cut a backoff short */
+					m_cond.wait_until(lock, m_dirty_since + m_budget, [this] {
+						return m_stop || (m_failures == 0 && m_dirty_bytes >= max_batch_bytes);
+					});
+					sync(lock);
+					continue;
+				}
+				if (m_spare == nullptr) {
+					prepare(lock);
+				}
+				compact(lock);
+			}
+		}
+
+		/* Wait after m_failures syncs failed in a row */
+		clock_t::duration backoff() const {
+			clock_t::duration most = std::chrono::milliseconds(bin::sz_t(max_backoff_ms));
+			clock_t::duration d = std::max<clock_t::duration>(m_budget, std::chrono::milliseconds(1));
+			for (bin::u32_t i = 1; i < m_failures && d < most; ++i) {
+				d *= 2;
+			}
+			return std::min(d, most);
+		}
+
+		/* Segment files are made out of the lock,
+		 * writers rolling over meanwhile wait for it */
+		void prepare(std::unique_lock<std::mutex> & lock) {
+			bin::u32_t seq = m_segs.empty() ? 1 : m_segs.back()->seq + 1;
+			m_preparing = true;
+			lock.unlock();
+			segment * s = map(seq, true);
+			lock.lock();
+			m_spare = s;
+			m_preparing = false;
+			m_prepared.notify_all();
+		}
+
+		void compact(std::unique_lock<std::mutex> & lock) {
+			if (m_segs.size() < 2) {
+				return;
+			}
+			segment * s = m_segs.front();
+			if (s->accepted != 0 && s->live * 100 >= s->accepted * compact_percent) {
+				return;
+			}
+			/* Sealed segment is not written anymore, records
+			 * are copied under the lock one by one */
+			for (bin::sz_t off = 0; off < s->used && !m_stop;) {
+				record r = read(s, off);
+				if (r.size == 0) {
+					break;
+				}
+				off += r.size;
+				auto it = m_index.find(r.id);
+				if (r.type == accepted && it != m_index.end()
+						&& it->second == lsn(s->seq, off)) {
+					if (write(lock, accepted, r.id, r.data, r.len) == 0) {
+						return;
+					}
+				}
+				if (m_dirty_bytes >= max_batch_bytes && !sync(lock)) {
+					return;
+				}
+			}
+			if (m_stop || !sync(lock) || s->live != 0) {
+				return;
+			}
+			m_segs.pop_front();
+			lock.unlock();
+			std::string p = path(s->seq);
+			close(s);
+			std::remove(p.c_str());
+			lock.lock();
+		}
+};
+
+} } }
+
+#endif
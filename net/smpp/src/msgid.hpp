@@ -0,0 +1,116 @@
+#ifndef smpp_msgid_hpp
+#define smpp_msgid_hpp
+
+#include <atomic>
+#include <chrono>
+#include <toolbox/bin.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Message id generator.
+ *
+ * Ids are 63 bit numbers: milliseconds since 2015-01-01 (41 bits), node
+ * number (10 bits) and sequence within a millisecond (12 bits). They are
+ * printed as 16 hex digits, so text ids sort in the order of generation.
+ * Time and sequence are kept in one atomic, a sequence overflow borrows
+ * the next millisecond, and a clock going back is never followed. Nodes
+ * sharing an id space must have distinct node numbers. */
+class msgid {
+	public:
+		typedef std::chrono::system_clock clock_t;
+
+		/* Text id length including terminating zero */
+		static const bin::sz_t text_len = 17;
+		static const bin::u16_t max_node = 0x3FF;
+
+		msgid(const msgid &) = delete;
+		msgid & operator=(const msgid &) = delete;
+
+		msgid(bin::u16_t node = 0)
+			: m_node(node & max_node)
+			, m_last(static_cast<bin::u64_t>(now_ms()) << seq_bits)
+		{}
+
+		bin::u16_t node() const { return m_node; }
+
+		bin::u64_t next() {
+			bin::u64_t ms = now_ms();
+			bin::u64_t last = m_last.load(std::memory_order_relaxed);
+			bin::u64_t cur;
+			do {
+				cur = (last >> seq_bits) < ms ? ms << seq_bits : last + 1;
+			} while (!m_last.compare_exchange_weak(last, cur
+				, std::memory_order_relaxed));
+			return ((cur >> seq_bits) << (node_bits + seq_bits))
+				| (static_cast<bin::u64_t>(m_node) << seq_bits)
+				| (cur & seq_mask);
+		}
+
+		/* Put next id to msg_id of a response, e.g. submit_sm_r */
+		template <class MsgT>
+		bin::u64_t next(MsgT & r) {
+			bin::u64_t id = next();
+			format(id, r.msg_id);
+			r.msg_id_len = text_len;
+			return id;
+		}
+
+		/* Write text_len bytes of zero terminated id to out */
+		static void format(bin::u64_t id, bin::u8_t * out) {
+			static const char digits[] = "0123456789ABCDEF";
+			for (int i = text_len - 2; i >= 0; --i) {
+				out[i] = digits[id & 0xF];
+				id >>= 4;
+			}
+			out[text_len - 1] = '\0';
+		}
+
+		/* Id from its text, len may include terminating zero */
+		static bool parse(const bin::u8_t * text, bin::sz_t len, bin::u64_t & id) {
+			if (len == text_len && text[len - 1] == '\0') {
+				len--;
+			}
+			if (len != text_len - 1) {
+				return false;
+			}
+			id = 0;
+			for (bin::sz_t i = 0; i < len; ++i) {
+				bin::u8_t c = text[i];
+				if (c >= '0' && c <= '9') {
+					id = id << 4 | (c - '0');
+				} else if (c >= 'A' && c <= 'F') {
+					id = id << 4 | (c - 'A' + 10);
+				} else {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		/* Time the id was generated at */
+		static clock_t::time_point time(bin::u64_t id) {
+			return clock_t::time_point(std::chrono::milliseconds(
+				(id >> (node_bits + seq_bits)) + epoch_ms));
+		}
+
+	private:
+		static const int node_bits = 10;
+		static const int seq_bits = 12;
+		static const bin::u64_t seq_mask = (1 << seq_bits) - 1;
+		/* 2015-01-01T00:00:00Z */
+		static const bin::u64_t epoch_ms = 1420070400000ull;
+
+		const bin::u16_t m_node;
+		std::atomic<bin::u64_t> m_last;
+
+		static bin::u64_t now_ms() {
+			return std::chrono::duration_cast<std::chrono::milliseconds>(
+				clock_t::now().time_since_epoch()).count() - epoch_ms;
+		}
+};
+
+} } }
+
+#endif
@@ -0,0 +1,358 @@
+#ifndef smpp_portability_hpp
+#define smpp_portability_hpp
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <toolbox/bin.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Number portability database file:
+ *
+ * header
+ * operators	operators * op_name bytes, zero padded
+ * keys			(blocks + 1) first numbers of blocks, in Eytzinger order from 1
+ * offsets		(blocks + 1) offsets of blocks in data, in the same order
+ * data			blocks of up to block_size numbers
+ *
+ * Every part starts at a multiple of 64 bytes.
+ *
+ * Numbers are sorted and cut in blocks, a block being the count, the
+ * operator of its first number and then the difference from the number
+ * before and the operator of each other number, all of them varints.
+ * Ported numbers of a range are close to each other, so a number takes
+ * two or three bytes. Block keys are laid out as an implicit search tree,
+ * children of k at 2k and 2k + 1, so the first levels of the search share
+ * cache lines and a line holds all descendants of k three levels down,
+ * which is fetched while those levels are passed.
+ *
+ * Numbers are kept as decimal 1 followed by their digits, so leading
+ * zeros are told apart. Integers are in host byte order, the magic does
+ * not match on a host of the other order. */
+namespace np {
+	/* "MOBINP01" */
+	const bin::u64_t magic			= 0x3130504E49424F4Dull;
+	const bin::sz_t block_size		= 64;
+	/* Operator names are shorter than that */
+	const bin::sz_t op_name			= 16;
+	const bin::sz_t max_digits		= 18;
+	const bin::u32_t nil			= ~static_cast<bin::u32_t>(0);
+	const bin::sz_t align			= 64;
+
+	struct header {
+		bin::u64_t magic;
+		bin::u64_t numbers;
+		bin::u64_t blocks;
+		bin::u64_t data_size;
+		bin::u32_t operators;
+		bin::u32_t reserved;
+	};
+
+	inline bin::u64_t aligned(bin::u64_t n) {
+		return (n + align - 1) / align * align;
+	}
+
+	/* Key of a number, a leading '+' is skipped and it may end with
+	 * zero. Returns false if it is not 1 to max_digits digits. */
+	inline bool key(const bin::u8_t * s, bin::sz_t len, bin::u64_t & k) {
+		bin::sz_t i = len != 0 && s[0] == '+' ? 1 : 0;
+		bin::sz_t digits = 0;
+		k = 1;
+		for (; i < len && s[i] != '\0'; ++i, ++digits) {
+			if (s[i] < '0' || s[i] > '9' || digits == max_digits) {
+				return false;
+			}
+			k = k * 10 + (s[i] - '0');
+		}
+		return digits != 0;
+	}
+
+	inline void put_varint(std::vector<bin::u8_t> & out, bin::u64_t v) {
+		while (v >= 0x80) {
+			out.push_back(static_cast<bin::u8_t>(v) | 0x80);
+			v >>= 7;
+		}
+		out.push_back(static_cast<bin::u8_t>(v));
+	}
+
+	/* Returns nullptr if it runs past end */
+	inline const bin::u8_t * get_varint(const bin::u8_t * p, const bin::u8_t * end, bin::u64_t & v) {
+		v = 0;
+		for (unsigned shift = 0; p != end && shift < 64; shift += 7) {
+			bin::u8_t b = *p++;
+			v |= static_cast<bin::u64_t>(b & 0x7F) << shift;
+			if ((b & 0x80) == 0) {
+				return p;
+			}
+		}
+		return nullptr;
+	}
+}
+
+/* Collects ported numbers and writes them to a database file offline */
+class np_builder {
+	public:
+		/* The last operator given for a number wins. Operators are named
+		 * by their routing number, which goes in front of dst_addr for
+		 * route lookups. Returns false if the number is malformed or the
+		 * name is too long or not made of digits. */
+		bool add(const std::string & number, const std::string & op) {
+			bin::u64_t k;
+			if (!np::key(reinterpret_cast<const bin::u8_t *>(number.data()), number.size(), k)
+					|| op.empty() || op.size() >= np::op_name
+					|| op.find_first_not_of("0123456789") != std::string::npos) {
+				return false;
+			}
+			std::pair<std::unordered_map<std::string, bin::u32_t>::iterator, bool> p
+				= m_op_index.insert(std::make_pair(op, m_ops.size()));
+			if (p.second) {
+				m_ops.push_back(op);
+			}
+			entry e = { k, p.first->second };
+			m_entries.push_back(e);
+			return true;
+		}
+
+		bin::sz_t size() const { return m_entries.size(); }
+
+		/* Write to a file next to path and move it over, so processes
+		 * having the old one open keep reading it. */
+		bool write(const std::string & path) {
+			std::stable_sort(m_entries.begin(), m_entries.end()
+				, [] (const entry & a, const entry & b) {
+					return a.key < b.key;
+				});
+			std::vector<entry> numbers;
+			numbers.reserve(m_entries.size());
+			for (const entry & e: m_entries) {
+				if (!numbers.empty() && numbers.back().key == e.key) {
+					numbers.back() = e;
+				} else {
+					numbers.push_back(e);
+				}
+			}
+			std::vector<bin::u64_t> sorted_keys;
+			std::vector<bin::u64_t> sorted_offsets;
+			std::vector<bin::u8_t> data;
+			for (bin::sz_t i = 0; i < numbers.size(); i += np::block_size) {
+				bin::sz_t n = std::min(np::block_size, numbers.size() - i);
+				sorted_keys.push_back(numbers[i].key);
+				sorted_offsets.push_back(data.size());
+				data.push_back(n);
+				np::put_varint(data, numbers[i].op);
+				for (bin::sz_t j = i + 1; j < i + n; ++j) {
+					np::put_varint(data, numbers[j].key - numbers[j - 1].key);
+					np::put_varint(data, numbers[j].op);
+				}
+			}
+			std::vector<bin::u64_t> keys(sorted_keys.size() + 1);
+			std::vector<bin::u64_t> offsets(keys.size());
+			bin::sz_t next = 0;
+			layout(sorted_keys, keys, next, 1);
+			next = 0;
+			layout(sorted_offsets, offsets, next, 1);
+
+			np::header h;
+			std::memset(&h, 0, sizeof(h));
+			h.magic = np::magic;
+			h.numbers = numbers.size();
+			h.blocks = sorted_keys.size();
+			h.data_size = data.size();
+			h.operators = m_ops.size();
+			/* Names are padded for the keys to start aligned */
+			std::vector<char> names(np::aligned(sizeof(h) + m_ops.size() * np::op_name) - sizeof(h), '\0');
+			for (bin::sz_t i = 0; i < m_ops.size(); ++i) {
+				std::memcpy(&names[i * np::op_name], m_ops[i].data(), m_ops[i].size());
+			}
+
+			std::string tmp = path + ".tmp";
+			std::FILE * f = std::fopen(tmp.c_str(), "wb");
+			if (f == nullptr) {
+				return false;
+			}
+			offsets.resize(np::aligned(offsets.size() * 8) / 8);
+			keys.resize(np::aligned(keys.size() * 8) / 8);
+			bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1
+				&& std::fwrite(&names[0], names.size(), 1, f) == 1
+				&& std::fwrite(&keys[0], sizeof(bin::u64_t), keys.size(), f) == keys.size()
+				&& std::fwrite(&offsets[0], sizeof(bin::u64_t), offsets.size(), f) == offsets.size()
+				&& (data.empty() || std::fwrite(&data[0], data.size(), 1, f) == 1);
+			ok = std::fclose(f) == 0 && ok;
+			if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+				std::remove(tmp.c_str());
+				return false;
+			}
+			return true;
+		}
+
+	private:
+		struct entry {
+			bin::u64_t key;
+			bin::u32_t op;
+		};
+
+		std::vector<entry> m_entries;
+		std::vector<std::string> m_ops;
+		std::unordered_map<std::string, bin::u32_t> m_op_index;
+
+		/* In order walk of the implicit tree takes blocks in order */
+		static void layout(const std::vector<bin::u64_t> & sorted
+				, std::vector<bin::u64_t> & tree, bin::sz_t & next, bin::sz_t k) {
+			if (k >= tree.size()) {
+				return;
+			}
+			layout(sorted, tree, next, 2 * k);
+			tree[k] = sorted[next++];
+			layout(sorted, tree, next, 2 * k + 1);
+		}
+};
+
+/* Number portability database mapped read only. Pages are shared by
+ * every process having the file open and read in on first touch, so
+ * opening takes no time whatever the size. Lookups allocate nothing.
+ *
+ * Thread safe once open. */
+class np_database {
+	public:
+		np_database(const np_database &) = delete;
+		np_database & operator=(const np_database &) = delete;
+
+		np_database()
+			: m_map(nullptr)
+			, m_size(0)
+			, m_header(nullptr)
+			, m_names(nullptr)
+			, m_keys(nullptr)
+			, m_offsets(nullptr)
+			, m_data(nullptr)
+		{}
+
+		~np_database() {
+			close();
+		}
+
+		/* Returns false if the file can not be mapped or is malformed */
+		bool open(const std::string & path) {
+			close();
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0) {
+				return false;
+			}
+			struct stat st;
+			if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(np::header))) {
+				::close(fd);
+				return false;
+			}
+			void * map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			::close(fd);
+			if (map == MAP_FAILED) {
+				return false;
+			}
+			m_map = map;
+			m_size = st.st_size;
+			const bin::u8_t * p = static_cast<const bin::u8_t *>(map);
+			m_header = reinterpret_cast<const np::header *>(p);
+			const np::header & h = *m_header;
+			if (h.magic != np::magic || h.blocks > m_size || h.data_size > m_size
+					|| h.operators > m_size) {
+				close();
+				return false;
+			}
+			bin::u64_t keys = np::aligned(sizeof(h) + static_cast<bin::u64_t>(h.operators) * np::op_name);
+			bin::u64_t index = np::aligned((h.blocks + 1) * sizeof(bin::u64_t));
+			if (keys + index * 2 + h.data_size != m_size) {
+				close();
+				return false;
+			}
+			m_names = reinterpret_cast<const char *>(p + sizeof(h));
+			m_keys = reinterpret_cast<const bin::u64_t *>(p + keys);
+			m_offsets = reinterpret_cast<const bin::u64_t *>(p + keys + index);
+			m_data = p + keys + index * 2;
+			madvise(map, m_size, MADV_RANDOM);
+			return true;
+		}
+
+		void close() {
+			if (m_map != nullptr) {
+				munmap(m_map, m_size);
+			}
+			m_map = nullptr;
+			m_size = 0;
+			m_header = nullptr;
+		}
+
+		bool is_open() const { return m_map != nullptr; }
+
+		/* Operator a number is ported to, np::nil if it is not */
+		bin::u32_t find(const bin::u8_t * number, bin::sz_t len) const {
+			bin::u64_t k;
+			if (m_header == nullptr || !np::key(number, len, k)) {
+				return np::nil;
+			}
+			/* Last block starting at k or before */
+			const bin::u64_t n = m_header->blocks;
+			bin::u64_t i = 1;
+			bin::u64_t found = 0;
+			while (i <= n) {
+				__builtin_prefetch(m_keys + i * 8);
+				bool right = m_keys[i] <= k;
+				found = right ? i : found;
+				i = 2 * i + right;
+			}
+			if (found == 0 || m_offsets[found] >= m_header->data_size) {
+				return np::nil;
+			}
+			const bin::u8_t * end = m_data + m_header->data_size;
+			const bin::u8_t * p = m_data + m_offsets[found];
+			bin::sz_t count = *p++;
+			bin::u64_t number_key = m_keys[found];
+			bin::u64_t op;
+			p = np::get_varint(p, end, op);
+			for (bin::sz_t j = 1; p != nullptr && number_key < k && j < count; ++j) {
+				bin::u64_t delta;
+				p = np::get_varint(p, end, delta);
+				if (p == nullptr) {
+					break;
+				}
+				number_key += delta;
+				p = np::get_varint(p, end, op);
+			}
+			if (p == nullptr || number_key != k || op >= m_header->operators) {
+				return np::nil;
+			}
+			return op;
+		}
+
+		/* Zero terminated name of an operator found */
+		const char * name(bin::u32_t op) const {
+			return m_names + static_cast<bin::sz_t>(op) * np::op_name;
+		}
+
+		bin::sz_t numbers() const { return m_header == nullptr ? 0 : m_header->numbers; }
+		bin::sz_t operators() const { return m_header == nullptr ? 0 : m_header->operators; }
+		/* Bytes of the file */
+		bin::sz_t size() const { return m_size; }
+
+	private:
+		void * m_map;
+		bin::sz_t m_size;
+		const np::header * m_header;
+		const char * m_names;
+		const bin::u64_t * m_keys;
+		const bin::u64_t * m_offsets;
+		const bin::u8_t * m_data;
+};
+
+} } }
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef smpp_printer_hpp
+#define smpp_printer_hpp
+
+#include <ostream>
+#include <smpp/proto.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+	/* Prints PDUs from their raw bytes, for full dumps made away from
+	 * the message path, e.g. from a capture file, while the services log
+	 * headers only */
+	class printer: public parser<std::ostream> {
+		public:
+			explicit printer(std::ostream & out)
+				: parser<std::ostream>(out)
+				, m_out(out)
+				, m_failed(false)
+			{}
+
+			virtual ~printer() {}
+
+			/* Print PDUs in buf, false if it is not made of
+			 * whole PDUs this parser knows */
+			bool print(const bin::u8_t * buf, bin::sz_t len) {
+				m_failed = false;
+				return parse(buf, buf + len) != nullptr && !m_failed;
+			}
+
+		protected:
+			action on_bind_transmitter(const bind_transmitter & msg) { return out(msg); }
+			action on_bind_transmitter_r(const bind_transmitter_r & msg) { return out(msg); }
+			action on_bind_receiver(const bind_receiver & msg) { return out(msg); }
+			action on_bind_receiver_r(const bind_receiver_r & msg) { return out(msg); }
+			action on_bind_transceiver(const bind_transceiver & msg) { return out(msg); }
+			action on_bind_transceiver_r(const bind_transceiver_r & msg) { return out(msg); }
+			action on_unbind(const unbind & msg) { return out(msg); }
+			action on_unbind_r(const unbind_r & msg) { return out(msg); }
+			action on_outbind(const outbind & msg) { return out(msg); }
+			action on_generic_nack(const generic_nack & msg) { return out(msg); }
+			action on_submit_sm(const submit_sm & msg) { return out(msg); }
+			action on_submit_sm_r(const submit_sm_r & msg) { return out(msg); }
+			action on_submit_multi_sm(const submit_multi_sm & msg) { return out(msg); }
+			action on_submit_multi_r(const submit_multi_r & msg) { return out(msg); }
+			action on_deliver_sm(const deliver_sm & msg) { return out(msg); }
+			action on_deliver_sm_r(const deliver_sm_r & msg) { return out(msg); }
+			action on_data_sm(const data_sm & msg) { return out(msg); }
+			action on_data_sm_r(const data_sm_r & msg) { return out(msg); }
+			action on_query_sm(const query_sm & msg) { return out(msg); }
+			action on_query_sm_r(const query_sm_r & msg) { return out(msg); }
+			action on_cancel_sm(const cancel_sm & msg) { return out(msg); }
+			action on_cancel_sm_r(const cancel_sm_r & msg) { return out(msg); }
+			action on_replace_sm(const replace_sm & msg) { return out(msg); }
+			action on_replace_sm_r(const replace_sm_r & msg) { return out(msg); }
+			action on_enquire_link(const enquire_link & msg) { return out(msg); }
+			action on_enquire_link_r(const enquire_link_r & msg) { return out(msg); }
+			action on_alert_notification(const alert_notification & msg) { return out(msg); }
+
+			action on_parse_error(const bin::u8_t * buf, const bin::u8_t * bend) {
+				(void)(buf);
+				(void)(bend);
+				m_failed = true;
+				return stop;
+			}
+
+		private:
+			std::ostream & m_out;
+			bool m_failed;
+
+			template <typename MsgT>
+			action out(const MsgT & msg) {
+				m_out << msg;
+				return resume;
+			}
+	};
+
+} } }
+
+#endif
@@ -0,0 +1,303 @@
+#ifndef smpp_receipt_hpp
+#define smpp_receipt_hpp
+
+#include <ctime>
+#include <cstring>
+#include <toolbox/bin.hpp>
+#include <smpp/proto.hpp>
+#include <smpp/dlr.hpp>
+#include <smpp/time.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Delivery receipt as carried in short message text:
+ *
+ * id:IIIIIIIIII sub:SSS dlvrd:DDD submit date:YYMMDDhhmm
+ * done date:YYMMDDhhmm stat:DDDDDDD err:E text:...
+ *
+ * Strings point into the text a receipt is parsed from,
+ * or to the ones to format it with. */
+struct receipt {
+	const bin::u8_t * id;
+	bin::sz_t id_len;
+	bin::u16_t sub;
+	bin::u16_t dlvrd;
+	/* Seconds since epoch, 0 if unknown */
+	std::time_t submit_date;
+	std::time_t done_date;
+	/* One of message_state */
+	bin::u8_t state;
+	bin::u16_t err;
+	const bin::u8_t * text;
+	bin::sz_t text_len;
+
+	receipt()
+		: id(nullptr), id_len(0), sub(0), dlvrd(0)
+		, submit_date(0), done_date(0)
+		, state(message_state::unknown), err(0)
+		, text(nullptr), text_len(0)
+	{}
+};
+
+namespace receipt_text {
+
+	/* Characters of original text a receipt repeats */
+	const bin::sz_t max_text = 20;
+
+	/* Keys are compared ignoring case, blanks and underscores,
+	 * so "submit date", "Submit_Date" and "submitdate" are the same */
+	inline bool key_is(const bin::u8_t * k, const bin::u8_t * kend, const char * name) {
+		for (; k != kend; ++k) {
+			bin::u8_t c = *k;
+			if (c == ' ' || c == '_') {
+				continue;
+			}
+			if (c >= 'A' && c <= 'Z') {
+				c += 'a' - 'A';
+			}
+			if (*name == '\0' || c != static_cast<bin::u8_t>(*name++)) {
+				return false;
+			}
+		}
+		return *name == '\0';
+	}
+
+	inline bin::u32_t number(const bin::u8_t * v, const bin::u8_t * vend) {
+		bin::u32_t n = 0;
+		for (; v != vend && *v >= '0' && *v <= '9'; ++v) {
+			n = n * 10 + (*v - '0');
+		}
+		return n;
+	}
+
+	/* YYMMDDhhmm with optional seconds, 0 if malformed */
+	inline std::time_t date(const bin::u8_t * v, const bin::u8_t * vend) {
+		bin::sz_t len = vend - v;
+		if (len != 10 && len != 12) {
+			return 0;
+		}
+		for (const bin::u8_t * p = v; p != vend; ++p) {
+			if (*p < '0' || *p > '9') {
+				return 0;
+			}
+		}
+		unsigned mon = number(v + 2, v + 4);
+		unsigned day = number(v + 4, v + 6);
+		unsigned hour = number(v + 6, v + 8);
+		unsigned min = number(v + 8, v + 10);
+		unsigned sec = len == 12 ? number(v + 10, v + 12) : 0;
+		if (mon < 1 || mon > 12 || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 59) {
+			return 0;
+		}
+		long days = days_from_civil(2000 + number(v, v + 2), mon, day);
+		return static_cast<std::time_t>(days) * 86400 + hour * 3600 + min * 60 + sec;
+	}
+
+	/* Full words, seven letter abbreviations and numeric states */
+	inline bin::u8_t state(const bin::u8_t * v, const bin::u8_t * vend) {
+		if (vend - v >= 1 && *v >= '1' && *v <= '8') {
+			return *v - '0';
+		}
+		if (vend - v < 5) {
+			return message_state::unknown;
+		}
+		char s[5];
+		for (int i = 0; i < 5; ++i) {
+			s[i] = v[i] >= 'a' && v[i] <= 'z' ? v[i] - ('a' - 'A') : v[i];
+		}
+		static const struct {
+			char prefix[6];
+			bin::u8_t state;
+		} states[] = {
+			{ "DELIV", message_state::delivered }
+			, { "EXPIR", message_state::expired }
+			, { "DELET", message_state::deleted }
+			, { "UNDEL", message_state::undeliverable }
+			, { "ACCEP", message_state::accepted }
+			, { "REJEC", message_state::rejected }
+			, { "ENROU", message_state::enroute }
+		};
+		for (const auto & e: states) {
+			if (std::memcmp(s, e.prefix, 5) == 0) {
+				return e.state;
+			}
+		}
+		return message_state::unknown;
+	}
+
+	inline const char * state_name(bin::u8_t state) {
+		switch (state) {
+			case message_state::enroute: return "ENROUTE";
+			case message_state::delivered: return "DELIVRD";
+			case message_state::expired: return "EXPIRED";
+			case message_state::deleted: return "DELETED";
+			case message_state::undeliverable: return "UNDELIV";
+			case message_state::accepted: return "ACCEPTD";
+			case message_state::rejected: return "REJECTD";
+			default: return "UNKNOWN";
+		}
+	}
+
+	/* Appends to out unless it runs past end, then returns nullptr */
+	inline bin::u8_t * put(bin::u8_t * out, const bin::u8_t * end
+			, const void * s, bin::sz_t len) {
+		if (out == nullptr || out + len > end) {
+			return nullptr;
+		}
+		if (len != 0) {
+			std::memcpy(out, s, len);
+		}
+		return out + len;
+	}
+
+	inline bin::u8_t * put(bin::u8_t * out, const bin::u8_t * end, const char * s) {
+		return put(out, end, s, std::strlen(s));
+	}
+
+	/* Zero padded to width digits */
+	inline bin::u8_t * put(bin::u8_t * out, const bin::u8_t * end
+			, bin::u32_t n, bin::sz_t width) {
+		char digits[10];
+		bin::sz_t len = 0;
+		do {
+			digits[sizeof(digits) - ++len] = '0' + n % 10;
+			n /= 10;
+		} while (n != 0 && len < sizeof(digits));
+		while (len < width && len < sizeof(digits)) {
+			digits[sizeof(digits) - ++len] = '0';
+		}
+		return put(out, end, digits + sizeof(digits) - len, len);
+	}
+
+	inline bin::u8_t * put_date(bin::u8_t * out, const bin::u8_t * end, std::time_t t) {
+		long days = t / 86400;
+		long secs = t % 86400;
+		long y;
+		unsigned m, d;
+		civil_from_days(days, y, m, d);
+		out = put(out, end, y % 100, 2);
+		out = put(out, end, m, 2);
+		out = put(out, end, d, 2);
+		out = put(out, end, secs / 3600, 2);
+		return put(out, end, secs / 60 % 60, 2);
+	}
+}
+
+/* Parse receipt text in one pass. Fields may come in any order, unknown
+ * ones are skipped, text runs to the end. Returns false if there is no
+ * id, which any receipt has. */
+inline bool parse_receipt(const bin::u8_t * buf, bin::sz_t len, receipt & r) {
+	using namespace receipt_text;
+	r = receipt();
+	const bin::u8_t * p = buf;
+	const bin::u8_t * end = buf + len;
+	/* Text may end with zero */
+	if (p != end && end[-1] == '\0') {
+		end--;
+	}
+	while (p != end) {
+		while (p != end && *p == ' ') {
+			p++;
+		}
+		const bin::u8_t * k = p;
+		while (p != end && *p != ':') {
+			p++;
+		}
+		if (p == end) {
+			break;
+		}
+		const bin::u8_t * kend = p++;
+		if (key_is(k, kend, "text")) {
+			r.text = p;
+			r.text_len = end - p;
+			break;
+		}
+		while (p != end && *p == ' ') {
+			p++;
+		}
+		const bin::u8_t * v = p;
+		while (p != end && *p != ' ' && *p != ':') {
+			p++;
+		}
+		if (p != end && *p == ':') {
+			/* Empty value, that was the next key */
+			p = v;
+			continue;
+		}
+		const bin::u8_t * vend = p;
+		if (key_is(k, kend, "id")) {
+			r.id = v;
+			r.id_len = vend - v;
+		} else if (key_is(k, kend, "sub")) {
+			r.sub = number(v, vend);
+		} else if (key_is(k, kend, "dlvrd")) {
+			r.dlvrd = number(v, vend);
+		} else if (key_is(k, kend, "submitdate")) {
+			r.submit_date = date(v, vend);
+		} else if (key_is(k, kend, "donedate")) {
+			r.done_date = date(v, vend);
+		} else if (key_is(k, kend, "stat")) {
+			r.state = state(v, vend);
+		} else if (key_is(k, kend, "err")) {
+			r.err = number(v, vend);
+		}
+	}
+	return r.id_len != 0;
+}
+
+/* Receipt in deliver_sm or data_sm text */
+template <class MsgT>
+bool get_receipt(const MsgT & msg, receipt & r) {
+	if (msg.msg_payload.tag == option::msg_payload) {
+		return parse_receipt(msg.msg_payload.val, msg.msg_payload.len, r);
+	}
+	return parse_receipt(msg.short_msg, msg.short_msg_len, r);
+}
+
+inline bool get_receipt(const data_sm & msg, receipt & r) {
+	return parse_receipt(msg.msg_payload.val, msg.msg_payload.len, r);
+}
+
+/* Write receipt text without terminating zero, text is cut to max_text.
+ * Returns its length, 0 if it does not fit in size bytes. */
+inline bin::sz_t format_receipt(const receipt & r, bin::u8_t * buf, bin::sz_t size) {
+	using namespace receipt_text;
+	const bin::u8_t * end = buf + size;
+	bin::u8_t * p = put(buf, end, "id:");
+	p = put(p, end, r.id, r.id_len);
+	p = put(p, end, " sub:");
+	p = put(p, end, r.sub, 3);
+	p = put(p, end, " dlvrd:");
+	p = put(p, end, r.dlvrd, 3);
+	p = put(p, end, " submit date:");
+	p = put_date(p, end, r.submit_date);
+	p = put(p, end, " done date:");
+	p = put_date(p, end, r.done_date);
+	p = put(p, end, " stat:");
+	p = put(p, end, state_name(r.state));
+	p = put(p, end, " err:");
+	p = put(p, end, r.err, 3);
+	p = put(p, end, " text:");
+	p = put(p, end, r.text, r.text_len < max_text ? r.text_len : max_text);
+	return p == nullptr ? 0 : p - buf;
+}
+
+/* Make msg a delivery receipt with the text in short_msg */
+template <class MsgT>
+bool set_receipt(MsgT & msg, const receipt & r) {
+	bin::sz_t len = format_receipt(r, msg.short_msg, sizeof(msg.short_msg));
+	if (len == 0) {
+		return false;
+	}
+	msg.short_msg_len = len;
+	msg.msg_payload.tag = 0;
+	msg.msg_payload.len = 0;
+	msg.esm_class = (msg.esm_class & ~dlr::esm_type_mask) | dlr::esm_smsc_receipt;
+	return true;
+}
+
+} } }
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef smpp_route_hpp
+#define smpp_route_hpp
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <istream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <toolbox/bin.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Messages to dst_addr starting with prefix go to pool, optionally
+ * only those of the given TON/NPI or submitted by the given sys_id */
+struct route {
+	std::string prefix;
+	/* -1 for any */
+	int ton;
+	int npi;
+	/* Empty for any */
+	std::string sys_id;
+	std::string pool;
+
+	route(): ton(-1), npi(-1) {}
+};
+
+/* Read routes, one per line:
+ *
+ * <prefix> <pool> [ton=N] [npi=N] [sys_id=S]
+ *
+ * Prefix is digits, optionally after '+'. Empty lines and ones starting
+ * with '#' are skipped. Returns false with the number of the malformed
+ * line in error_line. */
+inline bool read_routes(std::istream & in, std::vector<route> & routes, bin::sz_t & error_line) {
+	std::string line;
+	error_line = 0;
+	while (std::getline(in, line)) {
+		error_line++;
+		std::istringstream fields(line);
+		route r;
+		if (!(fields >> r.prefix) || r.prefix[0] == '#') {
+			continue;
+		}
+		if (r.prefix[0] == '+') {
+			r.prefix.erase(0, 1);
+		}
+		if (r.prefix.empty() || r.prefix.size() > 20
+				|| r.prefix.find_first_not_of("0123456789") != std::string::npos
+				|| !(fields >> r.pool)) {
+			return false;
+		}
+		std::string opt;
+		while (fields >> opt) {
+			std::string::size_type eq = opt.find('=');
+			if (eq == std::string::npos || eq + 1 == opt.size()) {
+				return false;
+			}
+			std::string name = opt.substr(0, eq);
+			std::string val = opt.substr(eq + 1);
+			if (name == "sys_id") {
+				r.sys_id = val;
+				continue;
+			}
+			char * end;
+			long n = std::strtol(val.c_str(), &end, 10);
+			if (*end != '\0' || n < 0 || n > 255) {
+				return false;
+			}
+			if (name == "ton") {
+				r.ton = n;
+			} else if (name == "npi") {
+				r.npi = n;
+			} else {
+				return false;
+			}
+		}
+		routes.push_back(r);
+	}
+	error_line = 0;
+	return true;
+}
+
+/* Routes compiled to a trie indexed by digits of dst_addr.
+ *
+ * Nodes are 12 bytes and laid out breadth first, children of a node
+ * being next to each other: a node has a bit per digit it has a child
+ * for and the index of the first child, the child of digit d is found
+ * by counting the bits below d. The top levels every lookup goes
+ * through stay in cache and each digit after that costs one node read.
+ *
+ * Routes of a prefix are kept with its node, the more specific first,
+ * the deepest node having a route matching TON/NPI and sys_id wins.
+ * sys_id is compared by a 64 bit hash taken once per bind.
+ *
+ * Immutable once built, so any number of threads may use it. */
+class route_table {
+	public:
+		static const bin::u32_t nil = ~static_cast<bin::u32_t>(0);
+
+		explicit route_table(const std::vector<route> & routes) {
+			build(routes);
+		}
+
+		/* Key of a sys_id to find routes with, 0 for none */
+		static bin::u64_t sys_key(const bin::u8_t * sys_id, bin::sz_t len) {
+			bin::u64_t h = 0xCBF29CE484222325ull;
+			bin::sz_t i = 0;
+			for (; i < len && sys_id[i] != '\0'; ++i) {
+				h = (h ^ sys_id[i]) * 0x100000001B3ull;
+			}
+			return i == 0 ? 0 : h | 1;
+		}
+
+		/* Pool of the longest prefix of dst matching ton, npi and sys_id
+		 * key. A leading '+' is skipped, the walk stops at a non-digit.
+		 * Returns nil if there is no route. */
+		bin::u32_t find(const bin::u8_t * dst, bin::sz_t len
+				, bin::u8_t ton, bin::u8_t npi, bin::u64_t sys_id) const {
+			if (m_nodes.empty()) {
+				return nil;
+			}
+			bin::sz_t i = len != 0 && dst[0] == '+' ? 1 : 0;
+			const node * n = &m_nodes[0];
+			bin::u32_t best = match(*n, ton, npi, sys_id);
+			for (; i < len; ++i) {
+				unsigned d = dst[i] - '0';
+				if (d > 9 || (n->children & (1u << d)) == 0) {
+					break;
+				}
+				n = &m_nodes[n->first + popcount(n->children & ((1u << d) - 1))];
+				bin::u32_t p = match(*n, ton, npi, sys_id);
+				if (p != nil) {
+					best = p;
+				}
+			}
+			return best;
+		}
+
+		const std::string & pool(bin::u32_t i) const { return m_pools[i]; }
+		bin::sz_t pools() const { return m_pools.size(); }
+		bin::sz_t routes() const { return m_targets.size(); }
+		bin::sz_t nodes() const { return m_nodes.size(); }
+
+		/* Bytes taken by nodes and routes */
+		bin::sz_t memory() const {
+			return m_nodes.size() * sizeof(node) + m_targets.size() * sizeof(target);
+		}
+
+	private:
+		struct node {
+			bin::u32_t first;
+			bin::u16_t children;
+			bin::u16_t count;
+			bin::u32_t targets;
+		};
+
+		struct target {
+			/* 0 for any */
+			bin::u64_t sys_id;
+			/* -1 for any */
+			bin::s16_t ton;
+			bin::s16_t npi;
+			bin::u32_t pool;
+		};
+
+		std::vector<node> m_nodes;
+		std::vector<target> m_targets;
+		std::vector<std::string> m_pools;
+
+		static unsigned popcount(unsigned v) {
+			return __builtin_popcount(v);
+		}
+
+		bin::u32_t match(const node & n, bin::u8_t ton, bin::u8_t npi, bin::u64_t sys_id) const {
+			for (bin::u32_t i = n.targets; i < n.targets + n.count; ++i) {
+				const target & t = m_targets[i];
+				if ((t.sys_id == 0 || t.sys_id == sys_id)
+						&& (t.ton < 0 || t.ton == ton)
+						&& (t.npi < 0 || t.npi == npi)) {
+					return t.pool;
+				}
+			}
+			return nil;
+		}
+
+		/* More qualifiers first, sys_id weighs more than TON/NPI */
+		static int rank(const route & r) {
+			return (r.sys_id.empty() ? 0 : 4) + (r.ton < 0 ? 0 : 1) + (r.npi < 0 ? 0 : 1);
+		}
+
+		void build(const std::vector<route> & routes) {
+			/* Routes sorted by prefix, the shortest first, then by rank */
+			std::vector<const route *> sorted;
+			sorted.reserve(routes.size());
+			for (const route & r: routes) {
+				sorted.push_back(&r);
+			}
+			std::stable_sort(sorted.begin(), sorted.end()
+				, [] (const route * a, const route * b) {
+					int c = a->prefix.compare(b->prefix);
+					return c != 0 ? c < 0 : rank(*a) > rank(*b);
+				});
+			/* Every node is a range of sorted routes sharing depth digits */
+			struct range {
+				bin::sz_t lo;
+				bin::sz_t hi;
+				bin::sz_t depth;
+			};
+			std::deque<range> queue;
+			std::unordered_map<std::string, bin::u32_t> pools;
+			queue.push_back(range{ 0, sorted.size(), 0 });
+			m_nodes.push_back(node());
+			for (bin::sz_t n = 0; !queue.empty(); ++n) {
+				range r = queue.front();
+				queue.pop_front();
+				node & nd = m_nodes[n];
+				nd.targets = m_targets.size();
+				nd.count = 0;
+				bin::sz_t i = r.lo;
+				for (; i < r.hi && sorted[i]->prefix.size() == r.depth; ++i) {
+					m_targets.push_back(compile(*sorted[i], pools));
+					nd.count++;
+				}
+				nd.first = m_nodes.size();
+				nd.children = 0;
+				while (i < r.hi) {
+					char d = sorted[i]->prefix[r.depth];
+					bin::sz_t j = i;
+					while (j < r.hi && sorted[j]->prefix[r.depth] == d) {
+						j++;
+					}
+					m_nodes[n].children |= 1u << (d - '0');
+					queue.push_back(range{ i, j, r.depth + 1 });
+					m_nodes.push_back(node());
+					i = j;
+				}
+			}
+		}
+
+		target compile(const route & r, std::unordered_map<std::string, bin::u32_t> & pools) {
+			target t;
+			t.sys_id = sys_key(reinterpret_cast<const bin::u8_t *>(r.sys_id.data()), r.sys_id.size());
+			t.ton = r.ton;
+			t.npi = r.npi;
+			std::pair<std::unordered_map<std::string, bin::u32_t>::iterator, bool> p
+				= pools.insert(std::make_pair(r.pool, m_pools.size()));
+			if (p.second) {
+				m_pools.push_back(r.pool);
+			}
+			t.pool = p.first->second;
+			return t;
+		}
+};
+
+/* Current route table, replaced as a whole.
+ *
+ * A new table is built aside, in a thread of its own if asked to, and
+ * published with an atomic pointer swap and a version bump. Readers keep
+ * a reference to the table they use and only look at the version on
+ * lookup, taking the new table when it changes; the old one is freed
+ * once the last reader lets it go. Lookups never wait for an update. */
+class router {
+	public:
+		typedef std::shared_ptr<const route_table> table_ptr;
+
+		/* View of one thread */
+		class reader {
+			public:
+				explicit reader(const router & r)
+					: m_router(r)
+					, m_version(0)
+				{}
+
+				/* Table current as of this call, nullptr if there is none */
+				const route_table * table() {
+					bin::u64_t v = m_router.m_version.load(std::memory_order_acquire);
+					if (v != m_version) {
+						m_table = std::atomic_load(&m_router.m_table);
+						m_version = v;
+					}
+					return m_table.get();
+				}
+
+			private:
+				const router & m_router;
+				table_ptr m_table;
+				bin::u64_t m_version;
+		};
+
+		router(): m_version(0) {}
+
+		router(const router &) = delete;
+		router & operator=(const router &) = delete;
+
+		~router() {
+			std::lock_guard<std::mutex> lock(m_mtx);
+			if (m_builder.joinable()) {
+				m_builder.join();
+			}
+		}
+
+		void publish(table_ptr t) {
+			std::atomic_store(&m_table, t);
+			m_version.fetch_add(1, std::memory_order_release);
+		}
+
+		/* Build table of routes and publish it from a thread of its own,
+		 * then call done(table). Waits for the previous build, if any. */
+		template <class F>
+		void rebuild(std::vector<route> routes, F done) {
+			std::lock_guard<std::mutex> lock(m_mtx);
+			if (m_builder.joinable()) {
+				m_builder.join();
+			}
+			m_builder = std::thread([this, routes, done] {
+				table_ptr t = std::make_shared<const route_table>(routes);
+				publish(t);
+				done(*t);
+			});
+		}
+
+		table_ptr table() const {
+			return std::atomic_load(&m_table);
+		}
+
+	private:
+		table_ptr m_table;
+		std::atomic<bin::u64_t> m_version;
+		std::mutex m_mtx;
+		std::thread m_builder;
+};
+
+} } }
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef smpp_session_hpp
+#define smpp_session_hpp
+
+#include <toolbox/bin.hpp>
+#include <smpp/proto.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* SMPP session state machine.
+ *
+ * Received PDUs are admitted by command id only, so disallowed ones are
+ * answered from their header and never reach the body parser. State
+ * changes are driven by responses: a bind is complete when a successful
+ * bind_*_r is sent (smsc side) or received (esme side), and the session
+ * is closed once unbind is answered. */
+class session {
+	public:
+		enum state_t: bin::u8_t {
+			open,
+			bound_tx,
+			bound_rx,
+			bound_trx,
+			unbinding,
+			closed
+		};
+
+		/* Side of the session we are acting as */
+		enum role_t: bin::u8_t {
+			smsc,
+			esme
+		};
+
+		session(role_t role = smsc)
+			: m_role(role)
+			, m_state(open)
+			, m_rejects(0)
+		{}
+
+		state_t state() const { return m_state; }
+		role_t role() const { return m_role; }
+
+		bool bound() const {
+			return m_state == bound_tx
+				|| m_state == bound_rx
+				|| m_state == bound_trx;
+		}
+
+		/* Number of PDUs rejected in a row */
+		bin::sz_t rejects() const { return m_rejects; }
+
+		/* Check if received PDU is allowed in current state.
+		 * Returns esme_rok or command status to answer with. */
+		bin::u32_t admit(bin::u32_t id) {
+			bin::u32_t status = check(id);
+			if (status == command_status::esme_rok) {
+				m_rejects = 0;
+			} else {
+				m_rejects++;
+			}
+			return status;
+		}
+
+		/* PDU with given id and status is received */
+		void on_recv(bin::u32_t id, bin::u32_t status) {
+			if (m_role == esme) {
+				bind_done(id, status);
+			}
+			unbind_done(id);
+		}
+
+		/* PDU with given id and status is sent */
+		void on_send(bin::u32_t id, bin::u32_t status) {
+			if (m_role == smsc) {
+				bind_done(id, status);
+			}
+			unbind_done(id);
+		}
+
+		void close() {
+			m_state = closed;
+		}
+
+	private:
+		role_t m_role;
+		state_t m_state;
+		bin::sz_t m_rejects;
+
+		/* Bit number of a request in admission masks, -1 if unknown */
+		static int request_bit(bin::u32_t id) {
+			switch (id) {
+				case command::bind_receiver:		return 0;
+				case command::bind_transmitter:		return 1;
+				case command::bind_transceiver:		return 2;
+				case command::outbind:				return 3;
+				case command::unbind:				return 4;
+				case command::enquire_link:			return 5;
+				case command::submit_sm:			return 6;
+				case command::submit_multi_sm:		return 7;
+				case command::data_sm:				return 8;
+				case command::query_sm:				return 9;
+				case command::cancel_sm:			return 10;
+				case command::replace_sm:			return 11;
+				case command::deliver_sm:			return 12;
+				case command::alert_notification:	return 13;
+				default:							return -1;
+			}
+		}
+
+		static bool response(bin::u32_t id) {
+			return (id & command::generic_nack) != 0;
+		}
+
+		/* Requests allowed to be received, by role and state */
+		static bin::u16_t allowed(role_t role, state_t state) {
+			enum : bin::u16_t {
+				binds	= 0x0007,
+				outbind	= 0x0008,
+				unbind	= 0x0010,
+				link	= 0x0020,
+				submit	= 0x0040 | 0x0080 | 0x0100,
+				ops		= 0x0200 | 0x0400 | 0x0800,
+				deliver	= 0x1000 | 0x0100 | 0x2000
+			};
+			static const bin::u16_t table[2][6] = {
+				/* smsc: requests coming from esme */
+				{ binds | link
+				, submit | ops | link | unbind
+				, link | unbind
+				, submit | ops | link | unbind
+				, unbind
+				, 0 },
+				/* esme: requests coming from smsc */
+				{ outbind | link
+				, link | unbind
+				, deliver | link | unbind
+				, deliver | link | unbind
+				, unbind
+				, 0 }
+			};
+			return table[role][state];
+		}
+
+		bin::u32_t check(bin::u32_t id) const {
+			if (response(id)) {
+				/* Responses are matched against requests later on */
+				return m_state == closed
+					? command_status::esme_rinvbndsts
+					: command_status::esme_rok;
+			}
+			int bit = request_bit(id);
+			if (bit < 0) {
+				return command_status::esme_rinvcmdid;
+			}
+			if (allowed(m_role, m_state) & (1 << bit)) {
+				return command_status::esme_rok;
+			}
+			if (bit <= 2 && bound()) {
+				return command_status::esme_ralybnd;
+			}
+			return command_status::esme_rinvbndsts;
+		}
+
+		void bind_done(bin::u32_t id, bin::u32_t status) {
+			if (m_state != open || status != command_status::esme_rok) {
+				return;
+			}
+			switch (id) {
+				case command::bind_transmitter_r:
+					m_state = bound_tx;
+					break;
+				case command::bind_receiver_r:
+					m_state = bound_rx;
+					break;
+				case command::bind_transceiver_r:
+					m_state = bound_trx;
+					break;
+				default:
+					break;
+			}
+		}
+
+		void unbind_done(bin::u32_t id) {
+			if (id == command::unbind && bound()) {
+				m_state = unbinding;
+			} else if (id == command::unbind_r && m_state == unbinding) {
+				m_state = closed;
+			}
+		}
+};
+
+} } }
+
+#endif
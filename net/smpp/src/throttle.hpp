@@ -0,0 +1,222 @@
+#ifndef smpp_throttle_hpp
+#define smpp_throttle_hpp
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <cstring>
+#include <toolbox/bin.hpp>
+
+namespace mobi { namespace net { namespace smpp {
+
+using namespace toolbox;
+
+/* Token bucket kept as the theoretical arrival time of the next
+ * message (GCRA). The whole state is one atomic, so a bucket may be
+ * shared by binds served from different threads without locking.
+ * Rate is exact to a nanosecond of message interval. */
+class bucket {
+	public:
+		bucket(const bucket &) = delete;
+		bucket & operator=(const bucket &) = delete;
+
+		bucket()
+			: m_tat(0)
+			, m_interval(0)
+			, m_tolerance(0)
+		{}
+
+		/* rate: messages per second, 0 for unlimited,
+		 * burst: messages accepted at once after a pause */
+		void set(bin::sz_t rate, bin::sz_t burst) {
+			bin::u64_t interval = rate ? 1000000000ull / rate : 0;
+			m_tolerance.store(interval * (burst ? burst - 1 : 0)
+				, std::memory_order_relaxed);
+			m_interval.store(interval, std::memory_order_relaxed);
+		}
+
+		/* Take one token, now is in nanoseconds of a monotonic clock */
+		bool acquire(bin::u64_t now) {
+			bin::u64_t interval = m_interval.load(std::memory_order_relaxed);
+			if (interval == 0) {
+				return true;
+			}
+			bin::u64_t tolerance = m_tolerance.load(std::memory_order_relaxed);
+			bin::u64_t tat = m_tat.load(std::memory_order_relaxed);
+			bin::u64_t next;
+			do {
+				bin::u64_t base = tat > now ? tat : now;
+				if (base - now > tolerance) {
+					return false;
+				}
+				next = base + interval;
+			} while (!m_tat.compare_exchange_weak(tat, next
+				, std::memory_order_relaxed));
+			return true;
+		}
+
+		/* Give back a token taken by acquire */
+		void release() {
+			m_tat.fetch_sub(m_interval.load(std::memory_order_relaxed)
+				, std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<bin::u64_t> m_tat;
+		std::atomic<bin::u64_t> m_interval;
+		std::atomic<bin::u64_t> m_tolerance;
+};
+
+/* Throughput limits of ESME accounts keyed by bind sys_id, optionally
+ * narrowed by destination address prefix. Accounts are looked up
+ * under lock once per bind; everything on the message path is atomic. */
+class throttle {
+	public:
+		typedef std::chrono::steady_clock clock_t;
+
+		/* Maximum number of destination prefix limits per account */
+		static const bin::sz_t max_prefixes = 32;
+
+		class account {
+			public:
+				account(const account &) = delete;
+				account & operator=(const account &) = delete;
+
+				account(): m_prefix_count(0) {}
+
+				/* Limit of all messages of the account */
+				bool acquire(bin::u64_t now) {
+					return m_total.acquire(now);
+				}
+
+				void release() {
+					m_total.release();
+				}
+
+				bool has_prefixes() const {
+					return m_prefix_count.load(std::memory_order_relaxed) != 0;
+				}
+
+				/* Limit of messages to the longest matching prefix of dst */
+				bool acquire(const bin::u8_t * dst, bin::sz_t len, bin::u64_t now) {
+					bin::sz_t n = m_prefix_count.load(std::memory_order_acquire);
+					prefix * best = nullptr;
+					for (bin::sz_t i = 0; i < n; ++i) {
+						prefix & p = m_prefixes[i];
+						if (p.len <= len
+								&& (best == nullptr || p.len > best->len)
+								&& std::memcmp(p.digits, dst, p.len) == 0) {
+							best = &p;
+						}
+					}
+					return best == nullptr || best->limit.acquire(now);
+				}
+
+			private:
+				friend class throttle;
+
+				struct prefix {
+					bin::u8_t digits[21];
+					bin::sz_t len;
+					bucket limit;
+				};
+
+				bucket m_total;
+				prefix m_prefixes[max_prefixes];
+				/* Published with release after a prefix is filled in */
+				std::atomic<bin::sz_t> m_prefix_count;
+		};
+
+		throttle()
+			: m_default_rate(0)
+			, m_default_burst(0)
+		{}
+
+		/* Current time for acquire calls */
+		static bin::u64_t now() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				clock_t::now().time_since_epoch()).count();
+		}
+
+		/* Limit applied to accounts not configured explicitly, 0 for none */
+		void set_default(bin::sz_t rate, bin::sz_t burst) {
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_default_rate = rate;
+			m_default_burst = burst;
+		}
+
+		void set_limit(const std::string & sys_id, bin::sz_t rate, bin::sz_t burst) {
+			std::lock_guard<std::mutex> lock(m_mtx);
+			get(sys_id).m_total.set(rate, burst);
+		}
+
+		/* Returns false if prefix does not fit or there are too many of them */
+		bool set_limit(const std::string & sys_id, const std::string & dst_prefix
+				, bin::sz_t rate, bin::sz_t burst) {
+			std::lock_guard<std::mutex> lock(m_mtx);
+			if (dst_prefix.empty() || dst_prefix.size() > sizeof(account::prefix::digits)) {
+				return false;
+			}
+			account & a = get(sys_id);
+			bin::sz_t n = a.m_prefix_count.load(std::memory_order_relaxed);
+			for (bin::sz_t i = 0; i < n; ++i) {
+				account::prefix & p = a.m_prefixes[i];
+				if (p.len == dst_prefix.size()
+						&& std::memcmp(p.digits, dst_prefix.data(), p.len) == 0) {
+					p.limit.set(rate, burst);
+					return true;
+				}
+			}
+			if (n == max_prefixes) {
+				return false;
+			}
+			account::prefix & p = a.m_prefixes[n];
+			std::memcpy(p.digits, dst_prefix.data(), dst_prefix.size());
+			p.len = dst_prefix.size();
+			p.limit.set(rate, burst);
+			a.m_prefix_count.store(n + 1, std::memory_order_release);
+			return true;
+		}
+
+		/* Account for the given sys_id, nullptr if it is not limited.
+		 * Accounts live as long as the throttle does. */
+		account * find(const bin::u8_t * sys_id, bin::sz_t len) {
+			/* sys_id length may include terminating zero */
+			std::string key(reinterpret_cast<const char *>(sys_id)
+				, ::strnlen(reinterpret_cast<const char *>(sys_id), len));
+			std::lock_guard<std::mutex> lock(m_mtx);
+			accounts_t::iterator it = m_accounts.find(key);
+			if (it != m_accounts.end()) {
+				return it->second.get();
+			}
+			if (m_default_rate == 0) {
+				return nullptr;
+			}
+			account & a = get(key);
+			a.m_total.set(m_default_rate, m_default_burst);
+			return &a;
+		}
+
+	private:
+		typedef std::map<std::string, std::unique_ptr<account>> accounts_t;
+
+		std::mutex m_mtx;
+		accounts_t m_accounts;
+		bin::sz_t m_default_rate;
+		bin::sz_t m_default_burst;
+
+		account & get(const std::string & sys_id) {
+			std::unique_ptr<account> & a = m_accounts[sys_id];
+			if (!a) {
+				a.reset(new account());
+			}
+			return *a;
+		}
+};
+
+} } }
+
+#endif
@@ -0,0 +1,25 @@
+#include <new>
+#include <cstdlib>
+
+#include "heap.hpp"
+
+/* Kept apart from the rest of the code,
+ * so that calls to these are never inlined */
+namespace heap {
+	std::atomic<std::size_t> count(0);
+	std::atomic<std::size_t> bytes(0);
+}
+
+void * operator new(std::size_t n) {
+	heap::count.fetch_add(1, std::memory_order_relaxed);
+	heap::bytes.fetch_add(n, std::memory_order_relaxed);
+	void * p = std::malloc(n ? n : 1);
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void * p) noexcept {
+	std::free(p);
+}
@@ -0,0 +1,14 @@
+#ifndef smpp_bench_heap_hpp
+#define smpp_bench_heap_hpp
+
+#include <atomic>
+#include <cstddef>
+
+/* Heap usage of the measured code is counted by replacing global
+ * allocation functions, codec itself is expected to allocate nothing */
+namespace heap {
+	extern std::atomic<std::size_t> count;
+	extern std::atomic<std::size_t> bytes;
+}
+
+#endif
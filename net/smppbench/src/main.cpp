@@ -0,0 +1,597 @@
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+#include <smpp/proto.hpp>
+
+#include <boost/program_options.hpp>
+
+#include "heap.hpp"
+
+namespace local {
+
+	using namespace mobi::net;
+	using namespace mobi::net::toolbox;
+
+	typedef std::chrono::steady_clock clock_t;
+
+	/* Parser doing nothing but accepting every PDU */
+	class sink: public smpp::parser<std::ostream> {
+		public:
+			sink(std::ostream & l): smpp::parser<std::ostream>(l), pdus(0) {}
+			virtual ~sink() {}
+
+			bin::sz_t pdus;
+
+		protected:
+			action on_bind_transmitter(const smpp::bind_transmitter &) { return done(); }
+			action on_bind_transmitter_r(const smpp::bind_transmitter_r &) { return done(); }
+			action on_bind_receiver(const smpp::bind_receiver &) { return done(); }
+			action on_bind_receiver_r(const smpp::bind_receiver_r &) { return done(); }
+			action on_bind_transceiver(const smpp::bind_transceiver &) { return done(); }
+			action on_bind_transceiver_r(const smpp::bind_transceiver_r &) { return done(); }
+			action on_unbind(const smpp::unbind &) { return done(); }
+			action on_unbind_r(const smpp::unbind_r &) { return done(); }
+			action on_outbind(const smpp::outbind &) { return done(); }
+			action on_generic_nack(const smpp::generic_nack &) { return done(); }
+			action on_submit_sm(const smpp::submit_sm &) { return done(); }
+			action on_submit_sm_r(const smpp::submit_sm_r &) { return done(); }
+			action on_submit_multi_sm(const smpp::submit_multi_sm &) { return done(); }
+			action on_submit_multi_r(const smpp::submit_multi_r &) { return done(); }
+			action on_deliver_sm(const smpp::deliver_sm &) { return done(); }
+			action on_deliver_sm_r(const smpp::deliver_sm_r &) { return done(); }
+			action on_data_sm(const smpp::data_sm &) { return done(); }
+			action on_data_sm_r(const smpp::data_sm_r &) { return done(); }
+			action on_query_sm(const smpp::query_sm &) { return done(); }
+			action on_query_sm_r(const smpp::query_sm_r &) { return done(); }
+			action on_cancel_sm(const smpp::cancel_sm &) { return done(); }
+			action on_cancel_sm_r(const smpp::cancel_sm_r &) { return done(); }
+			action on_replace_sm(const smpp::replace_sm &) { return done(); }
+			action on_replace_sm_r(const smpp::replace_sm_r &) { return done(); }
+			action on_enquire_link(const smpp::enquire_link &) { return done(); }
+			action on_enquire_link_r(const smpp::enquire_link_r &) { return done(); }
+			action on_alert_notification(const smpp::alert_notification &) { return done(); }
+
+			action on_parse_error(const bin::u8_t *, const bin::u8_t *) {
+				return stop;
+			}
+
+		private:
+			action done() {
+				pdus++;
+				return resume;
+			}
+	};
+
+	struct result {
+		std::string pdu;
+		std::string variant;
+		const char * op;
+		bin::sz_t iterations;
+		bin::sz_t pdu_bytes;
+		double ns_per_op;
+		double allocs_per_op;
+		double alloc_bytes_per_op;
+	};
+
+	class bench {
+		public:
+			bench(bin::sz_t iterations, bin::sz_t runs
+					, const std::string & filter, bool json)
+				: m_null(nullptr)
+				, m_writer(m_null)
+				, m_parser(m_null)
+				, m_iterations(iterations ? iterations : 1)
+				, m_runs(runs ? runs : 1)
+				, m_filter(filter)
+				, m_json(json)
+				, m_failed(0)
+				, m_sink(nullptr)
+			{}
+
+			bin::sz_t failed() const { return m_failed; }
+
+			void header() {
+				if (!m_json) {
+					std::cout << "pdu,variant,op,iterations,pdu_bytes"
+						",ns_per_op,bytes_per_op,allocs_per_op,alloc_bytes_per_op"
+						",mb_per_s" << std::endl;
+				}
+			}
+
+			/* Write and parse one PDU, m_iterations times each per run.
+			 * Median of runs is reported. */
+			template <class MsgT>
+			void run(const char * pdu, const char * variant, MsgT msg) {
+				if (!m_filter.empty()
+						&& std::string(pdu).find(m_filter) == std::string::npos) {
+					return;
+				}
+				msg.command.len = msg.raw_size();
+				std::vector<bin::u8_t> raw(msg.command.len);
+				bin::u8_t * buf = raw.data();
+				bin::u8_t * bend = buf + raw.size();
+
+				/* Round trip must succeed before it is measured */
+				if (m_writer.write(buf, bend, msg) != bend
+						|| m_parser.parse(buf, bend) != bend) {
+					std::cerr << "smpp_bench: " << pdu << "/" << variant
+						<< ": round trip failed" << std::endl;
+					m_failed++;
+					return;
+				}
+
+				result r;
+				r.pdu = pdu;
+				r.variant = variant;
+				r.iterations = m_iterations;
+				r.pdu_bytes = raw.size();
+
+				r.op = "write";
+				measure(r, [&] () {
+					m_sink = m_writer.write(buf, bend, msg);
+				});
+				print(r);
+
+				r.op = "parse";
+				measure(r, [&] () {
+					m_sink = m_parser.parse(buf, bend);
+				});
+				print(r);
+			}
+
+		private:
+			std::ostream m_null;
+			smpp::writer<std::ostream> m_writer;
+			sink m_parser;
+
+			bin::sz_t m_iterations;
+			bin::sz_t m_runs;
+			std::string m_filter;
+			bool m_json;
+			bin::sz_t m_failed;
+
+			/* Keeps results of measured calls observable */
+			const void * volatile m_sink;
+
+			template <class F>
+			void measure(result & r, F f) {
+				std::vector<double> ns(m_runs);
+				std::size_t count = heap::count.load();
+				std::size_t bytes = heap::bytes.load();
+				for (bin::sz_t run = 0; run < m_runs; ++run) {
+					clock_t::time_point start = clock_t::now();
+					for (bin::sz_t i = 0; i < m_iterations; ++i) {
+						f();
+					}
+					clock_t::duration d = clock_t::now() - start;
+					ns[run] = std::chrono::duration<double, std::nano>(d).count()
+						/ m_iterations;
+				}
+				std::sort(ns.begin(), ns.end());
+				double ops = static_cast<double>(m_iterations) * m_runs;
+				r.ns_per_op = ns[ns.size() / 2];
+				r.allocs_per_op = (heap::count.load() - count) / ops;
+				r.alloc_bytes_per_op = (heap::bytes.load() - bytes) / ops;
+			}
+
+			void print(const result & r) {
+				/* bytes/s divided by 2^20 */
+				double mbps = r.ns_per_op > 0
+					? r.pdu_bytes * 1e9 / r.ns_per_op / (1 << 20) : 0;
+				std::cout << std::fixed << std::setprecision(2);
+				if (m_json) {
+					std::cout << "{\"pdu\":\"" << r.pdu << "\""
+						<< ",\"variant\":\"" << r.variant << "\""
+						<< ",\"op\":\"" << r.op << "\""
+						<< ",\"iterations\":" << r.iterations
+						<< ",\"pdu_bytes\":" << r.pdu_bytes
+						<< ",\"ns_per_op\":" << r.ns_per_op
+						<< ",\"bytes_per_op\":" << r.pdu_bytes
+						<< ",\"allocs_per_op\":" << r.allocs_per_op
+						<< ",\"alloc_bytes_per_op\":" << r.alloc_bytes_per_op
+						<< ",\"mb_per_s\":" << mbps
+						<< "}" << std::endl;
+				} else {
+					std::cout << r.pdu
+						<< "," << r.variant
+						<< "," << r.op
+						<< "," << r.iterations
+						<< "," << r.pdu_bytes
+						<< "," << r.ns_per_op
+						<< "," << r.pdu_bytes
+						<< "," << r.allocs_per_op
+						<< "," << r.alloc_bytes_per_op
+						<< "," << mbps
+						<< std::endl;
+				}
+			}
+	};
+
+	/* Sample values */
+	const bin::u8_t callback[] = "79001234567";
+	const bin::u8_t subaddr[] = "\xA0" "12345";
+	const bin::u8_t session[] = "\x01\x02";
+
+	template <class MsgT>
+	void fill_sm(MsgT & msg) {
+		msg.set_serv_type("CMT");
+		msg.src_addr_ton			= 0x01;
+		msg.src_addr_npi			= 0x01;
+		msg.set_src_addr("79001234567");
+		msg.dst_addr_ton			= 0x01;
+		msg.dst_addr_npi			= 0x01;
+		msg.set_dst_addr("79007654321");
+		msg.esm_class				= 0x00;
+		msg.registered_delivery		= 0x01;
+		msg.data_coding				= 0x00;
+	}
+
+	/* Short message of the maximum length allowed */
+	template <class MsgT>
+	void fill_max_short_msg(MsgT & msg) {
+		msg.short_msg_len = sizeof(msg.short_msg);
+		for (bin::sz_t i = 0; i < sizeof(msg.short_msg); ++i) {
+			msg.short_msg[i] = 'a' + i % 26;
+		}
+	}
+
+	void fill_many_tlvs(smpp::submit_sm & msg) {
+		msg.user_msg_reference.set(0x10);
+		msg.src_port.set(0x10);
+		msg.src_addr_subunit.set(0x01);
+		msg.dst_port.set(0x10);
+		msg.dst_addr_subunit.set(0x01);
+		msg.sar_msg_ref_num.set(0x1234);
+		msg.sar_total_segments.set(0x03);
+		msg.sar_segment_seqnum.set(0x01);
+		msg.more_msgs_to_send.set(0x01);
+		msg.payload_type.set(0x00);
+		msg.privacy_ind.set(0x00);
+		msg.callback_num.set(callback, sizeof(callback) - 1);
+		msg.callback_num_pres_ind.set(0x01);
+		msg.callback_num_atag.set(callback, sizeof(callback) - 1);
+		msg.src_subaddr.set(subaddr, sizeof(subaddr) - 1);
+		msg.dst_subaddr.set(subaddr, sizeof(subaddr) - 1);
+		msg.user_resp_code.set(0x01);
+		msg.display_time.set(0x01);
+		msg.sms_signal.set(0x01);
+		msg.ms_validity.set(0x01);
+		msg.ms_msg_wait_fclts.set(0x01);
+		msg.number_of_msgs.set(0x01);
+		msg.alert_on_msg_delivery.set(0x01);
+		msg.lang_ind.set(0x01);
+		msg.its_reply_type.set(0x01);
+		msg.its_session_info.set(session, sizeof(session) - 1);
+		msg.ussd_serv_op.set(0x01);
+	}
+
+	void fill_many_tlvs(smpp::deliver_sm & msg) {
+		msg.user_msg_reference.set(0x10);
+		msg.src_port.set(0x10);
+		msg.dst_port.set(0x10);
+		msg.sar_msg_ref_num.set(0x1234);
+		msg.sar_total_segments.set(0x03);
+		msg.sar_segment_seqnum.set(0x01);
+		msg.payload_type.set(0x00);
+		msg.privacy_ind.set(0x00);
+		msg.callback_num.set(callback, sizeof(callback) - 1);
+		msg.src_subaddr.set(subaddr, sizeof(subaddr) - 1);
+		msg.dst_subaddr.set(subaddr, sizeof(subaddr) - 1);
+		msg.user_resp_code.set(0x01);
+		msg.lang_ind.set(0x01);
+		msg.its_session_info.set(session, sizeof(session) - 1);
+	}
+
+	void fill_many_tlvs(smpp::data_sm & msg) {
+		msg.user_msg_reference.set(0x10);
+		msg.src_port.set(0x10);
+		msg.src_addr_subunit.set(0x01);
+		msg.dst_port.set(0x10);
+		msg.dst_addr_subunit.set(0x01);
+		msg.sar_msg_ref_num.set(0x1234);
+		msg.sar_total_segments.set(0x03);
+		msg.sar_segment_seqnum.set(0x01);
+		msg.more_msgs_to_send.set(0x01);
+		msg.payload_type.set(0x00);
+		msg.privacy_ind.set(0x00);
+		msg.callback_num.set(callback, sizeof(callback) - 1);
+		msg.callback_num_pres_ind.set(0x01);
+		msg.callback_num_atag.set(callback, sizeof(callback) - 1);
+		msg.src_subaddr.set(subaddr, sizeof(subaddr) - 1);
+		msg.dst_subaddr.set(subaddr, sizeof(subaddr) - 1);
+		msg.user_resp_code.set(0x01);
+		msg.display_time.set(0x01);
+		msg.sms_signal.set(0x01);
+		msg.ms_validity.set(0x01);
+		msg.ms_msg_wait_fclts.set(0x01);
+		msg.number_of_msgs.set(0x01);
+		msg.alert_on_msg_delivery.set(0x01);
+		msg.lang_ind.set(0x01);
+		msg.its_reply_type.set(0x01);
+		msg.its_session_info.set(session, sizeof(session) - 1);
+	}
+
+	template <class BindT>
+	BindT make_bind() {
+		BindT msg;
+		msg.set_sys_id("esme0001");
+		msg.set_password("secret");
+		msg.set_sys_type("VMS");
+		msg.interface_version		= 0x34;
+		msg.addr_ton				= 0x01;
+		msg.addr_npi				= 0x01;
+		msg.set_addr_range("");
+		return msg;
+	}
+
+	template <class BindT>
+	BindT make_bind_r() {
+		BindT msg;
+		msg.set_sys_id("smsc");
+		msg.sc_interface_version.tag	= smpp::option::sc_interface_version;
+		msg.sc_interface_version.len	= 1;
+		msg.sc_interface_version.val	= 0x34;
+		return msg;
+	}
+
+	void run_all(bench & b, const std::vector<bin::u8_t> & payload) {
+		using namespace smpp;
+
+		b.run("bind_transmitter", "typical", make_bind<bind_transmitter>());
+		b.run("bind_transmitter_r", "typical", make_bind_r<bind_transmitter_r>());
+		b.run("bind_receiver", "typical", make_bind<bind_receiver>());
+		b.run("bind_receiver_r", "typical", make_bind_r<bind_receiver_r>());
+		b.run("bind_transceiver", "typical", make_bind<bind_transceiver>());
+		b.run("bind_transceiver_r", "typical", make_bind_r<bind_transceiver_r>());
+
+		{
+			outbind msg;
+			msg.set_sys_id("smsc");
+			msg.set_password("secret");
+			b.run("outbind", "typical", msg);
+		}
+
+		b.run("unbind", "typical", unbind());
+		b.run("unbind_r", "typical", unbind_r());
+		b.run("generic_nack", "typical", generic_nack());
+		b.run("enquire_link", "typical", enquire_link());
+		b.run("enquire_link_r", "typical", enquire_link_r());
+
+		{
+			submit_sm msg;
+			fill_sm(msg);
+			msg.protocol_id				= 0x00;
+			msg.priority_flag			= 0x00;
+			msg.set_schedule_delivery_time("");
+			msg.set_validity_period("000001000000000R");
+			msg.replace_if_present_flag	= 0x00;
+			msg.sm_default_msg_id		= 0x00;
+			msg.set_short_msg("Your code is 4711");
+			b.run("submit_sm", "typical", msg);
+
+			fill_max_short_msg(msg);
+			b.run("submit_sm", "max_short_msg", msg);
+
+			msg.short_msg_len = 0;
+			msg.msg_payload.set(payload.data(), payload.size());
+			b.run("submit_sm", "msg_payload", msg);
+
+			msg.msg_payload = tlv_msg_payload();
+			fill_max_short_msg(msg);
+			fill_many_tlvs(msg);
+			b.run("submit_sm", "many_tlvs", msg);
+		}
+
+		{
+			submit_sm_r msg;
+			msg.set_msg_id("0123456789abcdef");
+			b.run("submit_sm_r", "typical", msg);
+		}
+
+		{
+			submit_multi_sm msg;
+			msg.set_serv_type("CMT");
+			msg.src_addr_ton			= 0x01;
+			msg.src_addr_npi			= 0x01;
+			msg.set_src_addr("79001234567");
+			msg.registered_delivery		= 0x01;
+			for (int i = 0; i < 10; ++i) {
+				msg.add_dst_addr(0x01, 0x01, "7900765432" + std::to_string(i));
+			}
+			msg.set_short_msg("Your code is 4711");
+			b.run("submit_multi_sm", "typical", msg);
+
+			while (msg.add_dst_addr(0x01, 0x01, "79007654321"));
+			fill_max_short_msg(msg);
+			b.run("submit_multi_sm", "max_dsts", msg);
+		}
+
+		{
+			submit_multi_r msg;
+			msg.set_msg_id("0123456789abcdef");
+			b.run("submit_multi_r", "typical", msg);
+
+			for (; msg.no_unsuccess < 10; ++msg.no_unsuccess) {
+				unsuccess_smes & u = msg.unsuccess_sme[msg.no_unsuccess];
+				u.dst_addr_ton = 0x01;
+				u.dst_addr_npi = 0x01;
+				u.dst_addr_len = sizeof(callback);
+				std::memcpy(u.dst_addr, callback, sizeof(callback));
+				u.error_status_code = command_status::esme_rinvdstadr;
+			}
+			b.run("submit_multi_r", "unsuccess", msg);
+		}
+
+		{
+			deliver_sm msg;
+			fill_sm(msg);
+			msg.protocol_id				= 0x00;
+			msg.priority_flag			= 0x00;
+			msg.set_schedule_delivery_time();
+			msg.set_validity_period();
+			msg.replace_if_present_flag	= 0x00;
+			msg.sm_default_msg_id		= 0x00;
+			msg.set_short_msg("Your code is 4711");
+			b.run("deliver_sm", "typical", msg);
+
+			fill_max_short_msg(msg);
+			b.run("deliver_sm", "max_short_msg", msg);
+
+			msg.short_msg_len = 0;
+			msg.msg_payload.set(payload.data(), payload.size());
+			b.run("deliver_sm", "msg_payload", msg);
+
+			msg.msg_payload = tlv_msg_payload();
+			fill_max_short_msg(msg);
+			fill_many_tlvs(msg);
+			b.run("deliver_sm", "many_tlvs", msg);
+		}
+
+		{
+			deliver_sm_r msg;
+			msg.set_msg_id("");
+			b.run("deliver_sm_r", "typical", msg);
+		}
+
+		{
+			data_sm msg;
+			fill_sm(msg);
+			b.run("data_sm", "typical", msg);
+
+			msg.msg_payload.set(payload.data(), payload.size());
+			b.run("data_sm", "msg_payload", msg);
+
+			fill_many_tlvs(msg);
+			b.run("data_sm", "many_tlvs", msg);
+		}
+
+		{
+			data_sm_r msg;
+			msg.set_msg_id("0123456789abcdef");
+			b.run("data_sm_r", "typical", msg);
+
+			const bin::u8_t error[] = "\x03\x00\x0B";
+			const bin::u8_t text[] = "Absent subscriber";
+			msg.delivery_failure_reason.set(0x01);
+			msg.network_error_code.set(error, sizeof(error) - 1);
+			msg.additional_status_info_text.set(text, sizeof(text));
+			msg.dpf_result.set(0x01);
+			b.run("data_sm_r", "many_tlvs", msg);
+		}
+
+		{
+			query_sm msg;
+			msg.set_msg_id("0123456789abcdef");
+			msg.src_addr_ton			= 0x01;
+			msg.src_addr_npi			= 0x01;
+			msg.set_src_addr("79001234567");
+			b.run("query_sm", "typical", msg);
+		}
+
+		{
+			query_sm_r msg;
+			msg.set_msg_id("0123456789abcdef");
+			msg.set_final_date("");
+			msg.msg_state				= 0x02;
+			msg.error_code				= 0x00;
+			b.run("query_sm_r", "typical", msg);
+		}
+
+		{
+			cancel_sm msg;
+			msg.set_serv_type("");
+			msg.set_msg_id("0123456789abcdef");
+			msg.src_addr_ton			= 0x01;
+			msg.src_addr_npi			= 0x01;
+			msg.set_src_addr("79001234567");
+			msg.dst_addr_ton			= 0x01;
+			msg.dst_addr_npi			= 0x01;
+			msg.set_dst_addr("79007654321");
+			b.run("cancel_sm", "typical", msg);
+		}
+
+		b.run("cancel_sm_r", "typical", cancel_sm_r());
+
+		{
+			replace_sm msg;
+			msg.set_msg_id("0123456789abcdef");
+			msg.src_addr_ton			= 0x01;
+			msg.src_addr_npi			= 0x01;
+			msg.set_src_addr("79001234567");
+			msg.set_schedule_delivery_time("");
+			msg.set_validity_period("000001000000000R");
+			msg.registered_delivery		= 0x01;
+			msg.sm_default_msg_id		= 0x00;
+			msg.set_short_msg("Your code is 4711");
+			b.run("replace_sm", "typical", msg);
+
+			fill_max_short_msg(msg);
+			b.run("replace_sm", "max_short_msg", msg);
+		}
+
+		b.run("replace_sm_r", "typical", replace_sm_r());
+
+		{
+			alert_notification msg;
+			msg.src_addr_ton			= 0x01;
+			msg.src_addr_npi			= 0x01;
+			msg.set_src_addr("79001234567");
+			msg.esme_addr_ton			= 0x01;
+			msg.esme_addr_npi			= 0x01;
+			msg.set_esme_addr("79007654321");
+			msg.ms_availability_status.set(0x00);
+			b.run("alert_notification", "typical", msg);
+		}
+	}
+
+}
+
+int main(int argc, char ** argv)
+{
+	using namespace mobi::net;
+	namespace po = boost::program_options;
+
+	po::options_description options("Options");
+	options.add_options()
+		("help", "Produce help messages")
+		("iterations", po::value<std::size_t>()->default_value(100000)
+			, "Operations per run")
+		("runs", po::value<std::size_t>()->default_value(5)
+			, "Runs per operation, median is reported")
+		("payload", po::value<std::size_t>()->default_value(1024)
+			, "Size of msg_payload TLV value, up to 65535")
+		("filter", po::value<std::string>()->default_value("")
+			, "Measure only PDUs with names containing the string")
+		("json", "Output JSON lines instead of CSV")
+	;
+
+	po::variables_map opts;
+	po::store(po::parse_command_line(argc, argv, options), opts);
+
+	if (opts.count("help")) {
+		std::cout << options << std::endl;
+		return 1;
+	}
+
+	std::size_t payload_size = std::min<std::size_t>(
+		opts["payload"].as<std::size_t>(), 0xFFFF);
+	std::vector<toolbox::bin::u8_t> payload(payload_size);
+	for (std::size_t i = 0; i < payload.size(); ++i) {
+		payload[i] = 'a' + i % 26;
+	}
+
+	local::bench b(opts["iterations"].as<std::size_t>()
+		, opts["runs"].as<std::size_t>()
+		, opts["filter"].as<std::string>()
+		, opts.count("json") != 0);
+
+	b.header();
+	local::run_all(b, payload);
+
+	return b.failed() == 0 ? 0 : 1;
+}
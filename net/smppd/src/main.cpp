@@ -1,9 +1,35 @@
 
+#include <ctime>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <cstring>
 #include <sstream>
+#include <fstream>
 #include <chrono>
+#include <algorithm>
+#include <unordered_map>
 
 #include <vision/log.hpp>
+#include <smpp/cdr.hpp>
+#include <smpp/client.hpp>
+#include <smpp/concat.hpp>
+#include <smpp/dedup.hpp>
+#include <smpp/filter.hpp>
+#include <smpp/dlr.hpp>
+#include <smpp/receipt.hpp>
+#include <smpp/retry.hpp>
+#include <smpp/route.hpp>
+#include <smpp/fanout.hpp>
+#include <smpp/journal.hpp>
+#include <smpp/msgid.hpp>
+#include <smpp/portability.hpp>
 #include <smpp/service.hpp>
+#include <smpp/store.hpp>
+#include <smpp/time.hpp>
 #include <toolbox/toolbox.hpp>
 
 #include <boost/program_options.hpp>
@@ -19,27 +45,850 @@ namespace local {
 	namespace bs = boost::system;
 
 	typedef vision::log::source log_t;
-	typedef smpp::tcp_service<smpp::malloc_allocator, log_t> smpp_service;
+	/* Requests keep id of the message they are about */
+	typedef smpp::tcp_service<smpp::malloc_allocator, log_t, bin::u64_t> smpp_service;
+	typedef smpp::client<smpp::malloc_allocator, log_t> upstream_client;
 
 	class service: public smpp_service {
 
 		public:
+			/* Receipts of at most max_receipts messages sent upstream
+			 * are waited for, each one for receipt_ttl */
 			service(const ba::ip::tcp::endpoint & endpoint
 					, smpp::malloc_allocator & a
-					, log_t l)
+					, log_t l
+					, bin::u16_t node
+					, bin::sz_t max_receipts
+					, std::chrono::seconds receipt_ttl)
 				: smpp_service(endpoint, a, std::move(l))
+				, ids(node)
+				, parts(max_concat_groups, max_concat_bytes
+					, std::chrono::seconds(concat_timeout_s))
+				, receipts(max_receipts, receipt_ttl)
+				, retries(max_retries, smpp::retrier<bin::u64_t>::policy())
+				, held_count(0)
+				, upstream(nullptr)
+				, journal(nullptr)
+				, journal_failing(false)
+				, portability(nullptr)
+				, content(nullptr)
+				, cdrs(nullptr)
+				, dedup_window(0)
+				, query_window(0)
+				, replay_id(0)
+				, pdus(L)
 			{
-				msg_id = 0;
 			}
 
 			virtual ~service()
 			{
 			}
 
+			/* Accepted messages are answered once they are in the
+			 * journal. Set before start. */
+			void set_journal(smpp::journal * j) {
+				journal = j;
+			}
+
+			/* Messages routed to a pool with an account of c are submitted
+			 * there by its number in accounts, their receipts come back
+			 * through c. Set before start of both. */
+			void set_upstream(upstream_client & c
+					, const std::unordered_map<std::string, bin::sz_t> & accounts) {
+				upstream = &c;
+				upstream_accounts = accounts;
+				c.set_deliver_handler([this] (bin::sz_t, const smpp::deliver_sm & msg) {
+					if (!smpp::is_receipt(msg)) {
+						return;
+					}
+					/* Payload lives in the client receive buffer */
+					incoming_receipt in;
+					in.msg = msg;
+					if (msg.msg_payload.tag == smpp::option::msg_payload) {
+						in.payload.assign(msg.msg_payload.val, msg.msg_payload.val + msg.msg_payload.len);
+					}
+					bool first;
+					{
+						std::lock_guard<std::mutex> lock(upstream_mtx);
+						first = upstream_in.empty() && upstream_done.empty();
+						upstream_in.push_back(std::move(in));
+					}
+					if (first) {
+						wake();
+					}
+				});
+			}
+
+			/* Messages are routed by the current table of r, all of them
+			 * are handled locally if unset. Set before start. */
+			void set_router(const smpp::router & r) {
+				routes.reset(new smpp::router::reader(r));
+			}
+
+			/* Answer submit_sm of a message accepted within window with
+			 * the id of that one, filters take memory bytes in total */
+			void set_dedup(bin::sz_t memory, std::chrono::seconds window) {
+				dedup.reset(new smpp::dedup_filter(memory, window
+					, smpp::dedup_filter::clock_t::now()));
+				dedup_window = window.count();
+			}
+
+			/* Messages in a final state are answered to query_sm for
+			 * window, then forgotten. Set before start. */
+			void set_query_window(std::chrono::seconds window) {
+				query_window = window.count();
+			}
+
+			/* Ported numbers are routed by the routing number of their
+			 * operator put in front of them. Set before start. */
+			void set_portability(const smpp::np_database * db) {
+				portability = db;
+			}
+
+			/* Messages with text matching a pattern of f are
+			 * rejected. Set before start. */
+			void set_content_filter(const smpp::content_filter * f) {
+				content = f;
+			}
+
+			/* Billing records of accepted and settled messages go
+			 * to w, submits are throttled while it falls behind.
+			 * Set before start. */
+			void set_cdr_writer(smpp::cdr_writer & w) {
+				cdrs = &w.add_producer();
+			}
+
+			/* Load messages kept in the journal into the store and start
+			 * its sync. Returns false if the journal can not be read. */
+			bool recover(bin::sz_t & count) {
+				count = 0;
+				bool ok = journal->open([this, &count] (bin::u64_t id, const bin::u8_t * pdu, bin::sz_t len) {
+					replay_id = id;
+					replay(0, pdu, len);
+					count++;
+				});
+				journal->start([this] (bin::u64_t) {
+					journal_failing = false;
+					wake();
+				}, [this] (bin::u32_t failures) {
+					if (failures == max_sync_failures) {
+						journal_failing = true;
+						wake();
+					}
+				});
+				return ok;
+			}
+
 		protected:
 			using smpp_service::L;
 
-			bin::sz_t msg_id;
+			/* Limits of concatenated messages being reassembled */
+			static const bin::sz_t max_concat_groups = 4096;
+			static const bin::sz_t max_concat_bytes = 4 << 20;
+			static const bin::sz_t concat_timeout_s = 60;
+
+			/* Slots of the table of messages sent upstream
+			 * checked for expiry of their receipts per tick */
+			static const bin::sz_t receipt_sweep_slots = 4096;
+			static const bin::sz_t max_retries = 1 << 20;
+			static const bin::sz_t max_held = 1 << 16;
+
+			/* Validity of messages which do not set one, and most
+			 * scheduled or expiring messages handled per tick */
+			static const bin::sz_t default_validity_s = 72 * 3600;
+			static const bin::sz_t schedule_batch = 1 << 16;
+
+			/* Spare dedup filter bytes cleared per tick */
+			static const bin::sz_t dedup_clear_bytes = 1 << 20;
+
+			/* Most committed responses put in one write */
+			static const bin::sz_t response_batch = 512;
+			/* Journal syncs failed in a row before the submits
+			 * waiting for them are answered with ESME_RSYSERR */
+			static const bin::u32_t max_sync_failures = 8;
+
+			smpp::msgid ids;
+			smpp::reassembler parts;
+			smpp::store messages;
+			smpp::correlator receipts;
+
+			/* Receipts sent to receivers of the system the message came
+			 * from until they are answered, retried with backoff per
+			 * system when those are busy */
+			struct outgoing {
+				smpp::deliver_sm msg;
+				bin::u64_t sys_key;
+				bin::u32_t attempt;
+			};
+			std::unordered_map<bin::u64_t, outgoing> receipts_out;
+			smpp::retrier<bin::u64_t> retries;
+			/* Receiver and transceiver channels by sys_id key, and
+			 * receipts of systems with none bound waiting for one */
+			std::unordered_map<bin::u64_t, std::vector<bin::sz_t> > receivers;
+			std::unordered_map<bin::u64_t, std::deque<bin::u64_t> > held;
+			bin::sz_t held_count;
+
+			/* Client submitting messages upstream, account of every pool
+			 * it has one for, and what comes from its thread */
+			struct submitted {
+				bin::u64_t id;
+				bin::u64_t sys_key;
+				smpp::submit_sm_r r;
+			};
+			struct incoming_receipt {
+				smpp::deliver_sm msg;
+				std::vector<bin::u8_t> payload;
+			};
+			upstream_client * upstream;
+			std::unordered_map<std::string, bin::sz_t> upstream_accounts;
+			std::mutex upstream_mtx;
+			std::vector<submitted> upstream_done;
+			std::vector<incoming_receipt> upstream_in;
+
+			/* Ids of messages held until their delivery time and ones
+			 * to expire, cancelled and delivered ones are skipped */
+			smpp::scheduler<bin::u64_t> scheduled;
+			smpp::scheduler<bin::u64_t> expiring;
+			/* Messages in a final state, due to be erased */
+			smpp::scheduler<bin::u64_t> retiring;
+			smpp::journal * journal;
+			/* Set by the journal thread once syncs fail
+			 * max_sync_failures times in a row, until one works */
+			std::atomic<bool> journal_failing;
+
+			/* View of the route table and sys_id keys of bound channels */
+			std::unique_ptr<smpp::router::reader> routes;
+			std::unordered_map<bin::sz_t, bin::u64_t> sys_keys;
+			const smpp::np_database * portability;
+			const smpp::content_filter * content;
+			/* Billing records and sys_id of bound channels for them */
+			smpp::cdr_writer::producer * cdrs;
+			std::unordered_map<bin::sz_t, std::string> sys_ids;
+			std::unique_ptr<smpp::dedup_filter> dedup;
+			std::time_t dedup_window;
+			std::time_t query_window;
+			/* Id of the journal record being replayed */
+			bin::u64_t replay_id;
+
+			/* Journal records of messages made here, e.g. one
+			 * per destination of submit_multi_sm */
+			smpp::writer<log_t> pdus;
+			std::vector<bin::u8_t> record;
+
+			/* Responses waiting for their messages to be synced */
+			template <class RespT>
+			struct deferred {
+				bin::sz_t channel_id;
+				bin::u64_t lsn;
+				RespT r;
+			};
+			std::deque<deferred<smpp::submit_sm_r> > responses;
+			std::deque<deferred<smpp::submit_multi_r> > multi_responses;
+
+			/* Committed responses of a channel in a row go out
+			 * together, in one write of the channel */
+			template <class RespT>
+			void send_committed(std::deque<deferred<RespT> > & q, bin::u64_t committed) {
+				std::vector<RespT> batch;
+				while (!q.empty() && q.front().lsn <= committed) {
+					bin::sz_t channel_id = q.front().channel_id;
+					batch.clear();
+					while (!q.empty() && q.front().lsn <= committed
+							&& q.front().channel_id == channel_id
+							&& batch.size() < response_batch) {
+						batch.push_back(q.front().r);
+						q.pop_front();
+					}
+					smpp_service::send_batch(channel_id, batch.begin(), batch.end());
+				}
+			}
+
+			void send_committed() {
+				bin::u64_t committed = journal->committed();
+				send_committed(responses, committed);
+				send_committed(multi_responses, committed);
+				if (journal_failing && !(responses.empty() && multi_responses.empty())) {
+					lerror(L) << "journal sync is failing, "
+						<< responses.size() + multi_responses.size()
+						<< " submits answered with ESME_RSYSERR";
+					fail(responses);
+					fail(multi_responses);
+				}
+			}
+
+			/* Messages of the responses stay accepted, they are
+			 * synced and delivered if the journal recovers */
+			template <class RespT>
+			void fail(std::deque<deferred<RespT> > & q) {
+				for (deferred<RespT> & d: q) {
+					d.r.command.status = smpp::command_status::esme_rsyserr;
+					d.r.msg_id[0] = '\0';
+					d.r.msg_id_len = 1;
+					smpp_service::send(d.channel_id, d.r);
+				}
+				q.clear();
+			}
+
+			template <class RespT>
+			static void drop(std::deque<deferred<RespT> > & q, bin::sz_t channel_id) {
+				q.erase(std::remove_if(q.begin(), q.end()
+					, [channel_id] (const deferred<RespT> & d) {
+						return d.channel_id == channel_id;
+					}), q.end());
+			}
+
+			/* Journal sm as the submit_sm of message id.
+			 * Returns its lsn or 0 on failure. */
+			bin::u64_t append(bin::u64_t id, smpp::submit_sm & sm) {
+				sm.command.len = sm.raw_size();
+				record.resize(sm.command.len);
+				bin::u8_t * bend = record.data() + record.size();
+				if (pdus.write(record.data(), bend, sm) != bend) {
+					return 0;
+				}
+				return journal->append(id, record.data(), record.size());
+			}
+
+			/* Journal sync is complete or upstream has sent something */
+			void on_wake() {
+				if (journal != nullptr) {
+					send_committed();
+				}
+				std::vector<submitted> done;
+				std::vector<incoming_receipt> in;
+				{
+					std::lock_guard<std::mutex> lock(upstream_mtx);
+					done.swap(upstream_done);
+					in.swap(upstream_in);
+				}
+				for (const submitted & d: done) {
+					on_submitted(d);
+				}
+				for (incoming_receipt & r: in) {
+					if (!r.payload.empty()) {
+						r.msg.msg_payload.set(r.payload.data(), r.payload.size());
+					}
+					forward_receipt(r.msg);
+				}
+			}
+
+			void on_closed(bin::sz_t channel_id) {
+				auto key = sys_keys.find(channel_id);
+				if (key != sys_keys.end()) {
+					auto it = receivers.find(key->second);
+					if (it != receivers.end()) {
+						std::vector<bin::sz_t> & ch = it->second;
+						ch.erase(std::remove(ch.begin(), ch.end(), channel_id), ch.end());
+						if (ch.empty()) {
+							receivers.erase(it);
+						}
+					}
+					sys_keys.erase(key);
+				}
+				sys_ids.erase(channel_id);
+				drop(responses, channel_id);
+				drop(multi_responses, channel_id);
+			}
+
+			/* Absolute SMPP time of a final state, empty while pending */
+			static void set_final_date(smpp::query_sm_r & r, std::time_t t) {
+				if (t == 0) {
+					r.final_date[0] = '\0';
+					r.final_date_len = 1;
+					return;
+				}
+				smpp::format_time(t, r.final_date);
+				r.final_date_len = sizeof(r.final_date);
+			}
+
+			/* Delivery and expiry time of a message submitted at now, delivery
+			 * is 0 if immediate. Returns status to answer the message with. */
+			template <typename MsgT>
+			static bin::u32_t get_times(const MsgT & msg, std::time_t now
+					, std::time_t & deliver, std::time_t & expires) {
+				if (!smpp::parse_time(msg.schedule_delivery_time
+						, sizeof(msg.schedule_delivery_time), now, deliver)) {
+					return smpp::command_status::esme_rinvsched;
+				}
+				if (!smpp::parse_time(msg.validity_period
+						, sizeof(msg.validity_period), now, expires)) {
+					return smpp::command_status::esme_rinvexpiry;
+				}
+				if (expires == 0) {
+					expires = (deliver > now ? deliver : now) + default_validity_s;
+				}
+				if (expires <= now || expires <= deliver) {
+					return smpp::command_status::esme_rinvexpiry;
+				}
+				return smpp::command_status::esme_rok;
+			}
+
+			void plan(bin::u64_t id, std::time_t now, std::time_t deliver, std::time_t expires) {
+				if (deliver > now) {
+					scheduled.add(deliver, id);
+				}
+				expiring.add(expires, id);
+			}
+
+			/* Message has reached a final state, its record is
+			 * kept for query_sm until the window is over */
+			void retire(bin::u64_t id) {
+				retiring.add(std::time(nullptr) + query_window, id);
+			}
+
+			/* Pool of upstreams to send a message to, nil if every message
+			 * is handled locally. Returns false if there is no route. */
+			bool route(bin::sz_t channel_id, const bin::u8_t * dst, bin::sz_t len
+					, bin::u8_t ton, bin::u8_t npi, bin::u32_t & pool) {
+				pool = smpp::route_table::nil;
+				const smpp::route_table * t = routes ? routes->table() : nullptr;
+				if (t == nullptr) {
+					return true;
+				}
+				bin::u8_t ported[smpp::np::op_name + 24];
+				bin::u32_t op = portability ? portability->find(dst, len) : smpp::np::nil;
+				if (op != smpp::np::nil) {
+					const char * rn = portability->name(op);
+					bin::sz_t n = ::strnlen(rn, smpp::np::op_name);
+					std::memcpy(ported, rn, n);
+					for (bin::sz_t i = 0; i < len && dst[i] != '\0' && n < sizeof(ported); ++i) {
+						if (dst[i] != '+') {
+							ported[n++] = dst[i];
+						}
+					}
+					dst = ported;
+					len = n;
+				}
+				auto it = sys_keys.find(channel_id);
+				pool = t->find(dst, len, ton, npi, it == sys_keys.end() ? 0 : it->second);
+				return pool != smpp::route_table::nil;
+			}
+
+			/* Message is accepted for the upstreams of pool and goes to
+			 * the upstream account of the pool if there is one. Scheduled
+			 * ones go at once with their times, upstream holds them. */
+			void forward(bin::sz_t channel_id, bin::u64_t id, bin::u32_t pool
+					, const smpp::submit_sm & msg) {
+				if (pool == smpp::route_table::nil) {
+					return;
+				}
+				const std::string & name = routes->table()->pool(pool);
+				auto acc = upstream_accounts.find(name);
+				if (upstream == nullptr || acc == upstream_accounts.end()) {
+					ldebug(L) << "message #" << std::hex << id << std::dec
+						<< " routed to " << name;
+					return;
+				}
+				auto it = sys_keys.find(channel_id);
+				bin::u64_t sys_key = it == sys_keys.end() ? 0 : it->second;
+				/* Payload is referenced by the client until the response */
+				smpp::submit_sm sm = msg;
+				std::shared_ptr<std::vector<bin::u8_t> > payload;
+				if (msg.msg_payload.tag == smpp::option::msg_payload) {
+					payload = std::make_shared<std::vector<bin::u8_t> >(msg.msg_payload.val
+						, msg.msg_payload.val + msg.msg_payload.len);
+					sm.msg_payload.set(payload->data(), msg.msg_payload.len);
+				}
+				if (!upstream->submit(acc->second, sm, [this, id, sys_key, payload] (const smpp::submit_sm_r & r) {
+						submitted d = { id, sys_key, r };
+						bool first;
+						{
+							std::lock_guard<std::mutex> lock(upstream_mtx);
+							first = upstream_done.empty() && upstream_in.empty();
+							upstream_done.push_back(d);
+						}
+						if (first) {
+							wake();
+						}
+					})) {
+					lwarning(L) << "message #" << std::hex << id << std::dec
+						<< " not sent, queue of " << name << " is full";
+					undeliverable(id, smpp::command_status::esme_rmsgqful);
+				}
+			}
+
+			/* Upstream answered a submit, rejected messages are settled,
+			 * lost ones stay pending as they may have gone through */
+			void on_submitted(const submitted & d) {
+				bin::u32_t status = d.r.command.status;
+				if (status == smpp::command_status::esme_rok) {
+					expect_receipt(d.sys_key, d.id, d.r.msg_id, d.r.msg_id_len);
+					return;
+				}
+				lwarning(L) << "message #" << std::hex << d.id << std::dec
+					<< " rejected upstream: " << status;
+				if (status != upstream_client::lost && !smpp::transient(status)) {
+					undeliverable(d.id, status);
+				}
+			}
+
+			void undeliverable(bin::u64_t id, bin::u32_t status) {
+				bin::u8_t error = static_cast<bin::u8_t>(status);
+				if (messages.update(id, smpp::message_state::undeliverable, error
+						, smpp::store::clock_t::now())) {
+					retire(id);
+				}
+				bill(smpp::cdr::final, id, smpp::message_state::undeliverable, error);
+				if (journal != nullptr) {
+					journal->remove(id);
+				}
+			}
+
+			/* ESME bound on the channel, 0 before bind */
+			bin::u64_t sys_key_of(bin::sz_t channel_id) const {
+				auto it = sys_keys.find(channel_id);
+				return it == sys_keys.end() ? 0 : it->second;
+			}
+
+			/* Resent message accepted within the dedup window, r gets the
+			 * id of the first one. Filter hits are confirmed by the store,
+			 * which keeps short messages but not payloads. */
+			bool duplicate(bin::sz_t channel_id, const smpp::submit_sm & msg, smpp::submit_sm_r & r) {
+				if (!dedup) {
+					return false;
+				}
+				bin::u64_t sys_key = sys_key_of(channel_id);
+				smpp::dedup_hash h(sys_key);
+				h.add(msg.src_addr, msg.src_addr_len);
+				h.add(msg.dst_addr, msg.dst_addr_len);
+				h.add(msg.short_msg, msg.short_msg_len);
+				bool payload = msg.msg_payload.tag == smpp::option::msg_payload;
+				if (payload) {
+					h.add(msg.msg_payload.val, msg.msg_payload.len);
+				}
+				if (!dedup->check(h.value(), smpp::dedup_filter::clock_t::now()) || payload) {
+					return false;
+				}
+				bin::u64_t id = messages.duplicate_of(msg, sys_key, std::time(nullptr) - dedup_window);
+				if (id == 0) {
+					return false;
+				}
+				lwarning(L) << "channel #" << channel_id << " duplicate of message #"
+					<< std::hex << id << std::dec;
+				smpp::msgid::format(id, r.msg_id);
+				r.msg_id_len = smpp::msgid::text_len;
+				return true;
+			}
+
+			/* Text of msg matches a content filter pattern */
+			template <class MsgT>
+			bool blocked(bin::sz_t channel_id, const MsgT & msg) {
+				return blocked(channel_id, content ? content->find(msg) : smpp::content_filter::nil);
+			}
+
+			/* Text of a reassembled message matches one */
+			bool blocked(bin::sz_t channel_id, bin::u8_t dc, const bin::u8_t * text, bin::sz_t len) {
+				return blocked(channel_id, content ? content->find(dc, text, len) : smpp::content_filter::nil);
+			}
+
+			bool blocked(bin::sz_t channel_id, bin::u32_t pattern) {
+				if (pattern == smpp::content_filter::nil) {
+					return false;
+				}
+				lwarning(L) << "channel #" << channel_id << " message blocked by pattern \""
+					<< content->pattern(pattern) << "\"";
+				return true;
+			}
+
+			/* Billing records are lost rather than waited for,
+			 * the writer reports how many now and then */
+			void bill(const smpp::cdr & r) {
+				if (cdrs != nullptr) {
+					cdrs->push(r);
+				}
+			}
+
+			void bill(smpp::cdr::event_t e, bin::u64_t id, bin::u8_t state, bin::u8_t error = 0) {
+				if (cdrs != nullptr) {
+					smpp::cdr r = smpp::cdr::of(e, id);
+					r.state = state;
+					r.error = error;
+					bill(r);
+				}
+			}
+
+			/* Parts is the number of parts of the concatenated
+			 * message msg completes, see reassemble */
+			template <class MsgT>
+			void bill_accepted(bin::sz_t channel_id, bin::u64_t id, const MsgT & msg
+					, const bin::u8_t * dst, bin::sz_t len, bin::u8_t ton, bin::u8_t npi
+					, bin::u8_t parts = 0) {
+				if (cdrs == nullptr) {
+					return;
+				}
+				smpp::cdr r = smpp::cdr::of(smpp::cdr::accepted, id);
+				r.state = smpp::message_state::enroute;
+				r.set_message(msg);
+				r.parts = parts;
+				r.set_dst(dst, len, ton, npi);
+				auto it = sys_ids.find(channel_id);
+				if (it != sys_ids.end()) {
+					r.set_sys_id(reinterpret_cast<const bin::u8_t *>(it->second.data()), it->second.size());
+				}
+				bill(r);
+			}
+
+			/* Submits wait while billing records pile up */
+			bool billing_congested() const {
+				return cdrs != nullptr && cdrs->congested();
+			}
+
+			/* Message held until its delivery time is due */
+			void release(bin::u64_t id) {
+				ldebug(L) << "message #" << std::hex << id << std::dec << " is due for delivery";
+			}
+
+			/* Collect parts of concatenated messages, true if msg
+			 * completes one, m then refers to the whole text until
+			 * the next part is collected */
+			template <typename MsgT>
+			bool reassemble(bin::sz_t channel_id, const MsgT & msg, smpp::reassembler::message & m) {
+				smpp::segment s;
+				if (!smpp::get_segment(msg, s)) {
+					return false;
+				}
+				switch (parts.insert(msg.src_addr, msg.src_addr_len
+							, msg.dst_addr, msg.dst_addr_len
+							, s, smpp::reassembler::clock_t::now(), m)) {
+					case smpp::reassembler::complete:
+						ldebug(L) << "channel #" << channel_id
+							<< " concatenated message from "
+							<< std::string(msg.src_addr, msg.src_addr + msg.src_addr_len)
+							<< " " << static_cast<int>(m.total) << " parts, " << m.len << " bytes";
+						return true;
+					case smpp::reassembler::invalid:
+					case smpp::reassembler::overflow:
+						lwarning(L) << "channel #" << channel_id
+							<< " part " << static_cast<int>(s.seqnum)
+							<< "/" << static_cast<int>(s.total)
+							<< " of message #" << s.ref << " dropped";
+						break;
+					default:
+						break;
+				}
+				return false;
+			}
+
+			/* Message is sent upstream and known there by id, its
+			 * receipts go back to the system with sys_key it came from */
+			bool expect_receipt(bin::u64_t sys_key, bin::u64_t id
+					, const bin::u8_t * upstream_id, bin::sz_t len) {
+				smpp::correlator::origin o;
+				o.msg_id = id;
+				o.sys_key = sys_key;
+				o.submit_time = smpp::msgid::clock_t::to_time_t(smpp::msgid::time(id));
+				if (!receipts.insert(upstream_id, len, o, smpp::correlator::clock_t::now())) {
+					lwarning(L) << "receipt table is full, " << receipts.size()
+						<< " entries, " << receipts.memory() << " bytes";
+					return false;
+				}
+				return true;
+			}
+
+			/* Receipt from upstream goes to the system the message came
+			 * from, with the id it was given there. Final one settles
+			 * the message. Id and state are taken from TLVs, or from
+			 * the text if upstream sends none. */
+			void forward_receipt(const smpp::deliver_sm & msg) {
+				smpp::receipt text;
+				bool has_text = smpp::get_receipt(msg, text);
+				const bin::u8_t * upstream_id = text.id;
+				bin::sz_t len = text.id_len;
+				if (!smpp::receipted_id(msg, upstream_id, len) && !has_text) {
+					return;
+				}
+				bin::u8_t state = msg.msg_state.tag == smpp::option::msg_state
+					? msg.msg_state.val : text.state;
+				bool final = state != smpp::message_state::enroute
+					&& state != smpp::message_state::accepted
+					&& state != smpp::message_state::unknown;
+				smpp::correlator::origin o;
+				smpp::correlator::time_point now = smpp::correlator::clock_t::now();
+				if (!(final ? receipts.take(upstream_id, len, o, now)
+						: receipts.find(upstream_id, len, o, now))) {
+					ldebug(L) << "receipt for unknown message "
+						<< std::string(upstream_id, upstream_id + len);
+					return;
+				}
+				if (final) {
+					if (messages.update(o.msg_id, state, text.err, smpp::store::clock_t::now())) {
+						retire(o.msg_id);
+					}
+					bill(smpp::cdr::final, o.msg_id, state, text.err);
+					if (journal != nullptr) {
+						journal->remove(o.msg_id);
+					}
+				}
+				smpp::deliver_sm r = msg;
+				bin::u8_t id[smpp::msgid::text_len];
+				smpp::msgid::format(o.msg_id, id);
+				r.receipted_msg_id.set(id, sizeof(id));
+				if (has_text) {
+					text.id = id;
+					text.id_len = sizeof(id) - 1;
+					smpp::set_receipt(r, text);
+				}
+				if (r.msg_payload.tag == smpp::option::msg_payload) {
+					/* Payload lives in the receive buffer, no retries */
+					auto it = receivers.find(o.sys_key);
+					if (it == receivers.end()
+							|| send_request(it->second[o.msg_id % it->second.size()], r, 0) == 0) {
+						lwarning(L) << "receipt for message #" << std::hex << o.msg_id
+							<< std::dec << " is not sent";
+					}
+					return;
+				}
+				outgoing & out = receipts_out[o.msg_id];
+				out.msg = r;
+				out.sys_key = o.sys_key;
+				out.attempt = 0;
+				send_receipt(o.msg_id);
+			}
+
+			/* Receipt goes to a receiver of its system with room in
+			 * the window, or waits for one to bind if there is none */
+			void send_receipt(bin::u64_t id) {
+				auto out = receipts_out.find(id);
+				if (out == receipts_out.end()) {
+					return;
+				}
+				auto it = receivers.find(out->second.sys_key);
+				if (it == receivers.end()) {
+					hold(out);
+					return;
+				}
+				const std::vector<bin::sz_t> & ch = it->second;
+				for (bin::sz_t i = 0; i < ch.size(); ++i) {
+					if (send_request(ch[(id + i) % ch.size()], out->second.msg, id) != 0) {
+						return;
+					}
+				}
+				receipt_failed(id);
+			}
+
+			void hold(std::unordered_map<bin::u64_t, outgoing>::iterator out) {
+				if (out->second.attempt != 0) {
+					retries.finished();
+					out->second.attempt = 0;
+				}
+				if (held_count >= max_held) {
+					lwarning(L) << "receipt for message #" << std::hex << out->first << std::dec
+						<< " dropped, " << held_count << " held for systems with no receiver";
+					receipts_out.erase(out);
+					return;
+				}
+				held[out->second.sys_key].push_back(out->first);
+				held_count++;
+			}
+
+			/* Channel takes receipts of its system, held ones go to it */
+			void add_receiver(bin::sz_t channel_id) {
+				bin::u64_t key = sys_keys[channel_id];
+				receivers[key].push_back(channel_id);
+				auto it = held.find(key);
+				if (it == held.end()) {
+					return;
+				}
+				std::deque<bin::u64_t> ids;
+				ids.swap(it->second);
+				held.erase(it);
+				held_count -= ids.size();
+				for (bin::u64_t id: ids) {
+					send_receipt(id);
+				}
+			}
+
+			/* Receivers of the system are busy, their windows are
+			 * full or they do not answer */
+			void receipt_failed(bin::u64_t id) {
+				auto it = receipts_out.find(id);
+				if (it == receipts_out.end()) {
+					return;
+				}
+				if (it->second.attempt != 0) {
+					retries.finished();
+				}
+				if (!retries.failed(it->second.sys_key, id, it->second.attempt
+						, smpp::retrier<bin::u64_t>::clock_t::now())) {
+					lwarning(L) << "receipt for message #"
+						<< std::hex << id << std::dec << " dropped after "
+						<< it->second.attempt + 1 << " attempts";
+					receipts_out.erase(it);
+				}
+			}
+
+			void on_response(bin::sz_t channel_id, const smpp::deliver_sm_r & msg, const bin::u64_t & id) {
+				trace_got(channel_id, msg.command);
+				auto it = receipts_out.find(id);
+				if (it == receipts_out.end()) {
+					return;
+				}
+				if (smpp::transient(msg.command.status)) {
+					receipt_failed(id);
+					return;
+				}
+				if (it->second.attempt != 0) {
+					retries.finished();
+				}
+				if (msg.command.status == smpp::command_status::esme_rok) {
+					retries.succeeded(it->second.sys_key);
+				} else {
+					lwarning(L) << "channel #" << channel_id << " receipt for message #"
+						<< std::hex << id << std::dec << " rejected: " << msg.command.status;
+				}
+				receipts_out.erase(it);
+			}
+
+			void on_expire(bin::sz_t channel_id, bin::u32_t seqno, const bin::u64_t & id) {
+				ldebug(L) << "channel #" << channel_id << " request #" << seqno << " expired";
+				receipt_failed(id);
+			}
+
+			void on_timer() {
+				if (journal != nullptr) {
+					send_committed();
+				}
+				receipts.expire(smpp::correlator::clock_t::now(), receipt_sweep_slots);
+				if (dedup) {
+					dedup->maintain(smpp::dedup_filter::clock_t::now(), dedup_clear_bytes);
+				}
+				std::time_t now = std::time(nullptr);
+				scheduled.poll(now, schedule_batch, [this] (bin::u64_t id) {
+					if (messages.is_pending(id)) {
+						release(id);
+					}
+				});
+				expiring.poll(now, schedule_batch, [this] (bin::u64_t id) {
+					if (!messages.expire(id, smpp::store::clock_t::now())) {
+						return;
+					}
+					ldebug(L) << "message #" << std::hex << id << std::dec << " expired";
+					retire(id);
+					bill(smpp::cdr::expired, id, smpp::message_state::expired);
+					if (journal != nullptr) {
+						journal->remove(id);
+					}
+				});
+				retiring.poll(now, schedule_batch, [this] (bin::u64_t id) {
+					messages.erase(id);
+				});
+				retries.poll(smpp::retrier<bin::u64_t>::clock_t::now()
+					, [this] (bin::u64_t, bin::u64_t id, bin::u32_t attempt) {
+						auto it = receipts_out.find(id);
+						if (it == receipts_out.end()) {
+							retries.finished();
+							return;
+						}
+						it->second.attempt = attempt;
+						send_receipt(id);
+					});
+				parts.expire(smpp::reassembler::clock_t::now()
+					, [this] (bin::u16_t ref, bin::u8_t received, bin::u8_t total) {
+						lwarning(L) << "concatenated message #" << ref
+							<< " timed out with " << static_cast<int>(received)
+							<< "/" << static_cast<int>(total) << " parts";
+					});
+			}
 
 			void on_recv_error(bin::sz_t channel_id) {
 				ltrace(L) << "channel #" << channel_id << " recv error";
@@ -58,102 +907,361 @@ namespace local {
 				lerror(L) << "channel #" << channel_id << " parse error";
 			}
 
+			/* Session is bound once the response is sent */
+			template <typename BindT, typename RespT>
+			void bind(bin::sz_t channel_id, const BindT & msg, RespT & r) {
+				sys_keys[channel_id] = smpp::route_table::sys_key(msg.sys_id, msg.sys_id_len);
+				if (cdrs != nullptr) {
+					sys_ids[channel_id].assign(msg.sys_id, msg.sys_id + ::strnlen(
+						reinterpret_cast<const char *>(msg.sys_id), msg.sys_id_len));
+				}
+				std::memcpy(r.sys_id, msg.sys_id, msg.sys_id_len);
+				r.sys_id_len = msg.sys_id_len;
+				r.sc_interface_version.set(msg.interface_version);
+				r.command.seqno = msg.command.seqno;
+				smpp_service::send(channel_id, r);
+			}
+
 			void on_bind_transmitter(bin::sz_t channel_id, const smpp::bind_transmitter & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
+				smpp::bind_transmitter_r r;
+				bind(channel_id, msg, r);
 			}
 
 			void on_bind_receiver(bin::sz_t channel_id, const smpp::bind_receiver & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
+				smpp::bind_receiver_r r;
+				bind(channel_id, msg, r);
+				add_receiver(channel_id);
 			}
 
 			void on_bind_transceiver(bin::sz_t channel_id, const smpp::bind_transceiver & msg) {
-				std::string sys_id(reinterpret_cast<const char *>(msg.sys_id), msg.password_len);
-				std::string password(reinterpret_cast<const char *>(msg.password), msg.password_len);
+				trace_got(channel_id, msg.command);
 				smpp::bind_transceiver_r r;
-				std::memcpy(r.sys_id, msg.sys_id, msg.sys_id_len);
-				r.sys_id_len = msg.sys_id_len;
-				r.sc_interface_version.set(msg.interface_version);
-				r.command.seqno = msg.command.seqno;
-				smpp_service::send(channel_id, r);
+				bind(channel_id, msg, r);
+				add_receiver(channel_id);
 			}
 
 			void on_unbind(bin::sz_t channel_id, const smpp::unbind & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
+				smpp::unbind_r r;
+				r.command.seqno = msg.command.seqno;
+				smpp_service::send(channel_id, r);
 			}
 
 			void on_outbind(bin::sz_t channel_id, const smpp::outbind & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
 			}
 
 			void on_generic_nack(bin::sz_t channel_id, const smpp::generic_nack & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
 			}
 
 			void on_submit_sm(bin::sz_t channel_id, const smpp::submit_sm & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
-				std::string id(std::to_string(msg_id++));
+				std::time_t deliver, expires;
+				if (replaying()) {
+					/* Relative times count from acceptance. The journal
+					 * does not keep the ESME, so resends of replayed
+					 * messages are not taken for duplicates. */
+					std::time_t accepted = smpp::msgid::clock_t::to_time_t(smpp::msgid::time(replay_id));
+					messages.insert(replay_id, msg, smpp::store::clock_t::now());
+					if (get_times(msg, accepted, deliver, expires) == smpp::command_status::esme_rok) {
+						plan(replay_id, std::time(nullptr), deliver, expires);
+					}
+					return;
+				}
+				trace_got(channel_id, msg.command);
 				smpp::submit_sm_r r;
-				std::memcpy(r.msg_id, id.c_str(), id.size() + 1);
-				r.msg_id_len = id.size() + 1;
 				r.command.seqno = msg.command.seqno;
-				smpp_service::send(channel_id, r);
+				std::time_t now = std::time(nullptr);
+				r.command.status = billing_congested()
+					? smpp::command_status::esme_rthrottled
+					: get_times(msg, now, deliver, expires);
+				bin::u32_t pool;
+				if (r.command.status == smpp::command_status::esme_rok
+						&& !route(channel_id, msg.dst_addr, msg.dst_addr_len
+							, msg.dst_addr_ton, msg.dst_addr_npi, pool)) {
+					r.command.status = smpp::command_status::esme_rinvdstadr;
+				}
+				if (r.command.status == smpp::command_status::esme_rok && blocked(channel_id, msg)) {
+					r.command.status = smpp::command_status::esme_rsubmitfail;
+				}
+				/* Parts before the last are accepted on their own text,
+				 * the last one is refused for the text of all of them */
+				smpp::reassembler::message whole;
+				bin::u8_t total = 0;
+				if (r.command.status == smpp::command_status::esme_rok
+						&& reassemble(channel_id, msg, whole)) {
+					total = whole.total;
+					if (blocked(channel_id, msg.data_coding, whole.data, whole.len)) {
+						r.command.status = smpp::command_status::esme_rsubmitfail;
+					}
+				}
+				if (r.command.status != smpp::command_status::esme_rok) {
+					r.msg_id[0] = '\0';
+					r.msg_id_len = 1;
+					smpp_service::send(channel_id, r);
+					return;
+				}
+				if (!msg.replace_if_present_flag && duplicate(channel_id, msg, r)) {
+					smpp_service::send(channel_id, r);
+					return;
+				}
+				if (msg.replace_if_present_flag) {
+					bin::u64_t id = 0;
+					messages.find(smpp::store::key::of(msg), [&] (bin::u64_t found) {
+						if (messages.replace(found, msg) != smpp::command_status::esme_rok) {
+							return true;
+						}
+						id = found;
+						return false;
+					});
+					if (id != 0) {
+						smpp::msgid::format(id, r.msg_id);
+						r.msg_id_len = smpp::msgid::text_len;
+						smpp_service::send(channel_id, r);
+						return;
+					}
+				}
+				bin::u64_t id = ids.next(r);
+				messages.insert(id, msg, smpp::store::clock_t::now(), sys_key_of(channel_id));
+				plan(id, now, deliver, expires);
+				if (journal == nullptr) {
+					smpp_service::send(channel_id, r);
+				} else if (bin::u64_t lsn = journal->append(id, raw().data, raw().len)) {
+					deferred<smpp::submit_sm_r> d = { channel_id, lsn, r };
+					responses.push_back(d);
+					send_committed();
+				} else {
+					lerror(L) << "channel #" << channel_id << " journal append failed";
+					messages.erase(id);
+					r.command.status = smpp::command_status::esme_rsyserr;
+					r.msg_id[0] = '\0';
+					r.msg_id_len = 1;
+					smpp_service::send(channel_id, r);
+					return;
+				}
+				bill_accepted(channel_id, id, msg, msg.dst_addr, msg.dst_addr_len
+					, msg.dst_addr_ton, msg.dst_addr_npi, total);
+				forward(channel_id, id, pool, msg);
 			}
 
+			/* Every destination gets its own message id, the one of the
+			 * first accepted goes to the response. Each one is kept and
+			 * journaled as a submit_sm of its own. */
 			void on_submit_multi_sm(bin::sz_t channel_id, const smpp::submit_multi_sm & msg) {
-				(void)(msg);
-				ltrace(L) << "channel #" << channel_id << " got: ";
+				trace_got(channel_id, msg.command);
+				smpp::submit_multi_r r;
+				r.command.seqno = msg.command.seqno;
+				std::time_t deliver, expires;
+				std::time_t now = std::time(nullptr);
+				r.command.status = billing_congested()
+					? smpp::command_status::esme_rthrottled
+					: get_times(msg, now, deliver, expires);
+				if (r.command.status == smpp::command_status::esme_rok && blocked(channel_id, msg)) {
+					r.command.status = smpp::command_status::esme_rsubmitfail;
+				}
+				if (r.command.status != smpp::command_status::esme_rok) {
+					r.msg_id[0] = '\0';
+					r.msg_id_len = 1;
+					smpp_service::send(channel_id, r);
+					return;
+				}
+				bin::u64_t first = 0;
+				bin::u64_t lsn = 0;
+				bin::sz_t n = smpp::fanout(msg, r, [&] (const smpp::recipient & rcpt) -> bin::u32_t {
+					if (!rcpt.is_sme()) {
+						/* No distribution lists are provisioned */
+						return smpp::command_status::esme_rinvdlname;
+					}
+					const smpp::sme_dst_addr & addr = rcpt.dst().sme_addr;
+					bin::u32_t pool;
+					if (addr.dst_addr_len <= 1 || !route(channel_id, addr.dst_addr
+							, addr.dst_addr_len, addr.dst_addr_ton, addr.dst_addr_npi, pool)) {
+						return smpp::command_status::esme_rinvdstadr;
+					}
+					smpp::submit_sm sm;
+					rcpt.fill(sm);
+					if (msg.msg_payload.tag != smpp::option::msg_payload) {
+						/* Short message stays one, the store keeps those */
+						std::memcpy(sm.short_msg, rcpt.data(), rcpt.len());
+						sm.short_msg_len = rcpt.len();
+						sm.msg_payload = smpp::tlv_msg_payload();
+					}
+					bin::u64_t id = ids.next();
+					if (journal != nullptr) {
+						bin::u64_t l = append(id, sm);
+						if (l == 0) {
+							lerror(L) << "channel #" << channel_id << " journal append failed";
+							return smpp::command_status::esme_rsyserr;
+						}
+						lsn = l;
+					}
+					messages.insert(id, sm, smpp::store::clock_t::now(), sys_key_of(channel_id));
+					plan(id, now, deliver, expires);
+					if (first == 0) {
+						first = id;
+					}
+					ldebug(L) << "channel #" << channel_id << " message #" << std::hex << id << std::dec
+						<< " to " << std::string(addr.dst_addr, addr.dst_addr + addr.dst_addr_len - 1)
+						<< " " << rcpt.len() << " bytes";
+					bill_accepted(channel_id, id, msg, addr.dst_addr, addr.dst_addr_len
+						, addr.dst_addr_ton, addr.dst_addr_npi);
+					forward(channel_id, id, pool, sm);
+					return smpp::command_status::esme_rok;
+				});
+				if (n == 0) {
+					r.command.status = msg.num_of_dsts == 0
+						? smpp::command_status::esme_rinvnumdsts
+						: smpp::command_status::esme_rinvdstadr;
+				}
+				if (n != 0) {
+					smpp::msgid::format(first, r.msg_id);
+					r.msg_id_len = smpp::msgid::text_len;
+				} else {
+					r.msg_id[0] = '\0';
+					r.msg_id_len = 1;
+				}
+				r.command.seqno = msg.command.seqno;
+				if (lsn != 0) {
+					deferred<smpp::submit_multi_r> d = { channel_id, lsn, r };
+					multi_responses.push_back(d);
+					send_committed();
+					return;
+				}
+				smpp_service::send(channel_id, r);
 			}
 
 			void on_deliver_sm(bin::sz_t channel_id, const smpp::deliver_sm & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
+				smpp::deliver_sm_r r;
+				r.command.seqno = msg.command.seqno;
+				r.msg_id[0] = '\0';
+				r.msg_id_len = 1;
+				smpp_service::send(channel_id, r);
+				if (smpp::is_receipt(msg)) {
+					forward_receipt(msg);
+					return;
+				}
+				smpp::reassembler::message whole;
+				reassemble(channel_id, msg, whole);
 			}
 
 			void on_deliver_sm_r(bin::sz_t channel_id, const smpp::deliver_sm_r & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
 			}
 
 			void on_data_sm(bin::sz_t channel_id, const smpp::data_sm & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
+				smpp::reassembler::message whole;
+				reassemble(channel_id, msg, whole);
 			}
 
 			void on_data_sm_r(bin::sz_t channel_id, const smpp::data_sm_r & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
 			}
 
 			void on_query_sm(bin::sz_t channel_id, const smpp::query_sm & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
+				smpp::query_sm_r r;
+				r.command.seqno = msg.command.seqno;
+				std::memcpy(r.msg_id, msg.msg_id, msg.msg_id_len);
+				r.msg_id_len = msg.msg_id_len;
+				bin::u64_t id;
+				smpp::store::status st;
+				if (smpp::msgid::parse(msg.msg_id, msg.msg_id_len, id)
+						&& messages.query(id, msg.src_addr, msg.src_addr_len, st)) {
+					r.msg_state = st.state;
+					r.error_code = st.error_code;
+					set_final_date(r, st.final_date);
+				} else {
+					r.command.status = smpp::command_status::esme_rqueryfail;
+					r.msg_state = smpp::message_state::unknown;
+					r.error_code = 0;
+					set_final_date(r, 0);
+				}
+				smpp_service::send(channel_id, r);
 			}
 
 			void on_query_sm_r(bin::sz_t channel_id, const smpp::query_sm_r & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
 			}
 
+			/* Empty msg_id cancels all pending messages
+			 * from the source to the destination */
 			void on_cancel_sm(bin::sz_t channel_id, const smpp::cancel_sm & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
+				smpp::cancel_sm_r r;
+				r.command.seqno = msg.command.seqno;
+				smpp::store::key k = smpp::store::key::of(msg);
+				smpp::store::clock_t::time_point now = smpp::store::clock_t::now();
+				bin::u64_t id;
+				if (msg.msg_id_len > 1) {
+					r.command.status = smpp::msgid::parse(msg.msg_id, msg.msg_id_len, id)
+						? messages.cancel(id, k, now)
+						: smpp::command_status::esme_rinvmsgid;
+					if (r.command.status == smpp::command_status::esme_rok) {
+						bill(smpp::cdr::cancelled, id, smpp::message_state::deleted);
+						retire(id);
+						if (journal != nullptr) {
+							journal->remove(id);
+						}
+					}
+				} else if (k.dst_addr_len == 0) {
+					r.command.status = smpp::command_status::esme_rcancelfail;
+				} else {
+					bin::sz_t n = 0;
+					while (messages.find(k, [&] (bin::u64_t found) {
+						if (messages.cancel(found, k, now) == smpp::command_status::esme_rok) {
+							n++;
+							bill(smpp::cdr::cancelled, found, smpp::message_state::deleted);
+							retire(found);
+							if (journal != nullptr) {
+								journal->remove(found);
+							}
+						}
+						return true;
+					}) != 0) {
+					}
+					if (n == 0) {
+						r.command.status = smpp::command_status::esme_rcancelfail;
+					}
+				}
+				smpp_service::send(channel_id, r);
 			}
 
 			void on_cancel_sm_r(bin::sz_t channel_id, const smpp::cancel_sm_r & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
 			}
 
 			void on_replace_sm(bin::sz_t channel_id, const smpp::replace_sm & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
+				smpp::replace_sm_r r;
+				r.command.seqno = msg.command.seqno;
+				bin::u64_t id;
+				r.command.status = smpp::msgid::parse(msg.msg_id, msg.msg_id_len, id)
+					? messages.replace(id, msg)
+					: smpp::command_status::esme_rinvmsgid;
+				smpp_service::send(channel_id, r);
 			}
 
 			void on_replace_sm_r(bin::sz_t channel_id, const smpp::replace_sm_r & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
 			}
 
 			void on_enquire_link(bin::sz_t channel_id, const smpp::enquire_link & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
+				smpp::enquire_link_r r;
+				r.command.seqno = msg.command.seqno;
+				smpp_service::send(channel_id, r);
 			}
 
 			void on_enquire_link_r(bin::sz_t channel_id, const smpp::enquire_link_r & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
 			}
 
 			void on_alert_notification(bin::sz_t channel_id, const smpp::alert_notification & msg) {
-				ltrace(L) << "channel #" << channel_id << " got: " << msg;
+				trace_got(channel_id, msg.command);
 			}
 
 			/* Messages which are not expected at the server side */
@@ -171,14 +1279,89 @@ namespace local {
 				lerror(L) << "channel #" << channel_id << " unexpected";
 			}
 			void on_submit_multi_r(bin::sz_t channel_id, const smpp::submit_multi_r & msg) {
-				(void)(msg);
-				lerror(L) << "channel #" << channel_id << " unexpected";
+				lerror(L) << "channel #" << channel_id << " unexpected: " << msg;
 			}
 			void on_unbind_r(bin::sz_t channel_id, const smpp::unbind_r & msg) {
 				lerror(L) << "channel #" << channel_id << " unexpected: " << msg;
 			}
 	};
 
+	/* Taken by reference by std::chrono::seconds */
+	const bin::sz_t service::concat_timeout_s;
+
+	/* Content filter patterns of a file, see smpp::read_patterns.
+	 * Patterns with nothing left once normalized are refused. */
+	inline bool load_patterns(const std::string & path, std::vector<std::string> & patterns
+			, std::string & error) {
+		std::ifstream in(path.c_str());
+		if (!in) {
+			error = "can not open " + path;
+			return false;
+		}
+		smpp::read_patterns(in, patterns);
+		for (bin::sz_t i = 0; i < patterns.size(); ++i) {
+			if (smpp::content_filter::normalize(patterns[i]).empty()) {
+				error = path + ": pattern has no letters or digits: " + patterns[i];
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/* Routes of a file, see smpp::read_routes */
+	inline bool load_routes(const std::string & path, std::vector<smpp::route> & routes
+			, std::string & error) {
+		std::ifstream in(path.c_str());
+		if (!in) {
+			error = "can not open " + path;
+			return false;
+		}
+		bin::sz_t line;
+		if (!smpp::read_routes(in, routes, line)) {
+			std::ostringstream os;
+			os << path << ":" << line << ": malformed route";
+			error = os.str();
+			return false;
+		}
+		return true;
+	}
+
+	/* Upstream account of a pool, pool=host:port:sys_id:password[:binds] */
+	inline bool parse_upstream(const std::string & s, std::string & pool
+			, smpp::smsc_account & a) {
+		std::string::size_type eq = s.find('=');
+		if (eq == std::string::npos || eq == 0) {
+			return false;
+		}
+		pool = s.substr(0, eq);
+		std::vector<std::string> f;
+		std::istringstream in(s.substr(eq + 1));
+		for (std::string field; std::getline(in, field, ':'); ) {
+			f.push_back(field);
+		}
+		if (f.size() != 4 && f.size() != 5) {
+			return false;
+		}
+		bs::error_code ec;
+		ba::ip::address address = ba::ip::address::from_string(f[0], ec);
+		char * end;
+		unsigned long port = std::strtoul(f[1].c_str(), &end, 10);
+		if (ec || *end != '\0' || port == 0 || port > 0xFFFF
+				|| f[2].empty() || f[2].size() > 15 || f[3].size() > 8) {
+			return false;
+		}
+		a.endpoint = ba::ip::tcp::endpoint(address, static_cast<unsigned short>(port));
+		a.sys_id = f[2];
+		a.password = f[3];
+		if (f.size() == 5) {
+			a.binds = std::strtoul(f[4].c_str(), &end, 10);
+			if (*end != '\0' || a.binds == 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
 }
 
 int main(int argc, char ** argv)
@@ -193,6 +1376,53 @@ int main(int argc, char ** argv)
 		("help", "Produce help messages")
 		("console", "Log to console as well")
 		("log-file", "Log file name template")
+		("log-level", po::value<std::string>()->default_value("trace")
+			, "Lowest severity logged, trace, debug, info, warning, error or critical. "
+			"Changed at run time by 'level [channel] severity' on stdin")
+		("rate", po::value<std::size_t>()->default_value(0)
+			, "Messages per second allowed to each system_id, 0 for unlimited")
+		("burst", po::value<std::size_t>()->default_value(1)
+			, "Messages accepted at once after a pause")
+		("node-id", po::value<unsigned>()->default_value(0)
+			, "Number of this node in message ids, unique among nodes, 0-1023")
+		("journal", po::value<std::string>()
+			, "Directory to keep accepted messages in across restarts")
+		("journal-budget-us", po::value<std::size_t>()->default_value(2000)
+			, "Longest wait of an accepted message for the journal sync")
+		("journal-segment-mb", po::value<std::size_t>()->default_value(64)
+			, "Size of journal segment files")
+		("routes", po::value<std::string>()
+			, "File of dst_addr prefix routes to upstream pools, \"reload\" on stdin rereads it")
+		("dedup-mb", po::value<std::size_t>()->default_value(32)
+			, "Memory of duplicate submit_sm filters, 0 to accept duplicates")
+		("dedup-window", po::value<std::size_t>()->default_value(300)
+			, "Seconds a submitted message is remembered for duplicate detection")
+		("np", po::value<std::string>()
+			, "Number portability database made by np_build, routing numbers go before ported numbers")
+		("content-filter", po::value<std::string>()
+			, "File of patterns, one per line, submitted messages with text matching any are rejected")
+		("cdr", po::value<std::string>()
+			, "Directory to write billing records of accepted and settled messages to")
+		("cdr-format", po::value<std::string>()->default_value("bin")
+			, "Billing record files format, bin or csv")
+		("cdr-file-mb", po::value<std::size_t>()->default_value(64)
+			, "Size of billing record files")
+		("cdr-file-minutes", po::value<std::size_t>()->default_value(60)
+			, "Longest time a billing record file is written before the next one is started")
+		("capture", po::value<std::string>()
+			, "File to record PDUs of all sessions to, for cap_replay and smpp_trace, "
+			"'capture file|off' on stdin changes it at run time")
+		("capture-ring-mb", po::value<std::size_t>()->default_value(64)
+			, "Memory of PDUs waiting to be written to the capture file, PDUs beyond are dropped")
+		("upstream", po::value<std::vector<std::string> >()->composing()
+			, "Account messages routed to a pool are submitted to, pool=host:port:sys_id:password[:binds], "
+			"once per pool")
+		("receipts", po::value<std::size_t>()->default_value(1 << 18)
+			, "Messages sent upstream waiting for their receipts at most, the table takes 86 to 171 bytes per message")
+		("receipt-ttl-hours", po::value<std::size_t>()->default_value(72)
+			, "Time receipts of a message sent upstream are waited for")
+		("query-window-hours", po::value<std::size_t>()->default_value(24)
+			, "Time a message in a final state is kept for query_sm before it is forgotten")
 	;
 
 	po::variables_map opts;
@@ -209,6 +1439,13 @@ int main(int argc, char ** argv)
 		log_name_tmpl = opts["log-file"].as<std::string>();
 	}
 
+	vision::log::severity level;
+	if (!vision::log::severity_of(opts["log-level"].as<std::string>(), level)) {
+		std::cerr << "unknown log level: " << opts["log-level"].as<std::string>() << std::endl;
+		return 1;
+	}
+	vision::log::set_threshold(level);
+
 	vision::log::file::add("smppd%5N.log", true);
 
 	if (opts.count("console")) {
@@ -223,14 +1460,240 @@ int main(int argc, char ** argv)
 
 	std::string cmd;
 
+	unsigned node = opts["node-id"].as<unsigned>();
+	if (node > smpp::msgid::max_node) {
+		lcritical(L) << "node-id is out of range: " << node;
+		return 1;
+	}
+
 	try {
 		smpp::malloc_allocator allocator;
 		ba::ip::tcp::endpoint endpoint(ba::ip::tcp::v4(), 5555);
-		local::service service(endpoint, allocator, vision::log::channel("srv"));
+		smpp::throttle throttle;
+		smpp::router router;
+		std::vector<smpp::route> routes;
+		std::string error;
+		if (opts.count("routes")) {
+			if (!local::load_routes(opts["routes"].as<std::string>(), routes, error)) {
+				lcritical(L) << error;
+				return 1;
+			}
+			router.publish(std::make_shared<const smpp::route_table>(routes));
+			linfo(L) << "loaded " << routes.size() << " routes";
+		}
+		throttle.set_default(opts["rate"].as<std::size_t>()
+			, opts["burst"].as<std::size_t>());
+		smpp::np_database portability;
+		if (opts.count("np")) {
+			if (!portability.open(opts["np"].as<std::string>())) {
+				lcritical(L) << "can not open number portability database: " << opts["np"].as<std::string>();
+				return 1;
+			}
+			linfo(L) << "number portability: " << portability.numbers() << " numbers of "
+				<< portability.operators() << " operators";
+		}
+		std::unique_ptr<smpp::content_filter> content;
+		if (opts.count("content-filter")) {
+			std::vector<std::string> patterns;
+			if (!local::load_patterns(opts["content-filter"].as<std::string>(), patterns, error)) {
+				lcritical(L) << error;
+				return 1;
+			}
+			content.reset(new smpp::content_filter(patterns));
+			linfo(L) << "content filter: " << content->patterns() << " patterns, "
+				<< content->states() << " states, " << content->memory() << " bytes";
+		}
+		std::unique_ptr<smpp::cdr_writer> cdrs;
+		if (opts.count("cdr")) {
+			smpp::cdr_writer::options o;
+			const std::string & format = opts["cdr-format"].as<std::string>();
+			if (format != "bin" && format != "csv") {
+				lcritical(L) << "unknown billing record format: " << format;
+				return 1;
+			}
+			o.format = format == "csv" ? smpp::cdr_writer::csv : smpp::cdr_writer::binary;
+			o.file_size = opts["cdr-file-mb"].as<std::size_t>() << 20;
+			o.file_age = std::chrono::minutes(opts["cdr-file-minutes"].as<std::size_t>());
+			o.on_file = [] (const std::string & path, const smpp::cdr_writer::stats & s) {
+				linfo(L) << "billing records in " << path << ", " << s.records << " written, "
+					<< s.dropped << " dropped, " << s.errors << " errors, "
+					<< s.backlog << " waiting";
+			};
+			o.on_dropped = [] (toolbox::bin::u64_t n, const smpp::cdr_writer::stats & s) {
+				lwarning(L) << n << " billing records dropped, " << s.dropped << " so far, "
+					<< s.backlog << " waiting";
+			};
+			cdrs.reset(new smpp::cdr_writer(opts["cdr"].as<std::string>(), o));
+			if (!cdrs->start()) {
+				lcritical(L) << "can not write billing records to " << opts["cdr"].as<std::string>();
+				return 1;
+			}
+		}
+		std::size_t capture_ring = opts["capture-ring-mb"].as<std::size_t>() << 20;
+		/* Started capture, nullptr if the file can not be created */
+		auto open_capture = [capture_ring] (const std::string & path) -> std::unique_ptr<toolbox::capture> {
+			std::unique_ptr<toolbox::capture> c(new toolbox::capture(path, capture_ring));
+			c->set_error_handler([path] (int err) {
+				lerror(L) << "capture " << path << " truncated, write failed: " << std::strerror(err);
+			});
+			if (!c->start()) {
+				c.reset();
+			}
+			return c;
+		};
+		auto close_capture = [] (std::unique_ptr<toolbox::capture> & c) {
+			if (!c) {
+				return;
+			}
+			c->stop();
+			toolbox::capture::stats s = c->get_stats();
+			linfo(L) << "capture: " << s.records << " records, " << s.dropped
+				<< " dropped, " << s.bytes << " bytes, " << s.errors << " errors"
+				<< (s.truncated ? ", truncated" : "");
+			c.reset();
+		};
+		std::unique_ptr<toolbox::capture> capture;
+		if (opts.count("capture")) {
+			capture = open_capture(opts["capture"].as<std::string>());
+			if (!capture) {
+				lcritical(L) << "can not write capture to " << opts["capture"].as<std::string>();
+				return 1;
+			}
+		}
+		std::unique_ptr<local::upstream_client> upstream;
+		std::unordered_map<std::string, toolbox::bin::sz_t> pools;
+		if (opts.count("upstream")) {
+			upstream.reset(new local::upstream_client(allocator, vision::log::channel("upstream")));
+			for (const std::string & u: opts["upstream"].as<std::vector<std::string> >()) {
+				std::string pool;
+				smpp::smsc_account a;
+				if (!local::parse_upstream(u, pool, a)) {
+					lcritical(L) << "malformed upstream: " << u;
+					return 1;
+				}
+				pools[pool] = upstream->add_account(a);
+			}
+		}
+		local::service service(endpoint, allocator, vision::log::channel("srv")
+			, node, opts["receipts"].as<std::size_t>()
+			, std::chrono::hours(opts["receipt-ttl-hours"].as<std::size_t>()));
+		if (upstream) {
+			service.set_upstream(*upstream, pools);
+		}
+		service.set_capture(capture.get());
+		service.set_throttle(&throttle);
+		service.set_query_window(std::chrono::hours(opts["query-window-hours"].as<std::size_t>()));
+		if (portability.is_open()) {
+			service.set_portability(&portability);
+		}
+		service.set_content_filter(content.get());
+		if (cdrs) {
+			service.set_cdr_writer(*cdrs);
+		}
+		if (opts["dedup-mb"].as<std::size_t>() != 0) {
+			service.set_dedup(opts["dedup-mb"].as<std::size_t>() << 20
+				, std::chrono::seconds(opts["dedup-window"].as<std::size_t>()));
+		}
+		if (opts.count("routes")) {
+			service.set_router(router);
+		}
+		std::unique_ptr<smpp::journal> journal;
+		if (opts.count("journal")) {
+			journal.reset(new smpp::journal(opts["journal"].as<std::string>()
+				, opts["journal-segment-mb"].as<std::size_t>() << 20
+				, std::chrono::microseconds(opts["journal-budget-us"].as<std::size_t>())));
+			service.set_journal(journal.get());
+			toolbox::bin::sz_t count;
+			if (!service.recover(count)) {
+				lcritical(L) << "can not read journal: " << opts["journal"].as<std::string>();
+				return 1;
+			}
+			linfo(L) << "recovered " << count << " messages from journal";
+		}
 		toolbox::set_signal_handler(toolbox::stopper<local::service>(service));
 		service.start();
-		std::getline(std::cin, cmd);
+		if (upstream) {
+			upstream->start();
+		}
+		while (std::getline(std::cin, cmd)) {
+			std::istringstream words(cmd);
+			std::string word;
+			words >> word;
+			/* Commands end with stdin or quit only */
+			if (word.empty()) {
+				continue;
+			}
+			if (word == "quit") {
+				break;
+			}
+			if (word == "level") {
+				/* level [channel] severity */
+				std::string channel, name;
+				words >> channel >> name;
+				if (name.empty()) {
+					name.swap(channel);
+				}
+				if (!vision::log::severity_of(name, level)) {
+					lerror(L) << "unknown log level: " << name;
+				} else if (channel.empty()) {
+					vision::log::set_threshold(level);
+				} else {
+					vision::log::set_threshold(channel, level);
+				}
+				continue;
+			}
+			if (word == "capture") {
+				/* capture file|off, the file written so far is
+				 * closed once the service has let go of it */
+				std::string path;
+				words >> path;
+				if (path.empty()) {
+					lwarning(L) << "capture needs a file or off";
+					continue;
+				}
+				std::unique_ptr<toolbox::capture> next;
+				if (path != "off") {
+					next = open_capture(path);
+					if (!next) {
+						lerror(L) << "can not write capture to " << path;
+						continue;
+					}
+				}
+				service.set_capture(next.get());
+				close_capture(capture);
+				capture = std::move(next);
+				linfo(L) << (capture ? "capturing to " + path : std::string("capture off"));
+				continue;
+			}
+			if (word != "reload") {
+				lwarning(L) << "unknown command: " << cmd;
+				continue;
+			}
+			if (!opts.count("routes")) {
+				lwarning(L) << "nothing to reload, no --routes given";
+				continue;
+			}
+			routes.clear();
+			if (!local::load_routes(opts["routes"].as<std::string>(), routes, error)) {
+				lerror(L) << error;
+				continue;
+			}
+			router.rebuild(routes, [] (const smpp::route_table & t) {
+				linfo(L) << "routes reloaded: " << t.routes() << " routes, "
+					<< t.nodes() << " nodes, " << t.memory() << " bytes";
+			});
+		}
+		if (upstream) {
+			upstream->stop();
+		}
 		service.stop();
+		if (journal) {
+			journal->stop();
+		}
+		if (cdrs) {
+			cdrs->stop();
+		}
+		close_capture(capture);
 		linfo(L) << "bye!";
 	} catch (const std::exception & e) {
 		lcritical(L) << e.what();
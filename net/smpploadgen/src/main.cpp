@@ -0,0 +1,619 @@
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <algorithm>
+
+#include <smpp/client.hpp>
+#include <vision/log.hpp>
+
+#include <boost/program_options.hpp>
+
+namespace local {
+
+	using namespace mobi::net;
+	using namespace mobi::net::toolbox;
+
+	namespace ba = boost::asio;
+
+	typedef vision::log::source log_t;
+	typedef std::chrono::steady_clock clock_t;
+
+	class malloc_allocator {
+		public:
+			void * alloc(std::size_t len) {
+				return std::malloc(len);
+			}
+
+			template <typename T>
+			void dealloc(T * ptr) {
+				std::free(static_cast<void *>(ptr));
+			}
+	};
+
+	typedef smpp::client<malloc_allocator, log_t> client_t;
+
+	/* Latencies in microseconds, buckets 1/16 of a power of two
+	 * wide, so a percentile is off by 6% at most */
+	class histogram {
+		public:
+			static const bin::sz_t sub = 16;
+			static const bin::sz_t buckets = sub + 40 * sub;
+
+			histogram(): m_counts(buckets, 0), m_total(0), m_max(0) {}
+
+			void add(bin::u64_t us) {
+				m_counts[bucket(us)]++;
+				m_total++;
+				m_max = std::max(m_max, us);
+			}
+
+			void merge(const histogram & h) {
+				for (bin::sz_t i = 0; i < buckets; ++i) {
+					m_counts[i] += h.m_counts[i];
+				}
+				m_total += h.m_total;
+				m_max = std::max(m_max, h.m_max);
+			}
+
+			void clear() {
+				std::fill(m_counts.begin(), m_counts.end(), 0);
+				m_total = 0;
+				m_max = 0;
+			}
+
+			/* Upper bound of the bucket holding the q-th quantile */
+			bin::u64_t quantile(double q) const {
+				if (m_total == 0) {
+					return 0;
+				}
+				bin::u64_t rank = static_cast<bin::u64_t>(q * (m_total - 1)) + 1;
+				bin::u64_t seen = 0;
+				for (bin::sz_t i = 0; i < buckets; ++i) {
+					seen += m_counts[i];
+					if (seen >= rank) {
+						return std::min(upper(i), m_max);
+					}
+				}
+				return m_max;
+			}
+
+			bin::u64_t total() const { return m_total; }
+			bin::u64_t max() const { return m_max; }
+
+		private:
+			std::vector<bin::u64_t> m_counts;
+			bin::u64_t m_total;
+			bin::u64_t m_max;
+
+			static bin::sz_t bucket(bin::u64_t v) {
+				if (v < sub) {
+					return v;
+				}
+				bin::sz_t e = 63 - __builtin_clzll(v);
+				bin::sz_t i = (e - 3) * sub + ((v >> (e - 4)) & (sub - 1));
+				return std::min<bin::sz_t>(i, buckets - 1);
+			}
+
+			static bin::u64_t upper(bin::sz_t i) {
+				if (i < sub) {
+					return i;
+				}
+				bin::sz_t e = i / sub + 3;
+				return ((sub + i % sub + 1) << (e - 4)) - 1;
+			}
+	};
+
+	/* Message kinds generated, a concatenated one is three
+	 * submit_sm sent one after another */
+	enum kind_t { gsm7, ucs2, concat, tlv, kinds };
+	const char * const kind_names[kinds] = { "gsm7", "ucs2", "concat", "tlv" };
+
+	/* Payloads outlive every message referencing them */
+	const std::string long_text = [] {
+		std::string s;
+		while (s.size() < 600) {
+			s += "Your order 4711 has been shipped and will arrive tomorrow. ";
+		}
+		return s.substr(0, 600);
+	}();
+	const bin::u8_t callback[] = "79001234567";
+	const bin::u8_t subaddr[] = "\xA0" "12345";
+	const bin::u8_t session[] = "\x01\x02";
+
+	void fill_header(smpp::submit_sm & msg, const std::string & src, bool receipts) {
+		msg.set_serv_type("");
+		msg.src_addr_ton = 5;
+		msg.src_addr_npi = 0;
+		msg.set_src_addr(src);
+		msg.dst_addr_ton = 1;
+		msg.dst_addr_npi = 1;
+		msg.set_dst_addr("79000000000");
+		msg.esm_class = 0;
+		msg.protocol_id = 0;
+		msg.priority_flag = 0;
+		msg.set_schedule_delivery_time("");
+		msg.set_validity_period("");
+		msg.registered_delivery = receipts ? 1 : 0;
+		msg.replace_if_present_flag = 0;
+		msg.data_coding = 0;
+		msg.sm_default_msg_id = 0;
+		msg.short_msg_len = 0;
+	}
+
+	void set_short_msg(smpp::submit_sm & msg, const bin::u8_t * data, bin::sz_t len) {
+		std::memcpy(msg.short_msg, data, len);
+		msg.short_msg_len = len;
+	}
+
+	/* Submits of a message of each kind, dst_addr is set per send */
+	std::vector<std::vector<smpp::submit_sm> > make_templates(const std::string & src, bool receipts) {
+		std::vector<std::vector<smpp::submit_sm> > t(kinds);
+		smpp::submit_sm msg;
+		fill_header(msg, src, receipts);
+
+		smpp::submit_sm m = msg;
+		set_short_msg(m, bin::ascbuf(long_text.c_str()), 160);
+		t[gsm7].push_back(m);
+
+		m = msg;
+		m.data_coding = 8;
+		bin::u8_t text[140];
+		for (bin::sz_t i = 0; i < 70; ++i) {
+			bin::u16_t c = 0x0410 + i % 32;
+			text[2 * i] = c >> 8;
+			text[2 * i + 1] = c & 0xFF;
+		}
+		set_short_msg(m, text, sizeof(text));
+		t[ucs2].push_back(m);
+
+		for (bin::u8_t part = 1; part <= 3; ++part) {
+			m = msg;
+			m.esm_class = 0x40;
+			bin::u8_t udh[6 + 153] = { 5, 0, 3, 0, 3, part };
+			std::memcpy(udh + 6, long_text.data() + (part - 1) * 153, 153);
+			set_short_msg(m, udh, sizeof(udh));
+			t[concat].push_back(m);
+		}
+
+		m = msg;
+		m.msg_payload.set(bin::ascbuf(long_text.c_str()), long_text.size());
+		m.user_msg_reference.set(0x10);
+		m.src_port.set(0x10);
+		m.dst_port.set(0x10);
+		m.payload_type.set(0x00);
+		m.privacy_ind.set(0x00);
+		m.callback_num.set(callback, sizeof(callback) - 1);
+		m.callback_num_pres_ind.set(0x01);
+		m.src_subaddr.set(subaddr, sizeof(subaddr) - 1);
+		m.dst_subaddr.set(subaddr, sizeof(subaddr) - 1);
+		m.display_time.set(0x01);
+		m.ms_validity.set(0x01);
+		m.lang_ind.set(0x01);
+		m.its_session_info.set(session, sizeof(session) - 1);
+		t[tlv].push_back(m);
+		return t;
+	}
+
+	/* Weights of kinds from "gsm7=70,ucs2=15,concat=10,tlv=5" */
+	bool parse_mix(const std::string & s, std::vector<double> & weights) {
+		weights.assign(kinds, 0);
+		std::size_t pos = 0;
+		while (pos < s.size()) {
+			std::size_t end = s.find(',', pos);
+			std::string item = s.substr(pos, end == std::string::npos ? end : end - pos);
+			pos = end == std::string::npos ? s.size() : end + 1;
+			std::size_t eq = item.find('=');
+			if (eq == std::string::npos) {
+				return false;
+			}
+			int k = 0;
+			while (k < kinds && item.compare(0, eq, kind_names[k]) != 0) {
+				k++;
+			}
+			if (k == kinds) {
+				return false;
+			}
+			weights[k] = std::atof(item.c_str() + eq + 1);
+		}
+		return std::count(weights.begin(), weights.end(), 0.0) < kinds;
+	}
+
+	struct config {
+		ba::ip::tcp::endpoint endpoint;
+		std::string sys_id;
+		std::string password;
+		std::string src;
+		std::string dst_prefix;
+		bin::sz_t binds[3];
+		bin::sz_t window;
+		bin::sz_t timeout_ms;
+		/* Submits per second of the worker, 0 to keep windows full */
+		double rate;
+		bool receipts;
+		std::vector<double> mix;
+	};
+
+	/* Counters of a report interval */
+	struct sample {
+		bin::u64_t submitted;
+		bin::u64_t ok;
+		bin::u64_t failed;
+		bin::u64_t full;
+		bin::u64_t delivered;
+		histogram latency;
+
+		sample(): submitted(0), ok(0), failed(0), full(0), delivered(0) {}
+
+		void merge(const sample & s) {
+			submitted += s.submitted;
+			ok += s.ok;
+			failed += s.failed;
+			full += s.full;
+			delivered += s.delivered;
+			latency.merge(s.latency);
+		}
+	};
+
+	/* Client with its binds and a thread generating submits for it */
+	class worker {
+		public:
+			worker(const config & c, bin::sz_t n, malloc_allocator & a)
+				: C(c)
+				, m_client(a, vision::log::channel("client"))
+				, m_templates(make_templates(c.src, c.receipts))
+				, m_random(n)
+				, m_stop(false)
+				, m_outstanding(0)
+			{
+				m_client.set_window(c.window, c.timeout_ms);
+				smpp::smsc_account acc;
+				acc.endpoint = c.endpoint;
+				acc.password = c.password;
+				acc.max_queue = std::max<bin::sz_t>(c.window * 4, 1024);
+				const smpp::smsc_account::mode_t modes[3] = {
+					smpp::smsc_account::transceiver
+					, smpp::smsc_account::transmitter
+					, smpp::smsc_account::receiver
+				};
+				for (int i = 0; i < 3; ++i) {
+					if (c.binds[i] == 0) {
+						continue;
+					}
+					acc.sys_id = c.sys_id;
+					acc.mode = modes[i];
+					acc.binds = c.binds[i];
+					bin::sz_t id = m_client.add_account(acc);
+					m_accounts.push_back(id);
+					if (acc.mode != smpp::smsc_account::receiver) {
+						m_senders.push_back(id);
+					}
+				}
+				m_client.set_deliver_handler([this] (bin::sz_t, const smpp::deliver_sm &) {
+					std::lock_guard<std::mutex> lock(m_mtx);
+					m_sample.delivered++;
+				});
+			}
+
+			void start() {
+				m_client.start();
+				if (!m_senders.empty()) {
+					m_thread = std::thread([this] {
+						generate();
+					});
+				}
+			}
+
+			void stop() {
+				m_stop = true;
+				if (m_thread.joinable()) {
+					m_thread.join();
+				}
+				m_client.stop();
+			}
+
+			bin::sz_t bound() const {
+				bin::sz_t n = 0;
+				for (bin::sz_t id: m_accounts) {
+					n += m_client.bound(id);
+				}
+				return n;
+			}
+
+			/* Counters since the previous take */
+			sample take() {
+				sample s;
+				std::lock_guard<std::mutex> lock(m_mtx);
+				std::swap(s, m_sample);
+				return s;
+			}
+
+		private:
+			const config & C;
+			client_t m_client;
+			std::vector<std::vector<smpp::submit_sm> > m_templates;
+			std::vector<bin::sz_t> m_accounts;
+			/* Accounts submits go to */
+			std::vector<bin::sz_t> m_senders;
+			std::mt19937 m_random;
+			std::atomic<bool> m_stop;
+			std::atomic<bin::sz_t> m_outstanding;
+			std::thread m_thread;
+			std::mutex m_mtx;
+			sample m_sample;
+
+			void done(clock_t::time_point t0, const smpp::submit_sm_r & r) {
+				bin::u64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+					clock_t::now() - t0).count();
+				m_outstanding--;
+				std::lock_guard<std::mutex> lock(m_mtx);
+				if (r.command.status == smpp::command_status::esme_rok) {
+					m_sample.ok++;
+					m_sample.latency.add(us);
+				} else {
+					m_sample.failed++;
+				}
+			}
+
+			bool send(smpp::submit_sm & msg, bin::sz_t account) {
+				clock_t::time_point t0 = clock_t::now();
+				m_outstanding++;
+				if (m_client.submit(account, msg, [this, t0] (const smpp::submit_sm_r & r) {
+						done(t0, r);
+					})) {
+					return true;
+				}
+				m_outstanding--;
+				return false;
+			}
+
+			/* Send a message of a random kind to a random number,
+			 * returns the number of submits */
+			bin::sz_t send_one(std::discrete_distribution<int> & kind) {
+				std::vector<smpp::submit_sm> & parts = m_templates[kind(m_random)];
+				bin::sz_t account = m_senders[m_random() % m_senders.size()];
+				char dst[24];
+				std::snprintf(dst, sizeof(dst), "%s%07u", C.dst_prefix.c_str()
+					, static_cast<unsigned>(m_random() % 10000000));
+				bin::u8_t ref = m_random();
+				bin::sz_t sent = 0;
+				bin::sz_t full = 0;
+				for (smpp::submit_sm & msg: parts) {
+					msg.set_dst_addr(dst);
+					if (msg.esm_class & 0x40) {
+						msg.short_msg[3] = ref;
+					}
+					if (send(msg, account)) {
+						sent++;
+					} else {
+						full++;
+					}
+				}
+				std::lock_guard<std::mutex> lock(m_mtx);
+				m_sample.submitted += sent;
+				m_sample.full += full;
+				return sent + full;
+			}
+
+			/* Submits paced by the clock, counted from start, so a
+			 * slow server does not slow the offered load down */
+			void generate() {
+				std::discrete_distribution<int> kind(C.mix.begin(), C.mix.end());
+				bin::sz_t limit = 0;
+				for (bin::sz_t i = 0; i < 2; ++i) {
+					limit += C.binds[i] * C.window;
+				}
+				clock_t::time_point start = clock_t::now();
+				double total = 0;
+				while (!m_stop) {
+					double due;
+					if (C.rate > 0) {
+						double s = std::chrono::duration<double>(clock_t::now() - start).count();
+						due = C.rate * s - total;
+					} else {
+						due = static_cast<double>(limit) * 2 - m_outstanding;
+					}
+					for (bin::sz_t n = 0; due >= 1 && n < 4096 && !m_stop; ++n) {
+						bin::sz_t k = send_one(kind);
+						total += k;
+						due -= k;
+					}
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+			}
+	};
+
+	std::atomic<bool> interrupted(false);
+
+	void on_signal(int) {
+		interrupted = true;
+	}
+
+	void print_header() {
+		std::printf("%6s %9s %9s %7s %7s %9s %9s %9s %9s %9s %7s\n"
+			, "sec", "submit/s", "resp/s", "failed", "full"
+			, "p50_us", "p99_us", "p999_us", "max_us", "deliver/s", "bound");
+	}
+
+	void print_sample(const std::string & label, const sample & s, double seconds, bin::sz_t bound) {
+		std::printf("%6s %9.0f %9.0f %7llu %7llu %9llu %9llu %9llu %9llu %9.0f %7zu\n"
+			, label.c_str()
+			, s.submitted / seconds
+			, (s.ok + s.failed) / seconds
+			, static_cast<unsigned long long>(s.failed)
+			, static_cast<unsigned long long>(s.full)
+			, static_cast<unsigned long long>(s.latency.quantile(0.5))
+			, static_cast<unsigned long long>(s.latency.quantile(0.99))
+			, static_cast<unsigned long long>(s.latency.quantile(0.999))
+			, static_cast<unsigned long long>(s.latency.max())
+			, s.delivered / seconds
+			, bound);
+		std::fflush(stdout);
+	}
+
+}
+
+int main(int argc, char ** argv)
+{
+	using namespace mobi::net;
+	namespace po = boost::program_options;
+	namespace ba = boost::asio;
+
+	po::options_description options("Options");
+	options.add_options()
+		("help", "Produce help messages")
+		("console", "Log to console as well")
+		("host", po::value<std::string>()->default_value("127.0.0.1")
+			, "Address of the SMSC")
+		("port", po::value<unsigned short>()->default_value(5555)
+			, "Port of the SMSC")
+		("sys-id", po::value<std::string>()->default_value("loadgen")
+			, "system_id to bind with")
+		("password", po::value<std::string>()->default_value("secret")
+			, "Password to bind with")
+		("binds", po::value<std::size_t>()->default_value(10)
+			, "Transceiver binds")
+		("tx-binds", po::value<std::size_t>()->default_value(0)
+			, "Transmitter binds")
+		("rx-binds", po::value<std::size_t>()->default_value(0)
+			, "Receiver binds")
+		("threads", po::value<std::size_t>()->default_value(1)
+			, "Clients the binds are spread over, each with its own threads")
+		("rate", po::value<double>()->default_value(1000)
+			, "submit_sm per second in total, 0 to keep all windows full")
+		("window", po::value<std::size_t>()->default_value(10)
+			, "Requests sent per bind before waiting for responses")
+		("timeout-ms", po::value<std::size_t>()->default_value(30000)
+			, "Time a request waits for its response")
+		("mix", po::value<std::string>()->default_value("gsm7=70,ucs2=15,concat=10,tlv=5")
+			, "Shares of message kinds: gsm7, ucs2, concat of 3 parts, tlv with msg_payload")
+		("src", po::value<std::string>()->default_value("LoadGen")
+			, "Source address of the messages")
+		("dst-prefix", po::value<std::string>()->default_value("7900")
+			, "Destination numbers are this and 7 random digits")
+		("receipts", "Request delivery receipts")
+		("duration", po::value<std::size_t>()->default_value(60)
+			, "Seconds to run, 0 to run until interrupted")
+		("warmup", po::value<std::size_t>()->default_value(0)
+			, "Seconds left out of the summary")
+	;
+
+	po::variables_map opts;
+	po::store(po::parse_command_line(argc, argv, options), opts);
+
+	if (opts.count("help")) {
+		std::cout << options << std::endl;
+		return 1;
+	}
+
+	vision::log::file::add("smpp_loadgen%5N.log", true);
+
+	if (opts.count("console")) {
+		vision::log::console::add();
+	}
+
+	static auto L = vision::log::channel("main");
+
+	local::config c = local::config();
+	boost::system::error_code ec;
+	ba::ip::address address = ba::ip::address::from_string(opts["host"].as<std::string>(), ec);
+	if (ec) {
+		std::cerr << "bad host address: " << opts["host"].as<std::string>() << std::endl;
+		return 1;
+	}
+	c.endpoint = ba::ip::tcp::endpoint(address, opts["port"].as<unsigned short>());
+	c.sys_id = opts["sys-id"].as<std::string>();
+	c.password = opts["password"].as<std::string>();
+	c.src = opts["src"].as<std::string>();
+	c.dst_prefix = opts["dst-prefix"].as<std::string>().substr(0, 13);
+	c.window = std::max<std::size_t>(opts["window"].as<std::size_t>(), 1);
+	c.timeout_ms = opts["timeout-ms"].as<std::size_t>();
+	c.receipts = opts.count("receipts") != 0;
+	if (!local::parse_mix(opts["mix"].as<std::string>(), c.mix)) {
+		std::cerr << "bad mix: " << opts["mix"].as<std::string>() << std::endl;
+		return 1;
+	}
+
+	std::size_t threads = std::max<std::size_t>(opts["threads"].as<std::size_t>(), 1);
+	const char * const bind_opts[3] = { "binds", "tx-binds", "rx-binds" };
+	std::size_t total_binds = 0;
+	std::vector<local::config> configs(threads, c);
+	for (int i = 0; i < 3; ++i) {
+		std::size_t n = opts[bind_opts[i]].as<std::size_t>();
+		total_binds += n;
+		for (std::size_t t = 0; t < threads; ++t) {
+			configs[t].binds[i] = n / threads + (t < n % threads ? 1 : 0);
+		}
+	}
+	if (total_binds == 0) {
+		std::cerr << "no binds" << std::endl;
+		return 1;
+	}
+	/* Workers without binds to submit over offer no load */
+	std::size_t senders = 0;
+	for (const local::config & w: configs) {
+		senders += w.binds[0] + w.binds[1] != 0;
+	}
+	for (local::config & w: configs) {
+		w.rate = w.binds[0] + w.binds[1] != 0 && senders != 0
+			? opts["rate"].as<double>() / senders : 0;
+	}
+
+	linfo(L) << "binding " << total_binds << " times to " << c.endpoint;
+
+	std::signal(SIGINT, local::on_signal);
+	std::signal(SIGTERM, local::on_signal);
+
+	local::malloc_allocator allocator;
+	std::vector<std::unique_ptr<local::worker> > workers;
+	for (std::size_t t = 0; t < threads; ++t) {
+		workers.emplace_back(new local::worker(configs[t], t, allocator));
+	}
+	for (auto & w: workers) {
+		w->start();
+	}
+
+	std::size_t duration = opts["duration"].as<std::size_t>();
+	std::size_t warmup = opts["warmup"].as<std::size_t>();
+	local::sample summary;
+	local::print_header();
+	local::clock_t::time_point start = local::clock_t::now();
+	local::clock_t::time_point last = start;
+	std::size_t bound = 0;
+	for (std::size_t sec = 1; !local::interrupted && (duration == 0 || sec <= duration); ++sec) {
+		std::this_thread::sleep_until(start + std::chrono::seconds(sec));
+		local::clock_t::time_point now = local::clock_t::now();
+		local::sample s;
+		bound = 0;
+		for (auto & w: workers) {
+			s.merge(w->take());
+			bound += w->bound();
+		}
+		local::print_sample(std::to_string(sec), s
+			, std::chrono::duration<double>(now - last).count(), bound);
+		if (sec > warmup) {
+			summary.merge(s);
+		}
+		last = now;
+	}
+
+	std::size_t measured = std::chrono::duration_cast<std::chrono::seconds>(last - start).count();
+	local::print_header();
+	local::print_sample("total", summary
+		, static_cast<double>(std::max<std::size_t>(measured > warmup ? measured - warmup : 0, 1)), bound);
+
+	for (auto & w: workers) {
+		w->stop();
+	}
+	linfo(L) << "done";
+
+	return 0;
+}
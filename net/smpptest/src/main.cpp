@@ -1,7 +1,54 @@
 
 #define BOOST_TEST_MODULE MyTest
+#include <thread>
+#include <sstream>
+#include <fstream>
+#include <iterator>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <csignal>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <boost/log/core.hpp>
 #include <boost/test/unit_test.hpp>
+#include <toolbox/capture.hpp>
+#include <toolbox/wheel.hpp>
 #include <smpp/proto.hpp>
+#include <smpp/cdr.hpp>
+#include <smpp/client.hpp>
+#include <smpp/concat.hpp>
+#include <smpp/dedup.hpp>
+#include <smpp/dlr.hpp>
+#include <smpp/filter.hpp>
+#include <smpp/fanout.hpp>
+#include <smpp/journal.hpp>
+#include <smpp/msgid.hpp>
+#include <smpp/portability.hpp>
+#include <smpp/printer.hpp>
+#include <smpp/receipt.hpp>
+#include <smpp/retry.hpp>
+#include <smpp/route.hpp>
+#include <smpp/store.hpp>
+#include <smpp/time.hpp>
+#include <smpp/window.hpp>
+#include <smpp/session.hpp>
+#include <smpp/throttle.hpp>
+
+/* Journal syncs fail with EIO while set, the journal calls
+ * msync unqualified so this one is taken over that of libc */
+static std::atomic<bool> msync_fails(false);
+
+extern "C" int msync(void * addr, size_t len, int flags) noexcept
+{
+	if (msync_fails) {
+		errno = EIO;
+		return -1;
+	}
+	return syscall(SYS_msync, addr, len, flags);
+}
 
 using namespace mobi::net;
 using namespace mobi::net::toolbox;
@@ -227,7 +274,12 @@ class smpp_parser : public smpp::parser<std::ostream> {
 		}
 
 		virtual action on_submit_multi_sm(const smpp::submit_multi_sm & msg) {
-			(void)(msg);
+			std::cout << msg << std::endl;
+			return resume;
+		}
+
+		virtual action on_submit_multi_r(const smpp::submit_multi_r & msg) {
+			std::cout << msg << std::endl;
 			return resume;
 		}
 
@@ -780,6 +832,75 @@ BOOST_AUTO_TEST_CASE( test_pw_submit_sm_r )
 	std::cout << std::endl;
 	BOOST_CHECK((ptr = p.parse(buf, bend)) != nullptr && ptr == bend);
 }
+BOOST_AUTO_TEST_CASE( test_pw_submit_multi_sm )
+{
+	using namespace smpp;
+	using namespace bin;
+
+	writer<std::ostream>	w(std::cout);
+	smpp_parser				p(std::cout);
+
+	submit_multi_sm msg;
+	/* mandatory fields */
+	msg.set_serv_type("SUBS");
+	msg.src_addr_ton			= 0x10;
+	msg.src_addr_npi			= 0x10;
+	msg.set_src_addr("SUBMIT_MULTI");
+	BOOST_CHECK(msg.add_dst_addr(0x01, 0x01, "79001234567"));
+	BOOST_CHECK(msg.add_dl_name("FRIENDS"));
+	BOOST_CHECK(msg.add_dst_addr(0x01, 0x01, "79007654321"));
+	msg.esm_class				= 0x10;
+	msg.protocol_id				= 0x10;
+	msg.priority_flag			= 0x10;
+	msg.registered_delivery		= 0x10;
+	msg.replace_if_present_flag	= 0x10;
+	msg.data_coding				= 0x10;
+	msg.sm_default_msg_id		= 0x10;
+	msg.set_short_msg("SUBMIT_MULTI_SHORT_MESSAGE");
+	/* optional fields */
+	msg.user_msg_reference.set(0x10);
+	msg.sar_msg_ref_num.set(0x10);
+	msg.callback_num.set(STR("HELLO"));
+	msg.lang_ind.set(0x10);
+
+	msg.command.len				= msg.raw_size();
+
+	bin::u8_t _buf[0x200];
+	bin::u8_t * buf = _buf;
+	bin::u8_t * bend = _buf + msg.command.len;
+
+	const void * ptr;
+	BOOST_CHECK((ptr = w.write(buf, bend, msg)) != nullptr && ptr == bend);
+	std::cout << std::endl;
+	BOOST_CHECK((ptr = p.parse(buf, bend)) != nullptr && ptr == bend);
+}
+BOOST_AUTO_TEST_CASE( test_pw_submit_multi_r )
+{
+	using namespace smpp;
+	using namespace bin;
+
+	writer<std::ostream>	w(std::cout);
+	smpp_parser				p(std::cout);
+
+	submit_multi_r msg;
+	msg.set_msg_id(	"MSG_ID");
+	unsuccess_smes & u = msg.unsuccess_sme[msg.no_unsuccess++];
+	u.dst_addr_ton = 0x01;
+	u.dst_addr_npi = 0x01;
+	u.dst_addr_len = sizeof("79001234567");
+	std::memcpy(u.dst_addr, "79001234567", u.dst_addr_len);
+	u.error_status_code = command_status::esme_rinvdstadr;
+	msg.command.len				= msg.raw_size();
+
+	bin::u8_t _buf[0x200];
+	bin::u8_t * buf = _buf;
+	bin::u8_t * bend = _buf + msg.command.len;
+
+	const void * ptr;
+	BOOST_CHECK((ptr = w.write(buf, bend, msg)) != nullptr && ptr == bend);
+	std::cout << std::endl;
+	BOOST_CHECK((ptr = p.parse(buf, bend)) != nullptr && ptr == bend);
+}
 BOOST_AUTO_TEST_CASE( test_pw_deliver_sm )
 {
 	using namespace smpp;
@@ -1172,3 +1293,1670 @@ BOOST_AUTO_TEST_CASE( test_pw_alert_notification )
 	BOOST_CHECK((ptr = p.parse(buf, bend)) != nullptr && ptr == bend);
 }
 
+BOOST_AUTO_TEST_CASE( test_window )
+{
+	using namespace smpp;
+
+	typedef window<int> window_t;
+
+	window_t w(3, std::chrono::seconds(1));
+	window_t::time_point now = window_t::clock_t::now();
+
+	bin::u32_t s1 = w.push(1, now);
+	bin::u32_t s2 = w.push(2, now);
+	bin::u32_t s3 = w.push(3, now);
+	BOOST_CHECK(s1 != 0 && s2 != 0 && s3 != 0);
+	BOOST_CHECK(w.full());
+	BOOST_CHECK(w.push(4, now) == 0);
+
+	int ctx = 0;
+	BOOST_CHECK(w.pop(s2, ctx) && ctx == 2);
+	BOOST_CHECK(!w.pop(s2, ctx));
+
+	/* Reused slot gets a different sequence number */
+	bin::u32_t s4 = w.push(4, now + std::chrono::milliseconds(500));
+	BOOST_CHECK(s4 != 0 && s4 != s2);
+	BOOST_CHECK(!w.pop(s2, ctx));
+
+	int sum = 0;
+	BOOST_CHECK(w.expire(now + std::chrono::seconds(1)
+		, [&sum] (bin::u32_t, int c) { sum += c; }) == 2);
+	BOOST_CHECK(sum == 4);
+	BOOST_CHECK(w.count() == 1);
+	BOOST_CHECK(!w.pop(s1, ctx));
+	BOOST_CHECK(w.pop(s4, ctx) && ctx == 4);
+	BOOST_CHECK(w.empty());
+}
+BOOST_AUTO_TEST_CASE( test_session )
+{
+	using namespace smpp;
+
+	session s(session::smsc);
+
+	BOOST_CHECK(s.admit(command::submit_sm) == command_status::esme_rinvbndsts);
+	BOOST_CHECK(s.admit(0x77) == command_status::esme_rinvcmdid);
+	BOOST_CHECK(s.rejects() == 2);
+	BOOST_CHECK(s.admit(command::bind_transmitter) == command_status::esme_rok);
+	BOOST_CHECK(s.rejects() == 0);
+
+	/* Failed bind leaves session open */
+	s.on_send(command::bind_transmitter_r, command_status::esme_rbindfail);
+	BOOST_CHECK(s.state() == session::open);
+	s.on_send(command::bind_transmitter_r, command_status::esme_rok);
+	BOOST_CHECK(s.state() == session::bound_tx);
+
+	BOOST_CHECK(s.admit(command::submit_sm) == command_status::esme_rok);
+	BOOST_CHECK(s.admit(command::bind_transceiver) == command_status::esme_ralybnd);
+	BOOST_CHECK(s.admit(command::deliver_sm) == command_status::esme_rinvbndsts);
+	BOOST_CHECK(s.admit(command::submit_sm_r) == command_status::esme_rok);
+
+	BOOST_CHECK(s.admit(command::unbind) == command_status::esme_rok);
+	s.on_recv(command::unbind, command_status::esme_rok);
+	BOOST_CHECK(s.state() == session::unbinding);
+	BOOST_CHECK(s.admit(command::submit_sm) == command_status::esme_rinvbndsts);
+	s.on_send(command::unbind_r, command_status::esme_rok);
+	BOOST_CHECK(s.state() == session::closed);
+	BOOST_CHECK(s.admit(command::enquire_link) == command_status::esme_rinvbndsts);
+
+	session e(session::esme);
+	BOOST_CHECK(e.admit(command::outbind) == command_status::esme_rok);
+	e.on_recv(command::bind_receiver_r, command_status::esme_rok);
+	BOOST_CHECK(e.state() == session::bound_rx);
+	BOOST_CHECK(e.admit(command::deliver_sm) == command_status::esme_rok);
+	BOOST_CHECK(e.admit(command::submit_sm) == command_status::esme_rinvbndsts);
+}
+BOOST_AUTO_TEST_CASE( test_throttle )
+{
+	using namespace smpp;
+
+	const bin::u64_t ms = 1000000;
+	const bin::u64_t now = 1000000 * ms;
+
+	bucket b;
+	b.set(1000, 10);
+	for (int i = 0; i < 10; ++i) {
+		BOOST_CHECK(b.acquire(now));
+	}
+	BOOST_CHECK(!b.acquire(now));
+	BOOST_CHECK(b.acquire(now + ms));
+	BOOST_CHECK(!b.acquire(now + ms));
+	b.release();
+	BOOST_CHECK(b.acquire(now + ms));
+
+	throttle t;
+	t.set_limit("acct", 1000, 1);
+	BOOST_CHECK(t.set_limit("acct", "99", 1, 1));
+	BOOST_CHECK(t.set_limit("acct", "998", 1, 2));
+	BOOST_CHECK(t.find(bin::ascbuf("none"), 5) == nullptr);
+
+	throttle::account * a = t.find(bin::ascbuf("acct"), 5);
+	BOOST_CHECK(a != nullptr && a->has_prefixes());
+	BOOST_CHECK(a->acquire(now));
+	BOOST_CHECK(!a->acquire(now));
+	BOOST_CHECK(a->acquire(bin::ascbuf("991234"), 7, now));
+	BOOST_CHECK(!a->acquire(bin::ascbuf("991234"), 7, now));
+	BOOST_CHECK(a->acquire(bin::ascbuf("998765"), 7, now));
+	BOOST_CHECK(a->acquire(bin::ascbuf("998765"), 7, now));
+	BOOST_CHECK(!a->acquire(bin::ascbuf("998765"), 7, now));
+	BOOST_CHECK(a->acquire(bin::ascbuf("123"), 4, now));
+
+	t.set_default(10, 1);
+	BOOST_CHECK(t.find(bin::ascbuf("other"), 6) != nullptr);
+}
+BOOST_AUTO_TEST_CASE( test_reassembler )
+{
+	using namespace smpp;
+
+	typedef reassembler::clock_t clock_t;
+	clock_t::time_point now = clock_t::now();
+
+	/* Parts found in SAR TLVs and in UDH */
+	submit_sm sm;
+	sm.esm_class = 0;
+	sm.set_short_msg("abc");
+	segment s;
+	BOOST_CHECK(!get_segment(sm, s));
+	sm.sar_msg_ref_num.set(7);
+	sm.sar_total_segments.set(2);
+	sm.sar_segment_seqnum.set(2);
+	BOOST_CHECK(get_segment(sm, s) && s.ref == 7 && s.seqnum == 2 && s.len == 4);
+
+	deliver_sm dm;
+	const bin::u8_t udh16[] = "\x06\x08\x04\x12\x34\x03\x01" "def";
+	dm.esm_class = udh::esm_udhi;
+	dm.short_msg_len = sizeof(udh16) - 1;
+	std::memcpy(dm.short_msg, udh16, dm.short_msg_len);
+	BOOST_CHECK(get_segment(dm, s) && s.ref == 0x1234
+		&& s.total == 3 && s.seqnum == 1 && s.len == 3);
+	dm.short_msg[0] = 0x20;
+	BOOST_CHECK(!get_segment(dm, s));
+
+	reassembler r(2, 1024, std::chrono::seconds(10));
+	reassembler::message m;
+	const bin::u8_t src[] = "100";
+	const bin::u8_t dst[] = "200";
+
+	segment p[3];
+	const char * text[] = { "hello ", "concatenated ", "world" };
+	for (int i = 0; i < 3; ++i) {
+		p[i].ref = 1;
+		p[i].total = 3;
+		p[i].seqnum = i + 1;
+		p[i].data = bin::ascbuf(text[i]);
+		p[i].len = std::strlen(text[i]);
+	}
+	BOOST_CHECK(r.insert(src, 4, dst, 4, p[2], now, m) == reassembler::stored);
+	BOOST_CHECK(r.insert(src, 4, dst, 4, p[0], now, m) == reassembler::stored);
+	BOOST_CHECK(r.insert(src, 4, dst, 4, p[0], now, m) == reassembler::duplicate);
+	/* Other destination makes another message */
+	BOOST_CHECK(r.insert(src, 4, src, 4, p[1], now, m) == reassembler::stored);
+	BOOST_CHECK(r.groups() == 2);
+	BOOST_CHECK(r.insert(src, 4, dst, 4, p[1], now, m) == reassembler::complete);
+	BOOST_CHECK(std::string(reinterpret_cast<const char *>(m.data), m.len) == "hello concatenated world");
+	BOOST_CHECK(r.groups() == 1);
+
+	/* Incomplete message times out */
+	int expired = 0;
+	BOOST_CHECK(r.expire(now + std::chrono::seconds(10)
+		, [&expired] (bin::u16_t, bin::u8_t received, bin::u8_t total) {
+			expired += received == 1 && total == 3;
+		}) == 1);
+	BOOST_CHECK(expired == 1 && r.groups() == 0 && r.bytes_used() == 0);
+
+	/* Memory budget is kept by dropping the oldest message */
+	reassembler small(4, 256, std::chrono::seconds(10));
+	bin::u8_t big[200] = {};
+	segment b;
+	b.total = 2;
+	b.seqnum = 1;
+	b.data = big;
+	b.len = sizeof(big);
+	b.ref = 1;
+	BOOST_CHECK(small.insert(src, 4, dst, 4, b, now, m) == reassembler::stored);
+	b.ref = 2;
+	BOOST_CHECK(small.insert(src, 4, dst, 4, b, now, m) == reassembler::stored);
+	BOOST_CHECK(small.evicted() == 1 && small.groups() == 1);
+	BOOST_CHECK(small.bytes_used() <= 256);
+	b.seqnum = 2;
+	b.len = 100;
+	BOOST_CHECK(small.insert(src, 4, dst, 4, b, now, m) == reassembler::overflow);
+}
+
+BOOST_AUTO_TEST_CASE( test_segmenter )
+{
+	using namespace smpp;
+
+	/* Short text goes as is */
+	bin::u8_t text[400];
+	std::memset(text, 'a', sizeof(text));
+	submit_sm sm;
+	sm.esm_class = 0;
+	segmenter one(segmenter::udh8, 0x00, text, 160);
+	BOOST_CHECK_EQUAL(one.count(), 1);
+	one.fill(sm, 0, 1);
+	BOOST_CHECK(sm.short_msg_len == 160 && sm.esm_class == 0);
+
+	/* GSM 7-bit text in two parts with 8-bit reference UDH */
+	text[152] = 'b';
+	segmenter gsm(segmenter::udh8, 0x00, text, 300);
+	BOOST_CHECK_EQUAL(gsm.count(), 2);
+	gsm.fill(sm, 0, 0x1234);
+	const bin::u8_t udh8[] = { 5, 0, 3, 0x34, 2, 1 };
+	BOOST_CHECK(sm.short_msg_len == 6 + 153 && sm.esm_class == udh::esm_udhi);
+	BOOST_CHECK(std::memcmp(sm.short_msg, udh8, sizeof(udh8)) == 0);
+	BOOST_CHECK_EQUAL(sm.short_msg[6 + 152], 'b');
+	gsm.fill(sm, 1, 0x1234);
+	BOOST_CHECK(sm.short_msg_len == 6 + 147 && sm.short_msg[5] == 2);
+
+	/* Escape sequence is not split */
+	text[152] = 0x1B;
+	segmenter esc(segmenter::udh8, 0x00, text, 300);
+	esc.fill(sm, 0, 1);
+	BOOST_CHECK_EQUAL(sm.short_msg_len, 6 + 152);
+	text[152] = 'a';
+
+	/* UCS-2 text with 16-bit reference, surrogate pair is not split */
+	text[130] = 0xD8;
+	segmenter ucs(segmenter::udh16, 0x08, text, 200);
+	BOOST_CHECK_EQUAL(ucs.count(), 2);
+	ucs.fill(sm, 0, 0x1234);
+	const bin::u8_t udh16[] = { 6, 8, 4, 0x12, 0x34, 2, 1 };
+	BOOST_CHECK(std::memcmp(sm.short_msg, udh16, sizeof(udh16)) == 0);
+	BOOST_CHECK_EQUAL(sm.short_msg_len, 7 + 130);
+	text[130] = 'a';
+
+	/* SAR parts carry no UDH */
+	deliver_sm dm;
+	dm.esm_class = udh::esm_udhi;
+	segmenter sar(segmenter::sar, 0x04, text, 200);
+	BOOST_CHECK_EQUAL(sar.count(), 2);
+	sar.fill(dm, 1, 9);
+	BOOST_CHECK(dm.short_msg_len == 66 && dm.esm_class == 0);
+	BOOST_CHECK(dm.sar_msg_ref_num.val == 9 && dm.sar_total_segments.val == 2
+		&& dm.sar_segment_seqnum.val == 2);
+
+	/* Whole text in msg_payload */
+	segmenter payload(segmenter::payload, 0x00, text, 400);
+	BOOST_CHECK_EQUAL(payload.count(), 1);
+	payload.fill(sm, 0, 0);
+	BOOST_CHECK(sm.short_msg_len == 0 && sm.msg_payload.len == 400
+		&& sm.msg_payload.val == text);
+
+	/* Too many parts */
+	std::vector<bin::u8_t> huge(255 * 153 + 1, 'a');
+	segmenter big(segmenter::udh8, 0x00, huge.data(), huge.size());
+	BOOST_CHECK_EQUAL(big.count(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_fanout )
+{
+	using namespace smpp;
+
+	submit_multi_sm msg;
+	msg.set_src_addr("100");
+	msg.add_dst_addr(0x01, 0x01, "200");
+	msg.add_dl_name("FRIENDS");
+	msg.add_dst_addr(0x01, 0x01, "300");
+	msg.set_short_msg("hello");
+
+	/* Every recipient refers to the same body */
+	const bin::u8_t * body = nullptr;
+	submit_multi_r r;
+	bin::sz_t n = fanout(msg, r, [&] (const recipient & rcpt) -> bin::u32_t {
+		BOOST_CHECK(body == nullptr || body == rcpt.data());
+		body = rcpt.data();
+		if (!rcpt.is_sme()) {
+			return command_status::esme_rinvdlname;
+		}
+		if (rcpt.dst().sme_addr.dst_addr[0] == '3') {
+			return command_status::esme_rinvdstadr;
+		}
+		submit_sm sm;
+		rcpt.fill(sm);
+		BOOST_CHECK(sm.short_msg_len == 0 && sm.msg_payload.val == msg.short_msg
+			&& sm.msg_payload.len == msg.short_msg_len);
+		BOOST_CHECK(std::string(reinterpret_cast<const char *>(sm.dst_addr)) == "200");
+		return command_status::esme_rok;
+	});
+	BOOST_CHECK_EQUAL(n, 1);
+	BOOST_CHECK(body == msg.short_msg);
+	BOOST_CHECK_EQUAL(r.no_unsuccess, 2);
+	BOOST_CHECK_EQUAL(r.unsuccess_sme[0].error_status_code, command_status::esme_rinvdlname);
+	BOOST_CHECK(std::memcmp(r.unsuccess_sme[0].dst_addr, "FRIENDS", 8) == 0);
+	BOOST_CHECK_EQUAL(r.unsuccess_sme[1].error_status_code, command_status::esme_rinvdstadr);
+	BOOST_CHECK(std::memcmp(r.unsuccess_sme[1].dst_addr, "300", 4) == 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_msgid )
+{
+	using namespace smpp;
+
+	msgid ids(5);
+	submit_sm_r r;
+	bin::u64_t prev = ids.next(r);
+	BOOST_CHECK(r.msg_id_len == msgid::text_len);
+	BOOST_CHECK(r.msg_id[msgid::text_len - 1] == '\0');
+
+	/* Text and numeric order agree, text parses back */
+	bin::u8_t prev_text[msgid::text_len];
+	std::memcpy(prev_text, r.msg_id, sizeof(prev_text));
+	for (int i = 0; i < 10000; ++i) {
+		bin::u64_t id = ids.next(r);
+		BOOST_REQUIRE(id > prev);
+		BOOST_REQUIRE(std::memcmp(prev_text, r.msg_id, sizeof(prev_text)) < 0);
+		bin::u64_t parsed;
+		BOOST_REQUIRE(msgid::parse(r.msg_id, r.msg_id_len, parsed) && parsed == id);
+		BOOST_REQUIRE(((id >> 12) & msgid::max_node) == 5);
+		prev = id;
+		std::memcpy(prev_text, r.msg_id, sizeof(prev_text));
+	}
+	BOOST_CHECK(!msgid::parse(bin::ascbuf("0123"), 4, prev));
+	BOOST_CHECK(msgid::time(prev) <= msgid::clock_t::now());
+
+	/* No duplicates across threads */
+	const int threads = 4;
+	const int count = 20000;
+	std::vector<bin::u64_t> all(threads * count);
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; ++t) {
+		workers.push_back(std::thread([&ids, &all, t] () {
+			for (int i = 0; i < count; ++i) {
+				all[t * count + i] = ids.next();
+			}
+		}));
+	}
+	for (std::thread & w: workers) {
+		w.join();
+	}
+	std::sort(all.begin(), all.end());
+	BOOST_CHECK(std::adjacent_find(all.begin(), all.end()) == all.end());
+}
+
+BOOST_AUTO_TEST_CASE( test_store )
+{
+	using namespace smpp;
+
+	store st(4);
+	store::clock_t::time_point now = store::clock_t::now();
+	submit_sm msg;
+	msg.set_serv_type("");
+	msg.set_src_addr("100");
+	msg.set_dst_addr("200");
+	msg.set_schedule_delivery_time("");
+	msg.set_validity_period("");
+	msg.set_short_msg("hello");
+	msg.esm_class = 0;
+	msg.data_coding = 0;
+	msg.registered_delivery = 1;
+	msg.sm_default_msg_id = 0;
+
+	/* Many records across shards and table growth */
+	const bin::u64_t count = 5000;
+	for (bin::u64_t id = 1; id <= count; ++id) {
+		BOOST_REQUIRE(st.insert(id, msg, now));
+	}
+	BOOST_CHECK(!st.insert(1, msg, now));
+	BOOST_CHECK_EQUAL(st.size(), count);
+
+	store::status s;
+	BOOST_CHECK(st.query(7, bin::ascbuf("100"), 4, s));
+	BOOST_CHECK_EQUAL(s.state, message_state::enroute);
+	BOOST_CHECK_EQUAL(s.final_date, 0);
+	BOOST_CHECK(!st.query(7, bin::ascbuf("101"), 4, s));
+	BOOST_CHECK(!st.query(count + 1, bin::ascbuf("100"), 4, s));
+
+	/* Search by addresses, service type must match if given */
+	store::key k = store::key::of(msg);
+	bin::sz_t n = st.find(k, [] (bin::u64_t) { return true; });
+	BOOST_CHECK(n == store::max_matches);
+	bin::u64_t first = 0;
+	st.find(k, [&first] (bin::u64_t id) { first = id; return false; });
+	BOOST_CHECK(first >= 1 && first <= count);
+	k.serv_type = bin::ascbuf("WAP");
+	k.serv_type_len = 3;
+	BOOST_CHECK_EQUAL(st.find(k, [] (bin::u64_t) { return true; }), 0);
+	k.serv_type_len = 0;
+
+	/* Replacement keeps the record pending, cancel moves it to final */
+	replace_sm rep;
+	rep.set_src_addr("100");
+	rep.set_schedule_delivery_time("");
+	rep.set_validity_period("");
+	rep.set_short_msg(std::string(200, 'x'));
+	rep.registered_delivery = 0;
+	rep.sm_default_msg_id = 0;
+	BOOST_CHECK_EQUAL(st.replace(7, rep), command_status::esme_rok);
+	rep.set_src_addr("101");
+	BOOST_CHECK_EQUAL(st.replace(7, rep), command_status::esme_rreplacefail);
+	BOOST_CHECK_EQUAL(st.cancel(7, k, now), command_status::esme_rok);
+	BOOST_CHECK_EQUAL(st.cancel(7, k, now), command_status::esme_rcancelfail);
+	rep.set_src_addr("100");
+	BOOST_CHECK_EQUAL(st.replace(7, rep), command_status::esme_rreplacefail);
+	BOOST_CHECK(st.query(7, bin::ascbuf("100"), 4, s));
+	BOOST_CHECK_EQUAL(s.state, message_state::deleted);
+	BOOST_CHECK(s.final_date != 0);
+
+	/* Final states leave the address index, erase drops the record */
+	BOOST_CHECK(st.update(8, message_state::delivered, 0, now));
+	BOOST_CHECK(st.erase(9));
+	BOOST_CHECK(!st.erase(9));
+	BOOST_CHECK_EQUAL(st.size(), count - 1);
+	bin::sz_t pending = 0;
+	while ((n = st.find(k, [&] (bin::u64_t id) {
+		BOOST_REQUIRE(id != 7 && id != 8 && id != 9);
+		pending += st.cancel(id, k, now) == command_status::esme_rok;
+		return true;
+	})) != 0) {
+	}
+	BOOST_CHECK_EQUAL(pending, count - 3);
+
+	/* Final records are kept for a query window, then erased as smppd
+	 * does, by ids held in a scheduler until final_date + window */
+	const std::time_t window = 3600;
+	scheduler<bin::u64_t> retiring;
+	for (bin::u64_t id = 1; id <= count; ++id) {
+		if (id != 9 && st.query(id, bin::ascbuf("100"), 4, s)) {
+			BOOST_REQUIRE(s.final_date != 0);
+			retiring.add(s.final_date + window, id);
+		}
+	}
+	BOOST_CHECK_EQUAL(retiring.size(), count - 1);
+	std::time_t final_date = store::clock_t::to_time_t(now);
+	BOOST_CHECK_EQUAL(retiring.poll(final_date + window - 1, count, [&st] (bin::u64_t id) {
+		st.erase(id);
+	}), 0);
+	BOOST_CHECK_EQUAL(st.size(), count - 1);
+	BOOST_CHECK_EQUAL(retiring.poll(final_date + window, count, [&st] (bin::u64_t id) {
+		BOOST_CHECK(st.erase(id));
+	}), count - 1);
+	BOOST_CHECK_EQUAL(st.size(), 0);
+	BOOST_CHECK(!st.query(7, bin::ascbuf("100"), 4, s));
+	for (bin::u64_t id = 1; id <= count; ++id) {
+		BOOST_REQUIRE(st.insert(count + id, msg, now));
+	}
+	BOOST_CHECK_EQUAL(st.size(), count);
+}
+
+BOOST_AUTO_TEST_CASE( test_journal )
+{
+	using namespace smpp;
+
+	char dir[] = "/tmp/smpptest.XXXXXX";
+	BOOST_REQUIRE(mkdtemp(dir) != nullptr);
+	auto wait = [] (journal & j, bin::u64_t lsn) {
+		for (int i = 0; i < 500 && j.committed() < lsn; ++i) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		return j.committed() >= lsn;
+	};
+	std::vector<std::string> got;
+	auto collect = [&got] (bin::u64_t id, const bin::u8_t * pdu, bin::sz_t len) {
+		got.push_back(std::to_string(id) + ":" + std::string(pdu, pdu + len));
+	};
+
+	/* Commit, tombstones and recovery */
+	{
+		journal j(dir, 4096);
+		BOOST_REQUIRE(j.open(collect));
+		BOOST_CHECK(got.empty());
+		bin::u64_t committed = 0;
+		j.start([&committed] (bin::u64_t lsn) { committed = lsn; });
+		BOOST_CHECK(j.append(1, bin::ascbuf("one"), 3) != 0);
+		BOOST_CHECK(j.append(2, bin::ascbuf("two"), 3) != 0);
+		BOOST_CHECK(j.remove(1) != 0);
+		BOOST_CHECK_EQUAL(j.remove(5), 0);
+		bin::u64_t lsn = j.append(3, bin::ascbuf("three"), 5);
+		BOOST_CHECK(wait(j, lsn));
+		j.stop();
+		BOOST_CHECK_EQUAL(committed, lsn);
+		BOOST_CHECK_EQUAL(j.live(), 2);
+	}
+	{
+		journal j(dir, 4096);
+		BOOST_REQUIRE(j.open(collect));
+		BOOST_REQUIRE_EQUAL(got.size(), 2);
+		BOOST_CHECK_EQUAL(got[0], "2:two");
+		BOOST_CHECK_EQUAL(got[1], "3:three");
+	}
+
+	/* Mostly dead segments are compacted away,
+	 * their live records are moved to the head */
+	got.clear();
+	bin::sz_t segments;
+	{
+		journal j(dir, 4096);
+		BOOST_REQUIRE(j.open(collect));
+		j.start();
+		std::string body(100, 'x');
+		bin::u64_t lsn = 0;
+		for (bin::u64_t id = 10; id < 200; ++id) {
+			lsn = j.append(id, bin::ascbuf(body.c_str()), body.size());
+			BOOST_REQUIRE(lsn != 0);
+		}
+		for (bin::u64_t id = 10; id < 195; ++id) {
+			BOOST_REQUIRE(j.remove(id) != 0);
+		}
+		segments = j.segments();
+		BOOST_CHECK(segments > 4);
+		for (int i = 0; i < 300 && j.segments() > 2; ++i) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		BOOST_CHECK(j.segments() <= 2);
+		BOOST_CHECK_EQUAL(j.live(), 7);
+	}
+	got.clear();
+	{
+		journal j(dir, 4096);
+		BOOST_REQUIRE(j.open(collect));
+		BOOST_REQUIRE_EQUAL(got.size(), 7);
+		BOOST_CHECK(std::find(got.begin(), got.end(), "2:two") != got.end());
+		BOOST_CHECK(std::find(got.begin(), got.end(), "3:three") != got.end());
+		std::sort(got.begin(), got.end());
+		BOOST_CHECK_EQUAL(got[0].substr(0, 4), "195:");
+		BOOST_CHECK_EQUAL(got[4].substr(0, 4), "199:");
+	}
+
+	/* Failed syncs are retried with a backoff rather than in
+	 * a loop, and commit once syncs work again */
+	{
+		journal j(dir, 4096, std::chrono::milliseconds(1));
+		BOOST_REQUIRE(j.open(collect));
+		std::atomic<bin::u32_t> failures(0);
+		std::atomic<bin::u32_t> calls(0);
+		j.start(journal::commit_handler(), [&failures, &calls] (bin::u32_t n) {
+			failures = n;
+			calls++;
+		});
+		msync_fails = true;
+		bin::u64_t lsn = j.append(300, bin::ascbuf("failing"), 7);
+		BOOST_REQUIRE(lsn != 0);
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		bin::u32_t failed = calls.load();
+		BOOST_CHECK(failed >= 3);
+		BOOST_CHECK(failed <= 12);
+		BOOST_CHECK_EQUAL(failures.load(), failed);
+		BOOST_CHECK(j.committed() < lsn);
+		msync_fails = false;
+		BOOST_CHECK(wait(j, lsn));
+		j.stop();
+	}
+	if (std::system((std::string("rm -rf ") + dir).c_str()) != 0) {
+		BOOST_WARN_MESSAGE(false, "can not remove " << dir);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( test_correlator )
+{
+	using namespace smpp;
+
+	const bin::sz_t count = 10000;
+	correlator c(count, std::chrono::seconds(60));
+	correlator::time_point now = correlator::clock_t::now();
+	auto key = [] (bin::sz_t i) { return "UP" + std::to_string(i * 7919); };
+	correlator::origin o;
+	for (bin::sz_t i = 0; i < count; ++i) {
+		o.msg_id = i;
+		o.sys_key = 0xFEEDull << 40 | i % 8;
+		o.submit_time = 0;
+		std::string k = key(i);
+		BOOST_REQUIRE(c.insert(bin::ascbuf(k.c_str()), k.size(), o, now));
+	}
+	BOOST_CHECK_EQUAL(c.size(), count);
+	BOOST_CHECK(c.memory() >= count * 64);
+	BOOST_CHECK(!c.insert(bin::ascbuf("extra"), 5, o, now));
+	BOOST_CHECK_EQUAL(c.rejected(), 1);
+
+	/* Removal keeps the rest of probe runs reachable */
+	for (bin::sz_t i = 0; i < count; i += 2) {
+		std::string k = key(i);
+		BOOST_REQUIRE(c.take(bin::ascbuf(k.c_str()), k.size() + 1, o, now));
+		BOOST_REQUIRE_EQUAL(o.msg_id, i);
+	}
+	for (bin::sz_t i = 0; i < count; ++i) {
+		std::string k = key(i);
+		bool found = c.find(bin::ascbuf(k.c_str()), k.size(), o, now);
+		BOOST_REQUIRE_EQUAL(found, i % 2 == 1);
+		BOOST_REQUIRE(!found || (o.msg_id == i && o.sys_key == (0xFEEDull << 40 | i % 8)));
+	}
+
+	/* Ids longer than kept in a slot are told apart by hash */
+	std::string a(50, 'a');
+	std::string b = a + "b";
+	o.msg_id = 1;
+	BOOST_CHECK(c.insert(bin::ascbuf(a.c_str()), a.size(), o, now));
+	o.msg_id = 2;
+	BOOST_CHECK(c.insert(bin::ascbuf(b.c_str()), b.size(), o, now));
+	BOOST_CHECK(c.find(bin::ascbuf(a.c_str()), a.size(), o, now) && o.msg_id == 1);
+	BOOST_CHECK(c.erase(bin::ascbuf(b.c_str()), b.size(), now));
+	BOOST_CHECK(!c.find(bin::ascbuf(b.c_str()), b.size(), o, now));
+
+	/* Expiry by lookups and by sweeps */
+	correlator::time_point later = now + std::chrono::seconds(61);
+	std::string k = key(1);
+	BOOST_CHECK(!c.find(bin::ascbuf(k.c_str()), k.size(), o, later));
+	bin::sz_t left = c.size();
+	bin::sz_t dropped = 0;
+	for (int i = 0; i < 100 && c.size() != 0; ++i) {
+		dropped += c.expire(later, 1024);
+	}
+	BOOST_CHECK_EQUAL(dropped, left);
+	BOOST_CHECK_EQUAL(c.size(), 0);
+	BOOST_CHECK_EQUAL(c.expired(), left + 1);
+}
+
+BOOST_AUTO_TEST_CASE( test_receipt )
+{
+	using namespace smpp;
+
+	const char * text = "id:0123456789 sub:001 dlvrd:001 submit date:1501021530"
+		" done date:150102153112 stat:DELIVRD err:000 text:Hello world";
+	receipt r;
+	BOOST_REQUIRE(parse_receipt(bin::ascbuf(text), std::strlen(text), r));
+	BOOST_CHECK_EQUAL(std::string(r.id, r.id + r.id_len), "0123456789");
+	BOOST_CHECK_EQUAL(r.sub, 1);
+	BOOST_CHECK_EQUAL(r.dlvrd, 1);
+	/* 2015-01-02 15:30:00 UTC */
+	BOOST_CHECK_EQUAL(r.submit_date, 1420212600);
+	BOOST_CHECK_EQUAL(r.done_date, 1420212672);
+	BOOST_CHECK_EQUAL(r.state, message_state::delivered);
+	BOOST_CHECK_EQUAL(r.err, 0);
+	BOOST_CHECK_EQUAL(std::string(r.text, r.text + r.text_len), "Hello world");
+
+	/* Vendor variants: case, underscores, order, words, missing fields */
+	const char * variant = "Id:ABC-1  Stat:UNDELIVERABLE submit_date:1501021530"
+		" Err:12 foo:bar dlvrd: sub:1 Text:";
+	BOOST_REQUIRE(parse_receipt(bin::ascbuf(variant), std::strlen(variant) + 1, r));
+	BOOST_CHECK_EQUAL(std::string(r.id, r.id + r.id_len), "ABC-1");
+	BOOST_CHECK_EQUAL(r.state, message_state::undeliverable);
+	BOOST_CHECK_EQUAL(r.submit_date, 1420212600);
+	BOOST_CHECK_EQUAL(r.done_date, 0);
+	BOOST_CHECK_EQUAL(r.err, 12);
+	BOOST_CHECK_EQUAL(r.dlvrd, 0);
+	BOOST_CHECK_EQUAL(r.sub, 1);
+	BOOST_CHECK_EQUAL(r.text_len, 0);
+	BOOST_CHECK(!parse_receipt(bin::ascbuf("hello there"), 11, r));
+
+	/* Format and parse back through deliver_sm */
+	receipt out;
+	out.id = bin::ascbuf("00000000DEADBEEF");
+	out.id_len = 16;
+	out.sub = 1;
+	out.dlvrd = 1;
+	out.submit_date = 1420212600;
+	out.done_date = 1420212672;
+	out.state = message_state::expired;
+	out.err = 5;
+	out.text = bin::ascbuf("A long original message text");
+	out.text_len = 28;
+	deliver_sm msg;
+	msg.esm_class = 0;
+	BOOST_REQUIRE(set_receipt(msg, out));
+	BOOST_CHECK(is_receipt(msg));
+	BOOST_CHECK_EQUAL(std::string(msg.short_msg, msg.short_msg + msg.short_msg_len)
+		, "id:00000000DEADBEEF sub:001 dlvrd:001 submit date:1501021530"
+		" done date:1501021531 stat:EXPIRED err:005 text:A long original mess");
+	BOOST_REQUIRE(get_receipt(msg, r));
+	BOOST_CHECK_EQUAL(std::string(r.id, r.id + r.id_len), "00000000DEADBEEF");
+	BOOST_CHECK_EQUAL(r.state, message_state::expired);
+	BOOST_CHECK_EQUAL(r.done_date, 1420212660);
+	bin::u8_t small[32];
+	BOOST_CHECK_EQUAL(format_receipt(out, small, sizeof(small)), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_retrier )
+{
+	using namespace smpp;
+	using std::chrono::milliseconds;
+
+	/* Timer wheel: ordering across turns, cancel, pool limit */
+	typedef timer_wheel<int> wheel_t;
+	wheel_t::time_point t0 = wheel_t::clock_t::now();
+	wheel_t w(3, milliseconds(10), 4, t0);
+	std::vector<int> fired;
+	auto collect = [&fired] (int v) { fired.push_back(v); };
+	BOOST_CHECK(w.add(milliseconds(5), 1, t0) != wheel_t::nil);
+	wheel_t::handle h = w.add(milliseconds(25), 2, t0);
+	BOOST_CHECK(w.add(milliseconds(100), 3, t0) != wheel_t::nil);
+	BOOST_CHECK(w.add(milliseconds(1), 4, t0) == wheel_t::nil);
+	BOOST_CHECK_EQUAL(w.size(), 3);
+	BOOST_CHECK_EQUAL(w.expire(t0 + milliseconds(10), collect), 1);
+	BOOST_CHECK(w.cancel(h));
+	BOOST_CHECK(!w.cancel(h));
+	BOOST_CHECK_EQUAL(w.expire(t0 + milliseconds(90), collect), 0);
+	BOOST_CHECK_EQUAL(w.expire(t0 + milliseconds(100), collect), 1);
+	BOOST_REQUIRE_EQUAL(fired.size(), 2);
+	BOOST_CHECK_EQUAL(fired[0], 1);
+	BOOST_CHECK_EQUAL(fired[1], 3);
+	BOOST_CHECK_EQUAL(w.size(), 0);
+
+	/* Backoff grows per destination and is capped by attempts */
+	retrier<int>::policy p;
+	p.initial = std::chrono::seconds(1);
+	p.max = std::chrono::seconds(4);
+	p.max_attempts = 2;
+	p.max_inflight = 1;
+	retrier<int> r(16, p);
+	retrier<int>::time_point now = retrier<int>::clock_t::now();
+	std::vector<int> due;
+	bin::u32_t last_attempt = 0;
+	auto send = [&] (bin::u64_t dst, int v, bin::u32_t attempt) {
+		BOOST_CHECK_EQUAL(dst, 7);
+		due.push_back(v);
+		last_attempt = attempt;
+	};
+	BOOST_CHECK(r.failed(7, 1, 0, now));
+	BOOST_CHECK(r.failed(7, 2, 0, now));
+	BOOST_CHECK_EQUAL(r.size(), 2);
+	BOOST_CHECK_EQUAL(r.destinations(), 1);
+	BOOST_CHECK_EQUAL(r.poll(now + milliseconds(400), send), 0);
+	/* Both due, only one passed while the other is unfinished */
+	BOOST_CHECK_EQUAL(r.poll(now + milliseconds(1200), send), 1);
+	BOOST_CHECK_EQUAL(r.inflight(), 1);
+	BOOST_CHECK_EQUAL(last_attempt, 1);
+	r.finished();
+	BOOST_CHECK_EQUAL(r.poll(now + milliseconds(1200), send), 1);
+	r.finished();
+	BOOST_CHECK_EQUAL(r.size(), 0);
+	BOOST_CHECK_EQUAL(due.size(), 2);
+
+	/* Second failure waits 1 to 2 seconds */
+	now += milliseconds(1200);
+	BOOST_CHECK(r.failed(7, 1, 1, now));
+	BOOST_CHECK_EQUAL(r.poll(now + milliseconds(900), send), 0);
+	BOOST_CHECK_EQUAL(r.poll(now + milliseconds(2200), send), 1);
+	BOOST_CHECK_EQUAL(last_attempt, 2);
+	r.finished();
+	BOOST_CHECK(!r.failed(7, 1, 2, now + milliseconds(2200)));
+	BOOST_CHECK_EQUAL(r.dropped(), 1);
+
+	r.succeeded(7);
+	BOOST_CHECK_EQUAL(r.destinations(), 0);
+
+	/* Backoff of a destination which never succeeds is forgotten
+	 * once a max delay passes with nothing of it waiting */
+	auto resend = [] (bin::u64_t dst, int, bin::u32_t) {
+		BOOST_CHECK_EQUAL(dst, 9);
+	};
+	now += milliseconds(2200);
+	BOOST_CHECK(r.failed(9, 1, 1, now));
+	BOOST_CHECK_EQUAL(r.poll(now + milliseconds(1500), resend), 1);
+	BOOST_CHECK_EQUAL(r.destinations(), 1);
+	r.finished();
+	BOOST_CHECK(!r.failed(9, 1, 2, now + milliseconds(1500)));
+	BOOST_CHECK_EQUAL(r.poll(now + milliseconds(7000), resend), 0);
+	BOOST_CHECK_EQUAL(r.destinations(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_schedule )
+{
+	using namespace smpp;
+
+	/* 2015-01-02 15:30:00 UTC */
+	const std::time_t now = 1420212600;
+	std::time_t t;
+	BOOST_CHECK(parse_time(bin::ascbuf("150102153000000+"), 17, now, t));
+	BOOST_CHECK_EQUAL(t, now);
+	/* Two hours ahead of UTC and one behind */
+	BOOST_CHECK(parse_time(bin::ascbuf("150102173000008+"), 17, now, t));
+	BOOST_CHECK_EQUAL(t, now);
+	BOOST_CHECK(parse_time(bin::ascbuf("150102143000004-"), 16, now, t));
+	BOOST_CHECK_EQUAL(t, now);
+	/* Relative: a month, a day, an hour and a second from now */
+	BOOST_CHECK(parse_time(bin::ascbuf("000101010001000R"), 17, now, t));
+	BOOST_CHECK_EQUAL(t, now + (31 + 1) * 86400 + 3601);
+	BOOST_CHECK(parse_time(bin::ascbuf("000000000000000R"), 17, now, t));
+	BOOST_CHECK_EQUAL(t, now);
+	BOOST_CHECK(parse_time(bin::ascbuf(""), 1, now, t));
+	BOOST_CHECK_EQUAL(t, 0);
+	BOOST_CHECK(!parse_time(bin::ascbuf("151302153000000+"), 17, now, t));
+	BOOST_CHECK(!parse_time(bin::ascbuf("150102153000000X"), 17, now, t));
+	BOOST_CHECK(!parse_time(bin::ascbuf("1501021530"), 11, now, t));
+	BOOST_CHECK(!parse_time(bin::ascbuf("15010215300000+"), 17, now, t));
+
+	bin::u8_t buf[17];
+	format_time(now + 59, buf);
+	BOOST_CHECK_EQUAL(std::string(buf, buf + 16), "150102153059000+");
+	BOOST_CHECK(parse_time(buf, sizeof(buf), 0, t));
+	BOOST_CHECK_EQUAL(t, now + 59);
+
+	/* Values come back by second, at most max per poll */
+	scheduler<int> s;
+	for (int i = 0; i < 5; ++i) {
+		s.add(now + 10, i);
+	}
+	s.add(now + 5, 10);
+	s.add(now + 20, 20);
+	BOOST_CHECK_EQUAL(s.size(), 7);
+	BOOST_CHECK_EQUAL(s.buckets(), 3);
+	BOOST_CHECK_EQUAL(s.next(), now + 5);
+	std::vector<int> due;
+	auto collect = [&due] (int v) { due.push_back(v); };
+	BOOST_CHECK_EQUAL(s.poll(now + 4, 100, collect), 0);
+	BOOST_CHECK_EQUAL(s.poll(now + 10, 3, collect), 3);
+	BOOST_REQUIRE_EQUAL(due.size(), 3);
+	BOOST_CHECK_EQUAL(due[0], 10);
+	BOOST_CHECK_EQUAL(s.poll(now + 10, 100, collect), 3);
+	BOOST_CHECK_EQUAL(s.size(), 1);
+	BOOST_CHECK_EQUAL(s.next(), now + 20);
+	std::sort(due.begin(), due.end());
+	BOOST_CHECK_EQUAL(due[0], 0);
+	BOOST_CHECK_EQUAL(due[4], 4);
+	/* Added in the past comes with the next poll */
+	s.add(now, 30);
+	BOOST_CHECK_EQUAL(s.poll(now + 10, 100, collect), 1);
+	BOOST_CHECK_EQUAL(due.back(), 30);
+	BOOST_CHECK_EQUAL(s.poll(now + 30, 100, collect), 1);
+	BOOST_CHECK_EQUAL(s.size(), 0);
+	BOOST_CHECK_EQUAL(s.buckets(), 0);
+	BOOST_CHECK_EQUAL(s.next(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_route )
+{
+	using namespace smpp;
+
+	std::istringstream in(
+		"# prefix pool options\n"
+		"7 world\n"
+		"+7916 mts\n"
+		"7916 mts_intl ton=1\n"
+		"79161 bulk sys_id=bulk\n"
+		"\n"
+		"7495 moscow npi=1\n");
+	std::vector<route> routes;
+	bin::sz_t line;
+	BOOST_REQUIRE(read_routes(in, routes, line));
+	BOOST_REQUIRE_EQUAL(routes.size(), 5);
+	route_table t(routes);
+	BOOST_CHECK_EQUAL(t.routes(), 5);
+	BOOST_CHECK_EQUAL(t.pools(), 5);
+
+	const bin::u64_t bulk = route_table::sys_key(bin::ascbuf("bulk"), 5);
+	const bin::u64_t other = route_table::sys_key(bin::ascbuf("other"), 5);
+	BOOST_CHECK(bulk != 0);
+	BOOST_CHECK_EQUAL(route_table::sys_key(bin::ascbuf(""), 1), 0);
+	auto pool = [&] (const char * dst, bin::u8_t ton, bin::u8_t npi, bin::u64_t sys_id) {
+		bin::u32_t p = t.find(bin::ascbuf(dst), std::strlen(dst) + 1, ton, npi, sys_id);
+		return p == route_table::nil ? std::string() : t.pool(p);
+	};
+	BOOST_CHECK_EQUAL(pool("79161234567", 0, 0, other), "mts");
+	BOOST_CHECK_EQUAL(pool("+79161234567", 1, 1, other), "mts_intl");
+	BOOST_CHECK_EQUAL(pool("79161234567", 1, 1, bulk), "bulk");
+	BOOST_CHECK_EQUAL(pool("79261234567", 1, 1, bulk), "world");
+	BOOST_CHECK_EQUAL(pool("74951234567", 0, 1, 0), "moscow");
+	BOOST_CHECK_EQUAL(pool("74951234567", 0, 0, 0), "world");
+	BOOST_CHECK_EQUAL(pool("7", 0, 0, 0), "world");
+	BOOST_CHECK_EQUAL(pool("12025550100", 0, 0, 0), "");
+	BOOST_CHECK_EQUAL(pool("", 0, 0, 0), "");
+
+	std::istringstream bad("7 world\n79x1 mts\n");
+	routes.clear();
+	BOOST_CHECK(!read_routes(bad, routes, line));
+	BOOST_CHECK_EQUAL(line, 2);
+	std::istringstream bad_option("7 world ton=x\n");
+	BOOST_CHECK(!read_routes(bad_option, routes, line));
+
+	/* Readers see a new table once it is published */
+	router r;
+	router::reader reader(r);
+	BOOST_CHECK(reader.table() == nullptr);
+	std::vector<route> first(1);
+	first[0].prefix = "44";
+	first[0].pool = "uk";
+	r.publish(std::make_shared<const route_table>(first));
+	const route_table * current = reader.table();
+	BOOST_REQUIRE(current != nullptr);
+	BOOST_CHECK_EQUAL(current->pool(current->find(bin::ascbuf("447700"), 6, 0, 0, 0)), "uk");
+	std::vector<route> second(1);
+	second[0].prefix = "44";
+	second[0].pool = "uk2";
+	std::atomic<bool> done(false);
+	r.rebuild(second, [&done] (const route_table &) { done = true; });
+	while (!done) {
+		std::this_thread::yield();
+	}
+	current = reader.table();
+	BOOST_CHECK_EQUAL(current->pool(current->find(bin::ascbuf("447700"), 6, 0, 0, 0)), "uk2");
+}
+
+BOOST_AUTO_TEST_CASE( test_portability )
+{
+	using namespace smpp;
+
+	char dir[] = "/tmp/smpptest.XXXXXX";
+	BOOST_REQUIRE(mkdtemp(dir) != nullptr);
+	std::string path = std::string(dir) + "/np.db";
+
+	np_builder b;
+	BOOST_CHECK(b.add("79161234567", "25001"));
+	BOOST_CHECK(b.add("+79161234568", "25002"));
+	BOOST_CHECK(b.add("079161234567", "25099"));
+	BOOST_CHECK(!b.add("7916x", "25001"));
+	BOOST_CHECK(!b.add("79161234569", "an_operator_name_too_long"));
+	/* Routing numbers are looked up in the route table as digits */
+	BOOST_CHECK(!b.add("79161234569", "MTS"));
+	BOOST_CHECK(!b.add("79161234569", "250 01"));
+	/* Enough numbers for many blocks, the last operator of a number wins */
+	for (int i = 0; i < 1000; ++i) {
+		BOOST_REQUIRE(b.add(std::to_string(79260000000ll + i * 37), i % 2 ? "25001" : "25002"));
+	}
+	BOOST_CHECK(b.add("79260000037", "25020"));
+	BOOST_REQUIRE(b.write(path));
+
+	np_database db;
+	BOOST_CHECK_EQUAL(db.find(bin::ascbuf("79161234567"), 11), np::nil);
+	BOOST_REQUIRE(db.open(path));
+	BOOST_CHECK_EQUAL(db.numbers(), 1003);
+	BOOST_CHECK_EQUAL(db.operators(), 4);
+	auto op = [&db] (const char * number) {
+		bin::u32_t o = db.find(bin::ascbuf(number), std::strlen(number) + 1);
+		return o == np::nil ? std::string() : std::string(db.name(o));
+	};
+	BOOST_CHECK_EQUAL(op("79161234567"), "25001");
+	BOOST_CHECK_EQUAL(op("+79161234567"), "25001");
+	BOOST_CHECK_EQUAL(op("079161234567"), "25099");
+	BOOST_CHECK_EQUAL(op("79161234568"), "25002");
+	BOOST_CHECK_EQUAL(op("79161234566"), "");
+	BOOST_CHECK_EQUAL(op("79260000000"), "25002");
+	BOOST_CHECK_EQUAL(op("79260000037"), "25020");
+	BOOST_CHECK_EQUAL(op("79260036963"), "25001");
+	BOOST_CHECK_EQUAL(op("79260036964"), "");
+	BOOST_CHECK_EQUAL(op("79260036974"), "");
+	BOOST_CHECK_EQUAL(op("1"), "");
+	BOOST_CHECK_EQUAL(op(""), "");
+
+	/* Truncated file is refused */
+	BOOST_REQUIRE_EQUAL(::truncate(path.c_str(), db.size() - 1), 0);
+	np_database broken;
+	BOOST_CHECK(!broken.open(path));
+	db.close();
+	BOOST_CHECK_EQUAL(op("79161234567"), "");
+
+	if (std::system((std::string("rm -rf ") + dir).c_str()) != 0) {
+		BOOST_WARN_MESSAGE(false, "can not remove " << dir);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( test_dedup )
+{
+	using namespace smpp;
+	using std::chrono::seconds;
+
+	/* Field boundaries count */
+	dedup_hash a(1), b(1), c(2);
+	a.add(bin::ascbuf("ab"), 2);
+	a.add(bin::ascbuf("c"), 1);
+	b.add(bin::ascbuf("a"), 1);
+	b.add(bin::ascbuf("bc"), 2);
+	c.add(bin::ascbuf("ab"), 2);
+	c.add(bin::ascbuf("c"), 1);
+	BOOST_CHECK(a.value() != b.value());
+	BOOST_CHECK(a.value() != c.value());
+
+	/* 1MB of filters, a minute of window cut in 20 second spans */
+	dedup_filter::time_point t0 = dedup_filter::clock_t::now();
+	dedup_filter f(1 << 20, seconds(60), t0);
+	BOOST_CHECK(f.memory() <= (1 << 20));
+	const bin::u64_t n = 20000;
+	bin::sz_t false_hits = 0;
+	for (bin::u64_t i = 0; i < n; ++i) {
+		dedup_hash h;
+		h.add(reinterpret_cast<const bin::u8_t *>(&i), sizeof(i));
+		false_hits += f.check(h.value(), t0);
+	}
+	BOOST_CHECK(false_hits < n / 100);
+	for (bin::u64_t i = 0; i < n; i += 97) {
+		dedup_hash h;
+		h.add(reinterpret_cast<const bin::u8_t *>(&i), sizeof(i));
+		BOOST_CHECK(f.check(h.value(), t0 + seconds(59)));
+		f.maintain(t0 + seconds(59), 4096);
+	}
+	/* Forgotten some time after the window is over */
+	dedup_hash h;
+	bin::u64_t first = 0;
+	h.add(reinterpret_cast<const bin::u8_t *>(&first), sizeof(first));
+	BOOST_CHECK(f.check(h.value(), t0 + seconds(79)));
+	BOOST_CHECK(!f.check(h.value(), t0 + seconds(160)));
+	BOOST_CHECK(f.check(h.value(), t0 + seconds(161)));
+
+	/* Store confirms duplicates by ESME, addresses and text */
+	store s;
+	submit_sm msg;
+	msg.set_src_addr("79160000001");
+	msg.set_dst_addr("79160000002");
+	msg.set_short_msg("hello");
+	s.insert(1, msg, store::clock_t::now(), 7);
+	BOOST_CHECK_EQUAL(s.duplicate_of(msg, 7, 0), 1);
+	BOOST_CHECK_EQUAL(s.duplicate_of(msg, 8, 0), 0);
+	BOOST_CHECK_EQUAL(s.duplicate_of(msg, 7, std::time(nullptr) + 10), 0);
+	msg.set_short_msg("hello!");
+	BOOST_CHECK_EQUAL(s.duplicate_of(msg, 7, 0), 0);
+	/* Those in a final state are not */
+	msg.set_short_msg("hello");
+	BOOST_CHECK(s.update(1, message_state::delivered, 0, store::clock_t::now()));
+	BOOST_CHECK_EQUAL(s.duplicate_of(msg, 7, 0), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_content_filter )
+{
+	using namespace mobi::net;
+	using namespace mobi::net::toolbox;
+	const bin::u32_t nil = smpp::content_filter::nil;
+
+	std::istringstream in("# spam\nfree money\r\n\nWIN\nПривет\ncrédit\n");
+	std::vector<std::string> patterns;
+	smpp::read_patterns(in, patterns);
+	BOOST_REQUIRE_EQUAL(patterns.size(), 4);
+	BOOST_CHECK_EQUAL(smpp::content_filter::normalize("  Free, Money! "), "free money");
+	BOOST_CHECK_EQUAL(smpp::content_filter::normalize("..."), "");
+
+	smpp::content_filter f(patterns);
+	BOOST_CHECK_EQUAL(f.patterns(), 4);
+
+	/* IA5, separators collapse and patterns are substrings */
+	const char * ascii = "Get FREE -- money!!!";
+	BOOST_CHECK_EQUAL(f.find(0x01, reinterpret_cast<const bin::u8_t *>(ascii), std::strlen(ascii)), 0);
+	const char * winner = "you are a Winner";
+	BOOST_CHECK_EQUAL(f.find(0x01, reinterpret_cast<const bin::u8_t *>(winner), std::strlen(winner)), 1);
+	const char * clean = "free of money";
+	BOOST_CHECK_EQUAL(f.find(0x01, reinterpret_cast<const bin::u8_t *>(clean), std::strlen(clean)), nil);
+
+	/* GSM 7-bit: 0x05 is e acute, 0x1F capital E acute */
+	const bin::u8_t gsm[] = { 'C', 'R', 0x1F, 'D', 'I', 'T', 0x1B, 0x65 };
+	BOOST_CHECK_EQUAL(f.find(0x00, gsm, sizeof(gsm)), 3);
+	const bin::u8_t gsm2[] = { 'c', 'r', 0x05, 'd', 'i', 't' };
+	BOOST_CHECK_EQUAL(f.find(0xF0, gsm2, sizeof(gsm2)), 3);
+
+	/* UCS-2 capitals, with a zero width space inside */
+	const bin::u8_t ucs2[] = { 0x04, 0x1F, 0x04, 0x20, 0x20, 0x0B, 0x04, 0x18
+		, 0x04, 0x12, 0x04, 0x15, 0x04, 0x22, 0x00, 0x21 };
+	BOOST_CHECK_EQUAL(f.find(0x08, ucs2, sizeof(ucs2)), 2);
+	/* Fullwidth letters */
+	const bin::u8_t wide[] = { 0xFF, 0x37, 0xFF, 0x29, 0xFF, 0x2E };
+	BOOST_CHECK_EQUAL(f.find(0x08, wide, sizeof(wide)), 1);
+	/* Binary data is not scanned */
+	BOOST_CHECK_EQUAL(f.find(0x04, reinterpret_cast<const bin::u8_t *>(winner), std::strlen(winner)), nil);
+
+	/* Short message after user data header, then payload */
+	smpp::submit_sm msg;
+	msg.data_coding = 0x03;
+	msg.esm_class = smpp::udh::esm_udhi;
+	const bin::u8_t udh[] = { 0x05, 0x00, 0x03, 'w', 'i', 'n', 'n', 'o', 'p', 'e' };
+	std::memcpy(msg.short_msg, udh, sizeof(udh));
+	msg.short_msg_len = sizeof(udh);
+	BOOST_CHECK_EQUAL(f.find(msg), nil);
+	msg.esm_class = 0;
+	BOOST_CHECK_EQUAL(f.find(msg), 1);
+	msg.short_msg_len = 0;
+	msg.msg_payload.set(reinterpret_cast<const bin::u8_t *>(ascii), std::strlen(ascii));
+	BOOST_CHECK_EQUAL(f.find(msg), 0);
+
+	/* A pattern inside another one is found first */
+	std::vector<std::string> nested;
+	nested.push_back("abcd");
+	nested.push_back("bc");
+	smpp::content_filter g(nested);
+	const char * abcd = "xabcd";
+	BOOST_CHECK_EQUAL(g.find(0x01, reinterpret_cast<const bin::u8_t *>(abcd), std::strlen(abcd)), 1);
+	const char * ab = "aabx bcd";
+	BOOST_CHECK_EQUAL(g.find(0x01, reinterpret_cast<const bin::u8_t *>(ab), 4), nil);
+	BOOST_CHECK_EQUAL(g.find(0x01, reinterpret_cast<const bin::u8_t *>(ab), 8), 1);
+
+	smpp::content_filter empty((std::vector<std::string>()));
+	BOOST_CHECK_EQUAL(empty.find(0x01, reinterpret_cast<const bin::u8_t *>(ab), 8), nil);
+}
+
+BOOST_AUTO_TEST_CASE( test_cdr )
+{
+	using namespace mobi::net;
+	using namespace mobi::net::toolbox;
+	using namespace smpp;
+
+	char dir[] = "/tmp/smpptest.XXXXXX";
+	BOOST_REQUIRE(mkdtemp(dir) != nullptr);
+	auto files = [&dir] (const char * ext) {
+		std::vector<std::string> names;
+		DIR * d = opendir(dir);
+		while (struct dirent * e = readdir(d)) {
+			std::string n = e->d_name;
+			if (n.size() > 4 && n.compare(n.size() - 4, 4, ext) == 0) {
+				names.push_back(std::string(dir) + "/" + n);
+			}
+		}
+		closedir(d);
+		std::sort(names.begin(), names.end());
+		return names;
+	};
+
+	submit_sm msg;
+	msg.set_src_addr("Shop \"A\"");
+	msg.set_dst_addr("79001234567");
+	msg.dst_addr_ton = 1;
+	msg.dst_addr_npi = 1;
+	msg.data_coding = 8;
+	msg.esm_class = 0;
+	msg.set_short_msg("hello");
+
+	cdr r = cdr::of(cdr::accepted, 0x123456789ABCDEFull);
+	r.time = 1500000000123ull;
+	r.set_message(msg);
+	r.set_dst(msg.dst_addr, msg.dst_addr_len, msg.dst_addr_ton, msg.dst_addr_npi);
+	r.set_sys_id(reinterpret_cast<const bin::u8_t *>("esme-with-a-long-system-id"), 26);
+	BOOST_CHECK_EQUAL(std::string(r.sys_id, 16), "esme-with-a-long");
+	BOOST_CHECK_EQUAL(r.length, msg.short_msg_len);
+	char line[cdr_writer::max_line];
+	BOOST_CHECK_EQUAL(std::string(line, cdr_writer::format_csv(r, line))
+		, "0123456789ABCDEF,2017-07-14 02:40:00.123,1,0,0,\"esme-with-a-long\",0,0,\"Shop \"\"A\"\"\""
+		",1,1,\"79001234567\",8,0,6,0\n");
+	r.parts = 3;
+	BOOST_CHECK_EQUAL(std::string(line, cdr_writer::format_csv(r, line)).substr(101), "8,0,6,3\n");
+	r.parts = 0;
+
+	{
+		/* CSV, a file per batch of two records */
+		cdr_writer::options o;
+		o.format = cdr_writer::csv;
+		o.ring_size = 8;
+		o.file_size = 1;
+		o.batch_bytes = 200;
+		o.flush = std::chrono::hours(1);
+		bin::u64_t reported = 0;
+		o.on_dropped = [&reported] (bin::u64_t n, const cdr_writer::stats &) {
+			reported += n;
+		};
+		cdr_writer w(dir, o);
+		cdr_writer::producer & p = w.add_producer();
+		for (int i = 0; i < 8; ++i) {
+			BOOST_CHECK(p.push(r));
+		}
+		BOOST_CHECK(p.congested());
+		BOOST_CHECK(!p.push(r));
+		BOOST_REQUIRE(w.start());
+		w.stop();
+		cdr_writer::stats s = w.get_stats();
+		BOOST_CHECK_EQUAL(s.records, 8);
+		BOOST_CHECK_EQUAL(s.dropped, 1);
+		BOOST_CHECK_EQUAL(reported, 1);
+		BOOST_CHECK_EQUAL(s.backlog, 0);
+		BOOST_CHECK_EQUAL(s.files, 4);
+		BOOST_CHECK_EQUAL(s.writes, 4);
+		BOOST_CHECK_EQUAL(s.errors, 0);
+		std::vector<std::string> names = files(".csv");
+		BOOST_REQUIRE_EQUAL(names.size(), 4);
+		std::ifstream in(names[0].c_str());
+		std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		BOOST_CHECK_EQUAL(text, std::string(cdr_writer::csv_header()) + std::string(line, cdr_writer::format_csv(r, line)) + std::string(line, cdr_writer::format_csv(r, line)));
+		BOOST_CHECK(files(".part").empty());
+	}
+
+	{
+		/* Binary, records pushed from two threads meanwhile */
+		cdr_writer::options o;
+		o.ring_size = 64;
+		o.flush = std::chrono::milliseconds(1);
+		cdr_writer w(dir, o);
+		BOOST_REQUIRE(w.start());
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 2; ++t) {
+			cdr_writer::producer & p = w.add_producer();
+			threads.push_back(std::thread([&p, t] {
+				for (bin::u64_t i = 0; i < 10000; ++i) {
+					cdr c = cdr::of(cdr::final, (static_cast<bin::u64_t>(t) << 32) | i);
+					while (!p.push(c)) {
+						std::this_thread::yield();
+					}
+				}
+			}));
+		}
+		for (std::thread & t: threads) {
+			t.join();
+		}
+		w.stop();
+		std::vector<std::string> names = files(".bin");
+		BOOST_REQUIRE_EQUAL(names.size(), 1);
+		std::ifstream in(names[0].c_str(), std::ios::binary);
+		std::vector<bin::u64_t> next(2, 0);
+		cdr c;
+		bin::sz_t n = 0;
+		bool ordered = true;
+		while (in.read(reinterpret_cast<char *>(&c), sizeof(c))) {
+			bin::u64_t t = c.id >> 32;
+			ordered = ordered && t < 2 && c.event == cdr::final && (c.id & 0xFFFFFFFF) == next[t]++;
+			n++;
+		}
+		BOOST_CHECK(ordered);
+		BOOST_CHECK_EQUAL(n, 20000);
+		BOOST_CHECK_EQUAL(w.get_stats().records, 20000);
+	}
+
+	if (std::system((std::string("rm -rf ") + dir).c_str()) != 0) {
+		BOOST_WARN_MESSAGE(false, "can not remove " << dir);
+	}
+}
+
+namespace tst_tools {
+	struct malloc_allocator {
+		void * alloc(std::size_t len) { return std::malloc(len); }
+		template <typename T>
+		void dealloc(T * ptr) { std::free(static_cast<void *>(ptr)); }
+	};
+
+	typedef smpp::tcp_service<malloc_allocator, vision::log::source, bin::u64_t> smsc_base;
+
+	/* SMSC binding anyone and accepting every submit but
+	 * the drop_at-th one, whose channel it closes instead */
+	class smsc: public smsc_base {
+		public:
+			std::atomic<bin::sz_t> binds;
+			std::atomic<bin::sz_t> submits;
+			std::atomic<bin::sz_t> links;
+			std::vector<bin::sz_t> per_channel;
+			bin::sz_t drop_at;
+
+			smsc(malloc_allocator & a)
+				: smsc_base(ba::ip::tcp::endpoint(ba::ip::address::from_string("127.0.0.1"), 0)
+					, a, vision::log::channel("smsc"))
+				, binds(0)
+				, submits(0)
+				, links(0)
+				, per_channel(64, 0)
+				, drop_at(0)
+			{}
+
+		protected:
+			void on_bind_transceiver(bin::sz_t ch, const smpp::bind_transceiver & msg) {
+				smpp::bind_transceiver_r r;
+				r.command.seqno = msg.command.seqno;
+				r.set_sys_id("smsc");
+				send(ch, r);
+				binds++;
+			}
+
+			void on_submit_sm(bin::sz_t ch, const smpp::submit_sm & msg) {
+				bin::sz_t n = ++submits;
+				if (n == drop_at) {
+					close(ch);
+					return;
+				}
+				per_channel[ch]++;
+				smpp::submit_sm_r r;
+				r.command.seqno = msg.command.seqno;
+				r.set_msg_id(std::to_string(n));
+				send(ch, r);
+			}
+
+			void on_enquire_link(bin::sz_t ch, const smpp::enquire_link & msg) {
+				smpp::enquire_link_r r;
+				r.command.seqno = msg.command.seqno;
+				send(ch, r);
+				links++;
+			}
+
+			void on_unbind(bin::sz_t ch, const smpp::unbind & msg) {
+				smpp::unbind_r r;
+				r.command.seqno = msg.command.seqno;
+				send(ch, r);
+			}
+
+			void on_recv_error(bin::sz_t ch) { close(ch); }
+			void on_parse_error(bin::sz_t ch) { close(ch); }
+			void on_send(bin::sz_t, bin::sz_t) {}
+			void on_send_error(bin::sz_t, bin::sz_t) {}
+			void on_bind_transmitter(bin::sz_t, const smpp::bind_transmitter &) {}
+			void on_bind_transmitter_r(bin::sz_t, const smpp::bind_transmitter_r &) {}
+			void on_bind_receiver(bin::sz_t, const smpp::bind_receiver &) {}
+			void on_bind_receiver_r(bin::sz_t, const smpp::bind_receiver_r &) {}
+			void on_bind_transceiver_r(bin::sz_t, const smpp::bind_transceiver_r &) {}
+			void on_unbind_r(bin::sz_t, const smpp::unbind_r &) {}
+			void on_outbind(bin::sz_t, const smpp::outbind &) {}
+			void on_generic_nack(bin::sz_t, const smpp::generic_nack &) {}
+			void on_submit_sm_r(bin::sz_t, const smpp::submit_sm_r &) {}
+			void on_submit_multi_sm(bin::sz_t, const smpp::submit_multi_sm &) {}
+			void on_submit_multi_r(bin::sz_t, const smpp::submit_multi_r &) {}
+			void on_deliver_sm(bin::sz_t, const smpp::deliver_sm &) {}
+			void on_deliver_sm_r(bin::sz_t, const smpp::deliver_sm_r &) {}
+			void on_data_sm(bin::sz_t, const smpp::data_sm &) {}
+			void on_data_sm_r(bin::sz_t, const smpp::data_sm_r &) {}
+			void on_query_sm(bin::sz_t, const smpp::query_sm &) {}
+			void on_query_sm_r(bin::sz_t, const smpp::query_sm_r &) {}
+			void on_cancel_sm(bin::sz_t, const smpp::cancel_sm &) {}
+			void on_cancel_sm_r(bin::sz_t, const smpp::cancel_sm_r &) {}
+			void on_replace_sm(bin::sz_t, const smpp::replace_sm &) {}
+			void on_replace_sm_r(bin::sz_t, const smpp::replace_sm_r &) {}
+			void on_enquire_link_r(bin::sz_t, const smpp::enquire_link_r &) {}
+			void on_alert_notification(bin::sz_t, const smpp::alert_notification &) {}
+	};
+
+	template <class F>
+	bool wait_for(F f, int ms) {
+		for (; !f() && ms > 0; ms -= 10) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		return f();
+	}
+}
+
+BOOST_AUTO_TEST_CASE( test_client )
+{
+	using namespace mobi::net;
+	using namespace mobi::net::toolbox;
+	using namespace smpp;
+
+	boost::log::core::get()->set_logging_enabled(false);
+
+	tst_tools::malloc_allocator a;
+	tst_tools::smsc server(a);
+	server.drop_at = 100;
+	server.start();
+
+	typedef client<tst_tools::malloc_allocator, vision::log::source> client_t;
+	client_t c(a, vision::log::channel("client"));
+	c.set_window(8, 5000);
+	smsc_account acc;
+	acc.endpoint = server.local_endpoint();
+	acc.sys_id = "esme";
+	acc.password = "secret";
+	acc.binds = 3;
+	acc.enquire_link = std::chrono::seconds(1);
+	bin::sz_t up = c.add_account(acc);
+	/* Nothing listens there, submits only queue up */
+	acc.endpoint = ba::ip::tcp::endpoint(ba::ip::address::from_string("127.0.0.1"), 1);
+	acc.binds = 1;
+	acc.max_queue = 1;
+	bin::sz_t down = c.add_account(acc);
+	c.start();
+	BOOST_REQUIRE(tst_tools::wait_for([&] { return c.bound(up) == 3; }, 5000));
+
+	submit_sm msg;
+	msg.set_serv_type("");
+	msg.src_addr_ton = 5;
+	msg.src_addr_npi = 0;
+	msg.set_src_addr("shop");
+	msg.dst_addr_ton = 1;
+	msg.dst_addr_npi = 1;
+	msg.set_dst_addr("79001234567");
+	msg.esm_class = 0;
+	msg.protocol_id = 0;
+	msg.priority_flag = 0;
+	msg.set_schedule_delivery_time("");
+	msg.set_validity_period("");
+	msg.registered_delivery = 0;
+	msg.replace_if_present_flag = 0;
+	msg.data_coding = 0;
+	msg.sm_default_msg_id = 0;
+	msg.set_short_msg("hello");
+	std::atomic<bin::sz_t> done(0);
+	std::atomic<bin::sz_t> ok(0);
+	for (int i = 0; i < 300; ++i) {
+		BOOST_CHECK(c.submit(up, msg, [&] (const submit_sm_r & r) {
+			ok += r.command.status == command_status::esme_rok && r.msg_id_len > 1;
+			done++;
+		}));
+	}
+	std::future<submit_sm_r> f = c.submit(up, msg);
+	BOOST_REQUIRE(f.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+	BOOST_CHECK_EQUAL(f.get().command.status, 0);
+	/* The dropped submit is sent again once the others are free */
+	BOOST_REQUIRE(tst_tools::wait_for([&] { return done == 300; }, 10000));
+	BOOST_CHECK_EQUAL(ok, 300);
+	/* Requests in the window of the dropped bind may have got there */
+	BOOST_CHECK_GE(server.submits, 302);
+	bin::sz_t used = 0;
+	for (bin::sz_t n: server.per_channel) {
+		used += n != 0;
+	}
+	BOOST_CHECK_GE(used, 3);
+	/* Dropped bind comes back, idle ones are checked */
+	BOOST_CHECK(tst_tools::wait_for([&] { return c.bound(up) == 3 && server.binds == 4; }, 5000));
+	BOOST_CHECK(tst_tools::wait_for([&] { return server.links != 0; }, 5000));
+
+	std::future<submit_sm_r> queued = c.submit(down, msg);
+	std::future<submit_sm_r> full = c.submit(down, msg);
+	BOOST_REQUIRE(full.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+	BOOST_CHECK_EQUAL(full.get().command.status, command_status::esme_rmsgqful);
+	BOOST_CHECK_EQUAL(c.bound(down), 0);
+	c.stop();
+	server.stop();
+	BOOST_REQUIRE(queued.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+	bin::u32_t lost = client_t::lost;
+	BOOST_CHECK_EQUAL(queued.get().command.status, lost);
+	boost::log::core::get()->set_logging_enabled(true);
+}
+
+BOOST_AUTO_TEST_CASE( test_capture )
+{
+	using namespace mobi::net;
+	using namespace mobi::net::toolbox;
+	using namespace smpp;
+
+	char dir[] = "/tmp/smpptest.XXXXXX";
+	BOOST_REQUIRE(mkdtemp(dir) != nullptr);
+	std::string path = std::string(dir) + "/pdu.cap";
+
+	const bin::u8_t pdu[] = { 0, 0, 0, 10, 'a', 'b', 'c', 'd', 'e', 'f' };
+	{
+		capture c(path, 1);
+		BOOST_REQUIRE(c.start());
+		BOOST_CHECK(c.add(7, capture_record::open, nullptr, 0));
+		BOOST_CHECK(c.add(7, capture_record::in, pdu, sizeof(pdu)));
+		BOOST_CHECK(c.add(7, capture_record::out, pdu, 4));
+		BOOST_CHECK(c.add(7, capture_record::close, nullptr, 0));
+		c.stop();
+		capture::stats s = c.get_stats();
+		BOOST_CHECK_EQUAL(s.records, 4);
+		BOOST_CHECK_EQUAL(s.dropped, 0);
+		BOOST_CHECK_EQUAL(s.errors, 0);
+		BOOST_CHECK_EQUAL(s.bytes, sizeof(capture_file_header) + 4 * sizeof(capture_record) + 14);
+	}
+	{
+		capture_reader r;
+		BOOST_REQUIRE(r.open(path));
+		capture_record rec;
+		std::vector<bin::u8_t> data;
+		const bin::u8_t events[] = { capture_record::open, capture_record::in
+			, capture_record::out, capture_record::close };
+		const bin::u32_t lens[] = { 0, sizeof(pdu), 4, 0 };
+		bin::u64_t last = 0;
+		for (int i = 0; i < 4; ++i) {
+			BOOST_REQUIRE(r.next(rec, data));
+			BOOST_CHECK_EQUAL(rec.channel, 7);
+			BOOST_CHECK_EQUAL(rec.event, events[i]);
+			BOOST_CHECK_EQUAL(rec.len, lens[i]);
+			BOOST_CHECK(std::equal(data.begin(), data.end(), pdu));
+			BOOST_CHECK_GE(rec.time, last);
+			last = rec.time;
+		}
+		BOOST_CHECK(!r.next(rec, data));
+	}
+	{
+		/* Not started, nothing takes from the ring */
+		capture c(path, 4096);
+		std::vector<bin::u8_t> big(1024 - sizeof(capture_record), 1);
+		for (int i = 0; i < 4; ++i) {
+			BOOST_CHECK(c.add(1, capture_record::in, big.data(), big.size()));
+		}
+		BOOST_CHECK(!c.add(1, capture_record::in, big.data(), big.size()));
+		BOOST_CHECK(!c.add(1, capture_record::close, nullptr, 0));
+		BOOST_CHECK_EQUAL(c.get_stats().records, 4);
+		BOOST_CHECK_EQUAL(c.get_stats().dropped, 2);
+	}
+	{
+		/* File size limit makes a write fail past 4 kB */
+		capture c(path);
+		std::atomic<int> failed(0);
+		std::atomic<int> err(0);
+		c.set_error_handler([&] (int e) {
+			failed++;
+			err = e;
+		});
+		BOOST_REQUIRE(c.start());
+		rlimit old;
+		BOOST_REQUIRE(::getrlimit(RLIMIT_FSIZE, &old) == 0);
+		rlimit small = old;
+		small.rlim_cur = 4096;
+		void (*sig)(int) = std::signal(SIGXFSZ, SIG_IGN);
+		BOOST_REQUIRE(::setrlimit(RLIMIT_FSIZE, &small) == 0);
+		std::vector<bin::u8_t> big(1000, 1);
+		for (int i = 0; i < 8; ++i) {
+			BOOST_CHECK(c.add(1, capture_record::in, big.data(), big.size()));
+		}
+		BOOST_CHECK(tst_tools::wait_for([&] { return c.get_stats().truncated; }, 5000));
+		BOOST_CHECK(!c.add(1, capture_record::in, big.data(), big.size()));
+		c.stop();
+		::setrlimit(RLIMIT_FSIZE, &old);
+		std::signal(SIGXFSZ, sig);
+		capture::stats s = c.get_stats();
+		BOOST_CHECK_EQUAL(failed.load(), 1);
+		BOOST_CHECK_EQUAL(err.load(), EFBIG);
+		BOOST_CHECK_EQUAL(s.errors, 1);
+		BOOST_CHECK_EQUAL(s.dropped, 1);
+		BOOST_CHECK_EQUAL(s.bytes, 4096);
+		capture_reader r;
+		BOOST_REQUIRE(r.open(path));
+		capture_record rec;
+		std::vector<bin::u8_t> data;
+		int complete = 0;
+		while (r.next(rec, data)) {
+			complete++;
+		}
+		BOOST_CHECK_EQUAL(complete, 3);
+	}
+	capture_reader bad;
+	BOOST_CHECK(!bad.open(std::string(dir) + "/none"));
+
+	/* PDUs of a session as the service saw them */
+	boost::log::core::get()->set_logging_enabled(false);
+	{
+		capture c(path);
+		BOOST_REQUIRE(c.start());
+		tst_tools::malloc_allocator a;
+		tst_tools::smsc server(a);
+		server.set_capture(&c);
+		server.start();
+		typedef client<tst_tools::malloc_allocator, vision::log::source> client_t;
+		client_t cl(a, vision::log::channel("client"));
+		smsc_account acc;
+		acc.endpoint = server.local_endpoint();
+		acc.sys_id = "esme";
+		acc.password = "secret";
+		acc.binds = 1;
+		bin::sz_t id = cl.add_account(acc);
+		cl.start();
+		BOOST_REQUIRE(tst_tools::wait_for([&] { return cl.bound(id) == 1; }, 5000));
+		submit_sm msg;
+		msg.set_serv_type("");
+		msg.src_addr_ton = 5;
+		msg.src_addr_npi = 0;
+		msg.set_src_addr("shop");
+		msg.dst_addr_ton = 1;
+		msg.dst_addr_npi = 1;
+		msg.set_dst_addr("79001234567");
+		msg.esm_class = 0;
+		msg.protocol_id = 0;
+		msg.priority_flag = 0;
+		msg.set_schedule_delivery_time("");
+		msg.set_validity_period("");
+		msg.registered_delivery = 0;
+		msg.replace_if_present_flag = 0;
+		msg.data_coding = 0;
+		msg.sm_default_msg_id = 0;
+		msg.set_short_msg("hello");
+		for (int i = 0; i < 5; ++i) {
+			std::future<submit_sm_r> f = cl.submit(id, msg);
+			BOOST_REQUIRE(f.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+		}
+		/* Off and on again while running, the submit between is not recorded */
+		BOOST_CHECK(server.set_capture(nullptr) == &c);
+		std::future<submit_sm_r> f = cl.submit(id, msg);
+		BOOST_REQUIRE(f.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+		BOOST_CHECK(server.set_capture(&c) == nullptr);
+		cl.stop();
+		server.stop();
+		c.stop();
+		BOOST_CHECK_EQUAL(c.get_stats().dropped, 0);
+	}
+	boost::log::core::get()->set_logging_enabled(true);
+	{
+		capture_reader r;
+		BOOST_REQUIRE(r.open(path));
+		capture_record rec;
+		std::vector<bin::u8_t> data;
+		std::vector<bin::u8_t> events;
+		bin::sz_t submits = 0;
+		bin::sz_t replies = 0;
+		while (r.next(rec, data)) {
+			events.push_back(rec.event);
+			if (rec.event == capture_record::in || rec.event == capture_record::out) {
+				BOOST_REQUIRE_GE(data.size(), 16);
+				bin::u32_t len = bin::u32_t(data[0]) << 24 | data[1] << 16 | data[2] << 8 | data[3];
+				bin::u32_t cmd = bin::u32_t(data[4]) << 24 | data[5] << 16 | data[6] << 8 | data[7];
+				BOOST_CHECK_EQUAL(len, data.size());
+				submits += rec.event == capture_record::in && cmd == smpp::command::submit_sm;
+				replies += rec.event == capture_record::out && cmd == smpp::command::submit_sm_r;
+			}
+		}
+		BOOST_REQUIRE_GE(events.size(), 4);
+		BOOST_CHECK_EQUAL(events.front(), capture_record::open);
+		BOOST_CHECK_EQUAL(events[1], capture_record::in);
+		BOOST_CHECK_EQUAL(events.back(), capture_record::close);
+		BOOST_CHECK_EQUAL(submits, 5);
+		BOOST_CHECK_EQUAL(replies, 5);
+	}
+
+	if (std::system((std::string("rm -rf ") + dir).c_str()) != 0) {
+		BOOST_WARN_MESSAGE(false, "can not remove " << dir);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( test_printer )
+{
+	using namespace smpp;
+
+	writer<std::ostream> w(std::cout);
+	bin::u8_t buf[0x200];
+	bin::u8_t * end = buf;
+
+	enquire_link link;
+	link.command.len = link.raw_size();
+	link.command.seqno = 7;
+	end = w.write(end, buf + sizeof(buf), link);
+	BOOST_REQUIRE(end != nullptr);
+	submit_sm msg;
+	msg.set_serv_type("");
+	msg.src_addr_ton = 5;
+	msg.src_addr_npi = 0;
+	msg.set_src_addr("shop");
+	msg.dst_addr_ton = 1;
+	msg.dst_addr_npi = 1;
+	msg.set_dst_addr("79001234567");
+	msg.esm_class = 0;
+	msg.protocol_id = 0;
+	msg.priority_flag = 0;
+	msg.set_schedule_delivery_time("");
+	msg.set_validity_period("");
+	msg.registered_delivery = 0;
+	msg.replace_if_present_flag = 0;
+	msg.data_coding = 0;
+	msg.sm_default_msg_id = 0;
+	msg.set_short_msg("hello");
+	msg.command.len = msg.raw_size();
+	msg.command.seqno = 8;
+	end = w.write(end, buf + sizeof(buf), msg);
+	BOOST_REQUIRE(end != nullptr);
+
+	std::ostringstream out;
+	printer p(out);
+	BOOST_CHECK(p.print(buf, end - buf));
+	std::string s = out.str();
+	BOOST_CHECK(s.find("enquire_link") != std::string::npos);
+	BOOST_CHECK(s.find("submit_sm") != std::string::npos);
+	BOOST_CHECK(s.find("79001234567") != std::string::npos);
+	BOOST_CHECK(s.find("hello") != std::string::npos);
+
+	/* Cut short */
+	BOOST_CHECK(!p.print(buf, end - buf - 1));
+
+	std::ostringstream ids;
+	ids << command_id{command::deliver_sm_r} << " " << command_id{0x12345678};
+	BOOST_CHECK_EQUAL(ids.str(), "deliver_sm_r 0x12345678");
+}
+
+BOOST_AUTO_TEST_CASE( test_log_threshold )
+{
+	using namespace vision::log;
+
+	int evaluated = 0;
+	auto arg = [&evaluated] () {
+		return ++evaluated;
+	};
+	source a = vision::log::channel("threshold.a");
+	source b = vision::log::channel("threshold.b");
+	set_threshold("threshold.a", warning);
+	BOOST_CHECK(!a.enabled(info));
+	BOOST_CHECK(a.enabled(warning));
+	BOOST_CHECK(b.enabled(trace));
+
+	/* Filtered records do not evaluate their arguments */
+	ltrace(a) << arg();
+	linfo(a) << arg();
+	BOOST_CHECK_EQUAL(evaluated, 0);
+	lwarning(a) << arg();
+	BOOST_CHECK_EQUAL(evaluated, 1);
+
+	/* Sources made later and copies follow the channel */
+	source c = vision::log::channel("threshold.a");
+	source d = b;
+	set_threshold("threshold.b", error);
+	BOOST_CHECK(!c.enabled(info));
+	BOOST_CHECK(!d.enabled(warning));
+	BOOST_CHECK(d.enabled(critical));
+
+	set_threshold(trace);
+	BOOST_CHECK(a.enabled(trace));
+	BOOST_CHECK(d.enabled(trace));
+
+	severity s;
+	BOOST_CHECK(severity_of("debug", s));
+	BOOST_CHECK_EQUAL(s, debug);
+	BOOST_CHECK(!severity_of("verbose", s));
+}
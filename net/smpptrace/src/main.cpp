@@ -0,0 +1,77 @@
+#include <ctime>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <iostream>
+
+#include <smpp/printer.hpp>
+#include <toolbox/capture.hpp>
+
+#include <boost/program_options.hpp>
+
+int main(int argc, char ** argv)
+{
+	using namespace mobi::net;
+	namespace po = boost::program_options;
+	namespace bin = toolbox::bin;
+
+	po::options_description options("Options");
+	options.add_options()
+		("help", "Produce help messages")
+		("capture", po::value<std::string>()
+			, "Capture file written by smppd --capture")
+		("channel", po::value<bin::u32_t>()
+			, "Print records of this channel only")
+		("pdus", "Print received and sent PDUs only, no channel events")
+	;
+
+	po::variables_map opts;
+	po::store(po::parse_command_line(argc, argv, options), opts);
+
+	if (opts.count("help") || !opts.count("capture")) {
+		std::cout << options << std::endl;
+		return 1;
+	}
+
+	const std::string & path = opts["capture"].as<std::string>();
+	toolbox::capture_reader reader;
+	if (!reader.open(path)) {
+		std::cerr << "can not read capture " << path << std::endl;
+		return 1;
+	}
+
+	static const char * const events[] = { "?", "in", "out", "open", "close" };
+	bool channel = opts.count("channel") != 0;
+	bin::u32_t only = channel ? opts["channel"].as<bin::u32_t>() : 0;
+	bool pdus = opts.count("pdus") != 0;
+
+	smpp::printer printer(std::cout);
+	toolbox::capture_record r;
+	std::vector<bin::u8_t> data;
+	std::size_t records = 0;
+	std::size_t malformed = 0;
+	while (reader.next(r, data)) {
+		records++;
+		bool pdu = r.event == toolbox::capture_record::in
+			|| r.event == toolbox::capture_record::out;
+		if ((channel && r.channel != only) || (pdus && !pdu)) {
+			continue;
+		}
+		std::time_t sec = r.time / 1000000000;
+		std::tm tm;
+		char stamp[32];
+		char usec[8];
+		std::strftime(stamp, sizeof(stamp), "%d.%m.%Y %H:%M:%S", ::localtime_r(&sec, &tm));
+		std::snprintf(usec, sizeof(usec), ".%06u", static_cast<unsigned>(r.time % 1000000000 / 1000));
+		std::cout << stamp << usec << " #" << r.channel << " "
+			<< events[r.event < 5 ? r.event : 0] << " ";
+		if (pdu && !printer.print(data.data(), data.size())) {
+			std::cout << "malformed, " << data.size() << " bytes";
+			malformed++;
+		}
+		std::cout << std::endl;
+	}
+	std::cerr << records << " records, " << malformed << " malformed" << std::endl;
+
+	return 0;
+}
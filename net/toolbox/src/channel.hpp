@@ -1,6 +1,7 @@
 #ifndef mobi_net_toolbox_channel_hpp
 #define mobi_net_toolbox_channel_hpp
 
+#include <vector>
 #include <stdexcept>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
@@ -44,9 +45,15 @@ class channel {
 
 		void close() {
 			m_sock.get_io_service().post([this] {
+				/* Closed already, on_close is not called twice */
+				if (!m_sock.is_open()) {
+					return;
+				}
 				ltrace(S.L) << "closing channel #" << m_id;
-				m_sock.shutdown(sock_t::shutdown_both);
-				m_sock.close();
+				/* Peer may have gone already */
+				bs::error_code ec;
+				m_sock.shutdown(sock_t::shutdown_both, ec);
+				m_sock.close(ec);
 				ltrace(S.L) << "canceling pending send messages for channel #" << m_id;
 				cancel_all();
 				/* on_close will delete this */
@@ -62,25 +69,12 @@ class channel {
 			using namespace bin;
 			std::lock_guard<std::mutex> lock(out.mtx);
 			out.last_seqno++;
+			out.que.push(outmsg(out.last_seqno, buf));
 			if (out.ready) {
 				out.ready = false;
-				out.msg = outmsg(out.last_seqno, buf);
 				m_sock.get_io_service().post([this] () {
-					if (m_sock.is_open()) {
-						ba::async_write(m_sock
-							, ba::buffer(out.msg.buf.data, out.msg.buf.len)
-							, bind(&channel::on_out_bytes, this
-								, &channel::on_send
-								, ba::placeholders::error
-								, ba::placeholders::bytes_transferred));
-					} else {
-						std::lock_guard<std::mutex> lock(out.mtx);
-						out.ready = true;
-						S.on_send_error(this, out.last_seqno, out.msg.buf);
-					}
+					write_queued();
 				});
-			} else {
-				out.que.push(outmsg(out.last_seqno, buf));
 			}
 			return out.last_seqno;
 		}
@@ -97,22 +91,9 @@ class channel {
 			if (out.que.empty() || !out.ready) {
 				return;
 			}
-			out.msg = out.que.front();
-			out.que.pop();
 			out.ready = false;
 			m_sock.get_io_service().post([this] () {
-				if (m_sock.is_open()) {
-					ba::async_write(m_sock
-						, ba::buffer(out.msg.buf.data, out.msg.buf.len)
-						, bind(&channel::on_out_bytes, this
-							, &channel::on_send
-							, ba::placeholders::error
-							, ba::placeholders::bytes_transferred));
-				} else {
-					std::lock_guard<std::mutex> lock(out.mtx);
-					out.ready = true;
-					S.on_send_error(this, out.last_seqno, out.msg.buf);
-				}
+				write_queued();
 			});
 		}
 
@@ -126,6 +107,9 @@ class channel {
 		/* Socket to perform operations on */
 		sock_t m_sock;
 
+		/* Maximum number of queued messages written at once */
+		static const bin::sz_t max_batch = 64;
+
 		struct outmsg {
 			bin::sz_t seqno;
 			bin::buffer buf;
@@ -144,8 +128,9 @@ class channel {
 		struct outbuf {
 			/* Indicates if any outgoing operation is active at the moment */
 			bool ready;
-			/* Current message being sent */
-			outmsg msg;
+			/* Messages being sent by current write, io thread only */
+			std::vector<outmsg> batch;
+			std::vector<ba::const_buffer> iov;
 			/* Sequence numbering of outgoing messages
 			 * Each outgoing message is tracked by it's outgoing seqno */
 			bin::sz_t last_seqno;
@@ -166,6 +151,37 @@ class channel {
 			}
 		}
 
+		void write_queued() {
+			/* io thread. Messages queued while previous write was
+			 * in progress go to the socket with one gathered write */
+			{
+				std::lock_guard<std::mutex> lock(out.mtx);
+				out.batch.clear();
+				out.iov.clear();
+				while (!out.que.empty() && out.batch.size() < max_batch) {
+					const outmsg & msg = out.que.front();
+					out.batch.push_back(msg);
+					out.iov.push_back(ba::const_buffer(msg.buf.data, msg.buf.len));
+					out.que.pop();
+				}
+			}
+			if (m_sock.is_open()) {
+				ba::async_write(m_sock, out.iov
+					, bind(&channel::on_out_bytes, this
+						, &channel::on_send
+						, ba::placeholders::error
+						, ba::placeholders::bytes_transferred));
+			} else {
+				{
+					std::lock_guard<std::mutex> lock(out.mtx);
+					out.ready = true;
+				}
+				for (const outmsg & msg: out.batch) {
+					S.on_send_error(this, msg.seqno, msg.buf);
+				}
+			}
+		}
+
 		void on_in_bytes(cb_t cb, const bs::error_code & ec, bin::sz_t bytes) {
 			in.total_bytes += bytes;
 			/* !!! It's crucial to call callback at the very end of this
@@ -186,6 +202,11 @@ class channel {
 				lerror(S.L) << "channel::recv_header: in buffer is busy";
 				return;
 			}
+			if (!m_sock.is_open()) {
+				/* Closed meanwhile, nothing may be left
+				 * pending once the channel is destroyed */
+				return;
+			}
 			in.ready = false;
 			m_sock.async_receive(ba::buffer(asbuf(in.hdr)
 				, sizeof(in.hdr))
@@ -197,6 +218,13 @@ class channel {
 		void on_recv_len(const bs::error_code & ec) {
 			if (!ec) {
 				in.hdr.len = bin::bo::to_host(in.hdr.len);
+				if (in.hdr.len < sizeof(in.hdr)) {
+					/* Do not read from misbehaving peer any more */
+					lerror(S.L) << "channel::on_recv_len: wrong length: " << in.hdr.len;
+					in.ready = true;
+					S.on_recv_error(this);
+					return;
+				}
 				in.buf.len = in.hdr.len;
 				in.buf.data = static_cast<bin::u8_t *>(S.A.alloc(in.hdr.len));
 				/* Keep initial byte order */
@@ -214,6 +242,11 @@ class channel {
 
 		void recv_body() {
 			/* Read the remaining body of a messsage, beyond msg len */
+			if (!m_sock.is_open()) {
+				S.A.dealloc(in.buf.data);
+				in.ready = true;
+				return;
+			}
 			m_sock.async_receive(
 				ba::buffer(bin::asbuf(in.buf.data) + sizeof(in.hdr)
 					, in.buf.len - sizeof(in.hdr))
@@ -236,7 +269,6 @@ class channel {
 		}
 
 		void on_send(const bs::error_code & ec) {
-			outmsg msg = out.msg;
 			{
 				std::lock_guard<std::mutex> lock(out.mtx);
 				out.ready = true;
@@ -244,16 +276,28 @@ class channel {
 				 * as they may call send of flush leading to deadlock */
 			}
 			if (!ec) {
-				S.on_send(this, msg.seqno, msg.buf);
-				flush();
+				for (const outmsg & msg: out.batch) {
+					S.on_send(this, msg.seqno, msg.buf);
+				}
+				if (m_sock.is_open()) {
+					flush();
+				} else {
+					cancel_all();
+				}
 			} else {
 				/* Send cycle stop here. Call to flush is needed
 				 * in order to let messages in queue to be sent */
 				lerror(S.L) << "channel::on_send: " << ec.message();
 				/* !!! It's crucial to call callback at the very end of this
 				 * member function, since callback may delete this */
-				S.on_send_error(this, msg.seqno, msg.buf);
-				flush();
+				for (const outmsg & msg: out.batch) {
+					S.on_send_error(this, msg.seqno, msg.buf);
+				}
+				if (m_sock.is_open()) {
+					flush();
+				} else {
+					cancel_all();
+				}
 			}
 		}
 };
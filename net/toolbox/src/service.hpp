@@ -1,7 +1,10 @@
 #ifndef mobi_net_toolbox_service_hpp
 #define mobi_net_toolbox_service_hpp
 
+#include <set>
+#include <atomic>
 #include <stack>
+#include <memory>
 #include <vector>
 #include <thread>
 #include <functional>
@@ -10,6 +13,7 @@
 #include <toolbox/bin.hpp>
 #include <toolbox/toolbox.hpp>
 #include <toolbox/channel.hpp>
+#include <toolbox/capture.hpp>
 
 namespace mobi { namespace net { namespace toolbox {
 
@@ -41,9 +45,33 @@ class service {
 			, m_io()
 			, m_sock(m_io)
 			, m_acpt(m_io, ep)
+			, m_timer(m_io)
 			, A(a)
 		{
 			m_channel_count = 0;
+			m_tick_ms = 0;
+			m_stopping = false;
+			m_closing = false;
+			m_capture = nullptr;
+			m_recording = false;
+		}
+
+		/* Service with no listening socket, channels
+		 * are opened by connect only */
+		service(allocator_t & a, log_t l)
+			: L(std::move(l))
+			, m_io()
+			, m_sock(m_io)
+			, m_acpt(m_io)
+			, m_timer(m_io)
+			, A(a)
+		{
+			m_channel_count = 0;
+			m_tick_ms = 0;
+			m_stopping = false;
+			m_closing = false;
+			m_capture = nullptr;
+			m_recording = false;
 		}
 
 		virtual ~service() {
@@ -60,13 +88,35 @@ class service {
 				process_messages();
 			});
 			m_io_thread = std::thread([this] {
-				m_acpt.async_accept(m_sock
-					, boost::bind(&service::on_accept
-						, this, ba::placeholders::error));
+				if (m_acpt.is_open()) {
+					m_acpt.async_accept(m_sock
+						, boost::bind(&service::on_accept
+							, this, ba::placeholders::error));
+				}
+				if (m_tick_ms) {
+					wait_tick();
+				}
 				m_io.run();
 			});
 		}
 
+		/* Record PDUs of all channels to c, nullptr stops recording.
+		 * May be called while the service runs, from a thread of its
+		 * own. Returns the capture recorded to before, which the
+		 * service is done with once this returns. */
+		capture * set_capture(capture * c) {
+			capture * old = m_capture.exchange(c);
+			while (m_recording.load()) {
+				std::this_thread::yield();
+			}
+			return old;
+		}
+
+		/* Period of on_tick calls, 0 disables them. Set before start. */
+		void set_tick(bin::sz_t ms) {
+			m_tick_ms = ms;
+		}
+
 		void stop() {
 			ltrace(L) << "stopping service";
 			{
@@ -80,6 +130,57 @@ class service {
 			if (m_io_thread.joinable()) {
 				m_io_thread.join();
 			}
+			/* Channels destroyed after io thread ran out of work */
+			m_io.reset();
+			m_io.poll();
+		}
+
+		/* Open a channel to ep, on_connect or on_connect_error is then
+		 * called from message processing thread with the tag. May be
+		 * called from any thread once the service is started. */
+		void connect(const endpoint_t & ep, bin::sz_t tag) {
+			m_io.post([this, ep, tag] {
+				if (m_stopping) {
+					push(inmsg(inmsg::connect_error, 0, tag));
+					return;
+				}
+				std::shared_ptr<sock_t> sock = std::make_shared<sock_t>(m_io);
+				m_connecting.insert(sock);
+				sock->async_connect(ep, [this, sock, tag] (const bs::error_code & ec) {
+					m_connecting.erase(sock);
+					if (ec) {
+						lerror(L) << "service::connect: " << ec.message();
+						push(inmsg(inmsg::connect_error, 0, tag));
+						return;
+					}
+					/* Channels are either made before cancel_all
+					 * closes them or not made at all */
+					std::lock_guard<std::mutex> lock(m_closing_mtx);
+					if (m_closing) {
+						sock->close();
+						push(inmsg(inmsg::connect_error, 0, tag));
+						return;
+					}
+					channel_t * ch = create(*sock, *this);
+					record(ch, capture_record::open, bin::buffer());
+					ch->recv();
+					push(inmsg(inmsg::connect, ch->id(), tag));
+				});
+			});
+		}
+
+		/* Endpoint the service listens on, e.g. the port picked
+		 * for port 0 */
+		endpoint_t local_endpoint() const {
+			return m_acpt.local_endpoint();
+		}
+
+		/* Have on_wake called from message processing thread,
+		 * may be called from any thread */
+		void wake() {
+			std::lock_guard<std::mutex> lock(in.mtx);
+			in.que.push(inmsg(inmsg::wake));
+			in.cond.notify_one();
 		}
 
 	protected:
@@ -88,6 +189,21 @@ class service {
 		virtual void on_recv(bin::sz_t channel_id, bin::buffer buf) = 0;
 		virtual void on_recv_error(bin::sz_t channel_id) = 0;
 
+		/* Called periodically from message processing thread */
+		virtual void on_tick() {}
+		/* Called from message processing thread after wake */
+		virtual void on_wake() {}
+		/* Called from message processing thread after channel is deleted,
+		 * channel id may be reused from now on */
+		virtual void on_destroy(bin::sz_t channel_id) { (void)(channel_id); }
+		/* Called from message processing thread once a channel opened
+		 * by connect is receiving, or the connection failed */
+		virtual void on_connect(bin::sz_t channel_id, bin::sz_t tag) {
+			(void)(channel_id);
+			(void)(tag);
+		}
+		virtual void on_connect_error(bin::sz_t tag) { (void)(tag); }
+
 		void close(bin::sz_t channel_id) {
 			channel_t * ch = get_channel(channel_id);
 			if (ch == nullptr) {
@@ -111,8 +227,21 @@ class service {
 		ba::io_service m_io;
 		sock_t m_sock;
 		acpt_t m_acpt;
+		ba::deadline_timer m_timer;
 		allocator_t & A;
 
+		bin::sz_t m_tick_ms;
+		bool m_stopping;
+		/* Set once channels are being closed on stop */
+		bool m_closing;
+		std::mutex m_closing_mtx;
+		/* Sockets being connected, io thread only */
+		std::set<std::shared_ptr<sock_t> > m_connecting;
+		/* Read by io thread, which raises m_recording while it
+		 * writes to the capture it got */
+		std::atomic<capture *> m_capture;
+		std::atomic<bool> m_recording;
+
 		std::stack<bin::sz_t> m_hole;
 		std::vector<channel_t *> m_book;
 
@@ -122,7 +251,8 @@ class service {
 		std::thread m_pm_thread;
 
 		struct inmsg {
-			enum type_t { unknown, recv, recv_error, send, send_error, destroy, stop } type;
+			enum type_t { unknown, recv, recv_error, send, send_error, destroy, tick, wake
+				, connect, connect_error, stop } type;
 			bin::sz_t ch_id;
 			bin::sz_t msg_id;
 			bin::buffer buf;
@@ -154,6 +284,7 @@ class service {
 		void on_accept(const bs::error_code & ec) {
 			if (!ec) {
 				channel_t * ch = create(m_sock, *this);
+				record(ch, capture_record::open, bin::buffer());
 				ch->recv();
 				m_acpt.async_accept(m_sock
 					, boost::bind(&service::on_accept
@@ -164,16 +295,50 @@ class service {
 		}
 
 		void cancel_all() {
-			for (channel_t * ch: m_book) {
-				if (ch != nullptr) {
-					ch->close();
+			{
+				std::lock_guard<std::mutex> lock(m_closing_mtx);
+				m_closing = true;
+				for (channel_t * ch: m_book) {
+					if (ch != nullptr) {
+						ch->close();
+					}
 				}
 			}
 			m_io.post([this] {
+				m_stopping = true;
+				m_timer.cancel();
 				m_acpt.close();
+				for (const std::shared_ptr<sock_t> & sock: m_connecting) {
+					sock->close();
+				}
 			});
 		}
 
+		void push(const inmsg & msg) {
+			std::lock_guard<std::mutex> lock(in.mtx);
+			in.que.push(msg);
+			in.cond.notify_one();
+		}
+
+		void wait_tick() {
+			m_timer.expires_from_now(boost::posix_time::milliseconds(m_tick_ms));
+			m_timer.async_wait(boost::bind(&service::on_tick_timer
+				, this, ba::placeholders::error));
+		}
+
+		void on_tick_timer(const bs::error_code & ec) {
+			/* io thread */
+			if (ec || m_stopping) {
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(in.mtx);
+				in.que.push(inmsg(inmsg::tick));
+				in.cond.notify_one();
+			}
+			wait_tick();
+		}
+
 		void process_messages() {
 			bool stop = false;
 			inmsg msg;
@@ -209,6 +374,7 @@ class service {
 						channel_t * ch = get_channel(msg.ch_id);
 						if (ch != nullptr) {
 							destroy(ch);
+							on_destroy(msg.ch_id);
 						} else {
 							lerror(L)
 								<< "service::process_messages"
@@ -216,6 +382,18 @@ class service {
 						}
 						break;
 					}
+					case inmsg::tick:
+						on_tick();
+						break;
+					case inmsg::wake:
+						on_wake();
+						break;
+					case inmsg::connect:
+						on_connect(msg.ch_id, msg.msg_id);
+						break;
+					case inmsg::connect_error:
+						on_connect_error(msg.msg_id);
+						break;
 					case inmsg::stop: {
 						cancel_all();
 						stop = true;
@@ -230,8 +408,22 @@ class service {
 			}
 		}
 
+		void record(channel_t * ch, capture_record::event_t e, bin::buffer buf) {
+			/* Not recording costs no fence */
+			if (m_capture.load(std::memory_order_relaxed) == nullptr) {
+				return;
+			}
+			m_recording = true;
+			capture * c = m_capture.load();
+			if (c != nullptr) {
+				c->add(ch->id(), e, buf.data, buf.len);
+			}
+			m_recording = false;
+		}
+
 		void on_recv(channel_t * ch, bin::buffer buf) {
 			/* called from io thread */
+			record(ch, capture_record::in, buf);
 			std::lock_guard<std::mutex> lock(in.mtx);
 			in.que.push(inmsg(inmsg::recv, ch->id(), buf));
 			in.cond.notify_one();
@@ -247,6 +439,7 @@ class service {
 		}
 
 		void on_send(channel_t * ch, bin::sz_t msg_id, bin::buffer buf) {
+			record(ch, capture_record::out, buf);
 			std::lock_guard<std::mutex> lock(in.mtx);
 			A.dealloc(buf.data);
 			in.que.push(inmsg(inmsg::send, ch->id(), msg_id));
@@ -265,6 +458,7 @@ class service {
 		}
 
 		void on_close(channel_t * ch) {
+			record(ch, capture_record::close, bin::buffer());
 			std::lock_guard<std::mutex> lock(in.mtx);
 			in.que.push(inmsg(inmsg::destroy, ch->id()));
 			in.cond.notify_one();
@@ -293,7 +487,11 @@ class service {
 			m_book.at(ch->id()) = nullptr;
 			m_hole.push(ch->id());
 			m_channel_count--;
-			delete ch;
+			/* Handlers of operations cancelled by close are queued in
+			 * io thread by now, the channel goes after them */
+			m_io.post([ch] {
+				delete ch;
+			});
 		}
 
 		channel_t * get_channel(bin::sz_t id) {
@@ -8,6 +8,10 @@
 #include <boost/log/sources/logger.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <atomic>
 #include <thread>
 #include <string>
 #include <fstream>
@@ -70,10 +74,103 @@ namespace vision { namespace log {
         return strm;
     }
 
-	typedef boost::log::sources::severity_channel_logger_mt<severity> source;
+	/* Parse severity name as it is displayed, false if unknown */
+	inline bool severity_of(const std::string & name, severity & lvl) {
+		static const char* const names[] = {
+			"trace", "debug"
+			, "info", "warning"
+			, "error", "critical"
+		};
+		for (std::size_t i = 0; i < sizeof(names) / sizeof(*names); ++i) {
+			if (name == names[i]) {
+				lvl = static_cast<severity>(i);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/* Runtime severity thresholds of channels. Entries are never removed,
+	 * so sources keep pointers to them. */
+	class thresholds {
+		public:
+			static thresholds & get() {
+				static thresholds t;
+				return t;
+			}
+
+			std::atomic<int> & of(const std::string & channel) {
+				std::lock_guard<std::mutex> lock(m_mtx);
+				auto it = m_levels.find(channel);
+				if (it == m_levels.end()) {
+					it = m_levels.emplace(std::piecewise_construct
+						, std::forward_as_tuple(channel)
+						, std::forward_as_tuple(m_default)).first;
+				}
+				return it->second;
+			}
+
+			/* Threshold of all channels, including ones made later */
+			void set(severity lvl) {
+				std::lock_guard<std::mutex> lock(m_mtx);
+				m_default = lvl;
+				for (auto & l: m_levels) {
+					l.second.store(lvl, std::memory_order_relaxed);
+				}
+			}
+
+		private:
+			std::mutex m_mtx;
+			std::map<std::string, std::atomic<int> > m_levels;
+			int m_default;
+
+			thresholds(): m_default(trace) {}
+	};
+
+	/* Threshold of a channel, records below it are dropped before
+	 * they are made or their arguments evaluated */
+	inline void set_threshold(const std::string & channel, severity lvl) {
+		thresholds::get().of(channel).store(lvl, std::memory_order_relaxed);
+	}
+
+	inline void set_threshold(severity lvl) {
+		thresholds::get().set(lvl);
+	}
+
+	class source: public blsr::severity_channel_logger_mt<severity> {
+		typedef blsr::severity_channel_logger_mt<severity> base;
+
+		public:
+			source()
+				: base()
+				, m_threshold(&thresholds::get().of(""))
+			{}
+
+			explicit source(const std::string & channel)
+				: base(blk::channel = channel)
+				, m_threshold(&thresholds::get().of(channel))
+			{}
+
+			bool enabled(severity lvl) const {
+				return lvl >= m_threshold->load(std::memory_order_relaxed);
+			}
+
+		private:
+			std::atomic<int> * m_threshold;
+	};
+
+	/* Loggers other than source are filtered by the core only */
+	template <typename LoggerT>
+	inline bool enabled(const LoggerT &, severity) {
+		return true;
+	}
+
+	inline bool enabled(const source & src, severity lvl) {
+		return src.enabled(lvl);
+	}
 
 	source channel(const std::string & channel) {
-		source src(blk::channel = channel);
+		source src(channel);
 		src.add_attribute("RecID", bla::counter<std::uint32_t>(1));
 		src.add_attribute("Time", bla::local_clock());
 		src.add_attribute("PrcID", bla::current_process_id());
@@ -163,12 +260,23 @@ namespace vision { namespace log {
 
 } }
 
-#define ltrace(lg)		BOOST_LOG_SEV(lg, vision::log::trace)
-#define ldebug(lg)		BOOST_LOG_SEV(lg, vision::log::debug)
-#define linfo(lg)		BOOST_LOG_SEV(lg, vision::log::info)
-#define lwarning(lg)	BOOST_LOG_SEV(lg, vision::log::warning)
-#define lerror(lg)		BOOST_LOG_SEV(lg, vision::log::error)
-#define lcritical(lg)	BOOST_LOG_SEV(lg, vision::log::critical)
+/* Records below this severity are compiled out,
+ * e.g. -DVISION_LOG_MIN_SEVERITY=2 keeps info and above */
+#ifndef VISION_LOG_MIN_SEVERITY
+#define VISION_LOG_MIN_SEVERITY 0
+#endif
+
+#define lsev(lg, lvl)	\
+	if (!(static_cast<int>(lvl) >= VISION_LOG_MIN_SEVERITY	\
+			&& vision::log::enabled(lg, lvl))) {}	\
+	else BOOST_LOG_SEV(lg, lvl)
+
+#define ltrace(lg)		lsev(lg, vision::log::trace)
+#define ldebug(lg)		lsev(lg, vision::log::debug)
+#define linfo(lg)		lsev(lg, vision::log::info)
+#define lwarning(lg)	lsev(lg, vision::log::warning)
+#define lerror(lg)		lsev(lg, vision::log::error)
+#define lcritical(lg)	lsev(lg, vision::log::critical)
 #define lflush(lg)		do { boost::log::core::get()->flush(); } while(0)
 
 #endif